@@ -0,0 +1,159 @@
+// bench_blur.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Times draw__blur on a 1920x1080 bitmap over a range of radii with each
+// set of span kernels, and, for comparison, a direct 2D Gaussian blur,
+// which is timed on a 480x270 crop and scaled up to the full frame.
+//
+// Build it from this directory with this command, all on one line:
+//
+//   gcc -O2 -o bench_blur bench_blur.c draw.c now.c raster.c span.c ttf.c
+//       workers.c xy.c -lm -lpthread
+//
+
+#include "draw.h"
+#include "now.h"
+#include "span.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Internal globals.
+
+#define frame_w 1920
+#define frame_h 1080
+
+// The direct blur runs on a crop this many times smaller than the frame.
+#define crop_w     480
+#define crop_h     270
+#define crop_scale ((double)frame_w * frame_h / (crop_w * crop_h))
+
+// Each draw__blur timing is the best of this many runs.
+#define num_runs 5
+
+static const char *impls[] = { "scalar", "sse2", "avx2" };
+#define num_impls (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const double radii[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+#define num_radii (int)(sizeof(radii) / sizeof(radii[0]))
+
+// The direct blur is too slow for the larger radii.
+#define num_direct_radii 4
+
+static uint32_t seed = 1;
+
+
+// Internal functions.
+
+static uint32_t next_rand() {
+  seed = seed * 1664525 + 1013904223;
+  return seed >> 8;
+}
+
+// Fills the w x h pixels with random premultiplied colors.
+static void fill_randomly(uint32_t *pixels, int w, int h) {
+  for (int i = 0; i < w * h; ++i) {
+    uint32_t a = next_rand() & 0xff;
+    pixels[i] = span__pixel(next_rand() % (a + 1), next_rand() % (a + 1),
+                            next_rand() % (a + 1), a);
+  }
+}
+
+// Blurs the w x h pixels of src into dst with a Gaussian kernel of
+// standard deviation sigma, cut off at 3 sigma, repeating the edge pixels.
+// This is the direct way to blur, which draw__blur's box passes replace.
+static void direct_blur(uint32_t *dst, const uint32_t *src, int w, int h,
+                        double sigma) {
+  int    r      = (int)ceil(3 * sigma);
+  int    k_w    = 2 * r + 1;
+  float *kernel = malloc(k_w * k_w * sizeof(float));
+  float  total  = 0;
+  for (int y = -r; y <= r; ++y) {
+    for (int x = -r; x <= r; ++x) {
+      float v = expf(-(x * x + y * y) / (2 * sigma * sigma));
+      kernel[(y + r) * k_w + x + r] = v;
+      total += v;
+    }
+  }
+  for (int i = 0; i < k_w * k_w; ++i) kernel[i] /= total;
+
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      float sums[4] = {0};
+      for (int j = -r; j <= r; ++j) {
+        int yy = y + j;
+        yy = (yy < 0) ? 0 : (yy >= h) ? h - 1 : yy;
+        for (int i = -r; i <= r; ++i) {
+          int xx = x + i;
+          xx = (xx < 0) ? 0 : (xx >= w) ? w - 1 : xx;
+          const uint8_t *p = (const uint8_t *)&src[yy * w + xx];
+          float          v = kernel[(j + r) * k_w + i + r];
+          for (int c = 0; c < 4; ++c) sums[c] += v * p[c];
+        }
+      }
+      uint8_t *out = (uint8_t *)&dst[y * w + x];
+      for (int c = 0; c < 4; ++c) out[c] = (uint8_t)(sums[c] + 0.5f);
+    }
+  }
+  free(kernel);
+}
+
+
+// Main.
+
+int main() {
+  draw__Bitmap bitmap = draw__new_bitmap(frame_w, frame_h);
+  uint32_t    *pixels = draw__get_bitmap_data(bitmap);
+  fill_randomly(pixels, frame_w, frame_h);
+
+  printf("Milliseconds per %dx%d blur; draw__blur is the best of %d runs."
+         "\n\n", frame_w, frame_h, num_runs);
+  printf("  radius  ");
+  for (int r = 0; r < num_radii; ++r) printf(" %6g", radii[r]);
+  printf("\n");
+
+  for (int i = 0; i < num_impls; ++i) {
+    printf("  %-8s", impls[i]);
+    if (!span__set_impl(impls[i])) {
+      printf(" not supported\n");
+      continue;
+    }
+    for (int r = 0; r < num_radii; ++r) {
+      double best = 0;
+      for (int run = 0; run < num_runs; ++run) {
+        double start = now();
+        draw__blur(bitmap, xy__rect_pts(0, 0, frame_w, frame_h), radii[r]);
+        double ms = (now() - start) * 1000;
+        if (run == 0 || ms < best) best = ms;
+      }
+      printf(" %6.1f", best);
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+
+  uint32_t *src = malloc(crop_w * crop_h * sizeof(uint32_t));
+  uint32_t *dst = malloc(crop_w * crop_h * sizeof(uint32_t));
+  for (int y = 0; y < crop_h; ++y) {
+    memcpy(src + y * crop_w, pixels + y * frame_w,
+           crop_w * sizeof(uint32_t));
+  }
+  printf("  %-8s", "direct");
+  for (int r = 0; r < num_direct_radii; ++r) {
+    double start = now();
+    direct_blur(dst, src, crop_w, crop_h, radii[r]);
+    printf(" %6.0f", (now() - start) * 1000 * crop_scale);
+    fflush(stdout);
+  }
+  printf("\n");
+
+  free(src);
+  free(dst);
+  draw__delete_bitmap(bitmap);
+  return 0;
+}
@@ -0,0 +1,86 @@
+// bench_span.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Times draw__fill_rect over whole bitmaps with each set of span kernels,
+// printing megapixels per second for opaque and translucent fills.
+//
+// Build it from this directory with this command, all on one line:
+//
+//   gcc -O2 -o bench_span bench_span.c draw.c now.c raster.c span.c ttf.c
+//       workers.c xy.c -lm -lpthread
+//
+
+#include "draw.h"
+#include "now.h"
+#include "span.h"
+
+#include <stdio.h>
+
+
+// Internal globals.
+
+static const char *impls[] = { "scalar", "sse2", "avx2" };
+#define num_impls (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const int sizes[] = { 256, 1024, 4096 };
+#define num_sizes (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+// Each timing is the best of this many runs.
+#define num_runs 5
+
+
+// Internal functions.
+
+// Returns the megapixels per second of the fastest of num_runs fills of
+// the active bitmap, which is size x size pixels.
+static double fill_rate(int size, int reps) {
+  double best = 0;
+  for (int run = 0; run < num_runs; ++run) {
+    double start = now();
+    for (int i = 0; i < reps; ++i) {
+      draw__fill_rect(xy__rect_pts(0, 0, size, size));
+    }
+    double secs = now() - start;
+    double rate = (double)size * size * reps / secs / 1e6;
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+
+// Main.
+
+int main() {
+  printf("Megapixels per second, best of %d runs.\n\n", num_runs);
+  printf("  size   fill       ");
+  for (int i = 0; i < num_impls; ++i) printf(" %7s", impls[i]);
+  printf("\n");
+
+  for (int s = 0; s < num_sizes; ++s) {
+    int size = sizes[s];
+    // Each run fills about 64 megapixels.
+    int reps = (64 << 20) / (size * size);
+    draw__Bitmap bitmap = draw__new_bitmap(size, size);
+    draw__set_bitmap(bitmap);
+
+    for (int is_translucent = 0; is_translucent < 2; ++is_translucent) {
+      printf("  %4d^2 %-11s", size,
+             is_translucent ? "translucent" : "opaque");
+      for (int i = 0; i < num_impls; ++i) {
+        if (!span__set_impl(impls[i])) {
+          printf(" %7s", "-");
+          continue;
+        }
+        draw__rgba_fill_color(0.2, 0.4, 0.6, is_translucent ? 0.5 : 1.0);
+        printf(" %7.0f", fill_rate(size, reps));
+        fflush(stdout);
+      }
+      printf("\n");
+    }
+
+    draw__set_bitmap(NULL);
+    draw__delete_bitmap(bitmap);
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+// bench_tiles.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Times draw__execute_list on a 3840x2160 frame of mixed rects, outlines,
+// and lines at 1, 2, 4, and 8 threads, printing each time's speedup over
+// 1 thread, and checks that every thread count draws the same pixels as
+// 1 thread.
+//
+// Build it from this directory with this command, all on one line:
+//
+//   gcc -O2 -o bench_tiles bench_tiles.c draw.c now.c raster.c span.c ttf.c
+//       workers.c xy.c -lm -lpthread
+//
+
+#include "draw.h"
+
+#include "cbit.h"
+#include "now.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Internal globals.
+
+#define frame_w      3840
+#define frame_h      2160
+#define num_commands 4000
+
+// Each timing is the best of this many runs.
+#define num_runs 5
+
+static uint32_t seed = 1;
+
+
+// Internal functions.
+
+// Returns a repeatable pseudorandom number in [0, max).
+static double rand_below(double max) {
+  seed = seed * 1664525 + 1013904223;
+  return (seed >> 8) / (double)(1 << 24) * max;
+}
+
+// Returns a list of num_commands rects, outlines, and lines with random
+// colors, half of them translucent, spread over and just past the frame.
+static draw__List new_frame_list() {
+  draw__begin_list();
+  for (int i = 0; i < num_commands; ++i) {
+    double alpha = (i % 2) ? 1.0 : rand_below(1);
+    draw__rgba_fill_color  (rand_below(1), rand_below(1), rand_below(1),
+                            alpha);
+    draw__rgba_stroke_color(rand_below(1), rand_below(1), rand_below(1),
+                            alpha);
+    double x = rand_below(frame_w + 200) - 100;
+    double y = rand_below(frame_h + 200) - 100;
+    double w = rand_below(400);
+    double h = rand_below(400);
+    switch (i % 3) {
+      case 0: draw__fill_rect  (xy__rect_pts(x, y, x + w, y + h)); break;
+      case 1: draw__stroke_rect(xy__rect_pts(x, y, x + w, y + h)); break;
+      case 2: draw__line(x, y, x + w, y + h);                      break;
+    }
+  }
+  return draw__end_list();
+}
+
+// Returns the milliseconds of the fastest of num_runs runs of list.
+static double run_time(draw__List list) {
+  double best = 0;
+  for (int run = 0; run < num_runs; ++run) {
+    double start = now();
+    draw__execute_list(list);
+    double ms = (now() - start) * 1000;
+    if (run == 0 || ms < best) best = ms;
+  }
+  return best;
+}
+
+
+// Main.
+
+int main() {
+  draw__List list  = new_frame_list();
+  size_t     bytes = (size_t)frame_w * frame_h * 4;
+  uint8_t   *first = malloc(bytes);
+  double     ms_1  = 0;  // The time with 1 thread.
+
+  printf("%dx%d, %d commands, best of %d runs.\n\n", frame_w, frame_h,
+         num_commands, num_runs);
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    draw__Bitmap bitmap = draw__new_bitmap(frame_w, frame_h);
+    draw__set_bitmap(bitmap);
+    draw__set_num_threads(threads);
+    double ms = run_time(list);
+    if (threads == 1) ms_1 = ms;
+
+    // Compare one fresh run with the 1-thread pixels.
+    memset(draw__get_bitmap_data(bitmap), 0, bytes);
+    draw__execute_list(list);
+    const char *match = "";
+    if (threads == 1) {
+      memcpy(first, draw__get_bitmap_data(bitmap), bytes);
+    } else {
+      bit is_same = memcmp(first, draw__get_bitmap_data(bitmap), bytes) == 0;
+      match = is_same ? "  same pixels" : "  DIFFERENT PIXELS";
+    }
+    printf("  %d thread%s %8.1f ms %5.2fx%s\n", threads,
+           threads > 1 ? "s" : " ", ms, ms_1 / ms, match);
+
+    draw__set_bitmap(NULL);
+    draw__delete_bitmap(bitmap);
+  }
+
+  free(first);
+  draw__delete_list(list);
+  return 0;
+}
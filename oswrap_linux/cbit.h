@@ -0,0 +1,13 @@
+// cbit.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+
+#pragma once
+
+#define bit   char
+
+#ifndef __cplusplus
+#define true  1
+#define false 0
+#endif
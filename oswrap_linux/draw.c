@@ -0,0 +1,2995 @@
+// draw.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// A software rasterizer behind the draw interface.
+//
+// Pixels are premultiplied RGBA with the bytes of each pixel stored in the
+// order R, G, B, A. Row y starts stride bytes after row y - 1, and row 0 is
+// the first row in memory; as on the other platforms, passing the data to
+// OpenGL makes (0, 0) the lower-left corner of the texture.
+//
+// A pixel (x, y) covers the unit square with corners (x, y) and
+// (x + 1, y + 1). Rectangles fill every pixel whose center they contain.
+//
+// Text is drawn from TrueType files. Each font rasterizes a glyph the
+// first time it's drawn and packs it into an atlas bitmap; drawing a
+// string blends the color through each glyph's part of the atlas.
+//
+
+// For memfd_create and fallocate, which back the shared pixel blocks.
+#define _GNU_SOURCE
+
+#include "draw.h"
+
+#include "cbit.h"
+#include "raster.h"
+#include "span.h"
+#include "ttf.h"
+#include "workers.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Internal types and globals.
+
+#define max_dirty_rects     8
+#define default_pool_budget (32 << 20)
+#define num_size_classes    65  // One for each bit length of a size_t.
+#define block_bytes         (64 << 10)  // Clones share pixels in these.
+#define repeat_bit          0x80000000u
+#define max_run             0x7fffffff
+#define min_repeat          3
+
+// The parts of a bitmap changed by draw calls since it was last cleared,
+// as whole-pixel rects; see draw__get_dirty_rects.
+typedef struct {
+  xy__Rect rects[max_dirty_rects + 1];  // There's room to add one more.
+  int      num_rects;
+} Dirty;
+
+// A memory file of pixel blocks shared by a bitmap and its clones. Each
+// bitmap maps file blocks over its pixels, one per block_bytes, and a
+// block mapped by more than one bitmap is copied to a free block before
+// any of them writes to it. Blocks no bitmap maps are released to the
+// system and reused. The bitmaps may be on different threads, so the
+// counts are only used while holding mutex.
+typedef struct {
+  int             fd;
+  int            *refs;         // The number of bitmaps mapping each block.
+  int             num_blocks;
+  int             blocks_cap;
+  int            *free_blocks;  // Blocks with no refs, which hold no memory.
+  int             num_free;
+  int             num_bitmaps;  // The bitmaps mapping any of the blocks.
+  pthread_mutex_t mutex;
+} BlockFile;
+
+struct draw__BitmapStruct {
+  uint8_t *bytes;
+  int      x_size;
+  int      y_size;
+  int      stride;      // The number of bytes per row.
+  bit      owns_bytes;  // False when the caller owns the pixels.
+  Dirty    dirty;
+
+  // Pixels of at least block_bytes are mapped rather than allocated, as a
+  // whole number of blocks, so that they can be shared with clones. Once
+  // they're shared, file is set and blocks[i] is the file block mapped at
+  // byte i * block_bytes.
+  bit        is_mapped;
+  BlockFile *file;
+  int       *blocks;
+
+  // A compressed bitmap's pixels, which are unpacked before it's used, or
+  // NULL; see pack_pixels.
+  uint32_t  *packed;
+  size_t     num_packed;  // The words in packed.
+
+  // Views share the pixels of their parent from (x0, y0) on; see
+  // draw__new_bitmap_view. A parent is never itself a view, and other
+  // bitmaps have no parent and (x0, y0) = (0, 0).
+  struct draw__BitmapStruct *parent;
+  int                        x0;
+  int                        y0;
+
+  struct draw__BitmapStruct *next;  // The next bitmap in its pool list.
+};
+
+typedef struct draw__BitmapStruct Bitmap;
+
+// A rasterized glyph at (x, y) in its font's atlas, w x h pixels in size.
+// Its lower-left corner is drawn at (left, bottom) from the pen position.
+typedef struct {
+  int16_t x;
+  int16_t y;
+  int16_t w;
+  int16_t h;
+  int16_t left;
+  int16_t bottom;
+  uint8_t is_ready;
+} Glyph;
+
+// The atlas is packed in shelves; each shelf is a row of glyphs, and
+// new glyphs go at the right end of the top shelf.
+struct draw__FontStruct {
+  ttf__Font *ttf;
+  float      scale;    // Pixels per font unit.
+  uint16_t   ascii_glyphs[128];
+  Glyph     *glyphs;   // Indexed by glyph number.
+  Bitmap    *atlas;    // Coverage is in all four channels of each pixel.
+  int        shelf_x;
+  int        shelf_y;
+  int        shelf_h;
+
+  // Drawing text adds glyphs to the atlas, so contexts on different threads
+  // take turns drawing with the same font.
+  pthread_mutex_t mutex;
+};
+
+#define opaque_black      span__pixel(0, 0, 0, 255)
+#define tile_size         64
+#define mip_band_rows     32
+#define poly_band_rows    32
+#define min_threaded_mip  (256 * 256)  // Smaller levels use one thread.
+#define blur_band_rows    16
+#define blur_strip_width  64
+#define min_threaded_blur (256 * 256)  // Smaller rects use one thread.
+#define max_blur_radius   8192         // This keeps boxes under 65535 wide.
+#define min_atlas_size    256
+#define replacement_char  0xfffd
+#define max_text_layouts  32
+#define max_bitmap_width  (INT_MAX / 4)  // Wider rows overflow an int stride.
+
+// These are tried, in order, when the requested font isn't installed.
+static const char *default_font_names[] = {
+  "DejaVu Sans", "Liberation Sans", "Noto Sans", "FreeSans"
+};
+
+// A recorded drawing command. Each command keeps the color that was set
+// when it was recorded, so replaying a list never changes color state
+// between commands.
+
+enum {
+  cmd_fill_rect,
+  cmd_stroke_rect,
+  cmd_line,        // The rect holds its ends as (xmin, ymin, xmax, ymax).
+  cmd_smooth_line  // An antialiased line, held the same way.
+};
+
+typedef struct {
+  int      op;
+  uint32_t color;
+  xy__Rect rect;
+} Cmd;
+
+struct draw__ListStruct {
+  Cmd     *cmds;
+  int      num_cmds;
+  int      cmds_cap;
+
+  // The colors that were set when recording ended.
+  uint32_t fill_color;
+  uint32_t stroke_color;
+};
+
+// A bitmap along with the pixels [x0, x1) x [y0, y1) that drawing may touch.
+typedef struct {
+  Bitmap *bitmap;
+  int     x0;
+  int     y0;
+  int     x1;
+  int     y1;
+  bit     is_linear;  // Colors are blended in linear light when this is set.
+} Target;
+
+// The shared input for rasterizing a list tile by tile.
+typedef struct {
+  Target  clip;        // Each tile is clipped to this.
+  Cmd    *cmds;
+  int     tiles_x;
+  int    *bin_starts;  // Tile k uses bins[bin_starts[k]..bin_starts[k + 1] - 1],
+  int    *bins;        // which are indexes into cmds.
+} TileJob;
+
+// Drawing happens with the values in a context.
+struct draw__ContextStruct {
+  Bitmap     *bitmap;
+  uint32_t    fill_color;
+  uint32_t    stroke_color;
+  draw__Font  font;
+  draw__Color font_color;
+
+  // When this is non-NULL, shapes and lines are added to it instead of drawn.
+  draw__List  recording_list;
+
+  // Lists are rasterized in tiles across this many threads when it's above 1.
+  int         num_threads;
+
+  // When this is set, colors are blended in linear light.
+  bit         is_linear;
+
+  // Each clip rect is the one pushed within the clip below it, so the top
+  // one is where drawing may happen.
+  xy__Rect   *clips;
+  int         num_clips;
+  int         clips_cap;
+};
+
+#define new_context_values \
+  { NULL, opaque_black, opaque_black, NULL, opaque_black, NULL, 1, false, \
+    NULL, 0, 0 }
+
+// The functions without a context argument use this one.
+static draw__Context default_context = new_context_values;
+
+// Deleted bitmaps kept for reuse. The list pool[i] holds the bitmaps whose
+// byte counts are i bits long, most recently deleted first. The pool is
+// shared by every thread, so it's only used while holding pool_mutex.
+static Bitmap         *pool[num_size_classes];
+static draw__PoolStats pool_stats = { 0, 0, 0, 0, 0, default_pool_budget };
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Bitmaps may be drawn from on several threads at once, so they're
+// unpacked while holding this.
+static pthread_mutex_t packed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A bitmap may be cloned on several threads at once, so its blocks are
+// first shared while holding this; otherwise each thread could give it a
+// block file of its own.
+static pthread_mutex_t share_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// An atlas packs regions into its bitmap using a skyline, which is the top
+// edge of the packed regions as segments from left to right. The segments
+// span the bitmap's width, and each region is placed where its top is
+// lowest.
+
+typedef struct {
+  int x;
+  int y;  // The lowest row that's free above the segment.
+  int w;
+} Segment;
+
+struct draw__AtlasStruct {
+  draw__Bitmap  bitmap;
+  int           w;
+  int           h;
+
+  Segment      *segments;  // There's room for w, as each is at least 1 wide.
+  int           num_segments;
+
+  draw__Bitmap *views;
+  int           num_views;
+  int           views_cap;
+};
+
+// A tiled bitmap keeps its tiles in rows, and a row's array of tiles is
+// only made once one of its tiles is. Missing tiles are NULL.
+struct draw__TiledBitmapStruct {
+  int            w;
+  int            h;
+  int            tiles_x;
+  int            tiles_y;
+  draw__Bitmap **rows;
+};
+
+// A command of a list that touches tile (tx, ty).
+typedef struct {
+  int tx;
+  int ty;
+  int cmd;
+} TileHit;
+
+// A text box's string is split into words, each a run of non-space bytes
+// and the spaces after it. A newline ends the word before it and breaks the
+// line there. Words keep their widths, so wrapping them to a new width
+// doesn't measure any text.
+typedef struct {
+  size_t    chars_end;    // The byte after the word's last non-space byte.
+  size_t    end;          // The byte after its spaces and newline.
+  xy__Float width;        // The width of its non-space bytes.
+  xy__Float space_width;  // The width of its spaces.
+  bit       ends_line;    // True when it ends with a newline.
+} Word;
+
+// The words and lines of a string drawn by draw__text_box in one font.
+// Line i is the words from lines[i] up to lines[i + 1], or up to the end
+// for the last line. Layouts are kept in a list from most to least
+// recently used.
+typedef struct TextLayout {
+  struct TextLayout *newer;
+  struct TextLayout *older;
+
+  draw__Font font;
+  uint64_t   hash;
+  char      *text;
+  size_t     len;
+
+  Word      *words;
+  int        num_words;
+  int        words_cap;
+
+  int       *lines;
+  int        num_lines;
+  int        lines_cap;
+  bit        is_wrapped;  // True when the lines are wrapped to width.
+  xy__Float  width;
+} TextLayout;
+
+// Text box layouts are shared by every thread, so they're only used while
+// holding layouts_mutex.
+static TextLayout     *newest_layout = NULL;
+static TextLayout     *oldest_layout = NULL;
+static int             num_layouts   = 0;
+static pthread_mutex_t layouts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Internal functions.
+
+static int byte_of_unit(double v) {
+  if (v <= 0) return 0;
+  if (v >= 1) return 255;
+  return (int)(v * 255 + 0.5);
+}
+
+#define premultiply(c, alpha) ((byte_of_unit(c) * (alpha) + 127) / 255)
+
+static uint32_t color_of_rgba(double r, double g, double b, double a) {
+  int alpha = byte_of_unit(a);
+  return span__pixel(premultiply(r, alpha),
+                     premultiply(g, alpha),
+                     premultiply(b, alpha),
+                     alpha);
+}
+
+// Converts 0xRRGGBBAA to a pixel, rounding the same way as color_of_rgba.
+static uint32_t color_of_rgba32(draw__Rgba32 color) {
+  uint32_t r     = color >> 24;
+  uint32_t g     = (color >> 16) & 0xff;
+  uint32_t b     = (color >>  8) & 0xff;
+  uint32_t alpha = color & 0xff;
+  if (alpha < 255) {
+    r = (r * alpha + 127) / 255;
+    g = (g * alpha + 127) / 255;
+    b = (b * alpha + 127) / 255;
+  }
+  return span__pixel(r, g, b, alpha);
+}
+
+static int alpha_of(uint32_t color) {
+  return (color >> span__alpha_shift) & 0xff;
+}
+
+static uint32_t *row(Bitmap *b, int y) {
+  return (uint32_t *)(b->bytes + (size_t)y * b->stride);
+}
+
+// Returns the bitmap whose pixels b uses, which is b unless it's a view.
+static Bitmap *root_of(Bitmap *b) {
+  return b->parent ? b->parent : b;
+}
+
+// Converts a coordinate to the index of the first pixel whose center is at
+// or beyond it. The result is clamped to [lo, hi].
+static int pixel_edge(xy__Float v, int lo, int hi) {
+  v = ceil(v - 0.5);
+  if (!(v >= lo)) return lo;  // This also catches NaN.
+  if (v > hi)     return hi;
+  return (int)v;
+}
+
+// Finds the half-open pixel ranges [x0, x1) x [y0, y1) covered by rect,
+// clipped to [lo, hi) on each axis. Returns false if the result is empty.
+static bit pixel_bounds(xy__Rect rect, int lo, int x_hi, int y_hi,
+                        int *x0, int *y0, int *x1, int *y1) {
+  xy__Float t;
+  if (rect.xmin > rect.xmax) {
+    t = rect.xmin; rect.xmin = rect.xmax; rect.xmax = t;
+  }
+  if (rect.ymin > rect.ymax) {
+    t = rect.ymin; rect.ymin = rect.ymax; rect.ymax = t;
+  }
+  *x0 = pixel_edge(rect.xmin, lo, x_hi);
+  *x1 = pixel_edge(rect.xmax, lo, x_hi);
+  *y0 = pixel_edge(rect.ymin, lo, y_hi);
+  *y1 = pixel_edge(rect.ymax, lo, y_hi);
+  return *x0 < *x1 && *y0 < *y1;
+}
+
+static Target whole_bitmap(Bitmap *b) {
+  return (Target) { b, 0, 0, b->x_size, b->y_size, false };
+}
+
+// Returns the part of the context's bitmap inside its clip, which holds the
+// pixels whose centers are in the top clip rect.
+static Target target_of(draw__Context *c) {
+  Target t = whole_bitmap(c->bitmap);
+  t.is_linear = c->is_linear;
+  if (c->num_clips == 0) return t;
+  if (!pixel_bounds(c->clips[c->num_clips - 1], 0, t.x1, t.y1,
+                    &t.x0, &t.y0, &t.x1, &t.y1)) {
+    t.x1 = t.x0;
+  }
+  return t;
+}
+
+// Clips [x0, x1) x [y0, y1) to the target, returning false if it's empty.
+static bit clip_to(Target *t, int *x0, int *y0, int *x1, int *y1) {
+  if (*x0 < t->x0) *x0 = t->x0;
+  if (*y0 < t->y0) *y0 = t->y0;
+  if (*x1 > t->x1) *x1 = t->x1;
+  if (*y1 > t->y1) *y1 = t->y1;
+  return *x0 < *x1 && *y0 < *y1;
+}
+
+static xy__Float area_of(xy__Rect r) {
+  return (r.xmax - r.xmin) * (r.ymax - r.ymin);
+}
+
+static xy__Rect union_of(xy__Rect a, xy__Rect b) {
+  return xy__rect_pts(fmin(a.xmin, b.xmin), fmin(a.ymin, b.ymin),
+                      fmax(a.xmax, b.xmax), fmax(a.ymax, b.ymax));
+}
+
+// Returns the overlap of two rects with min <= max on each axis. An empty
+// overlap keeps min <= max so that it isn't read as a flipped rect.
+static xy__Rect intersection_of(xy__Rect a, xy__Rect b) {
+  xy__Rect r = xy__rect_pts(fmax(a.xmin, b.xmin), fmax(a.ymin, b.ymin),
+                            fmin(a.xmax, b.xmax), fmin(a.ymax, b.ymax));
+  if (r.xmax < r.xmin) r.xmax = r.xmin;
+  if (r.ymax < r.ymin) r.ymax = r.ymin;
+  return r;
+}
+
+// Shared blocks.
+
+static size_t bytes_of(Bitmap *b) {
+  return (size_t)b->stride * b->y_size;
+}
+
+static size_t mapped_size(size_t bytes) {
+  return (bytes + block_bytes - 1) / block_bytes * block_bytes;
+}
+
+// Returns transparent black pixels, mapped when they'll fill a block.
+static uint8_t *alloc_pixels(size_t bytes) {
+  if (bytes < block_bytes) return calloc(bytes, 1);
+  void *p = mmap(NULL, mapped_size(bytes), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+// Maps blocks[0..n-1] of the file over the pixels at p, joining runs of
+// consecutive blocks into one mapping. Returns false if any mapping fails.
+static bit map_blocks(uint8_t *p, BlockFile *f, const int *blocks, int n) {
+  for (int i = 0, end; i < n; i = end) {
+    for (end = i + 1; end < n && blocks[end] == blocks[end - 1] + 1; ++end);
+    void *q = mmap(p + (size_t)i * block_bytes, (size_t)(end - i) * block_bytes,
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, f->fd,
+                   (off_t)blocks[i] * block_bytes);
+    if (q == MAP_FAILED) return false;
+  }
+  return true;
+}
+
+// Returns a block with no refs, growing the file when none are free.
+static int take_block(BlockFile *f) {
+  if (f->num_free) return f->free_blocks[--f->num_free];
+  if (f->num_blocks == f->blocks_cap) {
+    f->blocks_cap *= 2;
+    f->refs        = realloc(f->refs,        f->blocks_cap * sizeof(int));
+    f->free_blocks = realloc(f->free_blocks, f->blocks_cap * sizeof(int));
+  }
+  if (ftruncate(f->fd, (off_t)(f->num_blocks + 1) * block_bytes)) return -1;
+  f->refs[f->num_blocks] = 0;
+  return f->num_blocks++;
+}
+
+// Moves the pixels of b, which are mapped and not yet shared, into a new
+// block file mapped over the same addresses. This copies them once, after
+// which clones share them without copying. Returns false on failure, which
+// leaves b as it was.
+static bit share_blocks(Bitmap *b) {
+  size_t size = mapped_size(bytes_of(b));
+  int    n    = (int)(size / block_bytes);
+  int    fd   = memfd_create("draw_bitmap", MFD_CLOEXEC);
+  if (fd < 0) return false;
+  if (ftruncate(fd, size) || pwrite(fd, b->bytes, size, 0) != (ssize_t)size) {
+    close(fd);
+    return false;
+  }
+
+  BlockFile *f   = calloc(1, sizeof(BlockFile));
+  f->fd          = fd;
+  f->num_blocks  = f->blocks_cap = n;
+  f->refs        = malloc(n * sizeof(int));
+  f->free_blocks = malloc(n * sizeof(int));
+  f->num_bitmaps = 1;
+  pthread_mutex_init(&f->mutex, NULL);
+  b->blocks = malloc(n * sizeof(int));
+  for (int i = 0; i < n; ++i) f->refs[i] = 1, b->blocks[i] = i;
+
+  // The pixels are the same before and after, so this can't be seen.
+  if (!map_blocks(b->bytes, f, b->blocks, n)) {
+    fprintf(stderr, "Error in %s: mmap failed.\n", __FUNCTION__);
+  }
+  b->file = f;
+  return true;
+}
+
+// Compressed pixels.
+
+// Packed pixels are a list of runs, each a header word and then pixels. A
+// header of repeat_bit | n is n copies of the one pixel after it, and any
+// other header n is n pixels stored as they are. Returns NULL if the runs
+// would take more than half the bytes of the n pixels at p.
+static uint32_t *pack_pixels(const uint32_t *p, size_t n, size_t *num_words) {
+  size_t    cap = 1024, len = 0, max_len = n / 2;
+  uint32_t *out = malloc(cap * sizeof(uint32_t));
+
+  // The pixels from lit on that aren't in a repeat yet are put in literal
+  // runs when a repeat is found, or at the end.
+  size_t lit = 0;
+  for (size_t i = 0; i <= n;) {
+    size_t end = i;
+    if (i < n) {
+      while (end < n && end - i < max_run && p[end] == p[i]) ++end;
+      if (end - i < min_repeat) {
+        i = end;
+        continue;
+      }
+    }
+    while (lit < i) {
+      size_t m = (i - lit < max_run) ? i - lit : max_run;
+      if (len + 1 + m > max_len) break;
+      if (len + 1 + m > cap) {
+        while (len + 1 + m > cap) cap *= 2;
+        out = realloc(out, cap * sizeof(uint32_t));
+      }
+      out[len++] = (uint32_t)m;
+      memcpy(out + len, p + lit, m * sizeof(uint32_t));
+      len += m;
+      lit += m;
+    }
+    if (lit < i || len + 2 > max_len) {
+      free(out);
+      return NULL;
+    }
+    if (i == n) break;
+    if (len + 2 > cap) out = realloc(out, (cap *= 2) * sizeof(uint32_t));
+    out[len++] = repeat_bit | (uint32_t)(end - i);
+    out[len++] = p[i];
+    i = lit = end;
+  }
+  *num_words = len;
+  return realloc(out, len * sizeof(uint32_t));
+}
+
+// Unpacks b's root if it's compressed. Everything that reads or writes
+// pixels calls this first.
+static void unpack_pixels(Bitmap *b) {
+  Bitmap *root = root_of(b);
+  if (__atomic_load_n(&root->packed, __ATOMIC_ACQUIRE) == NULL) return;
+  pthread_mutex_lock(&packed_mutex);
+  uint32_t *packed = root->packed;
+  if (packed) {
+    uint32_t *p = (uint32_t *)root->bytes;
+    for (size_t i = 0; i < root->num_packed;) {
+      uint32_t header = packed[i++];
+      int      n      = (int)(header & ~repeat_bit);
+      if (header & repeat_bit) {
+        span__fill(p, n, packed[i++]);
+      } else {
+        memcpy(p, packed + i, n * sizeof(uint32_t));
+        i += n;
+      }
+      p += n;
+    }
+    free(packed);
+    __atomic_store_n(&root->packed, NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&packed_mutex);
+}
+
+// Readies rows [y0, y1) of b to be written: its pixels are unpacked, and
+// it gets its own copy of each shared block holding the rows, so that
+// writing them doesn't change its clones. Everything that writes pixels
+// calls this first.
+static void own_rows(Bitmap *b, int y0, int y1) {
+  unpack_pixels(b);
+  Bitmap    *root = root_of(b);
+  BlockFile *f    = root->file;
+  if (f == NULL || y0 >= y1) return;
+  size_t start = (size_t)(y0 + b->y0) * root->stride;
+  size_t end   = (size_t)(y1 + b->y0) * root->stride;
+
+  pthread_mutex_lock(&f->mutex);
+  for (size_t k = start / block_bytes; k <= (end - 1) / block_bytes; ++k) {
+    int block = root->blocks[k];
+    if (f->refs[block] == 1) continue;
+    int      copy = take_block(f);
+    uint8_t *p    = root->bytes + k * block_bytes;
+    if (copy < 0 || pwrite(f->fd, p, block_bytes,
+                           (off_t)copy * block_bytes) != block_bytes ||
+        !map_blocks(p, f, &copy, 1)) {
+      fprintf(stderr, "Error in %s: couldn't copy a shared block.\n",
+              __FUNCTION__);
+      if (copy >= 0) f->free_blocks[f->num_free++] = copy;
+      break;
+    }
+    f->refs[block]--;
+    f->refs[copy]     = 1;
+    root->blocks[k]   = copy;
+  }
+  pthread_mutex_unlock(&f->mutex);
+}
+
+// Drops b's refs on its blocks, releasing the memory of the blocks no
+// bitmap maps anymore, and the file along with the last bitmap.
+static void release_blocks(Bitmap *b) {
+  BlockFile *f = b->file;
+  int        n = (int)(mapped_size(bytes_of(b)) / block_bytes);
+  pthread_mutex_lock(&f->mutex);
+  for (int i = 0; i < n; ++i) {
+    int block = b->blocks[i];
+    if (--f->refs[block]) continue;
+    fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)block * block_bytes, block_bytes);
+    f->free_blocks[f->num_free++] = block;
+  }
+  bit is_last = (--f->num_bitmaps == 0);
+  pthread_mutex_unlock(&f->mutex);
+
+  free(b->blocks);
+  if (!is_last) return;
+  close(f->fd);
+  pthread_mutex_destroy(&f->mutex);
+  free(f->refs);
+  free(f->free_blocks);
+  free(f);
+}
+
+// Adds r to the dirty rects. To keep the list short, any two rects whose
+// union is no bigger than their areas together are merged, which joins
+// rects that overlap or line up. Past max_dirty_rects, the pair whose
+// union adds the least area is merged.
+static void add_dirty(Dirty *d, xy__Rect r) {
+  if (!(r.xmin < r.xmax && r.ymin < r.ymax)) return;
+  for (int i = 0; i < d->num_rects; ++i) {
+    if (area_of(union_of(d->rects[i], r)) == area_of(d->rects[i])) return;
+  }
+  d->rects[d->num_rects++] = r;
+
+  while (d->num_rects > 1) {
+    int       best_i = 0, best_j = 1;
+    xy__Float best_cost = INFINITY;
+    for (int i = 0; i < d->num_rects; ++i) {
+      for (int j = i + 1; j < d->num_rects; ++j) {
+        xy__Rect *a = &d->rects[i], *b = &d->rects[j];
+        xy__Float cost = area_of(union_of(*a, *b)) - area_of(*a) -
+                         area_of(*b);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_i    = i;
+          best_j    = j;
+        }
+      }
+    }
+    if (best_cost > 0 && d->num_rects <= max_dirty_rects) break;
+    d->rects[best_i] = union_of(d->rects[best_i], d->rects[best_j]);
+    d->rects[best_j] = d->rects[--d->num_rects];
+  }
+}
+
+// Adds r, a rect of whole pixels within b, to the dirty rects of b and of
+// its parent when it's a view. Pixels are marked before they're drawn, so
+// this is also where their shared blocks are copied.
+static void mark_pixels(Bitmap *b, xy__Rect r) {
+  own_rows(b, (int)r.ymin, (int)r.ymax);
+  add_dirty(&b->dirty, r);
+  if (b->parent) {
+    add_dirty(&b->parent->dirty, xy__rect_pts(r.xmin + b->x0, r.ymin + b->y0,
+                                              r.xmax + b->x0, r.ymax + b->y0));
+  }
+}
+
+// The bitmap pool.
+
+static int size_class(size_t bytes) {
+  int c = 0;
+  for (; bytes; bytes >>= 1) ++c;
+  return c;
+}
+
+static void free_bitmap(Bitmap *b) {
+  free(b->packed);
+  if (b->file) release_blocks(b);
+  if (b->is_mapped)       munmap(b->bytes, mapped_size(bytes_of(b)));
+  else if (b->owns_bytes) free(b->bytes);
+  free(b);
+}
+
+// Frees pooled bitmaps, largest first, until the pool holds at most
+// max_bytes. Within a size class, the least recently deleted go first.
+static void trim_pool(size_t max_bytes) {
+  for (int c = num_size_classes - 1; c >= 0; --c) {
+    while (pool[c] && pool_stats.resident_bytes > max_bytes) {
+      Bitmap **link = &pool[c];
+      while ((*link)->next) link = &(*link)->next;
+      Bitmap *b = *link;
+      *link = NULL;
+      pool_stats.num_bitmaps--;
+      pool_stats.resident_bytes -= bytes_of(b);
+      pool_stats.evictions++;
+      free_bitmap(b);
+    }
+  }
+}
+
+// Keeps b for reuse if it fits in the pool's budget, and frees it otherwise.
+// Bitmaps that share blocks with clones are always freed.
+static void pool_bitmap(Bitmap *b) {
+  size_t bytes = bytes_of(b);
+  if (!b->owns_bytes || b->file || bytes > pool_stats.budget) {
+    free_bitmap(b);
+    return;
+  }
+  // A new bitmap is cleared anyway, so there's no need to unpack it.
+  free(b->packed);
+  b->packed = NULL;
+  trim_pool(pool_stats.budget - bytes);
+  int c = size_class(bytes);
+  b->next = pool[c];
+  pool[c] = b;
+  pool_stats.num_bitmaps++;
+  pool_stats.resident_bytes += bytes;
+}
+
+// Takes a w x h bitmap out of the pool, or returns NULL if there isn't one.
+static Bitmap *pooled_bitmap(int w, int h) {
+  size_t bytes = (size_t)w * 4 * h;
+  for (Bitmap **link = &pool[size_class(bytes)]; *link; link = &(*link)->next) {
+    Bitmap *b = *link;
+    if (b->x_size != w || b->y_size != h) continue;
+    *link = b->next;
+    pool_stats.num_bitmaps--;
+    pool_stats.resident_bytes -= bytes;
+    return b;
+  }
+  return NULL;
+}
+
+// Opaque colors are stored directly; others are blended over the bitmap.
+static void fill_span(Bitmap *b, int x0, int x1, int y, uint32_t color,
+                      bit is_linear) {
+  int       alpha = alpha_of(color);
+  uint32_t *p     = row(b, y) + x0;
+  if (alpha == 255)   span__fill(p, x1 - x0, color);
+  else if (!alpha)    return;
+  else if (is_linear) span__blend_linear(p, x1 - x0, color);
+  else                span__blend(p, x1 - x0, color);
+}
+
+// Fills [x0, x1) x [y0, y1) after clipping it to the target.
+static void fill_pixels(Target *t, int x0, int y0, int x1, int y1,
+                        uint32_t color) {
+  if (!clip_to(t, &x0, &y0, &x1, &y1)) return;
+  for (int y = y0; y < y1; ++y) {
+    fill_span(t->bitmap, x0, x1, y, color, t->is_linear);
+  }
+}
+
+// Draws pixel (x, y) if it's in the target.
+static void plot(Target *t, int x, int y, uint32_t color) {
+  if (x < t->x0 || x >= t->x1 || y < t->y0 || y >= t->y1) return;
+  uint32_t *p = row(t->bitmap, y) + x;
+  if (alpha_of(color) == 255) *p = color;
+  else if (t->is_linear)      span__blend_linear(p, 1, color);
+  else                        *p = span__over(*p, color);
+}
+
+// Lines take one pixel per step along their major axis, from the pixel
+// containing the start point up to but not including the pixel containing
+// the end point; this matches GDI's LineTo. The minor coordinate is an
+// integer DDA in 32.32 fixed point that starts from its value at step 0,
+// so each step's pixel depends only on the step and clipping never moves
+// the drawn pixels.
+//
+// Smooth lines take the same steps, but split each step between the two
+// pixels nearest the line, weighted by how close the line is to each, as
+// in Wu's algorithm.
+static void draw_line(Target *t, uint32_t color, bit is_smooth,
+                      double x1, double y1, double x2, double y2) {
+  bit is_steep = fabs(y2 - y1) > fabs(x2 - x1);
+  if (is_steep) {
+    double tmp;
+    tmp = x1; x1 = y1; y1 = tmp;
+    tmp = x2; x2 = y2; y2 = tmp;
+  }
+  int major_lo = is_steep ? t->y0 : t->x0, major_hi = is_steep ? t->y1 : t->x1;
+  int minor_lo = is_steep ? t->x0 : t->y0, minor_hi = is_steep ? t->x1 : t->y1;
+
+  double start = floor(x1), end = floor(x2);
+  if (start == end || !isfinite(start) || !isfinite(end)) return;
+  if (!isfinite(y1) || !isfinite(y2)) return;
+  int    step  = (end > start) ? 1 : -1;
+  double slope = (y2 - y1) / (x2 - x1);
+
+  // Clip the steps to the target; lo and hi are inclusive.
+  double lo = (step > 0) ? start : end + 1;
+  double hi = (step > 0) ? end - 1 : start;
+  if (lo < major_lo)     lo = major_lo;
+  if (hi > major_hi - 1) hi = major_hi - 1;
+  if (lo > hi) return;
+
+  // Skip lines that pass beside the target. The rest have minor values
+  // within a bitmap's size of the target, which keeps them in range below.
+  double at_lo = y1 + (lo + 0.5 - x1) * slope;
+  double at_hi = y1 + (hi + 0.5 - x1) * slope;
+  if (fmax(at_lo, at_hi) < minor_lo - 1 || fmin(at_lo, at_hi) > minor_hi + 1) {
+    return;
+  }
+
+  int64_t dv = llround(ldexp(slope, 32));
+  int64_t v  = llround(ldexp(y1 + (0.5 - x1) * slope, 32)) + (int64_t)lo * dv;
+  for (int i = (int)lo; i <= (int)hi; ++i, v += dv) {
+    if (!is_smooth) {
+      int j = (int)(v >> 32);
+      if (is_steep) plot(t, j, i, color);
+      else          plot(t, i, j, color);
+      continue;
+    }
+    // Pixel j + 1 gets the fraction of the step that the line's center is
+    // past the center of pixel j.
+    int64_t  c = v - ((int64_t)1 << 31);
+    int      j = (int)(c >> 32);
+    uint32_t a = (uint32_t)(((c & 0xffffffff) * 255 + 0x80000000) >> 32);
+    if (is_steep) {
+      if (a < 255) plot(t, j,     i, span__scale(color, 255 - a));
+      if (a > 0)   plot(t, j + 1, i, span__scale(color, a));
+    } else {
+      if (a < 255) plot(t, i, j,     span__scale(color, 255 - a));
+      if (a > 0)   plot(t, i, j + 1, span__scale(color, a));
+    }
+  }
+}
+
+static void fill_rect(Target *t, uint32_t color, xy__Rect rect) {
+  Bitmap *b = t->bitmap;
+  int x0, y0, x1, y1;
+  if (!pixel_bounds(rect, 0, b->x_size, b->y_size, &x0, &y0, &x1, &y1)) return;
+  fill_pixels(t, x0, y0, x1, y1, color);
+}
+
+// This outlines the same pixels that fill_rect would fill, drawing each
+// pixel once so that translucent corners aren't blended twice.
+static void stroke_rect(Target *t, uint32_t color, xy__Rect rect) {
+  // Find the unclipped outline so that clipped-off edges aren't drawn.
+  Bitmap *b = t->bitmap;
+  int x0, y0, x1, y1;
+  if (!pixel_bounds(rect, -1, b->x_size + 1, b->y_size + 1,
+                    &x0, &y0, &x1, &y1)) return;
+
+  fill_pixels(t, x0, y0, x1, y0 + 1, color);                   // Bottom edge.
+  if (y1 - 1 > y0) fill_pixels(t, x0, y1 - 1, x1, y1, color);  // Top edge.
+  fill_pixels(t, x0, y0 + 1, x0 + 1, y1 - 1, color);           // Left edge.
+  if (x1 - 1 > x0) {
+    fill_pixels(t, x1 - 1, y0 + 1, x1, y1 - 1, color);         // Right edge.
+  }
+}
+
+// Returns a rect containing every pixel the command may touch.
+static xy__Rect cmd_bounds(Cmd *cmd) {
+  // Lines and outlines stay within a pixel of their rect's corners.
+  xy__Rect  r   = cmd->rect;
+  xy__Float pad = (cmd->op == cmd_fill_rect) ? 0 : 1;
+  return xy__rect_pts(fmin(r.xmin, r.xmax) - pad, fmin(r.ymin, r.ymax) - pad,
+                      fmax(r.xmin, r.xmax) + pad, fmax(r.ymin, r.ymax) + pad);
+}
+
+// Finds the pixels [x0, x1) x [y0, y1) that cmd may touch within the
+// target, returning false if there are none. This is how commands outside
+// the clip are skipped before any rasterizing.
+static bit cmd_pixel_bounds(Target *t, Cmd *cmd,
+                            int *x0, int *y0, int *x1, int *y1) {
+  return pixel_bounds(cmd_bounds(cmd), 0, t->x1, t->y1, x0, y0, x1, y1) &&
+         clip_to(t, x0, y0, x1, y1);
+}
+
+// The software rasterizer has no drawing state to switch between commands,
+// so lists simply run in the order they were recorded.
+static void run_cmd(Target *t, Cmd *cmd) {
+  xy__Rect r = cmd->rect;
+  if (cmd->op == cmd_fill_rect)   fill_rect  (t, cmd->color, r);
+  if (cmd->op == cmd_stroke_rect) stroke_rect(t, cmd->color, r);
+  if (cmd->op == cmd_line || cmd->op == cmd_smooth_line) {
+    draw_line(t, cmd->color, cmd->op == cmd_smooth_line,
+              r.xmin, r.ymin, r.xmax, r.ymax);
+  }
+}
+
+// Rasterizes one tile of a list using the commands binned to that tile.
+static void run_tile(void *data, int tile) {
+  TileJob *job = data;
+  int      tx  = (tile % job->tiles_x) * tile_size;
+  int      ty  = (tile / job->tiles_x) * tile_size;
+  Target   t   = { job->clip.bitmap, tx, ty, tx + tile_size, ty + tile_size,
+                   job->clip.is_linear };
+  if (!clip_to(&job->clip, &t.x0, &t.y0, &t.x1, &t.y1)) return;
+
+  for (int i = job->bin_starts[tile]; i < job->bin_starts[tile + 1]; ++i) {
+    run_cmd(&t, &job->cmds[job->bins[i]]);
+  }
+}
+
+// Splits the bitmap into tiles, bins each command into the tiles it may
+// touch, and rasterizes the tiles in parallel. Each pixel belongs to one
+// tile and sees its commands in list order, while every rasterizer is
+// independent of where it's clipped. So the result is bit-identical to
+// drawing the list on one thread.
+static void run_cmds_tiled(Target *t, Cmd *cmds, int num_cmds,
+                           int num_threads) {
+  Bitmap *b = t->bitmap;
+  TileJob job;
+  job.clip    = *t;
+  job.cmds    = cmds;
+  job.tiles_x = (b->x_size + tile_size - 1) / tile_size;
+  int tiles_y = (b->y_size + tile_size - 1) / tile_size;
+  int n_tiles = job.tiles_x * tiles_y;
+
+  // Count the commands per tile, then store them in one array so that
+  // tile k's commands are bins[bin_starts[k]..bin_starts[k + 1] - 1].
+  int (*boxes)[4]  = malloc(num_cmds * sizeof(*boxes));
+  job.bin_starts   = calloc(n_tiles + 1, sizeof(int));
+  for (int i = 0; i < num_cmds; ++i) {
+    int *box = boxes[i];
+    if (!cmd_pixel_bounds(t, &cmds[i], &box[0], &box[1], &box[2], &box[3])) {
+      box[0] = box[2] = 0;
+      continue;
+    }
+    for (int y = box[1] / tile_size; y <= (box[3] - 1) / tile_size; ++y) {
+      for (int x = box[0] / tile_size; x <= (box[2] - 1) / tile_size; ++x) {
+        job.bin_starts[y * job.tiles_x + x + 1]++;
+      }
+    }
+  }
+  for (int k = 0; k < n_tiles; ++k) job.bin_starts[k + 1] += job.bin_starts[k];
+
+  int *fill = malloc(n_tiles * sizeof(int));
+  memcpy(fill, job.bin_starts, n_tiles * sizeof(int));
+  job.bins = malloc((job.bin_starts[n_tiles] + 1) * sizeof(int));
+  for (int i = 0; i < num_cmds; ++i) {
+    int *box = boxes[i];
+    if (box[0] == box[2]) continue;
+    for (int y = box[1] / tile_size; y <= (box[3] - 1) / tile_size; ++y) {
+      for (int x = box[0] / tile_size; x <= (box[2] - 1) / tile_size; ++x) {
+        job.bins[fill[y * job.tiles_x + x]++] = i;
+      }
+    }
+  }
+
+  workers__run(n_tiles, run_tile, &job, num_threads);
+
+  free(boxes);
+  free(fill);
+  free(job.bins);
+  free(job.bin_starts);
+}
+
+// Marks the pixels cmd may touch as dirty, returning false if there are
+// none.
+static bit mark_cmd_dirty(Target *t, Cmd *cmd) {
+  int x0, y0, x1, y1;
+  if (!cmd_pixel_bounds(t, cmd, &x0, &y0, &x1, &y1)) return false;
+  mark_pixels(t->bitmap, xy__rect_pts(x0, y0, x1, y1));
+  return true;
+}
+
+static void run_cmds(Target *t, Cmd *cmds, int num_cmds, int num_threads) {
+  Bitmap *b = t->bitmap;
+  if (num_threads > 1 && (b->x_size > tile_size || b->y_size > tile_size)) {
+    for (int i = 0; i < num_cmds; ++i) mark_cmd_dirty(t, &cmds[i]);
+    run_cmds_tiled(t, cmds, num_cmds, num_threads);
+    return;
+  }
+  for (int i = 0; i < num_cmds; ++i) {
+    if (mark_cmd_dirty(t, &cmds[i])) run_cmd(t, &cmds[i]);
+  }
+}
+
+// Polygons.
+
+// The shared input for rasterizing a polygon band by band.
+typedef struct {
+  Bitmap       *bitmap;
+  const xy__Pt *pts;
+  int           n;
+  int           rule;
+  uint32_t      color;
+  bit           is_linear;
+  int           x0;           // The pixels [x0, x1) x [y0, y1) are filled.
+  int           y0;
+  int           x1;
+  int           y1;
+  int          *bin_starts;  // Band k's edges start at bins[bin_starts[k]],
+  int          *bins;        // each given by the index of its first point.
+} PolygonJob;
+
+// Finds the bands [*b0, *b1] that the edge from point i crosses, returning
+// false if there are none. Flat edges add no coverage, so they're skipped.
+static bit edge_bands(PolygonJob *job, int i, int *b0, int *b1) {
+  const xy__Pt *p  = &job->pts[i];
+  const xy__Pt *q  = &job->pts[(i + 1 < job->n) ? i + 1 : 0];
+  double        h  = job->y1 - job->y0;
+  double        lo = fmin(p->y, q->y) - job->y0;
+  double        hi = fmax(p->y, q->y) - job->y0;
+  if (!(lo < hi) || hi <= 0 || lo >= h) return false;
+  *b0 = (lo <= 0) ? 0 : (int)(lo / poly_band_rows);
+  *b1 = (int)ceil(fmin(hi, h) / poly_band_rows) - 1;
+  return true;
+}
+
+// Returns the end of the run of bytes equal to v that starts at a[i],
+// comparing 8 bytes at a time across long runs.
+static int run_end(const uint8_t *a, int i, int n, uint8_t v) {
+  uint64_t run = 0x0101010101010101ull * v, word;
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&word, a + i, 8);
+    if (word != run) break;
+  }
+  while (i < n && a[i] == v) ++i;
+  return i;
+}
+
+// Finds the coverage of one band of rows from the edges that cross it, and
+// blends the color over each pixel by how much of it is covered. The band's
+// accumulation buffer is small enough to stay in cache.
+static void run_polygon_band(void *data, int band) {
+  PolygonJob *job = data;
+  int         y0  = job->y0 + band * poly_band_rows;
+  int         w   = job->x1 - job->x0;
+  int         h   = job->y1 - y0;
+  if (h > poly_band_rows) h = poly_band_rows;
+
+  raster__Canvas canvas;
+  raster__init(&canvas, w, h);
+  for (int k = job->bin_starts[band]; k < job->bin_starts[band + 1]; ++k) {
+    int           i = job->bins[k];
+    const xy__Pt *p = &job->pts[i];
+    const xy__Pt *q = &job->pts[(i + 1 < job->n) ? i + 1 : 0];
+    raster__line(&canvas, (float)(p->x - job->x0), (float)(p->y - y0),
+                          (float)(q->x - job->x0), (float)(q->y - y0));
+  }
+  uint8_t  *coverage = malloc((size_t)w * h);
+  uint32_t *mask     = malloc(w * sizeof(uint32_t));
+  raster__finish(&canvas, coverage, w, job->rule);
+  raster__free(&canvas);
+
+  // Each row is split into runs that are uncovered, which are skipped,
+  // fully covered, which are filled, and partly covered, which are blended
+  // through a mask.
+  for (int y = 0; y < h; ++y) {
+    uint8_t *a = coverage + (size_t)y * w;
+    for (int x = 0, end; x < w; x = end) {
+      bit is_partial = (a[x] != 0 && a[x] != 255);
+      if (is_partial) {
+        for (end = x + 1; end < w && a[end] != 0 && a[end] != 255; ++end);
+      } else {
+        end = run_end(a, x, w, a[x]);
+      }
+      if (a[x] == 255) {
+        fill_span(job->bitmap, job->x0 + x, job->x0 + end, y0 + y,
+                  job->color, job->is_linear);
+      } else if (is_partial) {
+        for (int i = x; i < end; ++i) {
+          mask[i] = span__pixel(a[i], a[i], a[i], a[i]);
+        }
+        uint32_t *p = row(job->bitmap, y0 + y) + job->x0 + x;
+        if (job->is_linear) {
+          span__blend_masked_linear(p, mask + x, end - x, job->color);
+        } else {
+          span__blend_masked(p, mask + x, end - x, job->color);
+        }
+      }
+    }
+  }
+  free(mask);
+  free(coverage);
+}
+
+// Mipmaps.
+
+typedef struct {
+  Bitmap *src;
+  Bitmap *dst;
+  bit     is_linear;  // Pixels are averaged in linear light when this is set.
+} MipJob;
+
+// Fills rows [y0, y1) of the mip level dst from its parent src. Sizes that
+// are odd drop the parent's last row or column, and a parent 1 pixel wide
+// or tall has its pixels used twice.
+static void downsample_rows(MipJob *job, int y0, int y1) {
+  Bitmap *src = job->src, *dst = job->dst;
+  void  (*downsample)(uint32_t *, const uint32_t *, const uint32_t *, int) =
+      job->is_linear ? span__downsample_linear : span__downsample;
+  for (int y = y0; y < y1; ++y) {
+    uint32_t *src0 = row(src, 2 * y);
+    uint32_t *src1 = row(src, (src->y_size > 1) ? 2 * y + 1 : 2 * y);
+    if (src->x_size > 1) {
+      downsample(row(dst, y), src0, src1, dst->x_size);
+    } else {
+      uint32_t pair0[2] = { src0[0], src0[0] };
+      uint32_t pair1[2] = { src1[0], src1[0] };
+      downsample(row(dst, y), pair0, pair1, 1);
+    }
+  }
+}
+
+static void run_mip_band(void *data, int band) {
+  MipJob *job = data;
+  int     y0  = band * mip_band_rows;
+  int     y1  = y0 + mip_band_rows;
+  downsample_rows(job, y0, (y1 < job->dst->y_size) ? y1 : job->dst->y_size);
+}
+
+// Stores up to max_levels mip levels of bitmap in levels and returns how
+// many were stored. Large levels are split into bands of rows made in
+// parallel.
+static int build_mipmaps(Bitmap *bitmap, Bitmap **levels, int max_levels,
+                         bit is_linear) {
+  if (bitmap == NULL) return 0;
+  unpack_pixels(bitmap);
+  int     n   = 0;
+  Bitmap *src = bitmap;
+  while (n < max_levels && (src->x_size > 1 || src->y_size > 1)) {
+    int     w   = (src->x_size > 1) ? src->x_size / 2 : 1;
+    int     h   = (src->y_size > 1) ? src->y_size / 2 : 1;
+    Bitmap *dst = draw__new_bitmap(w, h);
+    if (dst == NULL) break;
+
+    MipJob job = { src, dst, is_linear };
+    if ((int64_t)w * h >= min_threaded_mip) {
+      int num_bands = (h + mip_band_rows - 1) / mip_band_rows;
+      workers__run(num_bands, run_mip_band, &job, workers__num_cores());
+    } else {
+      downsample_rows(&job, 0, h);
+    }
+    add_dirty(&dst->dirty, xy__rect_pts(0, 0, w, h));
+
+    levels[n++] = dst;
+    src         = dst;
+  }
+  return n;
+}
+
+// Blurs.
+
+// A blur is three box blurs of each row, then three of each column. Rows
+// are blurred in bands; columns are blurred in strips, each moving a row of
+// box sums down its rows.
+typedef struct {
+  Bitmap   *bitmap;
+  int       x0;        // The pixels [x0, x0 + w) x [y0, y0 + h) are blurred.
+  int       y0;
+  int       w;
+  int       h;
+  int       radii[3];  // The radii of the box blurs, which run in order.
+  uint32_t *pixels;    // The w x h pixels with their rows blurred.
+} BlurJob;
+
+// Finds the radii of three box blurs that together are close to a Gaussian
+// blur with standard deviation sigma. A box of odd width w adds
+// (w^2 - 1) / 12 to the variance, so the widths are a mix of the odd w
+// below the ideal width and w + 2, in the numbers that sum closest to
+// sigma^2.
+static void find_blur_radii(double sigma, int *radii) {
+  double var = sigma * sigma;
+  int    w   = (int)sqrt(4 * var + 1);  // The ideal width for three boxes.
+  if (w % 2 == 0) --w;
+  int num_narrow = (int)round((12 * var - 3.0 * w * w - 12.0 * w - 9) /
+                              (-4.0 * w - 4));
+  for (int i = 0; i < 3; ++i) radii[i] = ((i < num_narrow) ? w : w + 2) / 2;
+}
+
+static void run_blur_band(void *data, int band) {
+  BlurJob  *job  = data;
+  int       y0   = band * blur_band_rows;
+  int       y1   = y0 + blur_band_rows;
+  uint32_t *tmp0 = malloc(2 * (size_t)job->w * sizeof(uint32_t));
+  uint32_t *tmp1 = tmp0 + job->w;
+  for (int y = y0; y < y1 && y < job->h; ++y) {
+    span__box_blur(tmp0, row(job->bitmap, job->y0 + y) + job->x0, job->w,
+                   job->radii[0]);
+    span__box_blur(tmp1, tmp0, job->w, job->radii[1]);
+    span__box_blur(job->pixels + (size_t)y * job->w, tmp1, job->w,
+                   job->radii[2]);
+  }
+  free(tmp0);
+}
+
+// Box blurs the columns of a strip n pixels wide and h rows tall from src
+// to dst, whose rows are src_stride and dst_stride pixels apart. The sums
+// array holds 4 * n values.
+static void box_blur_columns(uint32_t *dst, size_t dst_stride,
+                             const uint32_t *src, size_t src_stride,
+                             int n, int h, int r, uint32_t *sums) {
+  // Start with the boxes centered on row 0, which repeat the strip's top
+  // and bottom rows past its edges.
+  int            last   = (r < h - 1) ? r : h - 1;
+  const uint8_t *top    = (const uint8_t *)src;
+  const uint8_t *bottom = (const uint8_t *)(src + (h - 1) * src_stride);
+  for (int i = 0; i < 4 * n; ++i) {
+    sums[i] = (uint32_t)(r + 1) * top[i] + (uint32_t)(r - last) * bottom[i];
+  }
+  for (int y = 1; y <= last; ++y) {
+    const uint8_t *p = (const uint8_t *)(src + y * src_stride);
+    for (int i = 0; i < 4 * n; ++i) sums[i] += p[i];
+  }
+
+  for (int y = 0; y < h; ++y) {
+    int add = (y + r + 1 < h) ? y + r + 1 : h - 1;
+    int sub = (y - r > 0)     ? y - r     : 0;
+    span__box_blur_step(dst + y * dst_stride, sums, src + add * src_stride,
+                        src + sub * src_stride, n, r);
+  }
+}
+
+// Blurs the columns of one strip of job->pixels into the bitmap.
+static void run_blur_strip(void *data, int strip) {
+  BlurJob  *job  = data;
+  int       x    = strip * blur_strip_width;
+  int       n    = (job->w - x < blur_strip_width) ? job->w - x
+                                                   : blur_strip_width;
+  uint32_t *sums = malloc(4 * (size_t)n * sizeof(uint32_t));
+  uint32_t *tmp  = malloc((size_t)n * job->h * sizeof(uint32_t));
+  uint32_t *src  = job->pixels + x;
+  uint32_t *dst  = row(job->bitmap, job->y0) + job->x0 + x;
+  box_blur_columns(tmp, n, src, job->w, n, job->h, job->radii[0], sums);
+  box_blur_columns(src, job->w, tmp, n, n, job->h, job->radii[1], sums);
+  box_blur_columns(dst, job->bitmap->stride / 4, src, job->w, n, job->h,
+                   job->radii[2], sums);
+  free(tmp);
+  free(sums);
+}
+
+// Atlases.
+
+// Returns the width a w-wide region at x takes up, which includes a
+// pixel's gap on its right unless it's at the atlas's right edge.
+static int padded_width(draw__Atlas a, int x, int w) {
+  return (x + w < a->w) ? w + 1 : w;
+}
+
+// Returns the lowest y at which a w x h region and its gap fit with the
+// region's left edge at the start of segment i, or -1 if they don't fit.
+static int atlas_fit(draw__Atlas a, int i, int w, int h) {
+  Segment *s = a->segments;
+  if (s[i].x + w > a->w) return -1;
+  int x_end = s[i].x + padded_width(a, s[i].x, w);
+  int y     = 0;
+  for (int j = i; j < a->num_segments && s[j].x < x_end; ++j) {
+    if (s[j].y > y) y = s[j].y;
+  }
+  return (y + h <= a->h) ? y : -1;
+}
+
+static void remove_segment(draw__Atlas a, int i) {
+  memmove(a->segments + i, a->segments + i + 1,
+          (a->num_segments - i - 1) * sizeof(Segment));
+  a->num_segments--;
+}
+
+// Raises the skyline to y for w pixels from the start of segment i.
+static void atlas_raise(draw__Atlas a, int i, int w, int y) {
+  Segment *s     = a->segments;
+  int      x     = s[i].x;
+  int      x_end = x + w;
+
+  // The new segment replaces segments i to j - 1, which it covers, and
+  // trims segment j if it covers part of it.
+  int j = i;
+  while (j < a->num_segments && s[j].x + s[j].w <= x_end) ++j;
+  if (j < a->num_segments && s[j].x < x_end) {
+    s[j].w -= x_end - s[j].x;
+    s[j].x  = x_end;
+  }
+  memmove(s + i + 1, s + j, (a->num_segments - j) * sizeof(Segment));
+  a->num_segments += 1 - (j - i);
+  s[i] = (Segment) { x, y, w };
+
+  // Join the new segment to neighbors of the same height.
+  if (i + 1 < a->num_segments && s[i + 1].y == y) {
+    s[i].w += s[i + 1].w;
+    remove_segment(a, i + 1);
+  }
+  if (i > 0 && s[i - 1].y == y) {
+    s[i - 1].w += s[i].w;
+    remove_segment(a, i);
+  }
+}
+
+// Deletes the atlas's views and makes its whole bitmap free.
+static void reset_atlas(draw__Atlas a) {
+  for (int i = 0; i < a->num_views; ++i) draw__delete_bitmap(a->views[i]);
+  a->num_views    = 0;
+  a->num_segments = 1;
+  a->segments[0]  = (Segment) { 0, 0, a->w };
+}
+
+// Tiled bitmaps.
+
+static xy__Rect offset_rect(xy__Rect r, double dx, double dy) {
+  return xy__rect_pts(r.xmin + dx, r.ymin + dy, r.xmax + dx, r.ymax + dy);
+}
+
+// Orders hits by tile and, within a tile, by command, which keeps each
+// tile's commands in list order.
+static int compare_hits(const void *a, const void *b) {
+  const TileHit *p = a, *q = b;
+  if (p->ty != q->ty) return (p->ty < q->ty) ? -1 : 1;
+  if (p->tx != q->tx) return (p->tx < q->tx) ? -1 : 1;
+  return p->cmd - q->cmd;
+}
+
+// Returns true when the segment from (line.xmin, line.ymin) to
+// (line.xmax, line.ymax) meets r. The segment is cut by each of r's edges
+// in turn, as in the Liang-Barsky algorithm.
+static bit line_meets_rect(xy__Rect line, xy__Rect r) {
+  double x  = line.xmin,      y  = line.ymin;
+  double dx = line.xmax - x,  dy = line.ymax - y;
+  double p[4] = { -dx, dx, -dy, dy };
+  double q[4] = { x - r.xmin, r.xmax - x, y - r.ymin, r.ymax - y };
+  double t0 = 0, t1 = 1;
+  for (int i = 0; i < 4; ++i) {
+    if (p[i] == 0) {
+      if (q[i] < 0) return false;  // It's parallel to this edge and outside.
+      continue;
+    }
+    double t = q[i] / p[i];
+    if (p[i] < 0) {
+      if (t > t1) return false;
+      if (t > t0) t0 = t;
+    } else {
+      if (t < t0) return false;
+      if (t < t1) t1 = t;
+    }
+  }
+  return true;
+}
+
+// Returns true when cmd may touch r, given that its bounds overlap r.
+// Lines and outlines only touch the tiles along them, so a long line or a
+// big outline doesn't make every tile it spans.
+static bit cmd_meets_rect(Cmd *cmd, xy__Rect r) {
+  xy__Rect c = cmd->rect;
+  if (cmd->op == cmd_fill_rect) return true;
+  if (cmd->op != cmd_stroke_rect) return line_meets_rect(c, r);
+  return line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmax, c.ymin), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymax, c.xmax, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmin, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmax, c.ymin, c.xmax, c.ymax), r);
+}
+
+// Appends a hit for each tile that command i, cmd, may touch within area,
+// which is the part of the canvas inside the clip.
+static void add_tile_hits(xy__Rect area, Cmd *cmd, int i,
+                          TileHit **hits, int *num_hits, int *hits_cap) {
+  xy__Rect b = intersection_of(cmd_bounds(cmd), area);
+  if (b.xmin == b.xmax || b.ymin == b.ymax) return;
+  int tx0 = (int)floor(b.xmin / draw__tile_size);
+  int ty0 = (int)floor(b.ymin / draw__tile_size);
+  int tx1 = (int)ceil (b.xmax / draw__tile_size) - 1;
+  int ty1 = (int)ceil (b.ymax / draw__tile_size) - 1;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      // Pad the tile by a pixel to allow for the pen width and antialiasing.
+      xy__Rect r = xy__rect_size((double)tx * draw__tile_size - 1,
+                                 (double)ty * draw__tile_size - 1,
+                                 draw__tile_size + 2, draw__tile_size + 2);
+      if (!cmd_meets_rect(cmd, r)) continue;
+      if (*num_hits == *hits_cap) {
+        *hits_cap = *hits_cap ? 2 * *hits_cap : 64;
+        *hits     = realloc(*hits, *hits_cap * sizeof(TileHit));
+      }
+      (*hits)[(*num_hits)++] = (TileHit) { tx, ty, i };
+    }
+  }
+}
+
+// Returns the code point starting at *s and moves *s past it. Bytes that
+// aren't valid UTF-8 each become the replacement character.
+static uint32_t next_char(const char **s) {
+  static const uint32_t min_of_len[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+  const uint8_t *p = (const uint8_t *)*s;
+  int len = (p[0] < 0x80)      ? 1 :
+            (p[0] >> 5 == 6)   ? 2 :
+            (p[0] >> 4 == 14)  ? 3 :
+            (p[0] >> 3 == 30)  ? 4 : 0;
+  *s += 1;
+  if (len == 1) return p[0];
+  if (len == 0) return replacement_char;
+
+  // A null terminator also ends the sequence here.
+  uint32_t c = p[0] & (0x7f >> len);
+  for (int i = 1; i < len; ++i) {
+    if ((p[i] & 0xc0) != 0x80) return replacement_char;
+    c = c << 6 | (p[i] & 0x3f);
+  }
+  if (c < min_of_len[len] || c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) {
+    return replacement_char;
+  }
+  *s += len - 1;
+  return c;
+}
+
+// Copies the bottom rows of the atlas into a new atlas of twice the height.
+static void grow_atlas(draw__Font f) {
+  Bitmap *old = f->atlas;
+  if (2 * old->y_size > INT16_MAX) return;  // Glyph positions are 16-bit.
+  Bitmap *new = draw__new_bitmap(old->x_size, 2 * old->y_size);
+  if (new == NULL) return;
+  memcpy(new->bytes, old->bytes, (size_t)old->stride * old->y_size);
+  f->atlas = new;
+  draw__delete_bitmap(old);
+}
+
+// Rasterizes the glyph into the atlas if it's not there yet. Glyphs with
+// no outline, such as spaces, are ready with a size of 0.
+static Glyph *glyph_of(draw__Font f, int glyph) {
+  if (glyph >= f->ttf->num_glyphs) glyph = 0;
+  Glyph *g = &f->glyphs[glyph];
+  if (g->is_ready) return g;
+
+  ttf__Box box;
+  uint8_t *coverage = ttf__coverage(f->ttf, glyph, f->scale, &box);
+  g->is_ready = true;
+  if (coverage == NULL) return g;
+  if (box.w + 1 > f->atlas->x_size || box.h > INT16_MAX) {
+    free(coverage);
+    return g;
+  }
+
+  // Leave a pixel between glyphs so that they never touch.
+  if (f->shelf_x + box.w + 1 > f->atlas->x_size) {
+    f->shelf_x  = 0;
+    f->shelf_y += f->shelf_h + 1;
+    f->shelf_h  = 0;
+  }
+  while (f->shelf_y + box.h > f->atlas->y_size) {
+    int old_y_size = f->atlas->y_size;
+    grow_atlas(f);
+    if (f->atlas->y_size == old_y_size) {
+      free(coverage);
+      return g;
+    }
+  }
+
+  *g = (Glyph) { f->shelf_x, f->shelf_y, box.w, box.h, box.left, box.bottom,
+                 true };
+  for (int y = 0; y < box.h; ++y) {
+    uint32_t *dst = row(f->atlas, g->y + y) + g->x;
+    uint8_t  *src = coverage + y * box.w;
+    for (int x = 0; x < box.w; ++x) {
+      dst[x] = span__pixel(src[x], src[x], src[x], src[x]);
+    }
+  }
+  free(coverage);
+
+  f->shelf_x += box.w + 1;
+  if (box.h > f->shelf_h) f->shelf_h = box.h;
+  return g;
+}
+
+// Blends color through the glyph's coverage with the pen at (x, y), and
+// expands drawn to include the pixels changed.
+static void draw_glyph(Target *t, draw__Font f, Glyph *g, int x, int y,
+                       uint32_t color, xy__Rect *drawn) {
+  int x0 = x + g->left, y0 = y + g->bottom;
+  int x1 = x0 + g->w,   y1 = y0 + g->h;
+  int dx = 0,           dy = 0;
+  if (x0 < t->x0) { dx = t->x0 - x0; x0 = t->x0; }
+  if (y0 < t->y0) { dy = t->y0 - y0; y0 = t->y0; }
+  if (x1 > t->x1) x1 = t->x1;
+  if (y1 > t->y1) y1 = t->y1;
+  if (x0 >= x1 || y0 >= y1) return;
+
+  *drawn = union_of(*drawn, xy__rect_pts(x0, y0, x1, y1));
+  for (int i = 0; i < y1 - y0; ++i) {
+    uint32_t *mask = row(f->atlas, g->y + dy + i) + g->x + dx;
+    uint32_t *p    = row(t->bitmap, y0 + i) + x0;
+    if (t->is_linear) span__blend_masked_linear(p, mask, x1 - x0, color);
+    else              span__blend_masked(p, mask, x1 - x0, color);
+  }
+}
+
+static int glyph_of_char(draw__Font f, uint32_t c) {
+  return (c < 128) ? f->ascii_glyphs[c] : ttf__glyph_of_char(f->ttf, c);
+}
+
+// Returns the width of the len bytes at s in pixels, including kerning.
+static double string_width(draw__Font f, const char *s, size_t len) {
+  const char *end   = s + len;
+  int         units = 0, prev = -1;
+  while (s < end) {
+    int glyph = glyph_of_char(f, next_char(&s));
+    if (prev >= 0) units += ttf__kerning(f->ttf, prev, glyph);
+    units += ttf__advance(f->ttf, glyph);
+    prev   = glyph;
+  }
+  return units * f->scale;
+}
+
+// Draws the len bytes at s with the context's font in the box with min
+// corner (x, y) and width w, returning the x value at the end of the text.
+static xy__Float draw_text(draw__Context *c, const char *s, size_t len,
+                           xy__Float x, xy__Float y, xy__Float w,
+                           float pos) {
+  draw__Font  font  = c->font;
+  const char *end   = s + len;
+  double      width = string_width(font, s, len);
+  double      start = x + pos * (w - width);
+  if (c->bitmap == NULL) return start + width;
+
+  // The box's min y is the bottom of the font's descent.
+  ttf__Font *ttf      = font->ttf;
+  float      scale    = font->scale;
+  Target     t        = target_of(c);
+  int        baseline = (int)floor(y + ttf->descent * scale + 0.5);
+
+  // Strings outside the clip are skipped before their glyphs are rasterized.
+  // Each glyph is within the font's box around its pen position, give or
+  // take a pixel of antialiasing.
+  int      x0, y0, x1, y1;
+  xy__Rect bounds = xy__rect_pts(start + ttf->x_min * scale - 1,
+                                 baseline + ttf->y_min * scale - 1,
+                                 start + width + ttf->x_max * scale + 1,
+                                 baseline + ttf->y_max * scale + 1);
+  if (!pixel_bounds(bounds, 0, t.x1, t.y1, &x0, &y0, &x1, &y1) ||
+      !clip_to(&t, &x0, &y0, &x1, &y1)) {
+    return start + width;
+  }
+
+  int      units    = 0, prev = -1;
+  xy__Rect drawn    = xy__rect_pts(INFINITY, INFINITY, -INFINITY, -INFINITY);
+  own_rows(c->bitmap, y0, y1);
+  pthread_mutex_lock(&font->mutex);
+  while (s < end) {
+    int glyph = glyph_of_char(font, next_char(&s));
+    if (prev >= 0) units += ttf__kerning(font->ttf, prev, glyph);
+    int pen_x = (int)floor(start + units * font->scale + 0.5);
+    draw_glyph(&t, font, glyph_of(font, glyph), pen_x, baseline,
+               c->font_color, &drawn);
+    units += ttf__advance(font->ttf, glyph);
+    prev   = glyph;
+  }
+  pthread_mutex_unlock(&font->mutex);
+  mark_pixels(c->bitmap, drawn);
+
+  return start + width;
+}
+
+static void add_cmd(draw__Context *c, int op, uint32_t color, xy__Rect rect) {
+  draw__List list = c->recording_list;
+  if (list->num_cmds == list->cmds_cap) {
+    list->cmds_cap = list->cmds_cap ? 2 * list->cmds_cap : 64;
+    list->cmds     = realloc(list->cmds, list->cmds_cap * sizeof(Cmd));
+  }
+  list->cmds[list->num_cmds++] = (Cmd) { op, color, rect };
+}
+
+// Records the command if a list is being recorded, and otherwise draws it.
+static void do_cmd(draw__Context *c, int op, uint32_t color, xy__Rect rect) {
+  if (c->recording_list) { add_cmd(c, op, color, rect); return; }
+  if (c->bitmap == NULL) return;
+  Cmd    cmd = { op, color, rect };
+  Target t   = target_of(c);
+  if (mark_cmd_dirty(&t, &cmd)) run_cmd(&t, &cmd);
+}
+
+// Copies the sprite's pixels into the target, clipped to it and to the
+// source bitmap, and marks the pixels changed as dirty.
+static void blit(Target *t, const draw__Sprite *sprite, int mode) {
+  Bitmap *b   = t->bitmap;
+  Bitmap *src = sprite->src;
+  int     sx0, sy0, sx1, sy1;
+  if (src == NULL || !pixel_bounds(sprite->src_rect, INT_MIN, INT_MAX,
+                                   INT_MAX, &sx0, &sy0, &sx1, &sy1)) {
+    return;
+  }
+
+  // Clip in src coordinates; (dx, dy) takes them to b. The offset comes from
+  // the unclipped rect so that clipping doesn't move the pixels drawn.
+  int64_t dx = (int64_t)sprite->dst_x - sx0, dy = (int64_t)sprite->dst_y - sy0;
+  int64_t x0 = sx0, y0 = sy0, x1 = sx1, y1 = sy1;
+  if (x0 < 0)          x0 = 0;
+  if (x0 < t->x0 - dx) x0 = t->x0 - dx;
+  if (y0 < 0)          y0 = 0;
+  if (y0 < t->y0 - dy) y0 = t->y0 - dy;
+  if (x1 > src->x_size) x1 = src->x_size;
+  if (x1 > t->x1 - dx)  x1 = t->x1 - dx;
+  if (y1 > src->y_size) y1 = src->y_size;
+  if (y1 > t->y1 - dy)  y1 = t->y1 - dy;
+  if (x0 >= x1 || y0 >= y1) return;
+
+  int n = (int)(x1 - x0), h = (int)(y1 - y0);
+  mark_pixels(b, xy__rect_pts(x0 + dx, y0 + dy, x1 + dx, y1 + dy));
+  unpack_pixels(src);
+
+  // A bitmap blitted into itself, or between views of one bitmap, may have
+  // its source pixels drawn over before they're read, so they're read from
+  // a copy.
+  uint32_t *copy = NULL;
+  if (root_of(src) == root_of(b)) {
+    copy = malloc((size_t)n * h * sizeof(uint32_t));
+    for (int i = 0; i < h; ++i) {
+      memcpy(copy + (size_t)i * n, row(src, (int)y0 + i) + x0,
+             n * sizeof(uint32_t));
+    }
+  }
+
+  for (int i = 0; i < h; ++i) {
+    const uint32_t *from = copy ? copy + (size_t)i * n
+                                : row(src, (int)y0 + i) + x0;
+    uint32_t       *to   = row(b, (int)(y0 + dy) + i) + (x0 + dx);
+    switch (mode) {
+      case draw__blit_copy: memcpy(to, from, n * sizeof(uint32_t)); break;
+      case draw__blit_add:  span__add(to, from, n);                  break;
+      case draw__blit_over:
+        if (t->is_linear) span__composite_linear(to, from, n);
+        else              span__composite(to, from, n);
+        break;
+    }
+  }
+  free(copy);
+}
+
+// Text boxes.
+
+// This is the 64-bit FNV-1a hash taken 8 bytes at a time, which keeps
+// looking up a long string, such as a log, cheap enough to do every frame.
+static uint64_t hash_text(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ULL, v;
+  size_t   i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, 8);
+    h = (h ^ v) * 1099511628211ULL;
+  }
+  for (; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ULL;
+  return h ^ (h >> 32);
+}
+
+// Returns the number of bytes at the start of a and b that match,
+// comparing 8 bytes at a time.
+static size_t common_prefix(const char *a, size_t a_len,
+                            const char *b, size_t b_len) {
+  size_t n = (a_len < b_len) ? a_len : b_len, i = 0;
+  for (uint64_t u, v; i + 8 <= n; i += 8) {
+    memcpy(&u, a + i, 8);
+    memcpy(&v, b + i, 8);
+    if (u != v) break;
+  }
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
+}
+
+static void unlink_layout(TextLayout *l) {
+  if (l->newer) l->newer->older = l->older;
+  else          newest_layout   = l->older;
+  if (l->older) l->older->newer = l->newer;
+  else          oldest_layout   = l->newer;
+}
+
+static void push_newest_layout(TextLayout *l) {
+  l->newer = NULL;
+  l->older = newest_layout;
+  if (newest_layout) newest_layout->newer = l;
+  newest_layout = l;
+  if (oldest_layout == NULL) oldest_layout = l;
+}
+
+static void remove_layout(TextLayout *l) {
+  unlink_layout(l);
+  num_layouts--;
+  free(l->text);
+  free(l->words);
+  free(l->lines);
+  free(l);
+}
+
+// Starts the new layout l with the first num_words words and num_lines line
+// starts of from.
+static void copy_layout_start(TextLayout *l, TextLayout *from,
+                              int num_words, int num_lines) {
+  l->words     = malloc(num_words * sizeof(Word));
+  l->words_cap = l->num_words = num_words;
+  memcpy(l->words, from->words, num_words * sizeof(Word));
+  if (num_lines == 0) return;
+  l->lines     = malloc(num_lines * sizeof(int));
+  l->lines_cap = l->num_lines = num_lines;
+  memcpy(l->lines, from->lines, num_lines * sizeof(int));
+}
+
+// Drops the layouts in the given font, since it may be deleted and its
+// address reused.
+static void remove_layouts_using(draw__Font old_font) {
+  pthread_mutex_lock(&layouts_mutex);
+  for (TextLayout *l = oldest_layout, *newer; l; l = newer) {
+    newer = l->newer;
+    if (l->font == old_font) remove_layout(l);
+  }
+  pthread_mutex_unlock(&layouts_mutex);
+}
+
+static size_t word_start(TextLayout *l, int i) {
+  return i ? l->words[i - 1].end : 0;
+}
+
+static bit is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Appends the words of text[from..len) to the layout without measuring
+// them.
+static void split_words(TextLayout *l, size_t from) {
+  const char *text = l->text;
+  size_t      i    = from;
+  while (i < l->len) {
+    if (l->num_words == l->words_cap) {
+      l->words_cap = l->words_cap ? 2 * l->words_cap : 64;
+      l->words     = realloc(l->words, l->words_cap * sizeof(Word));
+    }
+    Word *w = &l->words[l->num_words++];
+    while (i < l->len && !is_space(text[i]) && text[i] != '\n') ++i;
+    w->chars_end = i;
+    while (i < l->len && is_space(text[i])) ++i;
+    w->ends_line = (i < l->len && text[i] == '\n');
+    if (w->ends_line) ++i;
+    w->end = i;
+  }
+}
+
+// Measures the words from words[first] on. Each line of text between
+// newlines is measured as one run, so kerning between two words counts
+// toward the later one.
+static void measure_words(draw__Context *c, TextLayout *l, int first) {
+  draw__Font  f    = c->font;
+  const char *s    = l->text + word_start(l, first);
+  int         prev = -1;
+  if (first > 0 && !l->words[first - 1].ends_line) {
+    const char *p = s - 1;
+    while (p > l->text && (*p & 0xc0) == 0x80) --p;
+    prev = glyph_of_char(f, next_char(&p));
+  }
+  for (int i = first; i < l->num_words; ++i) {
+    Word       *w         = &l->words[i];
+    const char *chars_end = l->text + w->chars_end;
+    const char *end       = l->text + w->end - w->ends_line;
+    int         units     = 0, chars_units = 0;
+    while (s < end) {
+      if (s == chars_end) chars_units = units;
+      int glyph = glyph_of_char(f, next_char(&s));
+      if (prev >= 0) units += ttf__kerning(f->ttf, prev, glyph);
+      units += ttf__advance(f->ttf, glyph);
+      prev   = glyph;
+    }
+    if (chars_end == end) chars_units = units;
+    w->width       = chars_units * f->scale;
+    w->space_width = (units - chars_units) * f->scale;
+    if (w->ends_line) {
+      ++s;
+      prev = -1;
+    }
+  }
+}
+
+// Breaks the words into lines from line first_line on, which starts with
+// the same word as before. Each line takes words while they fit in the
+// width; a word too wide for any line gets one to itself.
+static void wrap_lines(TextLayout *l, int first_line) {
+  int i = first_line ? l->lines[first_line] : 0;
+  l->num_lines = first_line;
+  while (i < l->num_words) {
+    if (l->num_lines == l->lines_cap) {
+      l->lines_cap = l->lines_cap ? 2 * l->lines_cap : 64;
+      l->lines     = realloc(l->lines, l->lines_cap * sizeof(int));
+    }
+    l->lines[l->num_lines++] = i;
+    xy__Float x = l->words[i].width;
+    while (!l->words[i].ends_line && i + 1 < l->num_words) {
+      xy__Float next = x + l->words[i].space_width + l->words[i + 1].width;
+      if (l->is_wrapped && next > l->width) break;
+      x = next;
+      ++i;
+    }
+    ++i;
+  }
+}
+
+// Returns the index of the first word that doesn't end before byte at,
+// which is the first word that may change when the text changes there.
+static int word_at(TextLayout *l, size_t at) {
+  int lo = 0, hi = l->num_words;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (l->words[mid].end < at) lo = mid + 1;
+    else                        hi = mid;
+  }
+  return lo;
+}
+
+// Returns the index of the line holding word i.
+static int line_of_word(TextLayout *l, int i) {
+  int lo = 0, hi = l->num_lines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (l->lines[mid] <= i) lo = mid;
+    else                    hi = mid - 1;
+  }
+  return lo;
+}
+
+// Returns the layout of s in the context's font, with its lines wrapped to
+// width when is_wrapped, making or updating one as needed. A string that
+// starts the same as a cached one in the font reuses its words: only the
+// words from the first changed byte on are measured, and only the lines
+// from the one before them are wrapped again. A new width wraps the
+// cached words without measuring them. The caller holds layouts_mutex.
+static TextLayout *layout_of(draw__Context *c, const char *s,
+                             bit is_wrapped, xy__Float width) {
+  size_t   len  = strlen(s);
+  uint64_t hash = hash_text(s, len);
+
+  // Find the layout of s, or else the one sharing the most leading bytes
+  // with it.
+  TextLayout *l    = NULL;
+  size_t      same = 0;
+  for (TextLayout *m = newest_layout; m; m = m->older) {
+    if (m->font != c->font) continue;
+    if (m->hash == hash && m->len == len && memcmp(m->text, s, len) == 0) {
+      l    = m;
+      same = len;
+      break;
+    }
+    size_t n = common_prefix(m->text, m->len, s, len);
+    if (n > same) {
+      l    = m;
+      same = n;
+    }
+  }
+
+  // A layout that would keep no words is left to its own string.
+  bit is_same = (l && same == len && l->len == len);
+  if (l && !is_same && word_at(l, same) == 0) l = NULL;
+
+  // Lines before the one holding the last unchanged word are kept, since
+  // each of their breaks only depends on unchanged words.
+  int first_word     = 0;
+  int first_line     = 0;
+  bit are_lines_kept = false;
+  if (l) {
+    first_word     = is_same ? l->num_words : word_at(l, same);
+    are_lines_kept = (l->num_lines > 0 && l->is_wrapped == is_wrapped &&
+                      (!is_wrapped || l->width == width));
+  }
+  if (are_lines_kept && first_word > 0) {
+    first_line = line_of_word(l, first_word - 1);
+  }
+
+  // A string that extends a cached one, such as a log that's been added to,
+  // takes over its layout. Any other string starts a new layout from a copy
+  // of the kept words and lines, so that boxes with a common start, such as
+  // timestamped entries, don't evict each other.
+  if (l && same == l->len) {
+    unlink_layout(l);
+  } else {
+    TextLayout *from = l;
+    l       = calloc(1, sizeof(TextLayout));
+    l->font = c->font;
+    if (from) {
+      copy_layout_start(l, from, first_word, first_line ? first_line + 1 : 0);
+    }
+    same = 0;  // The text is all copied below.
+    if (num_layouts == max_text_layouts) remove_layout(oldest_layout);
+    num_layouts++;
+  }
+
+  if (!is_same) {
+    size_t from = word_start(l, first_word);
+    l->text      = realloc(l->text, len + 1);
+    memcpy(l->text + same, s + same, len - same + 1);
+    l->len       = len;
+    l->hash      = hash;
+    l->num_words = first_word;
+    split_words(l, from);
+    measure_words(c, l, first_word);
+  }
+  if (!is_same || !are_lines_kept) {
+    l->is_wrapped = is_wrapped;
+    l->width      = width;
+    wrap_lines(l, are_lines_kept ? first_line : 0);
+  }
+  push_newest_layout(l);
+  return l;
+}
+
+// Finds the bytes [*start, *end) of line i, leaving out its trailing spaces
+// and newline.
+static void line_span(TextLayout *l, int i, size_t *start, size_t *end) {
+  int last = ((i + 1 < l->num_lines) ? l->lines[i + 1] : l->num_words) - 1;
+  *start = word_start(l, l->lines[i]);
+  *end   = l->words[last].chars_end;
+}
+
+
+// Bitmaps.
+
+draw__Bitmap draw__new_bitmap(int w, int h) {
+  if (w <= 0 || h <= 0 || w > max_bitmap_width) {
+    fprintf(stderr, "Error in %s: bitmap size must be positive, with a width "
+                    "of at most %d; got %dx%d.\n", __FUNCTION__,
+                    max_bitmap_width, w, h);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool_mutex);
+  Bitmap *b = pooled_bitmap(w, h);
+  if (b) pool_stats.hits++;
+  else   pool_stats.misses++;
+  pthread_mutex_unlock(&pool_mutex);
+  if (b) {
+    memset(b->bytes, 0, bytes_of(b));  // Transparent black, as if new.
+    b->dirty.num_rects = 0;
+    return b;
+  }
+
+  b = malloc(sizeof(Bitmap));
+  b->x_size = w;
+  b->y_size = h;
+  b->stride = w * 4;
+  b->bytes  = alloc_pixels((size_t)b->stride * h);
+  b->owns_bytes      = true;
+  b->dirty.num_rects = 0;
+  b->is_mapped       = (bytes_of(b) >= block_bytes);
+  b->file            = NULL;
+  b->blocks          = NULL;
+  b->packed          = NULL;
+  b->num_packed      = 0;
+  b->parent          = NULL;
+  b->x0              = 0;
+  b->y0              = 0;
+
+  if (b->bytes == NULL) {
+    fprintf(stderr, "Error in %s: out of memory for a %dx%d bitmap.\n",
+            __FUNCTION__, w, h);
+    free(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+draw__Bitmap draw__new_bitmap_with_data(int w, int h, int stride,
+                                       void *pixels) {
+  if (w <= 0 || h <= 0 || pixels == NULL) {
+    fprintf(stderr, "Error in %s: need pixels and a positive size; "
+                    "got %dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  // Rows are read as 32-bit pixels, so they must stay aligned.
+  if (stride < (int64_t)w * 4 || stride % 4 || (uintptr_t)pixels % 4) {
+    fprintf(stderr, "Error in %s: stride %d can't hold 4-byte-aligned rows "
+                    "of %d pixels.\n", __FUNCTION__, stride, w);
+    return NULL;
+  }
+
+  Bitmap *b = malloc(sizeof(Bitmap));
+  b->bytes           = pixels;
+  b->x_size          = w;
+  b->y_size          = h;
+  b->stride          = stride;
+  b->owns_bytes      = false;
+  b->dirty.num_rects = 0;
+  b->is_mapped       = false;
+  b->file            = NULL;
+  b->blocks          = NULL;
+  b->packed          = NULL;
+  b->num_packed      = 0;
+  b->parent          = NULL;
+  b->x0              = 0;
+  b->y0              = 0;
+  return b;
+}
+
+draw__Bitmap draw__new_bitmap_view(draw__Bitmap bitmap, int x, int y,
+                                   int w, int h) {
+  if (bitmap == NULL || w <= 0 || h <= 0 || x < 0 || y < 0 ||
+      x + w > bitmap->x_size || y + h > bitmap->y_size) {
+    fprintf(stderr, "Error in %s: need a bitmap containing the %dx%d rect "
+                    "at (%d, %d).\n", __FUNCTION__, w, h, x, y);
+    return NULL;
+  }
+  Bitmap *b = draw__new_bitmap_with_data(w, h, bitmap->stride,
+                                         row(bitmap, y) + x);
+  b->parent = root_of(bitmap);
+  b->x0     = bitmap->x0 + x;
+  b->y0     = bitmap->y0 + y;
+  return b;
+}
+
+draw__Bitmap draw__clone_bitmap(draw__Bitmap bitmap) {
+  if (bitmap == NULL) {
+    fprintf(stderr, "Error in %s: need a bitmap.\n", __FUNCTION__);
+    return NULL;
+  }
+
+  Bitmap *b = bitmap;
+  unpack_pixels(b);
+  pthread_mutex_lock(&share_mutex);
+  bit        is_shared = b->is_mapped && (b->file || share_blocks(b));
+  BlockFile *f         = b->file;
+  pthread_mutex_unlock(&share_mutex);
+  if (is_shared) {
+    size_t   size = mapped_size(bytes_of(b));
+    int      n    = (int)(size / block_bytes);
+    // Reserve the addresses, then map the blocks over them.
+    uint8_t *p    = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (p != MAP_FAILED) {
+      pthread_mutex_lock(&f->mutex);
+      bit is_mapped = map_blocks(p, f, b->blocks, n);
+      if (is_mapped) {
+        for (int i = 0; i < n; ++i) f->refs[b->blocks[i]]++;
+        f->num_bitmaps++;
+      }
+      pthread_mutex_unlock(&f->mutex);
+
+      if (is_mapped) {
+        Bitmap *clone = calloc(1, sizeof(Bitmap));  // No dirty rects or parent.
+        clone->bytes      = p;
+        clone->x_size     = b->x_size;
+        clone->y_size     = b->y_size;
+        clone->stride     = b->stride;
+        clone->owns_bytes = true;
+        clone->is_mapped  = true;
+        clone->file       = f;
+        clone->blocks     = malloc(n * sizeof(int));
+        memcpy(clone->blocks, b->blocks, n * sizeof(int));
+        return clone;
+      }
+      munmap(p, size);
+    }
+  }
+
+  Bitmap *clone = draw__new_bitmap(b->x_size, b->y_size);
+  if (clone == NULL) return NULL;
+  for (int y = 0; y < b->y_size; ++y) {
+    memcpy(row(clone, y), row(b, y), b->x_size * sizeof(uint32_t));
+  }
+  return clone;
+}
+
+void draw__delete_bitmap(draw__Bitmap bitmap) {
+  if (bitmap == NULL) return;
+  if (default_context.bitmap == bitmap) default_context.bitmap = NULL;
+  pthread_mutex_lock(&pool_mutex);
+  pool_bitmap(bitmap);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+void draw__ctx_set_bitmap(draw__Context *c, draw__Bitmap bitmap) {
+  c->bitmap = bitmap;
+}
+
+// The caller may write to the pixels, so a clone gets its own copy of them.
+void *draw__get_bitmap_data(draw__Bitmap bitmap) {
+  own_rows(bitmap, 0, bitmap->y_size);
+  return bitmap->bytes;
+}
+
+int draw__get_bitmap_stride(draw__Bitmap bitmap) {
+  return bitmap->stride;
+}
+
+void draw__copy_bitmap_data(draw__Bitmap bitmap, void *dst, int dst_stride,
+                            draw__Format format, int flags) {
+  static const int order_of_format[] = {
+    [draw__rgba] = span__rgba, [draw__bgra] = span__bgra,
+    [draw__argb] = span__argb
+  };
+  if (bitmap == NULL || format < draw__rgba || format > draw__argb) {
+    fprintf(stderr, "Error in %s: need a bitmap and a valid format.\n",
+            __FUNCTION__);
+    return;
+  }
+  unpack_pixels(bitmap);
+  for (int y = 0; y < bitmap->y_size; ++y) {
+    int dst_y = (flags & draw__flip_rows) ? bitmap->y_size - 1 - y : y;
+    span__convert((uint8_t *)dst + (size_t)dst_y * dst_stride, row(bitmap, y),
+                  bitmap->x_size, order_of_format[format],
+                  flags & draw__straight_alpha);
+  }
+}
+
+// Compressed bitmaps.
+
+// The pixels are mapped fresh over the old ones, which releases their
+// memory, along with b's share of any blocks shared with clones.
+void draw__compress_bitmap(draw__Bitmap bitmap) {
+  Bitmap *b = bitmap;
+  if (b == NULL || !b->is_mapped || b->packed) return;
+  size_t    num_words;
+  uint32_t *packed = pack_pixels((uint32_t *)b->bytes,
+                                 (size_t)b->x_size * b->y_size, &num_words);
+  if (packed == NULL) return;
+
+  size_t size = mapped_size(bytes_of(b));
+  void  *p    = mmap(b->bytes, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Error in %s: mmap failed.\n", __FUNCTION__);
+    free(packed);
+    return;
+  }
+  if (b->file) release_blocks(b);
+  b->file       = NULL;
+  b->blocks     = NULL;
+  b->packed     = packed;
+  b->num_packed = num_words;
+}
+
+// A block shared by n bitmaps counts 1 / n of its bytes toward each.
+size_t draw__get_bitmap_bytes(draw__Bitmap bitmap) {
+  Bitmap *b = bitmap;
+  if (b == NULL || b->parent || !b->owns_bytes) return 0;
+  pthread_mutex_lock(&packed_mutex);
+  size_t packed_bytes = b->packed ? b->num_packed * sizeof(uint32_t) : 0;
+  pthread_mutex_unlock(&packed_mutex);
+  if (packed_bytes) return packed_bytes;
+
+  BlockFile *f = b->file;
+  if (f == NULL) return bytes_of(b);
+  // Each block's bytes are split among the bitmaps sharing it; the last
+  // block only counts up to the end of the pixels.
+  size_t bytes = 0, left = bytes_of(b);
+  int    n     = (int)(mapped_size(left) / block_bytes);
+  pthread_mutex_lock(&f->mutex);
+  for (int i = 0; i < n; ++i, left -= block_bytes) {
+    size_t used = (left < block_bytes) ? left : block_bytes;
+    bytes += used / f->refs[b->blocks[i]];
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return bytes;
+}
+
+// Dirty rects.
+
+void draw__set_bitmap_pool_budget(size_t bytes) {
+  pthread_mutex_lock(&pool_mutex);
+  pool_stats.budget = bytes;
+  trim_pool(bytes);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+void draw__trim_bitmap_pool(size_t bytes) {
+  pthread_mutex_lock(&pool_mutex);
+  trim_pool(bytes);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+draw__PoolStats draw__get_bitmap_pool_stats() {
+  pthread_mutex_lock(&pool_mutex);
+  draw__PoolStats stats = pool_stats;
+  pthread_mutex_unlock(&pool_mutex);
+  return stats;
+}
+
+int draw__get_dirty_rects(draw__Bitmap bitmap, xy__Rect *out, int max) {
+  Dirty *d = bitmap ? &bitmap->dirty : NULL;
+  if (d == NULL || max <= 0) return 0;
+  int n = (d->num_rects < max) ? d->num_rects : max;
+  for (int i = 0; i < n; ++i) out[i] = d->rects[i];
+  for (int i = n; i < d->num_rects; ++i) {
+    out[n - 1] = union_of(out[n - 1], d->rects[i]);
+  }
+  return n;
+}
+
+void draw__clear_dirty(draw__Bitmap bitmap) {
+  Dirty *d = bitmap ? &bitmap->dirty : NULL;
+  if (d) d->num_rects = 0;
+}
+
+// Mipmaps.
+
+int draw__build_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                        int max_levels) {
+  return build_mipmaps(bitmap, levels, max_levels, false);
+}
+
+int draw__build_linear_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                               int max_levels) {
+  return build_mipmaps(bitmap, levels, max_levels, true);
+}
+
+// Blurs.
+
+void draw__blur(draw__Bitmap bitmap, xy__Rect rect, xy__Float radius) {
+  int x0, y0, x1, y1;
+  if (bitmap == NULL || !(radius > 0) ||
+      !pixel_bounds(rect, 0, bitmap->x_size, bitmap->y_size,
+                    &x0, &y0, &x1, &y1)) {
+    return;
+  }
+  mark_pixels(bitmap, xy__rect_pts(x0, y0, x1, y1));
+
+  BlurJob job = {
+    .bitmap = bitmap,
+    .x0     = x0,
+    .y0     = y0,
+    .w      = x1 - x0,
+    .h      = y1 - y0,
+    .pixels = malloc((size_t)(x1 - x0) * (y1 - y0) * sizeof(uint32_t))
+  };
+  find_blur_radii(fmin(radius, max_blur_radius), job.radii);
+
+  int num_threads = ((int64_t)job.w * job.h >= min_threaded_blur)
+                        ? workers__num_cores() : 1;
+  workers__run((job.h + blur_band_rows - 1) / blur_band_rows, run_blur_band,
+               &job, num_threads);
+  workers__run((job.w + blur_strip_width - 1) / blur_strip_width,
+               run_blur_strip, &job, num_threads);
+  free(job.pixels);
+}
+
+// Atlases.
+
+draw__Atlas draw__new_atlas(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: atlas size must be positive; got %dx%d.\n",
+            __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__Bitmap bitmap = draw__new_bitmap(w, h);
+  if (bitmap == NULL) return NULL;
+  draw__Atlas atlas = calloc(1, sizeof(*atlas));
+  atlas->bitmap   = bitmap;
+  atlas->w        = w;
+  atlas->h        = h;
+  atlas->segments = malloc(w * sizeof(Segment));
+  reset_atlas(atlas);
+  return atlas;
+}
+
+void draw__delete_atlas(draw__Atlas atlas) {
+  if (atlas == NULL) return;
+  reset_atlas(atlas);
+  draw__delete_bitmap(atlas->bitmap);
+  free(atlas->segments);
+  free(atlas->views);
+  free(atlas);
+}
+
+draw__Bitmap draw__get_atlas_bitmap(draw__Atlas atlas) {
+  return atlas->bitmap;
+}
+
+// Each region goes where its top is lowest, and where it's leftmost among
+// those. It takes up an extra row above it for its gap.
+draw__Bitmap draw__atlas_add(draw__Atlas atlas, int w, int h, xy__Rect *uv) {
+  if (atlas == NULL || w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: need an atlas and a positive size; "
+                    "got %dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  int best_i = -1, best_y = 0;
+  for (int i = 0; i < atlas->num_segments; ++i) {
+    int y = atlas_fit(atlas, i, w, h);
+    if (y >= 0 && (best_i < 0 || y < best_y)) {
+      best_i = i;
+      best_y = y;
+    }
+  }
+  if (best_i < 0) return NULL;
+
+  int          x    = atlas->segments[best_i].x;
+  draw__Bitmap view = draw__new_bitmap_view(atlas->bitmap, x, best_y, w, h);
+  if (view == NULL) return NULL;
+  atlas_raise(atlas, best_i, padded_width(atlas, x, w), best_y + h + 1);
+
+  if (atlas->num_views == atlas->views_cap) {
+    atlas->views_cap = atlas->views_cap ? 2 * atlas->views_cap : 64;
+    atlas->views     = realloc(atlas->views,
+                               atlas->views_cap * sizeof(draw__Bitmap));
+  }
+  atlas->views[atlas->num_views++] = view;
+
+  if (uv) {
+    double sx = 1.0 / atlas->w, sy = 1.0 / atlas->h;
+    *uv = xy__rect_pts(x * sx, best_y * sy, (x + w) * sx, (best_y + h) * sy);
+  }
+  return view;
+}
+
+void draw__clear_atlas(draw__Atlas atlas) {
+  if (atlas) reset_atlas(atlas);
+}
+
+// Tiled bitmaps.
+
+draw__TiledBitmap draw__new_tiled_bitmap(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: tiled bitmap size must be positive; got "
+                    "%dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__TiledBitmap tiled = malloc(sizeof(*tiled));
+  tiled->w       = w;
+  tiled->h       = h;
+  tiled->tiles_x = (int)(((int64_t)w + draw__tile_size - 1) / draw__tile_size);
+  tiled->tiles_y = (int)(((int64_t)h + draw__tile_size - 1) / draw__tile_size);
+  tiled->rows    = calloc(tiled->tiles_y, sizeof(draw__Bitmap *));
+  return tiled;
+}
+
+void draw__delete_tiled_bitmap(draw__TiledBitmap tiled) {
+  if (tiled == NULL) return;
+  for (int ty = 0; ty < tiled->tiles_y; ++ty) {
+    if (tiled->rows[ty] == NULL) continue;
+    for (int tx = 0; tx < tiled->tiles_x; ++tx) {
+      if (tiled->rows[ty][tx]) draw__delete_bitmap(tiled->rows[ty][tx]);
+    }
+    free(tiled->rows[ty]);
+  }
+  free(tiled->rows);
+  free(tiled);
+}
+
+void draw__get_tile_counts(draw__TiledBitmap tiled, int *tiles_x,
+                           int *tiles_y) {
+  *tiles_x = tiled->tiles_x;
+  *tiles_y = tiled->tiles_y;
+}
+
+// Tiles on the right and top edges are cut to the canvas.
+draw__Bitmap draw__get_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y) {
+    return NULL;
+  }
+  draw__Bitmap **row = &tiled->rows[ty];
+  if (*row == NULL) *row = calloc(tiled->tiles_x, sizeof(draw__Bitmap));
+  draw__Bitmap *tile = &(*row)[tx];
+  if (*tile == NULL) {
+    int x = tx * draw__tile_size, y = ty * draw__tile_size;
+    int w = tiled->w - x,         h = tiled->h - y;
+    *tile = draw__new_bitmap((w < draw__tile_size) ? w : draw__tile_size,
+                             (h < draw__tile_size) ? h : draw__tile_size);
+  }
+  return *tile;
+}
+
+draw__Bitmap draw__find_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y ||
+      tiled->rows[ty] == NULL) {
+    return NULL;
+  }
+  return tiled->rows[ty][tx];
+}
+
+// Fonts and text.
+
+draw__Font draw__new_font(const char *name, int size) {
+  // Names with a slash are paths to font files.
+  char *path = strchr(name, '/') ? strdup(name) : ttf__find(name);
+  int num_defaults = sizeof(default_font_names) / sizeof(default_font_names[0]);
+  for (int i = 0; path == NULL && i < num_defaults; ++i) {
+    path = ttf__find(default_font_names[i]);
+  }
+  if (path == NULL) {
+    fprintf(stderr, "Error in %s: can't find the font %s or a default font.\n",
+            __FUNCTION__, name);
+    return NULL;
+  }
+  ttf__Font *ttf = ttf__load(path);
+  free(path);
+  if (ttf == NULL) return NULL;
+
+  draw__Font f = calloc(1, sizeof(*f));
+  pthread_mutex_init(&f->mutex, NULL);
+  f->ttf    = ttf;
+  f->scale  = (float)size / ttf->units_per_em;
+  f->glyphs = calloc(ttf->num_glyphs + 1, sizeof(Glyph));
+  for (uint32_t c = 0; c < 128; ++c) {
+    f->ascii_glyphs[c] = ttf__glyph_of_char(ttf, c);
+  }
+
+  // Make the atlas wide enough for a few of the largest glyphs.
+  int atlas_size = min_atlas_size;
+  while (atlas_size < 4 * size && atlas_size < INT16_MAX / 2) atlas_size *= 2;
+  f->atlas = draw__new_bitmap(atlas_size, atlas_size);
+  if (f->atlas == NULL) {
+    draw__delete_font(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+void draw__delete_font(draw__Font old_font) {
+  if (old_font == NULL) return;
+  if (default_context.font == old_font) default_context.font = NULL;
+  remove_layouts_using(old_font);
+  ttf__free(old_font->ttf);
+  free(old_font->glyphs);
+  draw__delete_bitmap(old_font->atlas);
+  pthread_mutex_destroy(&old_font->mutex);
+  free(old_font);
+}
+
+void draw__ctx_set_font(draw__Context *c, draw__Font font) {
+  c->font = font;
+}
+
+void draw__ctx_set_font_color(draw__Context *c, draw__Color color) {
+  c->font_color = color;
+}
+
+xy__Float draw__ctx_string(draw__Context *c, const char *s,
+                           int x, int y, int w, float pos) {
+  if (c->font == NULL) {
+    fprintf(stderr, "Error in %s: need a non-NULL font.\n", __FUNCTION__);
+    return x;
+  }
+  return draw_text(c, s, strlen(s), x, y, w, pos);
+}
+
+void draw__set_string_cache_budget(size_t bytes) {
+  (void)bytes;
+  // There's no line cache to budget; see draw.h.
+}
+
+draw__CacheStats draw__get_string_cache_stats() {
+  draw__CacheStats stats = { 0, 0, 0, 0, 0, 0 };
+  return stats;
+}
+
+// Text measurement.
+
+draw__TextMetrics draw__ctx_measure_string(draw__Context *c, const char *s) {
+  draw__TextMetrics metrics = { 0, 0, 0 };
+  draw__ctx_measure_strings(c, &s, 1, &metrics);
+  return metrics;
+}
+
+void draw__ctx_measure_strings(draw__Context *c, const char **strs, int n,
+                               draw__TextMetrics *out) {
+  draw__Font font = c->font;
+  if (font == NULL) {
+    fprintf(stderr, "Error in %s: need a non-NULL font.\n", __FUNCTION__);
+    for (int i = 0; i < n; ++i) out[i] = (draw__TextMetrics) { 0, 0, 0 };
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    out[i].width   = string_width(font, strs[i], strlen(strs[i]));
+    out[i].ascent  = font->ttf->ascent  * font->scale;
+    out[i].descent = font->ttf->descent * font->scale;
+  }
+}
+
+// Text boxes.
+
+xy__Float draw__ctx_text_box(draw__Context *c, const char *s, xy__Rect rect,
+                             float align, int wrap) {
+  draw__Font font = c->font;
+  if (font == NULL) {
+    fprintf(stderr, "Error in %s: need a non-NULL font.\n", __FUNCTION__);
+    return 0;
+  }
+  ttf__Font *ttf    = font->ttf;
+  xy__Float  line_h = (ttf->ascent + ttf->descent + ttf->line_gap) *
+                      font->scale;
+  xy__Float  x0     = fmin(rect.xmin, rect.xmax);
+  xy__Float  width  = fmax(rect.xmin, rect.xmax) - x0;
+  xy__Float  top    = fmax(rect.ymin, rect.ymax);
+
+  // Only the lines that meet both the rect and the clip are drawn, so the
+  // cost of drawing doesn't grow with lines scrolled out of view.
+  xy__Rect visible = xy__rect_pts(x0, fmin(rect.ymin, rect.ymax),
+                                  x0 + width, top);
+  if (c->bitmap) {
+    visible = intersection_of(visible, xy__rect_pts(0, 0, c->bitmap->x_size,
+                                                    c->bitmap->y_size));
+  }
+  if (c->num_clips) {
+    visible = intersection_of(visible, c->clips[c->num_clips - 1]);
+  }
+
+  pthread_mutex_lock(&layouts_mutex);
+  TextLayout *l         = layout_of(c, s, wrap == draw__wrap_words, width);
+  int         num_lines = l->num_lines;
+  int         i0 = 0, i1 = 0;
+  if (c->bitmap && line_h > 0 && visible.ymin < visible.ymax) {
+    i0 = (int)fmax(floor((top - visible.ymax) / line_h), 0);
+    i1 = (int)fmin(ceil ((top - visible.ymin) / line_h), num_lines);
+  }
+  size_t *spans = malloc(2 * (size_t)(i1 > i0 ? i1 - i0 : 0) *
+                         sizeof(size_t));
+  for (int i = i0; i < i1; ++i) {
+    line_span(l, i, &spans[2 * (i - i0)], &spans[2 * (i - i0) + 1]);
+  }
+  pthread_mutex_unlock(&layouts_mutex);
+
+  // The lines are drawn after the layouts are released, as the spans are
+  // offsets into s.
+  for (int i = i0; i < i1; ++i) {
+    size_t start = spans[2 * (i - i0)], end = spans[2 * (i - i0) + 1];
+    draw_text(c, s + start, end - start, x0, top - (i + 1) * line_h, width,
+              align);
+  }
+  free(spans);
+  return num_lines * line_h;
+}
+
+// Colors.
+
+draw__Color draw__new_color(double r, double g, double b) {
+  return color_of_rgba(r, g, b, 1.0);
+}
+
+void draw__delete_color(draw__Color color) {
+  (void)color;
+  // Colors are plain pixel values, so there's nothing to free.
+}
+
+void draw__ctx_rgb_fill_color(draw__Context *c,
+                              double r, double g, double b) {
+  c->fill_color = draw__new_color(r, g, b);
+}
+
+void draw__ctx_rgb_stroke_color(draw__Context *c,
+                                double r, double g, double b) {
+  c->stroke_color = draw__new_color(r, g, b);
+}
+
+void draw__ctx_rgba_fill_color(draw__Context *c,
+                               double r, double g, double b, double a) {
+  c->fill_color = color_of_rgba(r, g, b, a);
+}
+
+void draw__ctx_rgba_stroke_color(draw__Context *c,
+                                 double r, double g, double b, double a) {
+  c->stroke_color = color_of_rgba(r, g, b, a);
+}
+
+void draw__ctx_fill_color32(draw__Context *c, draw__Rgba32 color) {
+  c->fill_color = color_of_rgba32(color);
+}
+
+void draw__ctx_stroke_color32(draw__Context *c, draw__Rgba32 color) {
+  c->stroke_color = color_of_rgba32(color);
+}
+
+void draw__ctx_set_gamma_blending(draw__Context *c, int is_on) {
+  c->is_linear = !!is_on;
+}
+
+// Clipping.
+
+void draw__ctx_push_clip(draw__Context *c, xy__Rect rect) {
+  if (c->num_clips == c->clips_cap) {
+    c->clips_cap = c->clips_cap ? 2 * c->clips_cap : 8;
+    c->clips     = realloc(c->clips, c->clips_cap * sizeof(xy__Rect));
+  }
+  rect = xy__rect_pts(fmin(rect.xmin, rect.xmax), fmin(rect.ymin, rect.ymax),
+                      fmax(rect.xmin, rect.xmax), fmax(rect.ymin, rect.ymax));
+  if (c->num_clips) rect = intersection_of(rect, c->clips[c->num_clips - 1]);
+  c->clips[c->num_clips++] = rect;
+}
+
+void draw__ctx_pop_clip(draw__Context *c) {
+  if (c->num_clips == 0) {
+    fprintf(stderr, "Error in %s: no clip to pop.\n", __FUNCTION__);
+    return;
+  }
+  c->num_clips--;
+}
+
+// Shapes and lines.
+
+void draw__ctx_fill_rect(draw__Context *c, xy__Rect rect) {
+  do_cmd(c, cmd_fill_rect, c->fill_color, rect);
+}
+
+void draw__ctx_stroke_rect(draw__Context *c, xy__Rect rect) {
+  do_cmd(c, cmd_stroke_rect, c->stroke_color, rect);
+}
+
+void draw__ctx_line(draw__Context *c, xy__Float x1, xy__Float y1,
+                    xy__Float x2, xy__Float y2) {
+  do_cmd(c, cmd_line, c->stroke_color, xy__rect_pts(x1, y1, x2, y2));
+}
+
+// The lines are drawn straight into the bitmap and marked dirty together,
+// which skips the per-command work of draw__line.
+void draw__ctx_lines(draw__Context *c, const xy__Pt *pts, int n, int mode) {
+  int  op          = (mode & draw__antialias) ? cmd_smooth_line : cmd_line;
+  bit  is_polyline = !(mode & draw__segments);
+  int  num_lines   = is_polyline ? n - 1 : n / 2;
+  int  stride      = is_polyline ? 1 : 2;
+  if (num_lines <= 0) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < num_lines; ++i) {
+      const xy__Pt *p = pts + i * stride;
+      add_cmd(c, op, c->stroke_color,
+              xy__rect_pts(p[0].x, p[0].y, p[1].x, p[1].y));
+    }
+    return;
+  }
+  if (c->bitmap == NULL) return;
+
+  int      num_pts = is_polyline ? n : 2 * num_lines;
+  xy__Rect bounds  = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 1; i < num_pts; ++i) {
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  Target t = target_of(c);
+  if (!mark_cmd_dirty(&t, &(Cmd) { op, c->stroke_color, bounds })) return;
+
+  for (int i = 0; i < num_lines; ++i) {
+    const xy__Pt *p = pts + i * stride;
+    draw_line(&t, c->stroke_color, op == cmd_smooth_line,
+              p[0].x, p[0].y, p[1].x, p[1].y);
+  }
+}
+
+// The polygon's pixels are split into bands of rows that are rasterized
+// independently, using the context's threads.
+void draw__ctx_fill_polygon(draw__Context *c, const xy__Pt *pts, int n,
+                            int rule) {
+  if (rule != draw__nonzero && rule != draw__even_odd) {
+    fprintf(stderr, "Error in %s: unknown fill rule %d.\n", __FUNCTION__,
+            rule);
+    return;
+  }
+  if (c->bitmap == NULL || n < 3) return;
+
+  xy__Rect bounds = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 1; i < n; ++i) {
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  // Include every pixel the polygon partly covers.
+  bounds = xy__rect_pts(bounds.xmin - 0.5, bounds.ymin - 0.5,
+                        bounds.xmax + 0.5, bounds.ymax + 0.5);
+  Target t = target_of(c);
+  int    x0, y0, x1, y1;
+  if (!pixel_bounds(bounds, 0, t.x1, t.y1, &x0, &y0, &x1, &y1) ||
+      !clip_to(&t, &x0, &y0, &x1, &y1)) {
+    return;
+  }
+  mark_pixels(t.bitmap, xy__rect_pts(x0, y0, x1, y1));
+
+  PolygonJob job = {
+    .bitmap    = t.bitmap,
+    .pts       = pts,
+    .n         = n,
+    .rule      = (rule == draw__even_odd) ? raster__even_odd
+                                          : raster__nonzero,
+    .color     = c->fill_color,
+    .is_linear = t.is_linear,
+    .x0 = x0, .y0 = y0, .x1 = x1, .y1 = y1
+  };
+  int num_bands = (y1 - y0 + poly_band_rows - 1) / poly_band_rows;
+
+  // Count the edges per band, then store them in one array so that band k's
+  // edges are bins[bin_starts[k]..bin_starts[k + 1] - 1].
+  int (*ranges)[2] = malloc(n * sizeof(*ranges));
+  job.bin_starts   = calloc(num_bands + 1, sizeof(int));
+  for (int i = 0; i < n; ++i) {
+    int *r = ranges[i];
+    if (!edge_bands(&job, i, &r[0], &r[1])) {
+      r[0] = 1;
+      r[1] = 0;
+      continue;
+    }
+    for (int k = r[0]; k <= r[1]; ++k) job.bin_starts[k + 1]++;
+  }
+  for (int k = 0; k < num_bands; ++k) {
+    job.bin_starts[k + 1] += job.bin_starts[k];
+  }
+
+  int *fill = malloc(num_bands * sizeof(int));
+  memcpy(fill, job.bin_starts, num_bands * sizeof(int));
+  job.bins = malloc((job.bin_starts[num_bands] + 1) * sizeof(int));
+  for (int i = 0; i < n; ++i) {
+    for (int k = ranges[i][0]; k <= ranges[i][1]; ++k) job.bins[fill[k]++] = i;
+  }
+
+  workers__run(num_bands, run_polygon_band, &job, c->num_threads);
+
+  free(ranges);
+  free(fill);
+  free(job.bins);
+  free(job.bin_starts);
+}
+
+// Blitting.
+
+void draw__ctx_blit(draw__Context *c, draw__Bitmap src, xy__Rect src_rect,
+                    int dst_x, int dst_y, int mode) {
+  draw__Sprite sprite = { src, src_rect, dst_x, dst_y };
+  draw__ctx_blit_many(c, &sprite, 1, mode);
+}
+
+void draw__ctx_blit_many(draw__Context *c, const draw__Sprite *sprites, int n,
+                         int mode) {
+  if (mode < draw__blit_copy || mode > draw__blit_add) {
+    fprintf(stderr, "Error in %s: unknown blit mode %d.\n", __FUNCTION__,
+            mode);
+    return;
+  }
+  if (c->bitmap == NULL) return;
+  Target t = target_of(c);
+  for (int i = 0; i < n; ++i) blit(&t, &sprites[i], mode);
+}
+
+// Command lists.
+
+void draw__ctx_begin_list(draw__Context *c) {
+  if (c->recording_list) {
+    fprintf(stderr, "Error in %s: a list is already being recorded.\n",
+            __FUNCTION__);
+    return;
+  }
+  c->recording_list = calloc(1, sizeof(*c->recording_list));
+}
+
+draw__List draw__ctx_end_list(draw__Context *c) {
+  draw__List list = c->recording_list;
+  if (list == NULL) {
+    fprintf(stderr, "Error in %s: no list is being recorded.\n", __FUNCTION__);
+    return NULL;
+  }
+  list->fill_color   = c->fill_color;
+  list->stroke_color = c->stroke_color;
+  c->recording_list  = NULL;
+  return list;
+}
+
+void draw__ctx_execute_list(draw__Context *c, draw__List list) {
+  if (list == NULL) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < list->num_cmds; ++i) {
+      Cmd *cmd = &list->cmds[i];
+      add_cmd(c, cmd->op, cmd->color, cmd->rect);
+    }
+  } else if (c->bitmap) {
+    Target t = target_of(c);
+    run_cmds(&t, list->cmds, list->num_cmds, c->num_threads);
+  }
+
+  c->fill_color   = list->fill_color;
+  c->stroke_color = list->stroke_color;
+}
+
+// Each touched tile runs the commands that touch it, moved to the tile's
+// coordinates, with the clip moved the same way. Setting the tile in the
+// context applies the moved clip, and restoring the bitmap afterward
+// applies the original one.
+void draw__ctx_execute_list_on_tiles(draw__Context *c,
+                                     draw__TiledBitmap tiled,
+                                     draw__List list) {
+  if (tiled == NULL || list == NULL) return;
+  if (c->recording_list) {
+    fprintf(stderr, "Error in %s: tiles can't be drawn into while a list is "
+                    "being recorded.\n", __FUNCTION__);
+    return;
+  }
+
+  // Tiles outside the clip aren't made.
+  xy__Rect area = xy__rect_pts(0, 0, tiled->w, tiled->h);
+  if (c->num_clips) area = intersection_of(area, c->clips[c->num_clips - 1]);
+
+  TileHit *hits     = NULL;
+  int      num_hits = 0, hits_cap = 0;
+  for (int i = 0; i < list->num_cmds; ++i) {
+    add_tile_hits(area, &list->cmds[i], i, &hits, &num_hits, &hits_cap);
+  }
+  if (num_hits) qsort(hits, num_hits, sizeof(TileHit), compare_hits);
+
+  draw__Bitmap bitmap    = c->bitmap;
+  xy__Rect    *clips     = c->clips;
+  int          num_clips = c->num_clips;
+  xy__Rect     clip;
+  struct draw__ListStruct part = *list;
+  part.cmds = malloc((list->num_cmds + 1) * sizeof(Cmd));
+  for (int i = 0, end; i < num_hits; i = end) {
+    int tx = hits[i].tx, ty = hits[i].ty;
+    for (end = i + 1; end < num_hits; ++end) {
+      if (hits[end].tx != tx || hits[end].ty != ty) break;
+    }
+    double dx = -(double)tx * draw__tile_size;
+    double dy = -(double)ty * draw__tile_size;
+    part.num_cmds = end - i;
+    for (int k = 0; k < part.num_cmds; ++k) {
+      part.cmds[k]      = list->cmds[hits[i + k].cmd];
+      part.cmds[k].rect = offset_rect(part.cmds[k].rect, dx, dy);
+    }
+    if (num_clips) {
+      clip = offset_rect(clips[num_clips - 1], dx, dy);
+      c->clips     = &clip;
+      c->num_clips = 1;
+    }
+    draw__ctx_set_bitmap(c, draw__get_tile(tiled, tx, ty));
+    draw__ctx_execute_list(c, &part);
+  }
+  c->clips     = clips;
+  c->num_clips = num_clips;
+  draw__ctx_set_bitmap(c, bitmap);
+
+  // Executing no commands leaves the colors as the list does.
+  part.num_cmds = 0;
+  draw__ctx_execute_list(c, &part);
+  free(part.cmds);
+  free(hits);
+}
+
+void draw__delete_list(draw__List list) {
+  if (list == NULL) return;
+  if (default_context.recording_list == list) {
+    default_context.recording_list = NULL;
+  }
+  free(list->cmds);
+  free(list);
+}
+
+void draw__ctx_set_num_threads(draw__Context *c, int n) {
+  c->num_threads = (n > 0) ? n : workers__num_cores();
+}
+
+// Contexts.
+
+draw__Context *draw__new_context() {
+  draw__Context *c = malloc(sizeof(draw__Context));
+  *c = (draw__Context) new_context_values;
+  return c;
+}
+
+void draw__delete_context(draw__Context *c) {
+  if (c == NULL || c == &default_context) return;
+  draw__delete_list(c->recording_list);
+  free(c->clips);
+  free(c);
+}
+
+draw__Context *draw__get_default_context() {
+  return &default_context;
+}
+
+// These use the default context.
+
+void draw__set_bitmap(draw__Bitmap bitmap) {
+  draw__ctx_set_bitmap(&default_context, bitmap);
+}
+
+void draw__set_font(draw__Font font) {
+  draw__ctx_set_font(&default_context, font);
+}
+
+void draw__set_font_color(draw__Color color) {
+  draw__ctx_set_font_color(&default_context, color);
+}
+
+xy__Float draw__string(const char *s, int x, int y, int w, float pos) {
+  return draw__ctx_string(&default_context, s, x, y, w, pos);
+}
+
+draw__TextMetrics draw__measure_string(const char *s) {
+  return draw__ctx_measure_string(&default_context, s);
+}
+
+void draw__measure_strings(const char **strs, int n, draw__TextMetrics *out) {
+  draw__ctx_measure_strings(&default_context, strs, n, out);
+}
+
+xy__Float draw__text_box(const char *s, xy__Rect rect, float align, int wrap) {
+  return draw__ctx_text_box(&default_context, s, rect, align, wrap);
+}
+
+void draw__rgb_fill_color(double r, double g, double b) {
+  draw__ctx_rgb_fill_color(&default_context, r, g, b);
+}
+
+void draw__rgb_stroke_color(double r, double g, double b) {
+  draw__ctx_rgb_stroke_color(&default_context, r, g, b);
+}
+
+void draw__rgba_fill_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_fill_color(&default_context, r, g, b, a);
+}
+
+void draw__rgba_stroke_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_stroke_color(&default_context, r, g, b, a);
+}
+
+void draw__fill_color32(draw__Rgba32 color) {
+  draw__ctx_fill_color32(&default_context, color);
+}
+
+void draw__stroke_color32(draw__Rgba32 color) {
+  draw__ctx_stroke_color32(&default_context, color);
+}
+
+void draw__set_gamma_blending(int is_on) {
+  draw__ctx_set_gamma_blending(&default_context, is_on);
+}
+
+void draw__push_clip(xy__Rect rect) {
+  draw__ctx_push_clip(&default_context, rect);
+}
+
+void draw__pop_clip() {
+  draw__ctx_pop_clip(&default_context);
+}
+
+void draw__fill_rect(xy__Rect rect) {
+  draw__ctx_fill_rect(&default_context, rect);
+}
+
+void draw__stroke_rect(xy__Rect rect) {
+  draw__ctx_stroke_rect(&default_context, rect);
+}
+
+void draw__line(xy__Float x1, xy__Float y1, xy__Float x2, xy__Float y2) {
+  draw__ctx_line(&default_context, x1, y1, x2, y2);
+}
+
+void draw__lines(const xy__Pt *pts, int n, int mode) {
+  draw__ctx_lines(&default_context, pts, n, mode);
+}
+
+void draw__fill_polygon(const xy__Pt *pts, int n, int rule) {
+  draw__ctx_fill_polygon(&default_context, pts, n, rule);
+}
+
+void draw__blit(draw__Bitmap src, xy__Rect src_rect, int dst_x, int dst_y,
+                int mode) {
+  draw__ctx_blit(&default_context, src, src_rect, dst_x, dst_y, mode);
+}
+
+void draw__blit_many(const draw__Sprite *sprites, int n, int mode) {
+  draw__ctx_blit_many(&default_context, sprites, n, mode);
+}
+
+void draw__begin_list() {
+  draw__ctx_begin_list(&default_context);
+}
+
+draw__List draw__end_list() {
+  return draw__ctx_end_list(&default_context);
+}
+
+void draw__execute_list(draw__List list) {
+  draw__ctx_execute_list(&default_context, list);
+}
+
+void draw__execute_list_on_tiles(draw__TiledBitmap tiled, draw__List list) {
+  draw__ctx_execute_list_on_tiles(&default_context, tiled, list);
+}
+
+void draw__set_num_threads(int n) {
+  draw__ctx_set_num_threads(&default_context, n);
+}
@@ -0,0 +1,30 @@
+// oswrap.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// One header to include them all.
+// Include this header to make all functions
+// of oswrap available at once.
+//
+// The linux version currently covers the modules
+// that don't depend on a windowing system.
+//
+
+#pragma once
+
+// Make it easy to include oswrap from C or C++.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "dbg.h"
+#include "draw.h"
+#include "now.h"
+#include "xy.h"
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,172 @@
+// raster.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Each row of cells is two cells wider than the canvas; an edge at the
+// right border adds its area just past the last pixel, where no pixel
+// reads it.
+//
+
+#include "raster.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Internal functions.
+
+static float *row_cells(raster__Canvas *canvas, int y) {
+  return canvas->cells + (size_t)y * (canvas->w + 2);
+}
+
+static float clamp(float v, float lo, float hi) {
+  if (!(v >= lo)) return lo;  // This also catches NaN.
+  if (v > hi)     return hi;
+  return v;
+}
+
+
+// Public functions.
+
+void raster__init(raster__Canvas *canvas, int w, int h) {
+  canvas->w     = w;
+  canvas->h     = h;
+  canvas->cells = calloc((size_t)(w + 2) * h, sizeof(float));
+}
+
+void raster__free(raster__Canvas *canvas) {
+  free(canvas->cells);
+  canvas->cells = NULL;
+}
+
+// For each row the edge crosses, this splits the row's part of the edge
+// between the cells it passes over. A cell gets the area between the edge
+// and the cell's right side, and the next cell gets the rest, so that a
+// running sum across the row adds the edge's full height to every pixel
+// right of it. Upward edges add and downward edges subtract.
+void raster__line(raster__Canvas *canvas,
+                  float x0, float y0, float x1, float y1) {
+  float dir = 1;
+  if (y0 == y1 || !isfinite(y0) || !isfinite(y1)) return;
+
+  // Split edges that cross the left or right border there. The part beyond
+  // the border can then be moved onto it below.
+  float w = (float)canvas->w;
+  float b = NAN;
+  if ((x0 < 0 && x1 > 0) || (x0 > 0 && x1 < 0)) b = 0;
+  if ((x0 < w && x1 > w) || (x0 > w && x1 < w)) b = w;
+  if (!isnan(b)) {
+    float y = y0 + (b - x0) * (y1 - y0) / (x1 - x0);
+    raster__line(canvas, x0, y0, b, y);
+    raster__line(canvas, b, y, x1, y1);
+    return;
+  }
+
+  if (y0 > y1) {
+    float t;
+    t = x0; x0 = x1; x1 = t;
+    t = y0; y0 = y1; y1 = t;
+    dir = -1;
+  }
+  // An edge left or right of the canvas acts as if it were on the border,
+  // which leaves the coverage of every pixel on the canvas unchanged.
+  x0 = clamp(x0, 0, w);
+  x1 = clamp(x1, 0, w);
+
+  float dxdy = (x1 - x0) / (y1 - y0);
+  float x    = x0;
+  int   y    = (int)floor(clamp(y0, 0, canvas->h));
+  int   end  = (int)ceil (clamp(y1, 0, canvas->h));
+  if (y0 < y) x += (y - y0) * dxdy;
+
+  for (; y < end; ++y) {
+    float *cells = row_cells(canvas, y);
+    float  dy    = fminf(y + 1, y1) - fmaxf(y, y0);
+    float  xnext = x + dxdy * dy;
+    float  d     = dy * dir;
+    float  xl    = fminf(x, xnext), xr = fmaxf(x, xnext);
+    int    il    = (int)floorf(xl), ir = (int)ceilf(xr);
+
+    if (ir <= il + 1) {
+      // The edge stays within one pixel on this row.
+      float xmid = 0.5f * (x + xnext) - il;
+      cells[il]     += d * (1 - xmid);
+      cells[il + 1] += d * xmid;
+    } else {
+      // The edge crosses pixels il to ir - 1; the end pixels get triangles
+      // of area and each pixel between gets an equal share.
+      float s      = 1 / (xr - xl);
+      float fl     = xl - il;
+      float a_left = 0.5f * s * (1 - fl) * (1 - fl);
+      float fr     = xr - (ir - 1);
+      float a_end  = 0.5f * s * fr * fr;
+      cells[il] += d * a_left;
+      if (ir == il + 2) {
+        cells[il + 1] += d * (1 - a_left - a_end);
+      } else {
+        float a_next = s * (1.5f - fl);
+        cells[il + 1] += d * (a_next - a_left);
+        for (int i = il + 2; i < ir - 1; ++i) cells[i] += d * s;
+        float a_before_end = a_next + (ir - il - 3) * s;
+        cells[ir - 1] += d * (1 - a_before_end - a_end);
+      }
+      cells[ir] += d * a_end;
+    }
+    x = xnext;
+  }
+}
+
+void raster__quad(raster__Canvas *canvas, float x0, float y0,
+                  float x1, float y1, float x2, float y2) {
+  // The distance from the curve to its chord is a quarter of the distance
+  // from the control point to the chord's midpoint. Splitting the curve
+  // into n lines divides that by n^2; this keeps it under 1/16 pixel.
+  float dx = x0 - 2 * x1 + x2, dy = y0 - 2 * y1 + y2;
+  float dist = sqrtf(dx * dx + dy * dy) / 4;
+  int   n    = (int)ceilf(sqrtf(dist * 16));
+  if (n < 1)   n = 1;
+  if (n > 100) n = 100;
+
+  float px = x0, py = y0;
+  for (int i = 1; i <= n; ++i) {
+    float t  = (float)i / n, u = 1 - t;
+    float qx = u * u * x0 + 2 * u * t * x1 + t * t * x2;
+    float qy = u * u * y0 + 2 * u * t * y1 + t * t * y2;
+    raster__line(canvas, px, py, qx, qy);
+    px = qx;
+    py = qy;
+  }
+}
+
+// The running sum along a row is the winding number of each pixel, blended
+// at edges. Under the nonzero rule, overlapping contours that wind the same
+// way sum past full coverage, so the sums are clamped. Under the even-odd
+// rule, each whole pair of windings cancels, and the rest folds back so
+// that a sum of 1 is covered and 0 or 2 is not.
+void raster__finish(raster__Canvas *canvas, uint8_t *out, int stride,
+                    int rule) {
+  for (int y = 0; y < canvas->h; ++y) {
+    float   *cells = row_cells(canvas, y);
+    uint8_t *dst   = out + (size_t)y * stride;
+    float    sum   = 0;
+    for (int x = 0; x < canvas->w;) {
+      sum += cells[x];
+      float a = fabsf(sum);
+      if (rule == raster__even_odd) {
+        a -= 2 * floorf(a / 2);
+        if (a > 1) a = 2 - a;
+      }
+      a        = fminf(a, 1);
+      dst[x++] = (uint8_t)(a * 255 + 0.5f);
+
+      // The coverage stays the same up to the next cell an edge touches,
+      // which skips the work across the inside and outside of big shapes.
+      int end = x;
+      while (end < canvas->w && cells[end] == 0) ++end;
+      memset(dst + x, dst[x - 1], end - x);
+      x = end;
+    }
+    memset(cells, 0, (canvas->w + 2) * sizeof(float));
+  }
+}
@@ -0,0 +1,46 @@
+// raster.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Antialiased coverage for shapes bounded by line segments and
+// quadratic curves.
+//
+// Each edge adds its signed area to a grid of cells, and summing the
+// cells along a row gives the fraction of each pixel inside the shape.
+// The edges must form closed contours. Pixel (x, y) covers the unit
+// square with corners (x, y) and (x + 1, y + 1).
+//
+
+#pragma once
+
+#include <stdint.h>
+
+// Fill rules, which decide the coverage where contours overlap.
+enum {
+  raster__nonzero,   // Anywhere the contours wind around is covered.
+  raster__even_odd   // Only where they wind around an odd number of times.
+};
+
+typedef struct {
+  float *cells;
+  int    w;
+  int    h;
+} raster__Canvas;
+
+// Prepares a w x h canvas with no coverage.
+void raster__init (raster__Canvas *canvas, int w, int h);
+void raster__free (raster__Canvas *canvas);
+
+void raster__line (raster__Canvas *canvas,
+                   float x0, float y0, float x1, float y1);
+
+// Adds the curve from (x0, y0) to (x2, y2) with control point (x1, y1) as
+// enough line segments to stay within a small fraction of a pixel.
+void raster__quad (raster__Canvas *canvas, float x0, float y0,
+                   float x1, float y1, float x2, float y2);
+
+// Writes the coverage of pixel (x, y) under the given fill rule as a byte
+// from 0 to 255 to out[y * stride + x], then clears the canvas so it can be
+// reused.
+void raster__finish(raster__Canvas *canvas, uint8_t *out, int stride,
+                    int rule);
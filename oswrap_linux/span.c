@@ -0,0 +1,1328 @@
+// span.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Blending uses premultiplied source-over,
+//   dst = src + dst * (255 - src_alpha) / 255,
+// where the division is rounded to the nearest integer. Each version
+// computes the product and the rounded division with the same 16-bit
+// arithmetic, which is what keeps their results bit-identical.
+//
+
+#include "span.h"
+
+#include "cbit.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define has_x86_kernels true
+#include <immintrin.h>
+#else
+#define has_x86_kernels false
+#endif
+
+// The shuffle pattern that copies each pixel's alpha, as a 16-bit channel,
+// to all four of its channels.
+#define alpha_lane       (span__alpha_shift / 8)
+#define alpha_everywhere \
+  _MM_SHUFFLE(alpha_lane, alpha_lane, alpha_lane, alpha_lane)
+
+// Blending a color into runs at least this long uses a table; see
+// avx2_blend_linear.
+#define min_table_run 512
+
+
+// Internal types and globals.
+
+typedef struct {
+  const char *name;
+  void (*fill) (uint32_t *dst, int n, uint32_t color);
+  void (*blend)(uint32_t *dst, int n, uint32_t color);
+  void (*blend_masked)(uint32_t *dst, const uint32_t *mask, int n,
+                       uint32_t color);
+  void (*composite)(uint32_t *dst, const uint32_t *src, int n);
+  void (*add)(uint32_t *dst, const uint32_t *src, int n);
+  void (*downsample)(uint32_t *dst, const uint32_t *src0,
+                     const uint32_t *src1, int n);
+  void (*convert)(void *dst, const uint32_t *src, int n, int order,
+                  int to_straight);
+  void (*to_linear)(uint16_t *dst, const uint32_t *src, int n);
+  void (*from_linear)(uint32_t *dst, const uint16_t *src, int n);
+  void (*blend_linear)(uint32_t *dst, const uint32_t *mask, int n,
+                       uint32_t color);
+  void (*composite_linear)(uint32_t *dst, const uint32_t *src, int n);
+  void (*box_blur)(uint32_t *dst, const uint32_t *src, int n, int r);
+  void (*box_blur_step)(uint32_t *dst, uint32_t *sums, const uint32_t *add,
+                        const uint32_t *sub, int n, int r);
+} Impl;
+
+static Impl *impl = NULL;
+
+// The linear light of each sRGB byte, from 0 to 65535, and the nearest
+// sRGB byte to each linear value. The second table has 3 bytes of padding
+// so that 32-bit gathers can read its last entry. They're filled on first
+// use; see make_tables.
+static uint32_t lin_of_srgb[256];
+static uint8_t  srgb_of_lin[65536 + 3];
+static bit      tables_made = false;
+
+
+// Scalar kernels.
+
+static void scalar_fill(uint32_t *dst, int n, uint32_t color) {
+  for (int i = 0; i < n; ++i) dst[i] = color;
+}
+
+static void scalar_blend(uint32_t *dst, int n, uint32_t color) {
+  uint32_t inv_alpha = 255 - ((color >> span__alpha_shift) & 0xff);
+  for (int i = 0; i < n; ++i) dst[i] = color + span__scale(dst[i], inv_alpha);
+}
+
+static void scalar_blend_masked(uint32_t *dst, const uint32_t *mask, int n,
+                                uint32_t color) {
+  for (int i = 0; i < n; ++i) {
+    uint32_t coverage = (mask[i] >> span__alpha_shift) & 0xff;
+    if (coverage) dst[i] = span__over(dst[i], span__scale(color, coverage));
+  }
+}
+
+// Zero pixels leave dst alone and opaque ones replace it, which is what
+// blending them would do.
+static void scalar_composite(uint32_t *dst, const uint32_t *src, int n) {
+  for (int i = 0; i < n; ++i) {
+    uint32_t alpha = (src[i] >> span__alpha_shift) & 0xff;
+    if (alpha == 255) dst[i] = src[i];
+    else if (src[i])  dst[i] = span__over(dst[i], src[i]);
+  }
+}
+
+static void scalar_add(uint32_t *dst, const uint32_t *src, int n) {
+  const uint8_t *in  = (const uint8_t *)src;
+  uint8_t       *out = (uint8_t *)dst;
+  for (int i = 0; i < 4 * n; ++i) {
+    unsigned sum = out[i] + in[i];
+    out[i] = sum > 255 ? 255 : sum;
+  }
+}
+
+// Every version finds the root with one float sqrt of the same exact value,
+// so they agree to the bit.
+static void scalar_downsample(uint32_t *dst, const uint32_t *src0,
+                              const uint32_t *src1, int n) {
+  for (int i = 0; i < n; ++i) {
+    const uint8_t *p[4] = {
+      (const uint8_t *)&src0[2 * i], (const uint8_t *)&src0[2 * i + 1],
+      (const uint8_t *)&src1[2 * i], (const uint8_t *)&src1[2 * i + 1]
+    };
+    uint8_t *out   = (uint8_t *)&dst[i];
+    int      a     = 3;  // The alpha byte.
+    uint32_t alpha = (p[0][a] + p[1][a] + p[2][a] + p[3][a] + 2) >> 2;
+    for (int j = 0; j < 3; ++j) {
+      uint32_t sum = p[0][j] * p[0][j] + p[1][j] * p[1][j] +
+                     p[2][j] * p[2][j] + p[3][j] * p[3][j];
+      uint32_t c   = (uint32_t)(sqrtf(sum * 0.25f) + 0.5f);
+      out[j] = c > alpha ? alpha : c;
+    }
+    out[a] = alpha;
+  }
+}
+
+// Straight alpha channels are rounded, and are clamped to 255 in case a
+// color is larger than its alpha.
+static uint8_t straight(uint32_t c, uint32_t a) {
+  uint32_t v = (c * 255 + a / 2) / a;
+  return v > 255 ? 255 : v;
+}
+
+static void scalar_convert(void *dst, const uint32_t *src, int n, int order,
+                           int to_straight) {
+  // This works with bytes so that it doesn't depend on endianness.
+  static const int byte_of_channel[][4] = {  // Indexed by order, then RGBA.
+    { 0, 1, 2, 3 },
+    { 2, 1, 0, 3 },
+    { 1, 2, 3, 0 }
+  };
+  const int *to   = byte_of_channel[order];
+  uint8_t   *out  = dst;
+  const uint8_t *in = (const uint8_t *)src;
+  for (int i = 0; i < n; ++i, in += 4, out += 4) {
+    uint8_t rgba[4] = { in[0], in[1], in[2], in[3] };
+    if (to_straight) {
+      for (int j = 0; j < 3; ++j) {
+        rgba[j] = rgba[3] ? straight(rgba[j], rgba[3]) : 0;
+      }
+    }
+    for (int j = 0; j < 4; ++j) out[to[j]] = rgba[j];
+  }
+}
+
+// Linear kernels.
+//
+// These blend in linear light, converting with lin_of_srgb and srgb_of_lin.
+// Colors are unpremultiplied before they're looked up, and the results are
+// premultiplied again. Each step is integer math, or float or double math
+// whose results truncate to the same integers, so every version agrees.
+
+// Returns x * a / 255, rounded, for x and a up to 255.
+static uint32_t mul255(uint32_t x, uint32_t a) {
+  uint32_t t = x * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// Composites a color with the linear channels lin[0..2] and alpha sa over
+// the pixel d. Each new channel averages the two colors' linear values
+// weighted by their share of the new alpha.
+static uint32_t over_linear(uint32_t d, const uint32_t *lin, uint32_t sa) {
+  const uint8_t *in = (const uint8_t *)&d;
+  uint32_t da = in[3];
+  uint32_t ws = sa * 255, wd = da * (255 - sa), oa = ws + wd;
+  if (oa == 0) return 0;
+
+  uint32_t out;
+  uint8_t *o = (uint8_t *)&out;
+  uint32_t a = (oa + 127) / 255;
+  for (int j = 0; j < 3; ++j) {
+    uint32_t ld = lin_of_srgb[da ? straight(in[j], da) : 0];
+    o[j] = mul255(srgb_of_lin[(lin[j] * ws + ld * wd) / oa], a);
+  }
+  o[3] = a;
+  return out;
+}
+
+// Sets lin[0..2] to the linear channels of the premultiplied pixel p.
+static void linear_color(uint32_t p, uint32_t *lin) {
+  const uint8_t *in = (const uint8_t *)&p;
+  for (int j = 0; j < 3; ++j) {
+    lin[j] = lin_of_srgb[in[3] ? straight(in[j], in[3]) : 0];
+  }
+}
+
+static void scalar_to_linear(uint16_t *dst, const uint32_t *src, int n) {
+  for (int i = 0; i < n; ++i, dst += 4) {
+    uint32_t lin[3];
+    linear_color(src[i], lin);
+    for (int j = 0; j < 3; ++j) dst[j] = lin[j];
+    dst[3] = ((const uint8_t *)&src[i])[3] * 257;
+  }
+}
+
+static void scalar_from_linear(uint32_t *dst, const uint16_t *src, int n) {
+  for (int i = 0; i < n; ++i, src += 4) {
+    uint8_t *o = (uint8_t *)&dst[i];
+    uint32_t a = (src[3] + 128) / 257;
+    for (int j = 0; j < 3; ++j) o[j] = mul255(srgb_of_lin[src[j]], a);
+    o[3] = a;
+  }
+}
+
+// A NULL mask covers every pixel.
+static void scalar_blend_linear(uint32_t *dst, const uint32_t *mask, int n,
+                                uint32_t color) {
+  uint32_t lin[3], alpha = ((const uint8_t *)&color)[3];
+  linear_color(color, lin);
+  for (int i = 0; i < n; ++i) {
+    uint32_t sa = mask ? mul255(alpha, (mask[i] >> span__alpha_shift) & 0xff)
+                       : alpha;
+    if (sa) dst[i] = over_linear(dst[i], lin, sa);
+  }
+}
+
+static void scalar_composite_linear(uint32_t *dst, const uint32_t *src,
+                                    int n) {
+  for (int i = 0; i < n; ++i) {
+    uint32_t lin[3], sa = ((const uint8_t *)&src[i])[3];
+    if (sa == 0) continue;
+    linear_color(src[i], lin);
+    dst[i] = over_linear(dst[i], lin, sa);
+  }
+}
+
+// Blur kernels.
+//
+// A box's channel sums are below 2^24, so they're exact as floats. Each
+// average is the sum times the float 1 / (2r + 1), converted to an integer
+// with the cpu's rounding, which is to nearest unless a program changes it;
+// every version does the same two steps, so they agree.
+
+// Sets sum[0..3] to the channel sums of the box centered on src[0].
+static void start_box(uint32_t *sum, const uint32_t *src, int n, int r) {
+  const uint8_t *in   = (const uint8_t *)src;
+  int            last = (r < n - 1) ? r : n - 1;  // The last pixel inside.
+  for (int j = 0; j < 4; ++j) {
+    sum[j] = (uint32_t)(r + 1) * in[j] +
+             (uint32_t)(r - last) * in[4 * (n - 1) + j];
+    for (int i = 1; i <= last; ++i) sum[j] += in[4 * i + j];
+  }
+}
+
+static void scalar_box_blur(uint32_t *dst, const uint32_t *src, int n,
+                            int r) {
+  const uint8_t *in    = (const uint8_t *)src;
+  uint8_t       *out   = (uint8_t *)dst;
+  float          scale = 1.0f / (2 * r + 1);
+  uint32_t       sum[4];
+  start_box(sum, src, n, r);
+  for (int x = 0; x < n; ++x) {
+    const uint8_t *add = in + 4 * ((x + r + 1 < n) ? x + r + 1 : n - 1);
+    const uint8_t *sub = in + 4 * ((x - r > 0) ? x - r : 0);
+    for (int j = 0; j < 4; ++j) {
+      out[4 * x + j] = (uint8_t)lrintf(sum[j] * scale);
+      sum[j] += add[j] - sub[j];
+    }
+  }
+}
+
+static void scalar_box_blur_step(uint32_t *dst, uint32_t *sums,
+                                 const uint32_t *add, const uint32_t *sub,
+                                 int n, int r) {
+  const uint8_t *a     = (const uint8_t *)add;
+  const uint8_t *b     = (const uint8_t *)sub;
+  uint8_t       *out   = (uint8_t *)dst;
+  float          scale = 1.0f / (2 * r + 1);
+  for (int i = 0; i < 4 * n; ++i) {
+    out[i]   = (uint8_t)lrintf(sums[i] * scale);
+    sums[i] += a[i] - b[i];
+  }
+}
+
+static Impl scalar_impl = {
+  "scalar", scalar_fill, scalar_blend, scalar_blend_masked, scalar_composite,
+  scalar_add, scalar_downsample, scalar_convert, scalar_to_linear,
+  scalar_from_linear, scalar_blend_linear, scalar_composite_linear,
+  scalar_box_blur, scalar_box_blur_step
+};
+
+
+#if has_x86_kernels
+
+// SSE2 kernels.
+
+__attribute__((target("sse2")))
+static void sse2_fill(uint32_t *dst, int n, uint32_t color) {
+  __m128i c = _mm_set1_epi32((int)color);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128((__m128i *)(dst + i),     c);
+    _mm_storeu_si128((__m128i *)(dst + i + 4), c);
+  }
+  for (; i < n; ++i) dst[i] = color;
+}
+
+// Scales the 16-bit channels in v by inv_alpha / 255, rounded.
+__attribute__((target("sse2")))
+static __m128i sse2_scale16(__m128i v, __m128i inv_alpha) {
+  v = _mm_add_epi16(_mm_mullo_epi16(v, inv_alpha), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void sse2_blend(uint32_t *dst, int n, uint32_t color) {
+  uint32_t inv_alpha = 255 - ((color >> span__alpha_shift) & 0xff);
+  __m128i  c    = _mm_set1_epi32((int)color);
+  __m128i  inv  = _mm_set1_epi16((short)inv_alpha);
+  __m128i  zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i d  = _mm_loadu_si128((__m128i *)(dst + i));
+    __m128i lo = sse2_scale16(_mm_unpacklo_epi8(d, zero), inv);
+    __m128i hi = sse2_scale16(_mm_unpackhi_epi8(d, zero), inv);
+    d = _mm_add_epi8(_mm_packus_epi16(lo, hi), c);
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+  for (; i < n; ++i) dst[i] = color + span__scale(dst[i], inv_alpha);
+}
+
+// Returns 255 minus the alpha of each pixel in v, which holds two pixels
+// with 16 bits per channel, in all four channels of that pixel.
+__attribute__((target("sse2")))
+static __m128i sse2_inv_alpha16(__m128i v) {
+  v = _mm_shufflelo_epi16(v, alpha_everywhere);
+  v = _mm_shufflehi_epi16(v, alpha_everywhere);
+  return _mm_sub_epi16(_mm_set1_epi16(255), v);
+}
+
+// Spreads the alpha of each of two pixels in v, which holds one 32-bit
+// value per pixel in its low 64 bits, to all four 16-bit channels.
+__attribute__((target("sse2")))
+static __m128i sse2_spread_alpha16(__m128i v) {
+  v = _mm_srli_epi32(v, span__alpha_shift);
+  v = _mm_and_si128(v, _mm_set1_epi32(0xff));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 2, 0, 0));
+  return _mm_unpacklo_epi32(v, v);
+}
+
+__attribute__((target("sse2")))
+static void sse2_blend_masked(uint32_t *dst, const uint32_t *mask, int n,
+                              uint32_t color) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i c    = _mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i m = _mm_loadu_si128((__m128i *)(mask + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(m, zero)) == 0xffff) continue;
+    __m128i d    = _mm_loadu_si128((__m128i *)(dst + i));
+    __m128i s_lo = sse2_scale16(c, sse2_spread_alpha16(m));
+    __m128i s_hi = sse2_scale16(c, sse2_spread_alpha16(_mm_srli_si128(m, 8)));
+    __m128i lo   = sse2_scale16(_mm_unpacklo_epi8(d, zero),
+                                sse2_inv_alpha16(s_lo));
+    __m128i hi   = sse2_scale16(_mm_unpackhi_epi8(d, zero),
+                                sse2_inv_alpha16(s_hi));
+    d = _mm_add_epi8(_mm_packus_epi16(lo, hi), _mm_packus_epi16(s_lo, s_hi));
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+  scalar_blend_masked(dst + i, mask + i, n - i, color);
+}
+
+// Runs of four zero or four opaque source pixels are skipped or copied
+// without blending, since sprites are mostly one or the other.
+__attribute__((target("sse2")))
+static void sse2_composite(uint32_t *dst, const uint32_t *src, int n) {
+  __m128i zero  = _mm_setzero_si128();
+  __m128i alpha = _mm_set1_epi32((int)(0xffu << span__alpha_shift));
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff) continue;
+    __m128i a = _mm_and_si128(s, alpha);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) != 0xffff) {
+      __m128i d  = _mm_loadu_si128((__m128i *)(dst + i));
+      __m128i lo = sse2_scale16(_mm_unpacklo_epi8(d, zero),
+                                sse2_inv_alpha16(_mm_unpacklo_epi8(s, zero)));
+      __m128i hi = sse2_scale16(_mm_unpackhi_epi8(d, zero),
+                                sse2_inv_alpha16(_mm_unpackhi_epi8(s, zero)));
+      s = _mm_add_epi8(_mm_packus_epi16(lo, hi), s);
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), s);
+  }
+  scalar_composite(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_add(uint32_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(d, s));
+  }
+  scalar_add(dst + i, src + i, n - i);
+}
+
+// Finds an output pixel from the sums of its four inputs' squares, sq, and
+// of the inputs themselves, v, which have 32 bits per channel. The rooted
+// colors come back as 16-bit channels in the low half, and the averages in
+// the high half.
+__attribute__((target("sse2")))
+static __m128i sse2_mip_pixel(__m128i sq, __m128i v) {
+  __m128  mean  = _mm_mul_ps(_mm_cvtepi32_ps(sq), _mm_set1_ps(0.25f));
+  __m128i c     = _mm_cvttps_epi32(_mm_add_ps(_mm_sqrt_ps(mean),
+                                              _mm_set1_ps(0.5f)));
+  __m128i alpha = _mm_srli_epi32(_mm_add_epi32(v, _mm_set1_epi32(2)), 2);
+  return _mm_packs_epi32(c, alpha);
+}
+
+// Adds the two pixels in v, which have 16 bits per channel, giving one
+// pixel with 32 bits per channel.
+__attribute__((target("sse2")))
+static __m128i sse2_pair_sum(__m128i v) {
+  __m128i zero = _mm_setzero_si128();
+  return _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                       _mm_unpackhi_epi16(v, zero));
+}
+
+// Each pass turns four pixels from each row into two output pixels.
+__attribute__((target("sse2")))
+static void sse2_downsample(uint32_t *dst, const uint32_t *src0,
+                            const uint32_t *src1, int n) {
+  __m128i zero     = _mm_setzero_si128();
+  __m128i is_alpha = _mm_slli_epi64(_mm_set1_epi64x(0xffff), 16 * alpha_lane);
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i r0 = _mm_loadu_si128((__m128i *)(src0 + 2 * i));
+    __m128i r1 = _mm_loadu_si128((__m128i *)(src1 + 2 * i));
+
+    // The pixels for the first output are in the low halves of the rows.
+    __m128i lo0 = _mm_unpacklo_epi8(r0, zero);
+    __m128i lo1 = _mm_unpacklo_epi8(r1, zero);
+    __m128i hi0 = _mm_unpackhi_epi8(r0, zero);
+    __m128i hi1 = _mm_unpackhi_epi8(r1, zero);
+
+    // The squares fit in 16 bits, but their sums don't.
+    __m128i sq0 = _mm_add_epi32(sse2_pair_sum(_mm_mullo_epi16(lo0, lo0)),
+                                sse2_pair_sum(_mm_mullo_epi16(lo1, lo1)));
+    __m128i sq1 = _mm_add_epi32(sse2_pair_sum(_mm_mullo_epi16(hi0, hi0)),
+                                sse2_pair_sum(_mm_mullo_epi16(hi1, hi1)));
+    __m128i p0  = sse2_mip_pixel(sq0, sse2_pair_sum(_mm_add_epi16(lo0, lo1)));
+    __m128i p1  = sse2_mip_pixel(sq1, sse2_pair_sum(_mm_add_epi16(hi0, hi1)));
+
+    // Each of p0 and p1 has colors in its low half and alphas in its high
+    // half; clamp the colors to the alpha and put the alpha in place.
+    __m128i c = _mm_unpacklo_epi64(p0, p1);
+    __m128i a = _mm_unpackhi_epi64(p0, p1);
+    a = _mm_shufflelo_epi16(a, alpha_everywhere);
+    a = _mm_shufflehi_epi16(a, alpha_everywhere);
+    c = _mm_min_epi16(c, a);
+    c = _mm_or_si128(_mm_andnot_si128(is_alpha, c), _mm_and_si128(is_alpha, a));
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(c, c));
+  }
+  scalar_downsample(dst + i, src0 + 2 * i, src1 + 2 * i, n - i);
+}
+
+// The conversion kernels treat each pixel as the little-endian value
+// R | G << 8 | B << 16 | A << 24, so that channels can be moved with
+// shifts and masks.
+
+// Converts the channel c, in the low byte of each 32-bit lane, to straight
+// alpha. The float division is exact enough that truncating it matches the
+// integer division in straight(); lanes with zero alpha become 0.
+__attribute__((target("sse2")))
+static __m128i sse2_straight(__m128i c, __m128i a, __m128i zero_alpha) {
+  __m128i num = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 8), c),
+                              _mm_srli_epi32(a, 1));
+  __m128i v   = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(num),
+                                            _mm_cvtepi32_ps(a)));
+  __m128i max = _mm_set1_epi32(255);
+  __m128i big = _mm_cmpgt_epi32(v, max);
+  v = _mm_or_si128(_mm_andnot_si128(big, v), _mm_and_si128(big, max));
+  return _mm_andnot_si128(zero_alpha, v);
+}
+
+__attribute__((target("sse2")))
+static void sse2_convert(void *dst, const uint32_t *src, int n, int order,
+                         int to_straight) {
+  __m128i byte = _mm_set1_epi32(0xff);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i r = _mm_and_si128(p, byte);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), byte);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), byte);
+    __m128i a = _mm_srli_epi32(p, 24);
+    if (to_straight) {
+      __m128i zero_alpha = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+      r = sse2_straight(r, a, zero_alpha);
+      g = sse2_straight(g, a, zero_alpha);
+      b = sse2_straight(b, a, zero_alpha);
+    }
+    g = _mm_slli_epi32(g, 8);
+    if (order == span__rgba) {
+      p = _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(_mm_slli_epi32(b, 16),
+                                                        _mm_slli_epi32(a, 24)));
+    } else if (order == span__bgra) {
+      p = _mm_or_si128(_mm_or_si128(b, g), _mm_or_si128(_mm_slli_epi32(r, 16),
+                                                        _mm_slli_epi32(a, 24)));
+    } else {
+      p = _mm_or_si128(_mm_or_si128(a, _mm_slli_epi32(r, 8)),
+                       _mm_or_si128(_mm_slli_epi32(g, 8),
+                                    _mm_slli_epi32(b, 24)));
+    }
+    _mm_storeu_si128((__m128i *)((uint8_t *)dst + 4 * i), p);
+  }
+  scalar_convert((uint8_t *)dst + 4 * i, src + i, n - i, order, to_straight);
+}
+
+// Returns the channels of pixel p with 32 bits each.
+static __m128i sse2_channels(uint32_t p) {
+  __m128i zero = _mm_setzero_si128();
+  return _mm_unpacklo_epi16(
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), zero), zero);
+}
+
+// Returns the 32-bit channel sums in v times scale, rounded.
+static __m128i sse2_average(__m128i v, __m128 scale) {
+  return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+}
+
+// Returns the 16-bit channel differences in d, which are from -255 to 255,
+// with 32 bits each; lo picks the low four and hi the high four.
+static __m128i sse2_widen_lo(__m128i d) {
+  return _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+}
+
+static __m128i sse2_widen_hi(__m128i d) {
+  return _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16);
+}
+
+// The sums are sequential along the run, so this keeps one pixel's four
+// channel sums in a register and moves them a pixel at a time. Where
+// neither end of the box is past the run's ends, two pixels are done per
+// pass, loading the pixels entering and leaving the box in pairs.
+static void sse2_box_blur(uint32_t *dst, const uint32_t *src, int n, int r) {
+  __m128   scale = _mm_set1_ps(1.0f / (2 * r + 1));
+  __m128i  zero  = _mm_setzero_si128();
+  uint32_t start[4];
+  start_box(start, src, n, r);
+  __m128i sum = _mm_loadu_si128((__m128i *)start);
+  for (int x = 0; x < n;) {
+    if (x >= r && x + r + 2 < n) {
+      __m128i in  = _mm_loadl_epi64((const __m128i *)(src + x + r + 1));
+      __m128i out = _mm_loadl_epi64((const __m128i *)(src + x - r));
+      __m128i d   = _mm_sub_epi16(_mm_unpacklo_epi8(in, zero),
+                                  _mm_unpacklo_epi8(out, zero));
+      __m128i next = _mm_add_epi32(sum, sse2_widen_lo(d));
+      __m128i avg  = _mm_packs_epi32(sse2_average(sum, scale),
+                                     sse2_average(next, scale));
+      _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(avg, avg));
+      sum = _mm_add_epi32(next, sse2_widen_hi(d));
+      x  += 2;
+      continue;
+    }
+    __m128i avg = sse2_average(sum, scale);
+    avg    = _mm_packs_epi32(avg, avg);
+    dst[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(avg, avg));
+    sum    = _mm_add_epi32(sum, sse2_channels(
+        src[(x + r + 1 < n) ? x + r + 1 : n - 1]));
+    sum    = _mm_sub_epi32(sum, sse2_channels(src[(x - r > 0) ? x - r : 0]));
+    ++x;
+  }
+}
+
+// Each pass moves the sums of four pixels.
+static void sse2_box_blur_step(uint32_t *dst, uint32_t *sums,
+                               const uint32_t *add, const uint32_t *sub,
+                               int n, int r) {
+  __m128  scale = _mm_set1_ps(1.0f / (2 * r + 1));
+  __m128i zero  = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i *s  = (__m128i *)(sums + 4 * i);
+    __m128i  v0 = _mm_loadu_si128(s),     v1 = _mm_loadu_si128(s + 1);
+    __m128i  v2 = _mm_loadu_si128(s + 2), v3 = _mm_loadu_si128(s + 3);
+    __m128i out = _mm_packus_epi16(
+        _mm_packs_epi32(sse2_average(v0, scale), sse2_average(v1, scale)),
+        _mm_packs_epi32(sse2_average(v2, scale), sse2_average(v3, scale)));
+    _mm_storeu_si128((__m128i *)(dst + i), out);
+
+    __m128i a  = _mm_loadu_si128((__m128i *)(add + i));
+    __m128i b  = _mm_loadu_si128((__m128i *)(sub + i));
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero),
+                               _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(b, zero));
+    _mm_storeu_si128(s,     _mm_add_epi32(v0, sse2_widen_lo(lo)));
+    _mm_storeu_si128(s + 1, _mm_add_epi32(v1, sse2_widen_hi(lo)));
+    _mm_storeu_si128(s + 2, _mm_add_epi32(v2, sse2_widen_lo(hi)));
+    _mm_storeu_si128(s + 3, _mm_add_epi32(v3, sse2_widen_hi(hi)));
+  }
+  scalar_box_blur_step(dst + i, sums + 4 * i, add + i, sub + i, n - i, r);
+}
+
+// SSE2 has no gather instruction for the table lookups, which are most of
+// the linear kernels' work, so it uses the scalar ones.
+static Impl sse2_impl = {
+  "sse2", sse2_fill, sse2_blend, sse2_blend_masked, sse2_composite, sse2_add,
+  sse2_downsample, sse2_convert, scalar_to_linear, scalar_from_linear,
+  scalar_blend_linear, scalar_composite_linear, sse2_box_blur,
+  sse2_box_blur_step
+};
+
+
+// AVX2 kernels.
+
+__attribute__((target("avx2")))
+static void avx2_fill(uint32_t *dst, int n, uint32_t color) {
+  __m256i c = _mm256_set1_epi32((int)color);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256((__m256i *)(dst + i),     c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), c);
+  }
+  for (; i < n; ++i) dst[i] = color;
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_scale16(__m256i v, __m256i inv_alpha) {
+  v = _mm256_add_epi16(_mm256_mullo_epi16(v, inv_alpha),
+                       _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+// The unpack and pack instructions work within 128-bit lanes, so the pixel
+// order survives the round trip through 16-bit channels.
+__attribute__((target("avx2")))
+static void avx2_blend(uint32_t *dst, int n, uint32_t color) {
+  uint32_t inv_alpha = 255 - ((color >> span__alpha_shift) & 0xff);
+  __m256i  c    = _mm256_set1_epi32((int)color);
+  __m256i  inv  = _mm256_set1_epi16((short)inv_alpha);
+  __m256i  zero = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i d  = _mm256_loadu_si256((__m256i *)(dst + i));
+    __m256i lo = avx2_scale16(_mm256_unpacklo_epi8(d, zero), inv);
+    __m256i hi = avx2_scale16(_mm256_unpackhi_epi8(d, zero), inv);
+    d = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), c);
+    _mm256_storeu_si256((__m256i *)(dst + i), d);
+  }
+  for (; i < n; ++i) dst[i] = color + span__scale(dst[i], inv_alpha);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_inv_alpha16(__m256i v) {
+  v = _mm256_shufflelo_epi16(v, alpha_everywhere);
+  v = _mm256_shufflehi_epi16(v, alpha_everywhere);
+  return _mm256_sub_epi16(_mm256_set1_epi16(255), v);
+}
+
+// Like the unpacks, this works within each 128-bit lane, spreading the
+// alpha of the lane's first two pixels.
+__attribute__((target("avx2")))
+static __m256i avx2_spread_alpha16(__m256i v) {
+  v = _mm256_srli_epi32(v, span__alpha_shift);
+  v = _mm256_and_si256(v, _mm256_set1_epi32(0xff));
+  v = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(2, 2, 0, 0));
+  return _mm256_unpacklo_epi32(v, v);
+}
+
+__attribute__((target("avx2")))
+static void avx2_blend_masked(uint32_t *dst, const uint32_t *mask, int n,
+                              uint32_t color) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i c    = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)color), zero);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i m = _mm256_loadu_si256((__m256i *)(mask + i));
+    if (_mm256_testz_si256(m, m)) continue;
+    __m256i d    = _mm256_loadu_si256((__m256i *)(dst + i));
+    __m256i s_lo = avx2_scale16(c, avx2_spread_alpha16(m));
+    __m256i s_hi = avx2_scale16(c, avx2_spread_alpha16(
+                                       _mm256_srli_si256(m, 8)));
+    __m256i lo   = avx2_scale16(_mm256_unpacklo_epi8(d, zero),
+                                avx2_inv_alpha16(s_lo));
+    __m256i hi   = avx2_scale16(_mm256_unpackhi_epi8(d, zero),
+                                avx2_inv_alpha16(s_hi));
+    d = _mm256_add_epi8(_mm256_packus_epi16(lo, hi),
+                        _mm256_packus_epi16(s_lo, s_hi));
+    _mm256_storeu_si256((__m256i *)(dst + i), d);
+  }
+  scalar_blend_masked(dst + i, mask + i, n - i, color);
+}
+
+__attribute__((target("avx2")))
+static void avx2_composite(uint32_t *dst, const uint32_t *src, int n) {
+  __m256i zero  = _mm256_setzero_si256();
+  __m256i alpha = _mm256_set1_epi32((int)(0xffu << span__alpha_shift));
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((__m256i *)(src + i));
+    if (_mm256_testz_si256(s, s)) continue;
+    if (!_mm256_testc_si256(s, alpha)) {
+      __m256i d  = _mm256_loadu_si256((__m256i *)(dst + i));
+      __m256i lo = avx2_scale16(_mm256_unpacklo_epi8(d, zero),
+                                avx2_inv_alpha16(
+                                    _mm256_unpacklo_epi8(s, zero)));
+      __m256i hi = avx2_scale16(_mm256_unpackhi_epi8(d, zero),
+                                avx2_inv_alpha16(
+                                    _mm256_unpackhi_epi8(s, zero)));
+      s = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s);
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), s);
+  }
+  scalar_composite(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_add(uint32_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(d, s));
+  }
+  scalar_add(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_mip_pixel(__m256i sq, __m256i v) {
+  __m256  mean  = _mm256_mul_ps(_mm256_cvtepi32_ps(sq), _mm256_set1_ps(0.25f));
+  __m256i c     = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_sqrt_ps(mean),
+                                                    _mm256_set1_ps(0.5f)));
+  __m256i alpha = _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(2)),
+                                    2);
+  return _mm256_packs_epi32(c, alpha);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_pair_sum(__m256i v) {
+  __m256i zero = _mm256_setzero_si256();
+  return _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero),
+                          _mm256_unpackhi_epi16(v, zero));
+}
+
+// This works like sse2_downsample within each 128-bit lane, so the low lane
+// makes the first two output pixels and the high lane the next two.
+__attribute__((target("avx2")))
+static void avx2_downsample(uint32_t *dst, const uint32_t *src0,
+                            const uint32_t *src1, int n) {
+  __m256i zero     = _mm256_setzero_si256();
+  __m256i is_alpha = _mm256_slli_epi64(_mm256_set1_epi64x(0xffff),
+                                       16 * alpha_lane);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i r0  = _mm256_loadu_si256((__m256i *)(src0 + 2 * i));
+    __m256i r1  = _mm256_loadu_si256((__m256i *)(src1 + 2 * i));
+    __m256i lo0 = _mm256_unpacklo_epi8(r0, zero);
+    __m256i lo1 = _mm256_unpacklo_epi8(r1, zero);
+    __m256i hi0 = _mm256_unpackhi_epi8(r0, zero);
+    __m256i hi1 = _mm256_unpackhi_epi8(r1, zero);
+
+    __m256i sq0 = _mm256_add_epi32(avx2_pair_sum(_mm256_mullo_epi16(lo0, lo0)),
+                                   avx2_pair_sum(_mm256_mullo_epi16(lo1, lo1)));
+    __m256i sq1 = _mm256_add_epi32(avx2_pair_sum(_mm256_mullo_epi16(hi0, hi0)),
+                                   avx2_pair_sum(_mm256_mullo_epi16(hi1, hi1)));
+    __m256i p0  = avx2_mip_pixel(sq0,
+                                 avx2_pair_sum(_mm256_add_epi16(lo0, lo1)));
+    __m256i p1  = avx2_mip_pixel(sq1,
+                                 avx2_pair_sum(_mm256_add_epi16(hi0, hi1)));
+
+    __m256i c = _mm256_unpacklo_epi64(p0, p1);
+    __m256i a = _mm256_unpackhi_epi64(p0, p1);
+    a = _mm256_shufflelo_epi16(a, alpha_everywhere);
+    a = _mm256_shufflehi_epi16(a, alpha_everywhere);
+    c = _mm256_min_epi16(c, a);
+    c = _mm256_or_si256(_mm256_andnot_si256(is_alpha, c),
+                        _mm256_and_si256(is_alpha, a));
+    c = _mm256_permute4x64_epi64(_mm256_packus_epi16(c, c),
+                                 _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(c));
+  }
+  scalar_downsample(dst + i, src0 + 2 * i, src1 + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_straight(__m256i c, __m256i a, __m256i zero_alpha) {
+  __m256i num = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(c, 8), c),
+                                 _mm256_srli_epi32(a, 1));
+  __m256i v   = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(num),
+                                                  _mm256_cvtepi32_ps(a)));
+  v = _mm256_min_epi32(v, _mm256_set1_epi32(255));
+  return _mm256_andnot_si256(zero_alpha, v);
+}
+
+__attribute__((target("avx2")))
+static void avx2_convert(void *dst, const uint32_t *src, int n, int order,
+                         int to_straight) {
+  __m256i byte = _mm256_set1_epi32(0xff);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i r = _mm256_and_si256(p, byte);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), byte);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), byte);
+    __m256i a = _mm256_srli_epi32(p, 24);
+    if (to_straight) {
+      __m256i zero_alpha = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+      r = avx2_straight(r, a, zero_alpha);
+      g = avx2_straight(g, a, zero_alpha);
+      b = avx2_straight(b, a, zero_alpha);
+    }
+    g = _mm256_slli_epi32(g, 8);
+    if (order == span__rgba) {
+      p = _mm256_or_si256(_mm256_or_si256(r, g),
+                          _mm256_or_si256(_mm256_slli_epi32(b, 16),
+                                          _mm256_slli_epi32(a, 24)));
+    } else if (order == span__bgra) {
+      p = _mm256_or_si256(_mm256_or_si256(b, g),
+                          _mm256_or_si256(_mm256_slli_epi32(r, 16),
+                                          _mm256_slli_epi32(a, 24)));
+    } else {
+      p = _mm256_or_si256(_mm256_or_si256(a, _mm256_slli_epi32(r, 8)),
+                          _mm256_or_si256(_mm256_slli_epi32(g, 8),
+                                          _mm256_slli_epi32(b, 24)));
+    }
+    _mm256_storeu_si256((__m256i *)((uint8_t *)dst + 4 * i), p);
+  }
+  scalar_convert((uint8_t *)dst + 4 * i, src + i, n - i, order, to_straight);
+}
+
+// Returns x * a / 255, rounded, for each 32-bit x and a up to 255; see
+// mul255.
+__attribute__((target("avx2")))
+static __m256i avx2_mul255(__m256i x, __m256i a) {
+  __m256i t = _mm256_add_epi32(_mm256_mullo_epi16(x, a),
+                               _mm256_set1_epi32(128));
+  return _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8);
+}
+
+// Looks up the linear value of each 32-bit sRGB byte in s.
+__attribute__((target("avx2")))
+static __m256i avx2_lin_of_srgb(__m256i s) {
+  return _mm256_i32gather_epi32((const int *)lin_of_srgb, s, 4);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_srgb_of_lin(__m256i l) {
+  return _mm256_and_si256(_mm256_i32gather_epi32((const int *)srgb_of_lin,
+                                                 l, 1),
+                          _mm256_set1_epi32(0xff));
+}
+
+// Returns n / d, rounded down, for unsigned 32-bit n and positive d below
+// 65536. A double holds both exactly, and the rounded quotient is too far
+// from the next integer up to reach it, so truncating it is exact.
+__attribute__((target("avx2")))
+static __m256i avx2_div(__m256i n, __m256i d) {
+  __m256i flip = _mm256_xor_si256(n, _mm256_set1_epi32((int)0x80000000));
+  __m256d half = _mm256_set1_pd(2147483648.0);
+  __m256d n0   = _mm256_add_pd(
+      _mm256_cvtepi32_pd(_mm256_castsi256_si128(flip)), half);
+  __m256d n1   = _mm256_add_pd(
+      _mm256_cvtepi32_pd(_mm256_extracti128_si256(flip, 1)), half);
+  __m128i q0   = _mm256_cvttpd_epi32(_mm256_div_pd(
+      n0, _mm256_cvtepi32_pd(_mm256_castsi256_si128(d))));
+  __m128i q1   = _mm256_cvttpd_epi32(_mm256_div_pd(
+      n1, _mm256_cvtepi32_pd(_mm256_extracti128_si256(d, 1))));
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(q0), q1, 1);
+}
+
+// Does over_linear for 8 pixels, with each color's linear channels in
+// lr, lg, and lb. When every pixel of d is opaque, the new alpha is 255
+// and its weights are sa and 255 - sa over 255, so that path skips the
+// unpremultiplying and divides with floats, whose quotients of integers
+// under 2^24 truncate exactly.
+__attribute__((target("avx2")))
+static __m256i avx2_over_linear(__m256i d, __m256i lr, __m256i lg,
+                                __m256i lb, __m256i sa) {
+  __m256i byte    = _mm256_set1_epi32(0xff);
+  __m256i lin[3]  = { lr, lg, lb };
+  __m256i out     = _mm256_setzero_si256();
+  __m256i da      = _mm256_srli_epi32(d, 24);
+  __m256i inv_sa  = _mm256_sub_epi32(byte, sa);
+
+  if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(da, byte)) == -1) {
+    __m256  k = _mm256_set1_ps(255.0f);
+    for (int j = 0; j < 3; ++j) {
+      __m256i c  = _mm256_and_si256(_mm256_srli_epi32(d, 8 * j), byte);
+      __m256i m  = _mm256_add_epi32(
+          _mm256_mullo_epi32(lin[j], sa),
+          _mm256_mullo_epi32(avx2_lin_of_srgb(c), inv_sa));
+      __m256i l  = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(m),
+                                                     k));
+      out = _mm256_or_si256(out, _mm256_slli_epi32(avx2_srgb_of_lin(l),
+                                                   8 * j));
+    }
+    return _mm256_or_si256(out, _mm256_slli_epi32(byte, 24));
+  }
+
+  __m256i zero_alpha = _mm256_cmpeq_epi32(da, _mm256_setzero_si256());
+  __m256i ws = _mm256_sub_epi32(_mm256_slli_epi32(sa, 8), sa);
+  __m256i wd = _mm256_mullo_epi16(da, inv_sa);
+  __m256i oa = _mm256_add_epi32(ws, wd);
+  __m256i d1 = _mm256_max_epi32(oa, _mm256_set1_epi32(1));
+  __m256i x  = _mm256_add_epi32(oa, _mm256_set1_epi32(127));
+  __m256i a  = _mm256_srli_epi32(
+      _mm256_add_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(1)),
+                       _mm256_srli_epi32(x, 8)), 8);
+  for (int j = 0; j < 3; ++j) {
+    __m256i c  = _mm256_and_si256(_mm256_srli_epi32(d, 8 * j), byte);
+    __m256i ld = avx2_lin_of_srgb(avx2_straight(c, da, zero_alpha));
+    __m256i l  = avx2_div(_mm256_add_epi32(_mm256_mullo_epi32(lin[j], ws),
+                                           _mm256_mullo_epi32(ld, wd)), d1);
+    out = _mm256_or_si256(out, _mm256_slli_epi32(
+        avx2_mul255(avx2_srgb_of_lin(l), a), 8 * j));
+  }
+  return _mm256_or_si256(out, _mm256_slli_epi32(a, 24));
+}
+
+// Returns true if each alpha in sa is 0 or 255.
+__attribute__((target("avx2")))
+static bit avx2_is_trivial(__m256i sa) {
+  __m256i ends = _mm256_or_si256(
+      _mm256_cmpeq_epi32(sa, _mm256_setzero_si256()),
+      _mm256_cmpeq_epi32(sa, _mm256_set1_epi32(0xff)));
+  return _mm256_movemask_epi8(ends) == -1;
+}
+
+// Returns d with the source pixels s, whose alphas are sa and linear
+// channels are lr, lg, and lb, composited over it. A source pixel with
+// alpha 0 leaves d as it is, and one with alpha 255 replaces it, which is
+// what over_linear does too; blocks with only those skip the blending.
+__attribute__((target("avx2")))
+static __m256i avx2_over_linear_where(__m256i d, __m256i s, __m256i lr,
+                                      __m256i lg, __m256i lb, __m256i sa) {
+  __m256i skip = _mm256_cmpeq_epi32(sa, _mm256_setzero_si256());
+  __m256i full = _mm256_cmpeq_epi32(sa, _mm256_set1_epi32(0xff));
+  __m256i p    = avx2_is_trivial(sa) ? d : avx2_over_linear(d, lr, lg, lb, sa);
+  p = _mm256_blendv_epi8(p, s, full);
+  return _mm256_blendv_epi8(p, d, skip);
+}
+
+// Sets lr, lg, and lb to the linear channels of the 8 pixels in p.
+__attribute__((target("avx2")))
+static void avx2_linear_color(__m256i p, __m256i *lr, __m256i *lg,
+                              __m256i *lb) {
+  __m256i byte       = _mm256_set1_epi32(0xff);
+  __m256i a          = _mm256_srli_epi32(p, 24);
+  __m256i zero_alpha = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+  __m256i *lin[3]    = { lr, lg, lb };
+  for (int j = 0; j < 3; ++j) {
+    __m256i c = _mm256_and_si256(_mm256_srli_epi32(p, 8 * j), byte);
+    *lin[j] = avx2_lin_of_srgb(avx2_straight(c, a, zero_alpha));
+  }
+}
+
+// Each pixel's 16-bit channels are built as the 32-bit halves rg and ba,
+// which are interleaved within 128-bit lanes and then put back in order.
+__attribute__((target("avx2")))
+static void avx2_to_linear(uint16_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i lr, lg, lb;
+    avx2_linear_color(p, &lr, &lg, &lb);
+    __m256i a  = _mm256_srli_epi32(p, 24);
+    __m256i rg = _mm256_or_si256(lr, _mm256_slli_epi32(lg, 16));
+    __m256i ba = _mm256_or_si256(lb, _mm256_slli_epi32(
+        _mm256_or_si256(_mm256_slli_epi32(a, 8), a), 16));
+    __m256i lo = _mm256_unpacklo_epi32(rg, ba);
+    __m256i hi = _mm256_unpackhi_epi32(rg, ba);
+    _mm256_storeu_si256((__m256i *)(dst + 4 * i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 4 * i + 16),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  scalar_to_linear(dst + 4 * i, src + i, n - i);
+}
+
+// This undoes the interleaving of avx2_to_linear: each 128-bit lane's
+// 32-bit halves are grouped, then the lanes are swapped into place.
+__attribute__((target("avx2")))
+static void avx2_from_linear(uint32_t *dst, const uint16_t *src, int n) {
+  __m256i word = _mm256_set1_epi32(0xffff);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v0 = _mm256_loadu_si256((__m256i *)(src + 4 * i));
+    __m256i v1 = _mm256_loadu_si256((__m256i *)(src + 4 * i + 16));
+    v0 = _mm256_shuffle_epi32(v0, _MM_SHUFFLE(3, 1, 2, 0));
+    v1 = _mm256_shuffle_epi32(v1, _MM_SHUFFLE(3, 1, 2, 0));
+    v0 = _mm256_permute4x64_epi64(v0, _MM_SHUFFLE(3, 1, 2, 0));
+    v1 = _mm256_permute4x64_epi64(v1, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i rg = _mm256_permute2x128_si256(v0, v1, 0x20);
+    __m256i ba = _mm256_permute2x128_si256(v0, v1, 0x31);
+    __m256i lin[3] = {
+      _mm256_and_si256(rg, word), _mm256_srli_epi32(rg, 16),
+      _mm256_and_si256(ba, word)
+    };
+    __m256i a = _mm256_cvttps_epi32(_mm256_div_ps(
+        _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_srli_epi32(ba, 16),
+                                            _mm256_set1_epi32(128))),
+        _mm256_set1_ps(257.0f)));
+    __m256i p = _mm256_slli_epi32(a, 24);
+    for (int j = 0; j < 3; ++j) {
+      p = _mm256_or_si256(p, _mm256_slli_epi32(
+          avx2_mul255(avx2_srgb_of_lin(lin[j]), a), 8 * j));
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), p);
+  }
+  scalar_from_linear(dst + i, src + 4 * i, n - i);
+}
+
+// Pixels the mask doesn't cover are kept as they are. Without a mask, each
+// channel of an opaque pixel maps to the same new value wherever it is, so
+// long runs first blend all 256 opaque grays into the table, and then look
+// up opaque pixels in it.
+__attribute__((target("avx2")))
+static void avx2_blend_linear(uint32_t *dst, const uint32_t *mask, int n,
+                              uint32_t color) {
+  __m256i c = _mm256_set1_epi32((int)color);
+  __m256i lr, lg, lb;
+  avx2_linear_color(c, &lr, &lg, &lb);
+  __m256i alpha = _mm256_srli_epi32(c, 24);
+  __m256i zero  = _mm256_setzero_si256();
+  __m256i byte  = _mm256_set1_epi32(0xff);
+
+  uint32_t table[3][256];
+  bit      has_table = (mask == NULL && n >= min_table_run);
+  for (int g = 0; has_table && g < 256; g += 8) {
+    __m256i gray = _mm256_mullo_epi32(
+        _mm256_add_epi32(_mm256_set1_epi32(g),
+                         _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+        _mm256_set1_epi32(0x010101));
+    __m256i p    = avx2_over_linear(_mm256_or_si256(gray, _mm256_set1_epi32(
+        (int)0xff000000)), lr, lg, lb, alpha);
+    for (int j = 0; j < 3; ++j) {
+      _mm256_storeu_si256((__m256i *)(table[j] + g), _mm256_or_si256(
+          _mm256_and_si256(p, _mm256_slli_epi32(byte, 8 * j)),
+          _mm256_set1_epi32(j ? 0 : (int)0xff000000)));
+    }
+  }
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+    if (has_table && _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_srli_epi32(d, 24), byte)) == -1) {
+      __m256i p = zero;
+      for (int j = 0; j < 3; ++j) {
+        __m256i k = _mm256_and_si256(_mm256_srli_epi32(d, 8 * j), byte);
+        p = _mm256_or_si256(p, _mm256_i32gather_epi32((const int *)table[j],
+                                                      k, 4));
+      }
+      _mm256_storeu_si256((__m256i *)(dst + i), p);
+      continue;
+    }
+    __m256i sa = alpha;
+    if (mask) {
+      __m256i m = _mm256_loadu_si256((__m256i *)(mask + i));
+      sa = avx2_mul255(alpha, _mm256_srli_epi32(m, span__alpha_shift));
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        avx2_over_linear_where(d, c, lr, lg, lb, sa));
+  }
+  scalar_blend_linear(dst + i, mask ? mask + i : NULL, n - i, color);
+}
+
+__attribute__((target("avx2")))
+static void avx2_composite_linear(uint32_t *dst, const uint32_t *src,
+                                  int n) {
+  __m256i zero = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s  = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i sa = _mm256_srli_epi32(s, 24);
+    if (_mm256_testz_si256(sa, sa)) continue;
+    __m256i lr = zero, lg = zero, lb = zero;
+    if (!avx2_is_trivial(sa)) avx2_linear_color(s, &lr, &lg, &lb);
+    __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        avx2_over_linear_where(d, s, lr, lg, lb, sa));
+  }
+  scalar_composite_linear(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_average(__m256i v, __m256 scale) {
+  return _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+}
+
+// Returns the channels of the two pixels at a minus those of the two at b,
+// with 32 bits each.
+__attribute__((target("avx2")))
+static __m256i avx2_diff(const uint32_t *a, const uint32_t *b) {
+  return _mm256_sub_epi32(
+      _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)a)),
+      _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)b)));
+}
+
+// Each pass moves the sums of eight pixels, which are in four registers
+// with two pixels each. The pack instructions work within 128-bit lanes,
+// so the packed pixels are put back in order at the end.
+__attribute__((target("avx2")))
+static void avx2_box_blur_step(uint32_t *dst, uint32_t *sums,
+                               const uint32_t *add, const uint32_t *sub,
+                               int n, int r) {
+  __m256  scale = _mm256_set1_ps(1.0f / (2 * r + 1));
+  __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i *s  = (__m256i *)(sums + 4 * i);
+    __m256i  v0 = _mm256_loadu_si256(s),     v1 = _mm256_loadu_si256(s + 1);
+    __m256i  v2 = _mm256_loadu_si256(s + 2), v3 = _mm256_loadu_si256(s + 3);
+    __m256i out = _mm256_packus_epi16(
+        _mm256_packs_epi32(avx2_average(v0, scale), avx2_average(v1, scale)),
+        _mm256_packs_epi32(avx2_average(v2, scale), avx2_average(v3, scale)));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permutevar8x32_epi32(out, order));
+
+    _mm256_storeu_si256(s,     _mm256_add_epi32(v0, avx2_diff(add + i,
+                                                              sub + i)));
+    _mm256_storeu_si256(s + 1, _mm256_add_epi32(v1, avx2_diff(add + i + 2,
+                                                              sub + i + 2)));
+    _mm256_storeu_si256(s + 2, _mm256_add_epi32(v2, avx2_diff(add + i + 4,
+                                                              sub + i + 4)));
+    _mm256_storeu_si256(s + 3, _mm256_add_epi32(v3, avx2_diff(add + i + 6,
+                                                              sub + i + 6)));
+  }
+  sse2_box_blur_step(dst + i, sums + 4 * i, add + i, sub + i, n - i, r);
+}
+
+// The sums along a run are sequential, and SSE2 already moves a pixel's
+// four sums at once, so the row kernel is the SSE2 one.
+static Impl avx2_impl = {
+  "avx2", avx2_fill, avx2_blend, avx2_blend_masked, avx2_composite, avx2_add,
+  avx2_downsample, avx2_convert, avx2_to_linear, avx2_from_linear,
+  avx2_blend_linear, avx2_composite_linear, sse2_box_blur, avx2_box_blur_step
+};
+
+#endif  // has_x86_kernels
+
+
+// Internal functions.
+
+static bit is_supported(Impl *candidate) {
+  if (candidate == &scalar_impl) return true;
+#if has_x86_kernels
+  __builtin_cpu_init();
+  if (candidate == &sse2_impl) return __builtin_cpu_supports("sse2") != 0;
+  if (candidate == &avx2_impl) return __builtin_cpu_supports("avx2") != 0;
+#endif
+  return false;
+}
+
+// Returns the kernel set in use, choosing it if needed. Threads drawing at
+// once may each make the choice, but they all choose the same set, and impl
+// is only read and written atomically.
+static Impl *current_impl() {
+  Impl *chosen = __atomic_load_n(&impl, __ATOMIC_ACQUIRE);
+  if (chosen) return chosen;
+
+  chosen = &scalar_impl;
+#if has_x86_kernels
+  if (is_supported(&sse2_impl)) chosen = &sse2_impl;
+  if (is_supported(&avx2_impl)) chosen = &avx2_impl;
+#endif
+  __atomic_store_n(&impl, chosen, __ATOMIC_RELEASE);
+  return chosen;
+}
+
+
+// Returns the linear light of the sRGB value x, both from 0 to 1.
+static double linear_of(double x) {
+  return (x <= 0.04045) ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+// Fills the sRGB tables. Each linear value maps to the byte whose sRGB
+// value is nearest its own, so that every byte maps back to itself. As with
+// impl, threads may each fill the tables, but they write the same values.
+static void make_tables() {
+  if (__atomic_load_n(&tables_made, __ATOMIC_ACQUIRE)) return;
+  for (int i = 0; i < 256; ++i) {
+    lin_of_srgb[i] = (uint32_t)lround(linear_of(i / 255.0) * 65535);
+  }
+  int    s    = 0;
+  double next = linear_of(0.5 / 255) * 65535;  // Where s + 1 starts.
+  for (int l = 0; l < 65536; ++l) {
+    while (s < 255 && l >= next) next = linear_of((++s + 0.5) / 255) * 65535;
+    srgb_of_lin[l] = s;
+  }
+  __atomic_store_n(&tables_made, true, __ATOMIC_RELEASE);
+}
+
+static Impl *linear_impl() {
+  make_tables();
+  return current_impl();
+}
+
+
+// Public functions.
+
+void span__fill(uint32_t *dst, int n, uint32_t color) {
+  current_impl()->fill(dst, n, color);
+}
+
+void span__blend(uint32_t *dst, int n, uint32_t color) {
+  current_impl()->blend(dst, n, color);
+}
+
+void span__blend_masked(uint32_t *dst, const uint32_t *mask, int n,
+                        uint32_t color) {
+  current_impl()->blend_masked(dst, mask, n, color);
+}
+
+void span__composite(uint32_t *dst, const uint32_t *src, int n) {
+  current_impl()->composite(dst, src, n);
+}
+
+void span__add(uint32_t *dst, const uint32_t *src, int n) {
+  current_impl()->add(dst, src, n);
+}
+
+void span__downsample(uint32_t *dst, const uint32_t *src0,
+                      const uint32_t *src1, int n) {
+  current_impl()->downsample(dst, src0, src1, n);
+}
+
+void span__convert(void *dst, const uint32_t *src, int n, int order,
+                   int to_straight) {
+  current_impl()->convert(dst, src, n, order, to_straight);
+}
+
+void span__to_linear(uint16_t *dst, const uint32_t *src, int n) {
+  linear_impl()->to_linear(dst, src, n);
+}
+
+void span__from_linear(uint32_t *dst, const uint16_t *src, int n) {
+  linear_impl()->from_linear(dst, src, n);
+}
+
+void span__blend_linear(uint32_t *dst, int n, uint32_t color) {
+  linear_impl()->blend_linear(dst, NULL, n, color);
+}
+
+void span__blend_masked_linear(uint32_t *dst, const uint32_t *mask, int n,
+                               uint32_t color) {
+  linear_impl()->blend_linear(dst, mask, n, color);
+}
+
+void span__composite_linear(uint32_t *dst, const uint32_t *src, int n) {
+  linear_impl()->composite_linear(dst, src, n);
+}
+
+// The pixels are converted to linear in chunks that fit on the stack. Each
+// output color is the average of its block's linear colors weighted by
+// their alphas.
+void span__downsample_linear(uint32_t *dst, const uint32_t *src0,
+                             const uint32_t *src1, int n) {
+  enum { chunk = 64 };
+  uint16_t row0[2 * chunk * 4], row1[2 * chunk * 4], out[chunk * 4];
+  Impl    *k = linear_impl();
+  for (int i = 0; i < n; i += chunk) {
+    int m = (n - i < chunk) ? n - i : chunk;
+    k->to_linear(row0, src0 + 2 * i, 2 * m);
+    k->to_linear(row1, src1 + 2 * i, 2 * m);
+    uint32_t alphas = 0xff000000;
+    for (int j = 2 * i; j < 2 * (i + m); ++j) alphas &= src0[j] & src1[j];
+    if (alphas == 0xff000000) {  // Opaque, so every pixel has equal weight.
+      for (int j = 0; j < 4 * m; ++j) {
+        int q  = j + (j & ~3);
+        out[j] = (row0[q] + row0[q + 4] + row1[q] + row1[q + 4]) >> 2;
+      }
+      k->from_linear(dst + i, out, m);
+      continue;
+    }
+    for (int j = 0; j < m; ++j) {
+      const uint16_t *p[4] = {
+        row0 + 8 * j, row0 + 8 * j + 4, row1 + 8 * j, row1 + 8 * j + 4
+      };
+      uint32_t a[4], sum = 0;
+      for (int q = 0; q < 4; ++q) sum += a[q] = p[q][3] / 257;
+      for (int c = 0; c < 3; ++c) {
+        uint32_t total = 0;
+        for (int q = 0; q < 4; ++q) total += p[q][c] * a[q];
+        out[4 * j + c] = sum ? total / sum : 0;
+      }
+      out[4 * j + 3] = ((sum + 2) >> 2) * 257;
+    }
+    k->from_linear(dst + i, out, m);
+  }
+}
+
+void span__box_blur(uint32_t *dst, const uint32_t *src, int n, int r) {
+  current_impl()->box_blur(dst, src, n, r);
+}
+
+void span__box_blur_step(uint32_t *dst, uint32_t *sums, const uint32_t *add,
+                         const uint32_t *sub, int n, int r) {
+  current_impl()->box_blur_step(dst, sums, add, sub, n, r);
+}
+
+const char *span__impl_name() {
+  return current_impl()->name;
+}
+
+int span__set_impl(const char *name) {
+  Impl *impls[] = {
+    &scalar_impl,
+#if has_x86_kernels
+    &sse2_impl, &avx2_impl
+#endif
+  };
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+    if (strcmp(impls[i]->name, name) == 0 && is_supported(impls[i])) {
+      __atomic_store_n(&impl, impls[i], __ATOMIC_RELEASE);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,129 @@
+// span.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Kernels that operate on runs of premultiplied 32-bit pixels.
+//
+// These back the software rasterizer in draw.c. Each kernel has a
+// scalar version plus SSE2 and AVX2 versions on x86; the fastest one
+// supported by the running cpu is chosen the first time a kernel is
+// called. Every version produces bit-identical results.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+// Builds a pixel value from premultiplied channel bytes so that its in-memory
+// byte order is R, G, B, A. The alpha of a pixel p is
+// (p >> span__alpha_shift) & 0xff.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define span__pixel(r, g, b, a) ((uint32_t)(r) << 24 | (uint32_t)(g) << 16 | \
+                                 (uint32_t)(b) <<  8 | (uint32_t)(a))
+#define span__alpha_shift 0
+#else
+#define span__pixel(r, g, b, a) ((uint32_t)(r)       | (uint32_t)(g) <<  8 | \
+                                 (uint32_t)(b) << 16 | (uint32_t)(a) << 24)
+#define span__alpha_shift 24
+#endif
+
+// Scales each channel of the pixel p by a / 255, rounded. The red/blue and
+// green/alpha channel pairs are each handled in one multiply with 16 bits
+// per channel.
+static inline uint32_t span__scale(uint32_t p, uint32_t a) {
+  uint32_t rb = (p & 0x00ff00ff) * a + 0x00800080;
+  rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+  uint32_t ga = ((p >> 8) & 0x00ff00ff) * a + 0x00800080;
+  ga = (ga + ((ga >> 8) & 0x00ff00ff)) & 0xff00ff00;
+  return rb | ga;
+}
+
+// Composites the pixel src over the pixel dst, as span__blend does.
+static inline uint32_t span__over(uint32_t dst, uint32_t src) {
+  return src + span__scale(dst, 255 - ((src >> span__alpha_shift) & 0xff));
+}
+
+// Sets dst[0..n-1] to color.
+void span__fill (uint32_t *dst, int n, uint32_t color);
+
+// Composites color over dst[0..n-1] using the source-over operator.
+void span__blend(uint32_t *dst, int n, uint32_t color);
+
+// Composites color over dst[0..n-1] using the source-over operator, after
+// scaling color by the alpha of the matching pixel in mask[0..n-1].
+void span__blend_masked(uint32_t *dst, const uint32_t *mask, int n,
+                        uint32_t color);
+
+// Composites the pixels src[0..n-1] over dst[0..n-1] using the source-over
+// operator. The two runs must not overlap.
+void span__composite(uint32_t *dst, const uint32_t *src, int n);
+
+// Adds the pixels src[0..n-1] to dst[0..n-1], one channel at a time, with
+// each sum clamped to 255. The two runs must not overlap.
+void span__add(uint32_t *dst, const uint32_t *src, int n);
+
+// Averages each 2x2 block of pixels from the rows src0 and src1, so that
+// dst[i] comes from src0[2i], src0[2i + 1], src1[2i], and src1[2i + 1] for
+// i in [0, n). Colors are averaged with a gamma of 2 as an approximation of
+// sRGB: the average of their squares is rooted and rounded, then clamped to
+// the new alpha. Alphas are averaged directly.
+void span__downsample(uint32_t *dst, const uint32_t *src0,
+                      const uint32_t *src1, int n);
+
+// The byte orders span__convert can write.
+enum {
+  span__rgba,
+  span__bgra,
+  span__argb
+};
+
+// Copies the pixels src[0..n-1] to dst with their bytes in the given order,
+// converting from premultiplied to straight alpha when to_straight is
+// nonzero. Neither pointer needs to be aligned.
+void span__convert(void *dst, const uint32_t *src, int n, int order,
+                   int to_straight);
+
+// Pixels hold sRGB colors, so blending their bytes directly mixes colors
+// in a space that's darker than linear light, which leaves dark fringes on
+// antialiased edges. The kernels below instead blend in linear light,
+// converting with lookup tables of the exact sRGB curve. A pixel converted
+// to linear and back is unchanged.
+
+// Converts the pixels src[0..n-1] to straight linear light with 16 bits per
+// channel, so that dst[4 * i .. 4 * i + 3] holds pixel i's red, green, blue,
+// and alpha, each from 0 to 65535.
+void span__to_linear(uint16_t *dst, const uint32_t *src, int n);
+
+// Converts pixels in the format made by span__to_linear back to pixels.
+void span__from_linear(uint32_t *dst, const uint16_t *src, int n);
+
+// Versions of span__blend, span__blend_masked, span__composite, and
+// span__downsample that blend in linear light. The downsampled colors are
+// averages of the linear colors weighted by alpha.
+void span__blend_linear       (uint32_t *dst, int n, uint32_t color);
+void span__blend_masked_linear(uint32_t *dst, const uint32_t *mask, int n,
+                               uint32_t color);
+void span__composite_linear   (uint32_t *dst, const uint32_t *src, int n);
+void span__downsample_linear  (uint32_t *dst, const uint32_t *src0,
+                               const uint32_t *src1, int n);
+
+// Box blurs src[0..n-1] into dst[0..n-1], so that each pixel becomes the
+// average of the 2r + 1 pixels centered on it, with src[0] and src[n - 1]
+// repeated past the ends. The runs must not overlap, and 2r + 1 must be at
+// most 65535.
+void span__box_blur(uint32_t *dst, const uint32_t *src, int n, int r);
+
+// Moves a box blur down a row of columns. sums holds the four channel sums
+// of each of n column boxes, which are 2r + 1 rows tall. This sets
+// dst[0..n-1] to their averages, then adds the channels of add[0..n-1],
+// the row entering each box, and subtracts those of sub[0..n-1], the row
+// leaving it.
+void span__box_blur_step(uint32_t *dst, uint32_t *sums, const uint32_t *add,
+                         const uint32_t *sub, int n, int r);
+
+// Returns the name of the kernel set in use: "avx2", "sse2", or "scalar".
+const char *span__impl_name();
+
+// Switches to the named kernel set, which is useful for benchmarks.
+// Returns nonzero on success, and 0 if the cpu doesn't support it.
+int         span__set_impl(const char *name);
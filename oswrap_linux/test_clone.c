@@ -0,0 +1,91 @@
+// test_clone.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Checks that a large bitmap cloned on two threads at once shares its
+// blocks with both clones through one block file. This includes draw.c so
+// it can see the block files. Prints each failed check and exits with a
+// nonzero status if any failed.
+//
+// Build it from this directory with this command, all on one line:
+//
+//   gcc -O2 -o test_clone test_clone.c now.c raster.c span.c ttf.c
+//       workers.c xy.c -lm -lpthread
+//
+
+#include "draw.c"
+
+
+// Internal globals.
+
+#define bitmap_w   512
+#define bitmap_h   512
+#define num_rounds 200
+
+static int num_failures = 0;
+
+// Each round, both threads wait here and then clone the same bitmap.
+static pthread_barrier_t start;
+static Bitmap           *original;
+
+
+// Internal functions.
+
+static void check(bit is_ok, const char *what) {
+  if (is_ok) return;
+  printf("Failed: %s\n", what);
+  num_failures++;
+}
+
+static void *clone_original(void *unused) {
+  (void)unused;
+  pthread_barrier_wait(&start);
+  return draw__clone_bitmap(original);
+}
+
+static bit has_same_pixels(Bitmap *a, Bitmap *b) {
+  for (int y = 0; y < a->y_size; ++y) {
+    if (memcmp(row(a, y), row(b, y), a->x_size * sizeof(uint32_t))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Main.
+
+int main() {
+  bit is_one_file = true, is_same = true;
+  pthread_barrier_init(&start, NULL, 2);
+  for (int round = 0; round < num_rounds; ++round) {
+    original = draw__new_bitmap(bitmap_w, bitmap_h);
+    draw__set_bitmap(original);
+    draw__rgba_fill_color(0.2, 0.4, 0.6, 1);
+    draw__fill_rect(xy__rect_pts(round % bitmap_w, 0, bitmap_w, bitmap_h));
+    draw__set_bitmap(NULL);
+
+    pthread_t thread;
+    Bitmap   *clones[2];
+    pthread_create(&thread, NULL, clone_original, NULL);
+    clones[0] = clone_original(NULL);
+    pthread_join(thread, (void **)&clones[1]);
+
+    BlockFile *f = original->file;
+    if (f == NULL || clones[0]->file != f || clones[1]->file != f ||
+        f->num_bitmaps != 3) {
+      is_one_file = false;
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (!has_same_pixels(original, clones[i])) is_same = false;
+      draw__delete_bitmap(clones[i]);
+    }
+    draw__delete_bitmap(original);
+  }
+  pthread_barrier_destroy(&start);
+  check(is_one_file, "both clones share the original's block file");
+  check(is_same, "both clones have the original's pixels");
+
+  if (num_failures == 0) printf("All checks passed.\n");
+  return num_failures ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+// test_text_box.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// Checks the text box layout cache in draw.c, which this file includes so
+// it can see the cached layouts. Prints each failed check and exits with
+// a nonzero status if any failed.
+//
+// Build it from this directory with this command, all on one line:
+//
+//   gcc -O2 -o test_text_box test_text_box.c now.c raster.c span.c ttf.c
+//       workers.c xy.c -lm -lpthread
+//
+// The optional argument is the font to use, by name or path; the default
+// is DejaVu Sans.
+//
+
+#include "draw.c"
+
+
+// Internal globals.
+
+static int num_failures = 0;
+
+
+// Internal functions.
+
+static void check(bit is_ok, const char *what) {
+  if (is_ok) return;
+  printf("Failed: %s\n", what);
+  num_failures++;
+}
+
+// Returns the cached layout of s in font, or NULL if there isn't one.
+static TextLayout *cached_layout(draw__Font font, const char *s) {
+  size_t len = strlen(s);
+  for (TextLayout *l = newest_layout; l; l = l->older) {
+    if (l->font == font && l->len == len && memcmp(l->text, s, len) == 0) {
+      return l;
+    }
+  }
+  return NULL;
+}
+
+// Returns true when the words and lines of a match those of a layout of the
+// same string made from scratch.
+static bit is_fresh_layout(draw__Context *c, TextLayout *a) {
+  TextLayout f = { .font = a->font, .len = a->len, .text = a->text };
+  split_words(&f, 0);
+  measure_words(c, &f, 0);
+  f.is_wrapped = a->is_wrapped;
+  f.width      = a->width;
+  wrap_lines(&f, 0);
+
+  bit is_same = (a->num_words == f.num_words && a->num_lines == f.num_lines);
+  for (int i = 0; is_same && i < f.num_words; ++i) {
+    Word *u = &a->words[i], *v = &f.words[i];
+    is_same = (u->chars_end   == v->chars_end   && u->end   == v->end   &&
+               u->space_width == v->space_width && u->width == v->width &&
+               u->ends_line   == v->ends_line);
+  }
+  for (int i = 0; is_same && i < f.num_lines; ++i) {
+    is_same = (a->lines[i] == f.lines[i]);
+  }
+  free(f.words);
+  free(f.lines);
+  return is_same;
+}
+
+// Draws each string in turn, many times over, and checks that every one of
+// them stays cached.
+static void test_alternating(draw__Context *c, const char **strs, int n,
+                             const char *what) {
+  xy__Rect rect      = xy__rect_pts(0, 0, 200, 400);
+  bit      is_cached = true;
+  for (int frame = 0; frame < 20; ++frame) {
+    for (int i = 0; i < n; ++i) {
+      draw__ctx_text_box(c, strs[i], rect, 0, draw__wrap_words);
+    }
+    for (int i = 0; i < n; ++i) {
+      if (frame > 0 && !cached_layout(c->font, strs[i])) is_cached = false;
+    }
+  }
+  check(is_cached, what);
+}
+
+
+// Main.
+
+int main(int argc, char **argv) {
+  draw__Font font = draw__new_font(argc > 1 ? argv[1] : "DejaVu Sans", 16);
+  if (font == NULL) {
+    printf("Couldn't load the font.\n");
+    return 1;
+  }
+  draw__Bitmap   bitmap = draw__new_bitmap(200, 400);
+  draw__Color    black  = draw__new_color(0, 0, 0);
+  draw__Context *c      = draw__new_context();
+  draw__ctx_set_bitmap(c, bitmap);
+  draw__ctx_set_font(c, font);
+  draw__ctx_set_font_color(c, black);
+
+  // Strings that share a prefix keep their own layouts.
+  const char *pair[] = {
+    "12:00:01 Player: the quick brown fox jumps over the lazy dog",
+    "12:00:01 Player: a different message of a similar length"
+  };
+  test_alternating(c, pair, 2, "two strings with a shared prefix");
+
+  const char *labels[] = {
+    "Player: Ada", "Player: Grace", "Player: Alan", "Player: Edsger"
+  };
+  test_alternating(c, labels, 4, "four labels with a shared prefix");
+
+  const char *nested[] = { "Player:", "Player: Ada" };
+  test_alternating(c, nested, 2, "a string and one that extends it");
+
+  // A string that extends a cached one takes over its layout.
+  char log[4096] = "";
+  pthread_mutex_lock(&layouts_mutex);
+  int num_before = num_layouts;
+  pthread_mutex_unlock(&layouts_mutex);
+  for (int i = 0; i < 50; ++i) {
+    char line[64];
+    snprintf(line, sizeof(line), "entry %d of the growing log\n", i);
+    strcat(log, line);
+    draw__ctx_text_box(c, log, xy__rect_pts(0, 0, 100, 400), 0,
+                       draw__wrap_words);
+  }
+  pthread_mutex_lock(&layouts_mutex);
+  check(num_layouts == num_before + 1, "a growing log keeps one layout");
+  pthread_mutex_unlock(&layouts_mutex);
+
+  // Layouts built from a copy of another's words match fresh ones.
+  pthread_mutex_lock(&layouts_mutex);
+  bit is_fresh = true;
+  for (TextLayout *l = newest_layout; l; l = l->older) {
+    if (!is_fresh_layout(c, l)) is_fresh = false;
+  }
+  check(is_fresh, "cached layouts match fresh ones");
+  pthread_mutex_unlock(&layouts_mutex);
+
+  draw__delete_font(font);
+  check(num_layouts == 0, "deleting a font drops its layouts");
+
+  if (num_failures == 0) printf("All checks passed.\n");
+  return num_failures ? 1 : 0;
+}
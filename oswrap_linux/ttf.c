@@ -0,0 +1,559 @@
+// ttf.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// All reads from the font data are bounds checked; out-of-range reads
+// return 0 so that a damaged file can give wrong glyphs, but can't crash.
+//
+
+#include "ttf.h"
+
+#include "raster.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define max_composite_depth 8
+#define max_search_depth    6
+#define max_key_len         256
+
+
+// Internal types.
+
+typedef struct {
+  float   x;
+  float   y;
+  uint8_t is_on_curve;
+} Pt;
+
+// The points of a glyph's contours; contour i ends at point ends[i].
+typedef struct {
+  Pt  *pts;
+  int  num_pts;
+  int  pts_cap;
+  int *ends;
+  int  num_ends;
+  int  ends_cap;
+} Outline;
+
+// A 2x2 matrix plus an offset, as used by composite glyphs.
+typedef struct {
+  float a, b, c, d;
+  float dx, dy;
+} Transform;
+
+
+// Internal functions.
+
+static uint32_t u8(ttf__Font *f, int at) {
+  return (at >= 0 && at < f->size) ? f->data[at] : 0;
+}
+
+static uint32_t u16(ttf__Font *f, int at) {
+  return u8(f, at) << 8 | u8(f, at + 1);
+}
+
+static int i16(ttf__Font *f, int at) {
+  return (int16_t)u16(f, at);
+}
+
+static uint32_t u32(ttf__Font *f, int at) {
+  return u16(f, at) << 16 | u16(f, at + 2);
+}
+
+static uint32_t tag(const char *s) {
+  return (uint32_t)s[0] << 24 | s[1] << 16 | s[2] << 8 | s[3];
+}
+
+static int find_table(ttf__Font *f, int font_start, const char *name) {
+  int num_tables = u16(f, font_start + 4);
+  for (int i = 0; i < num_tables; ++i) {
+    int record = font_start + 12 + 16 * i;
+    if (u32(f, record) == tag(name)) return u32(f, record + 8);
+  }
+  return 0;
+}
+
+// Picks a unicode subtable, preferring format 12 since it covers every
+// plane, and returns its offset or 0 if there are none.
+static int find_cmap_subtable(ttf__Font *f, int cmap) {
+  int num_records = u16(f, cmap + 2);
+  int best = 0;
+  for (int i = 0; i < num_records; ++i) {
+    int record   = cmap + 4 + 8 * i;
+    int platform = u16(f, record);
+    int encoding = u16(f, record + 2);
+    int subtable = cmap + u32(f, record + 4);
+    int format   = u16(f, subtable);
+
+    int is_unicode = platform == 0 ||
+                     (platform == 3 && (encoding == 1 || encoding == 10));
+    if (!is_unicode) continue;
+    if (format == 12) return subtable;
+    if (format == 4 && best == 0) best = subtable;
+  }
+  return best;
+}
+
+static int find_kern_pairs(ttf__Font *f, int kern, int *num_pairs) {
+  *num_pairs = 0;
+  if (kern == 0 || u16(f, kern) != 0) return 0;
+  int num_tables = u16(f, kern + 2);
+  int subtable   = kern + 4;
+  for (int i = 0; i < num_tables; ++i) {
+    int length   = u16(f, subtable + 2);
+    int coverage = u16(f, subtable + 4);
+    // Use horizontal format 0 kerning values that aren't minimums or
+    // cross-stream.
+    if ((coverage & 0xff07) == 0x0001) {
+      *num_pairs = u16(f, subtable + 6);
+      return subtable + 14;
+    }
+    subtable += length;
+  }
+  return 0;
+}
+
+static int glyph_start(ttf__Font *f, int glyph, int *end) {
+  if (glyph < 0 || glyph >= f->num_glyphs) return *end = 0;
+  int start;
+  if (f->is_long_loca) {
+    start = u32(f, f->loca + 4 * glyph);
+    *end  = u32(f, f->loca + 4 * glyph + 4);
+  } else {
+    start = u16(f, f->loca + 2 * glyph) * 2;
+    *end  = u16(f, f->loca + 2 * glyph + 2) * 2;
+  }
+  if (start >= *end) return *end = 0;
+  *end += f->glyf;
+  return f->glyf + start;
+}
+
+static void add_pt(Outline *o, float x, float y, int is_on_curve) {
+  if (o->num_pts == o->pts_cap) {
+    o->pts_cap = o->pts_cap ? 2 * o->pts_cap : 64;
+    o->pts     = realloc(o->pts, o->pts_cap * sizeof(Pt));
+  }
+  o->pts[o->num_pts++] = (Pt) { x, y, (uint8_t)is_on_curve };
+}
+
+static void end_contour(Outline *o) {
+  if (o->num_ends == o->ends_cap) {
+    o->ends_cap = o->ends_cap ? 2 * o->ends_cap : 16;
+    o->ends     = realloc(o->ends, o->ends_cap * sizeof(int));
+  }
+  o->ends[o->num_ends++] = o->num_pts - 1;
+}
+
+static void add_glyph(ttf__Font *f, int glyph, Transform *t, Outline *o,
+                      int depth);
+
+static void add_simple_glyph(ttf__Font *f, int at, int num_contours,
+                             Transform *t, Outline *o) {
+  int num_pts = 0;
+  for (int i = 0; i < num_contours; ++i) {
+    int end = u16(f, at + 10 + 2 * i) + 1;
+    if (end <= num_pts) return;  // The ends must increase.
+    num_pts = end;
+  }
+  int flags_at = at + 10 + 2 * num_contours;
+  flags_at += 2 + u16(f, flags_at);  // Skip the instructions.
+
+  // Each point has a byte of flags, with bit 3 meaning the next byte
+  // repeats the flags that many more times.
+  uint8_t *flags = malloc(num_pts);
+  for (int i = 0; i < num_pts;) {
+    uint8_t flag = u8(f, flags_at++);
+    int     n    = (flag & 8) ? u8(f, flags_at++) + 1 : 1;
+    for (; n > 0 && i < num_pts; --n) flags[i++] = flag;
+  }
+
+  // The x coordinates come next, followed by the y coordinates. Each is a
+  // byte with its sign in the flags (bit 1 or 2 is set), no change (bit 4
+  // or 5 is set), or a 16-bit delta.
+  int *xs = malloc(num_pts * sizeof(int)), *ys = malloc(num_pts * sizeof(int));
+  int  v  = 0, read_at = flags_at;
+  for (int i = 0; i < num_pts; ++i) {
+    if (flags[i] & 2) {
+      v += (flags[i] & 16) ? (int)u8(f, read_at) : -(int)u8(f, read_at);
+      read_at += 1;
+    } else if (!(flags[i] & 16)) {
+      v += i16(f, read_at);
+      read_at += 2;
+    }
+    xs[i] = v;
+  }
+  v = 0;
+  for (int i = 0; i < num_pts; ++i) {
+    if (flags[i] & 4) {
+      v += (flags[i] & 32) ? (int)u8(f, read_at) : -(int)u8(f, read_at);
+      read_at += 1;
+    } else if (!(flags[i] & 32)) {
+      v += i16(f, read_at);
+      read_at += 2;
+    }
+    ys[i] = v;
+  }
+
+  int contour = 0, contour_end = u16(f, at + 10);
+  for (int i = 0; i < num_pts; ++i) {
+    add_pt(o, t->a * xs[i] + t->c * ys[i] + t->dx,
+              t->b * xs[i] + t->d * ys[i] + t->dy, flags[i] & 1);
+    if (i == contour_end) {
+      end_contour(o);
+      contour++;
+      if (contour < num_contours) contour_end = u16(f, at + 10 + 2 * contour);
+    }
+  }
+
+  free(flags);
+  free(xs);
+  free(ys);
+}
+
+// Reads a 2.14 fixed-point number.
+static float f2dot14(ttf__Font *f, int at) {
+  return i16(f, at) / 16384.0f;
+}
+
+static void add_composite_glyph(ttf__Font *f, int at, Transform *t,
+                                Outline *o, int depth) {
+  int flags;
+  at += 10;
+  do {
+    flags     = u16(f, at);
+    int glyph = u16(f, at + 2);
+    at += 4;
+
+    // The offset of each component is either given directly, or is the
+    // difference of two points; only the former is supported.
+    float dx, dy;
+    if (flags & 1) {
+      dx = i16(f, at); dy = i16(f, at + 2); at += 4;
+    } else {
+      dx = (int8_t)u8(f, at); dy = (int8_t)u8(f, at + 1); at += 2;
+    }
+    if (!(flags & 2)) dx = dy = 0;
+
+    Transform m = { 1, 0, 0, 1, dx, dy };
+    if (flags & 8) {
+      m.a = m.d = f2dot14(f, at); at += 2;
+    } else if (flags & 0x40) {
+      m.a = f2dot14(f, at); m.d = f2dot14(f, at + 2); at += 4;
+    } else if (flags & 0x80) {
+      m.a = f2dot14(f, at);     m.b = f2dot14(f, at + 2);
+      m.c = f2dot14(f, at + 4); m.d = f2dot14(f, at + 6); at += 8;
+    }
+
+    // Apply m, then t.
+    Transform both = {
+      t->a * m.a  + t->c * m.b,  t->b * m.a  + t->d * m.b,
+      t->a * m.c  + t->c * m.d,  t->b * m.c  + t->d * m.d,
+      t->a * m.dx + t->c * m.dy + t->dx,
+      t->b * m.dx + t->d * m.dy + t->dy
+    };
+    add_glyph(f, glyph, &both, o, depth + 1);
+  } while (flags & 0x20);
+}
+
+static void add_glyph(ttf__Font *f, int glyph, Transform *t, Outline *o,
+                      int depth) {
+  if (depth > max_composite_depth) return;
+  int end, at = glyph_start(f, glyph, &end);
+  if (at == 0) return;
+  int num_contours = i16(f, at);
+  if (num_contours > 0) add_simple_glyph(f, at, num_contours, t, o);
+  if (num_contours < 0) add_composite_glyph(f, at, t, o, depth);
+}
+
+// Draws one contour. Two off-curve points in a row imply an on-curve
+// point halfway between them.
+static void draw_contour(raster__Canvas *canvas, Pt *pts, int n) {
+  if (n < 2) return;
+
+  // Find an on-curve point to start from.
+  Pt start = pts[0];
+  int first = 1;
+  if (!start.is_on_curve) {
+    if (pts[n - 1].is_on_curve) {
+      start = pts[n - 1];
+      n--;
+    } else {
+      start = (Pt) { (pts[0].x + pts[n - 1].x) / 2,
+                     (pts[0].y + pts[n - 1].y) / 2, 1 };
+    }
+    first = 0;
+  }
+
+  Pt  pen = start, ctrl = start;
+  int has_ctrl = 0;
+  for (int i = first; i <= n; ++i) {
+    Pt p = (i < n) ? pts[i] : start;
+    if (p.is_on_curve) {
+      if (has_ctrl) {
+        raster__quad(canvas, pen.x, pen.y, ctrl.x, ctrl.y, p.x, p.y);
+      } else {
+        raster__line(canvas, pen.x, pen.y, p.x, p.y);
+      }
+      pen      = p;
+      has_ctrl = 0;
+    } else {
+      if (has_ctrl) {
+        Pt mid = { (ctrl.x + p.x) / 2, (ctrl.y + p.y) / 2, 1 };
+        raster__quad(canvas, pen.x, pen.y, ctrl.x, ctrl.y, mid.x, mid.y);
+        pen = mid;
+      }
+      ctrl     = p;
+      has_ctrl = 1;
+    }
+  }
+}
+
+static int is_font_file(const char *s) {
+  const char *ext = strrchr(s, '.');
+  return ext && (strcasecmp(ext, ".ttf") == 0 || strcasecmp(ext, ".ttc") == 0);
+}
+
+// Writes the lowercase letters and digits of s, up to an optional
+// extension, into key.
+static void key_of_name(const char *s, char *key) {
+  const char *end = is_font_file(s) ? strrchr(s, '.') : s + strlen(s);
+  int n = 0;
+  for (; s < end && n < max_key_len - 1; ++s) {
+    if (isalnum((unsigned char)*s)) key[n++] = tolower((unsigned char)*s);
+  }
+  key[n] = '\0';
+}
+
+static int is_match(const char *file_name, const char *key) {
+  if (!is_font_file(file_name)) return 0;
+  char file_key[max_key_len];
+  key_of_name(file_name, file_key);
+  size_t len = strlen(key);
+  if (strncmp(file_key, key, len) != 0) return 0;
+  return file_key[len] == '\0' || strcmp(file_key + len, "regular") == 0;
+}
+
+static char *find_in_dir(const char *dir_path, const char *key, int depth) {
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) return NULL;
+
+  char *found = NULL;
+  struct dirent *entry;
+  while (found == NULL && (entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') continue;
+    char *path = malloc(strlen(dir_path) + strlen(entry->d_name) + 2);
+    sprintf(path, "%s/%s", dir_path, entry->d_name);
+    if (is_match(entry->d_name, key)) {
+      found = path;
+      break;
+    }
+    if (depth < max_search_depth) found = find_in_dir(path, key, depth + 1);
+    free(path);
+  }
+  closedir(dir);
+  return found;
+}
+
+
+// Public functions.
+
+char *ttf__find(const char *name) {
+  char key[max_key_len];
+  key_of_name(name, key);
+  if (key[0] == '\0') return NULL;
+
+  const char *home = getenv("HOME");
+  char user_dirs[2][1024] = { "", "" };
+  if (home) {
+    snprintf(user_dirs[0], sizeof(user_dirs[0]), "%s/.fonts", home);
+    snprintf(user_dirs[1], sizeof(user_dirs[1]), "%s/.local/share/fonts",
+             home);
+  }
+  const char *dirs[] = {
+    user_dirs[0], user_dirs[1], "/usr/local/share/fonts", "/usr/share/fonts"
+  };
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+    char *path = dirs[i][0] ? find_in_dir(dirs[i], key, 0) : NULL;
+    if (path) return path;
+  }
+  return NULL;
+}
+
+ttf__Font *ttf__load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Error in %s: can't open %s.\n", __FUNCTION__, path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  ttf__Font *f = calloc(1, sizeof(ttf__Font));
+  f->size = (int)size;
+  f->data = malloc(size > 0 ? size : 1);
+  size_t num_read = fread(f->data, 1, size, file);
+  fclose(file);
+  if (size <= 0 || num_read != (size_t)size) {
+    fprintf(stderr, "Error in %s: can't read %s.\n", __FUNCTION__, path);
+    ttf__free(f);
+    return NULL;
+  }
+
+  // Use the first font in a collection.
+  int font_start = 0;
+  if (u32(f, 0) == tag("ttcf")) font_start = u32(f, 12);
+
+  int head = find_table(f, font_start, "head");
+  int hhea = find_table(f, font_start, "hhea");
+  int maxp = find_table(f, font_start, "maxp");
+  int cmap = find_table(f, font_start, "cmap");
+  f->glyf  = find_table(f, font_start, "glyf");
+  f->loca  = find_table(f, font_start, "loca");
+  f->hmtx  = find_table(f, font_start, "hmtx");
+
+  if (!head || !hhea || !maxp || !cmap || !f->glyf || !f->loca || !f->hmtx) {
+    fprintf(stderr, "Error in %s: %s is not a TrueType font with glyph "
+                    "outlines.\n", __FUNCTION__, path);
+    ttf__free(f);
+    return NULL;
+  }
+
+  f->units_per_em  = u16(f, head + 18);
+  f->is_long_loca  = i16(f, head + 50) != 0;
+  f->x_min         = i16(f, head + 36);
+  f->y_min         = i16(f, head + 38);
+  f->x_max         = i16(f, head + 40);
+  f->y_max         = i16(f, head + 42);
+  f->ascent        =  i16(f, hhea + 4);
+  f->descent       = -i16(f, hhea + 6);
+  f->line_gap      =  i16(f, hhea + 8);
+  f->num_h_metrics = u16(f, hhea + 34);
+  f->num_glyphs    = u16(f, maxp + 4);
+  f->cmap_table    = find_cmap_subtable(f, cmap);
+  f->kern_pairs    = find_kern_pairs(f, find_table(f, font_start, "kern"),
+                                     &f->num_kern_pairs);
+  if (f->units_per_em == 0) f->units_per_em = 1000;
+
+  return f;
+}
+
+void ttf__free(ttf__Font *font) {
+  if (font == NULL) return;
+  free(font->data);
+  free(font);
+}
+
+int ttf__glyph_of_char(ttf__Font *f, uint32_t c) {
+  int table = f->cmap_table;
+  if (table == 0) return 0;
+
+  if (u16(f, table) == 12) {
+    // Binary search the groups of (first char, last char, first glyph).
+    int lo = 0, hi = (int)u32(f, table + 12) - 1;
+    while (lo <= hi) {
+      int      mid   = (lo + hi) / 2;
+      int      group = table + 16 + 12 * mid;
+      uint32_t first = u32(f, group), last = u32(f, group + 4);
+      if      (c < first) hi = mid - 1;
+      else if (c > last)  lo = mid + 1;
+      else return u32(f, group + 8) + (c - first);
+    }
+    return 0;
+  }
+
+  // This is format 4, which maps chars below 0x10000 in segments.
+  if (c > 0xffff) return 0;
+  int num_segs = u16(f, table + 6) / 2;
+  int ends     = table + 14;
+  int starts   = ends + 2 * num_segs + 2;
+  int deltas   = starts + 2 * num_segs;
+  int offsets  = deltas + 2 * num_segs;
+
+  int lo = 0, hi = num_segs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (u16(f, ends + 2 * mid) < c) lo = mid + 1;
+    else                             hi = mid;
+  }
+  uint32_t start = u16(f, starts + 2 * lo);
+  if (c < start || c > u16(f, ends + 2 * lo)) return 0;
+
+  int delta  = u16(f, deltas + 2 * lo);
+  int offset = u16(f, offsets + 2 * lo);
+  if (offset == 0) return (c + delta) & 0xffff;
+  int glyph = u16(f, offsets + 2 * lo + offset + 2 * (c - start));
+  return glyph ? (glyph + delta) & 0xffff : 0;
+}
+
+int ttf__advance(ttf__Font *f, int glyph) {
+  if (f->num_h_metrics == 0) return 0;
+  // Glyphs past the last metric share its advance.
+  if (glyph >= f->num_h_metrics) glyph = f->num_h_metrics - 1;
+  return u16(f, f->hmtx + 4 * glyph);
+}
+
+int ttf__kerning(ttf__Font *f, int left_glyph, int right_glyph) {
+  uint32_t key = (uint32_t)left_glyph << 16 | right_glyph;
+  int lo = 0, hi = f->num_kern_pairs - 1;
+  while (lo <= hi) {
+    int      mid  = (lo + hi) / 2;
+    int      pair = f->kern_pairs + 6 * mid;
+    uint32_t k    = u32(f, pair);
+    if      (key < k) hi = mid - 1;
+    else if (key > k) lo = mid + 1;
+    else return i16(f, pair + 4);
+  }
+  return 0;
+}
+
+uint8_t *ttf__coverage(ttf__Font *font, int glyph, float scale,
+                       ttf__Box *box) {
+  Outline   o = { 0 };
+  Transform t = { scale, 0, 0, scale, 0, 0 };
+  add_glyph(font, glyph, &t, &o, 0);
+  if (o.num_pts == 0) {
+    free(o.pts);
+    free(o.ends);
+    return NULL;
+  }
+
+  float xmin = o.pts[0].x, xmax = xmin, ymin = o.pts[0].y, ymax = ymin;
+  for (int i = 1; i < o.num_pts; ++i) {
+    xmin = fminf(xmin, o.pts[i].x); xmax = fmaxf(xmax, o.pts[i].x);
+    ymin = fminf(ymin, o.pts[i].y); ymax = fmaxf(ymax, o.pts[i].y);
+  }
+  box->left   = (int)floorf(xmin);
+  box->bottom = (int)floorf(ymin);
+  box->w      = (int)ceilf(xmax) - box->left;
+  box->h      = (int)ceilf(ymax) - box->bottom;
+  if (box->w <= 0 || box->h <= 0) {
+    free(o.pts);
+    free(o.ends);
+    return NULL;
+  }
+
+  raster__Canvas canvas;
+  raster__init(&canvas, box->w, box->h);
+  for (int i = 0; i < o.num_pts; ++i) {
+    o.pts[i].x -= box->left;
+    o.pts[i].y -= box->bottom;
+  }
+  int start = 0;
+  for (int i = 0; i < o.num_ends; ++i) {
+    draw_contour(&canvas, o.pts + start, o.ends[i] + 1 - start);
+    start = o.ends[i] + 1;
+  }
+
+  uint8_t *coverage = malloc((size_t)box->w * box->h);
+  raster__finish(&canvas, coverage, box->w, raster__nonzero);
+  raster__free(&canvas);
+  free(o.pts);
+  free(o.ends);
+  return coverage;
+}
@@ -0,0 +1,73 @@
+// ttf.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// A reader for TrueType font files.
+//
+// This finds glyphs for characters, their advances and kerning, and
+// rasterizes their outlines. Fonts with PostScript (CFF) outlines are
+// not supported.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  uint8_t *data;
+  int      size;
+
+  int      num_glyphs;
+  int      units_per_em;
+  int      ascent;        // In font units, above the baseline.
+  int      descent;       // In font units, below the baseline; usually > 0.
+  int      line_gap;
+
+  // The box around every glyph, in font units from the pen position.
+  int      x_min;
+  int      y_min;
+  int      x_max;
+  int      y_max;
+
+  // The offsets of the tables used; these are 0 for missing tables.
+  int      cmap_table;    // The chosen character-to-glyph subtable.
+  int      glyf;
+  int      loca;
+  int      hmtx;
+  int      kern_pairs;    // The first horizontal format 0 kern subtable.
+  int      num_kern_pairs;
+  int      num_h_metrics;
+  int      is_long_loca;
+} ttf__Font;
+
+// The box of a rasterized glyph, in pixels relative to the pen position on
+// the baseline. Rows go up from y = bottom.
+typedef struct {
+  int left;
+  int bottom;
+  int w;
+  int h;
+} ttf__Box;
+
+// Returns the path of an installed font file named like name, or NULL.
+// Names match file names while ignoring case, punctuation, spaces, and a
+// trailing "Regular"; so "DejaVu Sans" finds DejaVuSans.ttf. The caller
+// owns the returned string.
+char      *ttf__find(const char *name);
+
+// Loads the font file at path. Returns NULL and prints an error on failure.
+ttf__Font *ttf__load(const char *path);
+void       ttf__free(ttf__Font *font);
+
+// Returns the glyph for a unicode code point, or 0 for the missing glyph.
+int        ttf__glyph_of_char(ttf__Font *font, uint32_t c);
+
+// These are in font units.
+int        ttf__advance(ttf__Font *font, int glyph);
+int        ttf__kerning(ttf__Font *font, int left_glyph, int right_glyph);
+
+// Rasterizes a glyph at scale pixels per font unit. The returned coverage
+// bytes are box->w wide and box->h tall, from the bottom row up, and are
+// owned by the caller. This returns NULL for glyphs with no outline.
+uint8_t   *ttf__coverage(ttf__Font *font, int glyph, float scale,
+                         ttf__Box *box);
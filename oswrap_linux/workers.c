@@ -0,0 +1,122 @@
+// workers.c
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+
+#include "workers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define max_helpers 63
+
+
+// Internal globals.
+
+// Only one call to workers__run uses the pool at a time.
+static pthread_mutex_t run_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+// These guard and signal the fields of the current batch of jobs below.
+static pthread_mutex_t mutex      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  done_cond  = PTHREAD_COND_INITIALIZER;
+
+static int             num_helpers_started = 0;
+
+// The current batch. Helper threads with an id below num_helpers join each
+// batch, and the batch is over once all of them have checked back in.
+static unsigned        generation   = 0;
+static workers__Job    job_fn       = NULL;
+static void *          job_data     = NULL;
+static int             num_jobs     = 0;
+static int             next_job     = 0;  // Claimed with atomic increments.
+static int             num_helpers  = 0;
+static int             num_pending  = 0;
+
+
+// Internal functions.
+
+static void run_jobs() {
+  int i;
+  while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < num_jobs) {
+    job_fn(job_data, i);
+  }
+}
+
+static void *helper_main(void *arg) {
+  int      id   = (int)(intptr_t)arg;
+  unsigned seen = 0;
+
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    while (generation == seen) pthread_cond_wait(&start_cond, &mutex);
+    seen = generation;
+    if (id >= num_helpers) continue;
+
+    pthread_mutex_unlock(&mutex);
+    run_jobs();
+    pthread_mutex_lock(&mutex);
+
+    if (--num_pending == 0) pthread_cond_signal(&done_cond);
+  }
+  return NULL;
+}
+
+// This expects the caller to hold mutex.
+static void start_helpers(int n) {
+  while (num_helpers_started < n) {
+    pthread_t thread;
+    void *id = (void *)(intptr_t)num_helpers_started;
+    if (pthread_create(&thread, NULL, helper_main, id) != 0) {
+      fprintf(stderr, "Error in %s: pthread_create failed.\n", __FUNCTION__);
+      return;
+    }
+    pthread_detach(thread);
+    num_helpers_started++;
+  }
+}
+
+
+// Public functions.
+
+void workers__run(int n, workers__Job job, void *data, int num_threads) {
+  int helpers = num_threads - 1;
+  if (helpers > n - 1)       helpers = n - 1;
+  if (helpers > max_helpers) helpers = max_helpers;
+
+  if (helpers <= 0) {
+    for (int i = 0; i < n; ++i) job(data, i);
+    return;
+  }
+
+  pthread_mutex_lock(&run_mutex);
+  pthread_mutex_lock(&mutex);
+
+  start_helpers(helpers);
+  if (helpers > num_helpers_started) helpers = num_helpers_started;
+
+  job_fn      = job;
+  job_data    = data;
+  num_jobs    = n;
+  next_job    = 0;
+  num_helpers = helpers;
+  num_pending = helpers;
+  generation++;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&mutex);
+
+  run_jobs();
+
+  pthread_mutex_lock(&mutex);
+  while (num_pending > 0) pthread_cond_wait(&done_cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_mutex_unlock(&run_mutex);
+}
+
+int workers__num_cores() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int)n : 1;
+}
@@ -0,0 +1,20 @@
+// workers.h
+//
+// https://github.com/tylerneylon/oswrap in oswrap_linux
+//
+// A pool of threads for running independent jobs in parallel.
+//
+
+#pragma once
+
+typedef void (*workers__Job)(void *data, int index);
+
+// Calls job(data, i) for each i in [0, num_jobs) using up to num_threads
+// threads, including the calling thread, and returns once every job is done.
+// Jobs run in no particular order. Pool threads are started as needed and
+// then reused by later calls. Calls from different threads take turns; a job
+// must not call workers__run itself.
+void workers__run(int num_jobs, workers__Job job, void *data, int num_threads);
+
+// Returns the number of cpu cores available to this process.
+int  workers__num_cores();
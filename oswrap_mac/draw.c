@@ -7,65 +7,1912 @@
 
 #include "cbit.h"
 
+#include <Accelerate/Accelerate.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
 
-// Internal globals.
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define max_look_back        16
+#define default_cache_budget (1 << 20)
+#define min_cache_buckets    64
+#define max_dirty_rects      8
+#define default_pool_budget  (32 << 20)
+#define num_size_classes     65  // One for each bit length of a size_t.
+#define min_threaded_mip     (256 * 256)
+#define max_blur_radius      8192
+#define max_text_layouts     32
+#define max_bitmap_width     (INT_MAX / 4)  // So the stride fits in an int.
+
+// A rough size in bytes of a CTLine beyond the cache entry itself.
+#define line_cost(num_glyphs) (256 + 48 * (num_glyphs))
+
+
+// Internal types and globals.
+
+// A recorded drawing command. Each command keeps the color that was set
+// when it was recorded, so replaying a list only changes colors between
+// runs of differently-colored commands.
+
+enum {
+  cmd_fill_rect,
+  cmd_stroke_rect,
+  cmd_line  // The rect holds the line's endpoints as (xmin, ymin, xmax, ymax).
+};
+
+typedef struct {
+  int      op;
+  float    rgba[4];
+  xy__Rect rect;
+} Cmd;
+
+struct draw__ListStruct {
+  Cmd  *cmds;
+  int   num_cmds;
+  int   cmds_cap;
+
+  // The colors that were set when recording ended.
+  float fill_rgba[4];
+  float stroke_rgba[4];
+};
+
+// The parts of a bitmap changed by draw calls since it was last cleared,
+// as whole-pixel rects; see draw__get_dirty_rects.
+typedef struct {
+  xy__Rect rects[max_dirty_rects + 1];  // There's room to add one more.
+  int      num_rects;
+} Dirty;
+
+// Core graphics contexts have no room for extra data, so the dirty rects
+// of each bitmap are kept in this list.
+typedef struct BitmapInfo {
+  draw__Bitmap       bitmap;
+  Dirty              dirty;
+  bit                is_borrowed;  // True when the caller owns the pixels.
+  bit                is_vm;        // True when vm_allocate made the pixels.
+  struct BitmapInfo *next;
+
+  // Views share the pixels of their parent from (x0, y0) on; see
+  // draw__new_bitmap_view. A parent is never itself a view.
+  struct BitmapInfo *parent;
+  int                x0;
+  int                y0;
+
+  // The colors last set in the bitmap; core graphics starts with black.
+  float              fill_rgba[4];
+  float              stroke_rgba[4];
+} BitmapInfo;
+
+static BitmapInfo *bitmap_infos = NULL;
+
+// This guards bitmap_infos and the pool, which all contexts share.
+static pthread_mutex_t bitmaps_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Deleted bitmaps kept for reuse, linked through their info. The list
+// pool[i] holds the bitmaps whose byte counts are i bits long, most
+// recently deleted first.
+static BitmapInfo     *pool[num_size_classes];
+static draw__PoolStats pool_stats = { 0, 0, 0, 0, 0, default_pool_budget };
+
+// A shaped line in the draw__string cache. Entries are found by hashing
+// their key, which is the font, the color, and the string's bytes.
+// They're also kept in a list from most to least recently used.
+
+typedef struct LineEntry {
+  struct LineEntry *next_in_bucket;
+  struct LineEntry *newer;
+  struct LineEntry *older;
+
+  draw__Font   font;
+  draw__Color  color;
+  size_t       hash;
+  size_t       cost;  // The approximate bytes used by this entry.
+
+  CTLineRef    line;
+  double       width;
+  CGFloat      ascent;
+  CGFloat      descent;
+  CGRect       image_bounds;      // Relative to the text position.
+  bit          has_image_bounds;
+
+  size_t       len;
+  char         s[];   // The string, including its null terminator.
+} LineEntry;
+
+static LineEntry     **line_buckets    = NULL;
+static size_t          num_buckets     = 0;
+static LineEntry      *newest_line     = NULL;
+static LineEntry      *oldest_line     = NULL;
+static draw__CacheStats cache_stats    = { 0, 0, 0, 0, 0, default_cache_budget };
+
+// This guards the string cache. Cache entries are only used while it's
+// held, since another thread may trim them once it's released.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A text box's string is split into words, each a run of non-space bytes
+// and the spaces after it. A newline ends the word before it and breaks the
+// line there. Words keep their widths, so wrapping them to a new width
+// doesn't measure any text.
+typedef struct {
+  size_t    chars_end;    // The byte after the word's last non-space byte.
+  size_t    end;          // The byte after its spaces and newline.
+  xy__Float width;        // The width of its non-space bytes.
+  xy__Float space_width;  // The width of its spaces.
+  bit       ends_line;    // True when it ends with a newline.
+} Word;
+
+// The words and lines of a string drawn by draw__text_box in one font.
+// Line i is the words from lines[i] up to lines[i + 1], or up to the end
+// for the last line. Layouts are kept in a list from most to least
+// recently used.
+typedef struct TextLayout {
+  struct TextLayout *newer;
+  struct TextLayout *older;
+
+  draw__Font font;
+  uint64_t   hash;
+  char      *text;
+  size_t     len;
+
+  Word      *words;
+  int        num_words;
+  int        words_cap;
+
+  int       *lines;
+  int        num_lines;
+  int        lines_cap;
+  bit        is_wrapped;  // True when the lines are wrapped to width.
+  xy__Float  width;
+} TextLayout;
+
+// Text box layouts are shared by every thread, so they're only used while
+// holding layouts_mutex.
+static TextLayout     *newest_layout = NULL;
+static TextLayout     *oldest_layout = NULL;
+static int             num_layouts   = 0;
+static pthread_mutex_t layouts_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static CGColorSpaceRef generic_rgb_colorspace = NULL;
-static draw__Bitmap    ctx                    = NULL;
-static draw__Font      font                   = NULL;
-static draw__Color     font_color             = NULL;
 
+// Core graphics starts each bitmap with opaque black fill and stroke colors.
+static const float opaque_black[4] = { 0, 0, 0, 1 };
+
+struct draw__ContextStruct {
+  draw__Bitmap bitmap;
+  BitmapInfo  *info;         // The bitmap's.
+  draw__Font   font;
+  draw__Color  font_color;
+
+  // The most recently set colors, which are set in the bitmap when they're
+  // next used; core graphics defaults to black.
+  float        fill_rgba[4];
+  float        stroke_rgba[4];
+
+  // When this is non-NULL, shapes and lines are added to it instead of drawn.
+  draw__List   recording_list;
+
+  // Reusable space for passing runs of commands to core graphics.
+  CGRect      *scratch_rects;
+  CGPoint     *scratch_pts;
+  int          scratch_cap;
+
+  // Each clip rect has whole-pixel edges and is within the clip below it,
+  // so the top one is where drawing may happen. Core graphics is only
+  // clipped around the commands that cross its edge.
+  xy__Rect    *clips;
+  int          num_clips;
+  int          clips_cap;
+};
+
+static draw__Context default_context = {
+  .fill_rgba   = { 0, 0, 0, 1 },
+  .stroke_rgba = { 0, 0, 0, 1 }
+};
+
+// An atlas packs regions into its bitmap using a skyline, which is the top
+// edge of the packed regions as segments from left to right. The segments
+// span the bitmap's width, and each region is placed where its top is
+// lowest.
+
+typedef struct {
+  int x;
+  int y;  // The lowest row that's free above the segment.
+  int w;
+} Segment;
+
+struct draw__AtlasStruct {
+  draw__Bitmap  bitmap;
+  int           w;
+  int           h;
+
+  Segment      *segments;  // There's room for w, as each is at least 1 wide.
+  int           num_segments;
+
+  draw__Bitmap *views;
+  int           num_views;
+  int           views_cap;
+};
+
+
+// A tiled bitmap keeps its tiles in rows, and a row's array of tiles is
+// only made once one of its tiles is. Missing tiles are NULL.
+struct draw__TiledBitmapStruct {
+  int            w;
+  int            h;
+  int            tiles_x;
+  int            tiles_y;
+  draw__Bitmap **rows;
+};
+
+// A command of a list that touches tile (tx, ty).
+typedef struct {
+  int tx;
+  int ty;
+  int cmd;
+} TileHit;
+
+
+// Internal functions.
+
+static void init() {
+  generic_rgb_colorspace = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGB);
+  if (generic_rgb_colorspace == NULL) {
+    fprintf(stderr, "Error allocating generic rgb color space.\n");
+  }
+}
+
+static void init_if_needed() {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init);
+}
+
+#define cg_rect_from_xy(rect) \
+  ((CGRect) { { rect.xmin, rect.ymin }, { xy__width(rect), xy__height(rect) } })
+
+static void set_rgba(float *rgba, double r, double g, double b, double a) {
+  rgba[0] = r;
+  rgba[1] = g;
+  rgba[2] = b;
+  rgba[3] = a;
+}
+
+// The alpha byte is ignored, as packed colors are always opaque here.
+static void set_rgba32(float *rgba, draw__Rgba32 color) {
+  rgba[0] = (color >> 24)          / 255.0f;
+  rgba[1] = ((color >> 16) & 0xff) / 255.0f;
+  rgba[2] = ((color >>  8) & 0xff) / 255.0f;
+  rgba[3] = 1.0f;
+}
+
+static bit same_rgba(const float *a, const float *b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+static void add_cmd(draw__Context *c, int op, const float *rgba,
+                    xy__Rect rect) {
+  draw__List list = c->recording_list;
+  if (list->num_cmds == list->cmds_cap) {
+    list->cmds_cap = list->cmds_cap ? 2 * list->cmds_cap : 64;
+    list->cmds     = realloc(list->cmds, list->cmds_cap * sizeof(Cmd));
+  }
+  Cmd *cmd  = &list->cmds[list->num_cmds++];
+  cmd->op   = op;
+  cmd->rect = rect;
+  memcpy(cmd->rgba, rgba, sizeof(cmd->rgba));
+}
+
+// Fills use the fill color and everything else uses the stroke color, so
+// two commands can share a color setting when this returns true.
+static bit same_color_state(Cmd *a, Cmd *b) {
+  return (a->op == cmd_fill_rect) == (b->op == cmd_fill_rect) &&
+         same_rgba(a->rgba, b->rgba);
+}
+
+// Pads r by a pixel to allow for the stroke width and antialiasing.
+static xy__Rect padded(xy__Rect r) {
+  return xy__rect_pts(fmin(r.xmin, r.xmax) - 1, fmin(r.ymin, r.ymax) - 1,
+                      fmax(r.xmin, r.xmax) + 1, fmax(r.ymin, r.ymax) + 1);
+}
+
+// Returns a rect containing every pixel the command may touch.
+static xy__Rect cmd_bounds(Cmd *cmd) {
+  return padded(cmd->rect);
+}
+
+// Returns the overlap of two rects with min <= max on each axis. An empty
+// overlap keeps min <= max so that it isn't read as a flipped rect.
+static xy__Rect intersection_of(xy__Rect a, xy__Rect b) {
+  xy__Rect r = xy__rect_pts(fmax(a.xmin, b.xmin), fmax(a.ymin, b.ymin),
+                            fmin(a.xmax, b.xmax), fmin(a.ymax, b.ymax));
+  if (r.xmax < r.xmin) r.xmax = r.xmin;
+  if (r.ymax < r.ymin) r.ymax = r.ymin;
+  return r;
+}
+
+static bit is_empty(xy__Rect r) {
+  return !(r.xmin < r.xmax && r.ymin < r.ymax);
+}
+
+// Returns the part of r inside the context's bitmap and clip, with
+// min <= max. It's empty when r misses them, and such commands are skipped
+// before reaching core graphics.
+static xy__Rect clipped(draw__Context *c, xy__Rect r) {
+  xy__Rect all = xy__rect_pts(0, 0, CGBitmapContextGetWidth (c->bitmap),
+                                    CGBitmapContextGetHeight(c->bitmap));
+  r = xy__rect_pts(fmin(r.xmin, r.xmax), fmin(r.ymin, r.ymax),
+                   fmax(r.xmin, r.xmax), fmax(r.ymin, r.ymax));
+  r = intersection_of(r, all);
+  if (c->num_clips) r = intersection_of(r, c->clips[c->num_clips - 1]);
+  return r;
+}
+
+// Returns true when r, with min <= max, extends past the context's clip.
+static bit crosses_clip(draw__Context *c, xy__Rect r) {
+  if (c->num_clips == 0) return false;
+  xy__Rect clip = c->clips[c->num_clips - 1];
+  return r.xmin < clip.xmin || r.ymin < clip.ymin ||
+         r.xmax > clip.xmax || r.ymax > clip.ymax;
+}
+
+// Clips core graphics to the context's clip after saving its state, which
+// the caller restores. Colors are set before this, as restoring the state
+// would undo them.
+static void begin_clip(draw__Context *c) {
+  CGContextSaveGState(c->bitmap);
+  CGContextClipToRect(c->bitmap,
+                      cg_rect_from_xy(c->clips[c->num_clips - 1]));
+}
+
+static bit rects_overlap(xy__Rect a, xy__Rect b) {
+  return (a.xmin < b.xmax && b.xmin < a.xmax &&
+          a.ymin < b.ymax && b.ymin < a.ymax);
+}
+
+// Reorders the commands of a finished list so that commands sharing a color
+// setting run together. A command is only moved ahead of commands it
+// doesn't overlap, so the drawn result is unchanged.
+static void sort_cmds(draw__List list) {
+  typedef struct {
+    Cmd     *first;
+    xy__Rect bounds;
+    int      head;
+    int      tail;
+  } Batch;
+
+  int    n           = list->num_cmds;
+  Batch *batches     = malloc(n * sizeof(Batch));
+  int   *next        = malloc(n * sizeof(int));
+  int    num_batches = 0;
+
+  for (int i = 0; i < n; ++i) {
+    Cmd     *cmd    = &list->cmds[i];
+    xy__Rect bounds = cmd_bounds(cmd);
+    Batch   *batch  = NULL;
+
+    // Look for a recent batch with the same color that cmd can join without
+    // passing over anything it overlaps.
+    for (int j = num_batches - 1; j >= 0 && j >= num_batches - max_look_back;
+         --j) {
+      if (same_color_state(batches[j].first, cmd)) {
+        batch = &batches[j];
+        break;
+      }
+      if (rects_overlap(batches[j].bounds, bounds)) break;
+    }
+
+    next[i] = -1;
+    if (batch == NULL) {
+      batch         = &batches[num_batches++];
+      batch->first  = cmd;
+      batch->bounds = bounds;
+      batch->head   = i;
+    } else {
+      next[batch->tail] = i;
+      xy__Rect *b = &batch->bounds;
+      *b = xy__rect_pts(fmin(b->xmin, bounds.xmin), fmin(b->ymin, bounds.ymin),
+                        fmax(b->xmax, bounds.xmax), fmax(b->ymax, bounds.ymax));
+    }
+    batch->tail = i;
+  }
+
+  Cmd *sorted = malloc(list->cmds_cap * sizeof(Cmd));
+  int  k      = 0;
+  for (int j = 0; j < num_batches; ++j) {
+    for (int i = batches[j].head; i != -1; i = next[i]) {
+      sorted[k++] = list->cmds[i];
+    }
+  }
+
+  free(list->cmds);
+  free(batches);
+  free(next);
+  list->cmds = sorted;
+}
+
+// The string cache.
+
+// This is the 64-bit FNV-1a hash, with the font and color mixed in.
+static size_t hash_line_key(draw__Font font, draw__Color color,
+                            const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ULL;
+  h = (h ^ (uintptr_t)font)  * 1099511628211ULL;
+  h = (h ^ (uintptr_t)color) * 1099511628211ULL;
+  return (size_t)h;
+}
+
+static LineEntry **bucket_of(size_t hash) {
+  return &line_buckets[hash & (num_buckets - 1)];
+}
+
+static void unlink_from_lru(LineEntry *entry) {
+  if (entry->newer) entry->newer->older = entry->older;
+  else              newest_line         = entry->older;
+  if (entry->older) entry->older->newer = entry->newer;
+  else              oldest_line         = entry->newer;
+}
+
+static void push_newest(LineEntry *entry) {
+  entry->newer = NULL;
+  entry->older = newest_line;
+  if (newest_line) newest_line->newer = entry;
+  newest_line = entry;
+  if (oldest_line == NULL) oldest_line = entry;
+}
+
+static void remove_line(LineEntry *entry) {
+  LineEntry **link = bucket_of(entry->hash);
+  while (*link != entry) link = &(*link)->next_in_bucket;
+  *link = entry->next_in_bucket;
+  unlink_from_lru(entry);
+
+  cache_stats.num_entries--;
+  cache_stats.bytes_used -= entry->cost;
+  CFRelease(entry->line);
+  free(entry);
+}
+
+// Evicts the least recently used lines until the cache fits its budget.
+static void trim_cache() {
+  while (oldest_line && cache_stats.bytes_used > cache_stats.budget) {
+    remove_line(oldest_line);
+    cache_stats.evictions++;
+  }
+}
+
+// Keeps the number of buckets a power of two at least as big as the number
+// of entries.
+static void grow_buckets_if_needed() {
+  if (cache_stats.num_entries < num_buckets) return;
+
+  size_t      old_num_buckets = num_buckets;
+  LineEntry **old_buckets     = line_buckets;
+  num_buckets  = num_buckets ? 2 * num_buckets : min_cache_buckets;
+  line_buckets = calloc(num_buckets, sizeof(LineEntry *));
+
+  for (size_t i = 0; i < old_num_buckets; ++i) {
+    for (LineEntry *entry = old_buckets[i], *next; entry; entry = next) {
+      next = entry->next_in_bucket;
+      LineEntry **bucket    = bucket_of(entry->hash);
+      entry->next_in_bucket = *bucket;
+      *bucket               = entry;
+    }
+  }
+  free(old_buckets);
+}
+
+static CTLineRef new_line(draw__Font font, draw__Color font_color,
+                          const char *s) {
+  CFStringRef string = CFStringCreateWithCString(kCFAllocatorDefault, s,
+                                                 kCFStringEncodingUTF8);
+  if (string == NULL) return NULL;  // The string isn't valid UTF-8.
+
+  CFStringRef keys[] = { kCTFontAttributeName,
+                         kCTForegroundColorAttributeName };
+  CFTypeRef values[] = { font, font_color };
+
+  // Lines that are only measured may have no color.
+  CFIndex num_keys = font_color ? 2 : 1;
+
+  CFDictionaryRef attributes =
+  CFDictionaryCreate(kCFAllocatorDefault, (const void**)&keys,
+                     (const void**)&values, num_keys,
+                     &kCFTypeDictionaryKeyCallBacks,
+                     &kCFTypeDictionaryValueCallBacks);
+
+  CFAttributedStringRef attrString =
+      CFAttributedStringCreate(kCFAllocatorDefault, string, attributes);
+  CFRelease(string);
+  CFRelease(attributes);
+
+  CTLineRef line = CTLineCreateWithAttributedString(attrString);
+  CFRelease(attrString);
+
+  return line;
+}
+
+// Returns the cache entry for s with the given font and color, shaping
+// the line if needed. The entry is the most recently used one, so it stays
+// valid until the next call to trim_cache. The caller holds cache_mutex.
+static LineEntry *shaped_line(draw__Font font, draw__Color font_color,
+                              const char *s) {
+  size_t len  = strlen(s);
+  size_t hash = hash_line_key(font, font_color, s, len);
+
+  if (num_buckets) {
+    for (LineEntry *entry = *bucket_of(hash); entry;
+         entry = entry->next_in_bucket) {
+      if (entry->hash  == hash && entry->font == font &&
+          entry->color == font_color && entry->len == len &&
+          memcmp(entry->s, s, len) == 0) {
+        cache_stats.hits++;
+        unlink_from_lru(entry);
+        push_newest(entry);
+        return entry;
+      }
+    }
+  }
+  cache_stats.misses++;
+
+  LineEntry *entry = malloc(sizeof(LineEntry) + len + 1);
+  entry->font  = font;
+  entry->color = font_color;
+  entry->hash  = hash;
+  entry->len   = len;
+  memcpy(entry->s, s, len + 1);
+
+  entry->line  = new_line(font, font_color, s);
+  entry->width = CTLineGetTypographicBounds(entry->line, &entry->ascent,
+                                            &entry->descent, NULL);
+  entry->has_image_bounds = false;
+  entry->cost  = sizeof(LineEntry) + len + 1 +
+                 line_cost(CTLineGetGlyphCount(entry->line));
+
+  grow_buckets_if_needed();
+  LineEntry **bucket    = bucket_of(hash);
+  entry->next_in_bucket = *bucket;
+  *bucket               = entry;
+  push_newest(entry);
+  cache_stats.num_entries++;
+  cache_stats.bytes_used += entry->cost;
+
+  return entry;
+}
+
+// Drops cached lines that use the given font or color, since either may
+// be deleted and its address reused.
+static void remove_lines_using(draw__Font old_font, draw__Color old_color) {
+  for (LineEntry *entry = oldest_line, *newer; entry; entry = newer) {
+    newer = entry->newer;
+    if ((old_font  && entry->font  == old_font) ||
+        (old_color && entry->color == old_color)) {
+      remove_line(entry);
+    }
+  }
+}
+
+static xy__Float area_of(xy__Rect r) {
+  return (r.xmax - r.xmin) * (r.ymax - r.ymin);
+}
+
+static xy__Rect union_of(xy__Rect a, xy__Rect b) {
+  return xy__rect_pts(fmin(a.xmin, b.xmin), fmin(a.ymin, b.ymin),
+                      fmax(a.xmax, b.xmax), fmax(a.ymax, b.ymax));
+}
+
+// Adds r to the dirty rects. To keep the list short, any two rects whose
+// union is no bigger than their areas together are merged, which joins
+// rects that overlap or line up. Past max_dirty_rects, the pair whose
+// union adds the least area is merged.
+static void add_dirty(Dirty *d, xy__Rect r) {
+  if (!(r.xmin < r.xmax && r.ymin < r.ymax)) return;
+  for (int i = 0; i < d->num_rects; ++i) {
+    if (area_of(union_of(d->rects[i], r)) == area_of(d->rects[i])) return;
+  }
+  d->rects[d->num_rects++] = r;
+
+  while (d->num_rects > 1) {
+    int       best_i = 0, best_j = 1;
+    xy__Float best_cost = INFINITY;
+    for (int i = 0; i < d->num_rects; ++i) {
+      for (int j = i + 1; j < d->num_rects; ++j) {
+        xy__Rect *a = &d->rects[i], *b = &d->rects[j];
+        xy__Float cost = area_of(union_of(*a, *b)) - area_of(*a) -
+                         area_of(*b);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_i    = i;
+          best_j    = j;
+        }
+      }
+    }
+    if (best_cost > 0 && d->num_rects <= max_dirty_rects) break;
+    d->rects[best_i] = union_of(d->rects[best_i], d->rects[best_j]);
+    d->rects[best_j] = d->rects[--d->num_rects];
+  }
+}
+
+// Adds the whole pixels that r touches, clipped to a w x h bitmap, and
+// returns them.
+static xy__Rect mark_dirty(Dirty *d, int w, int h, xy__Rect r) {
+  xy__Rect pixels;
+  pixels.xmin = fmax(floor(fmin(r.xmin, r.xmax)), 0);
+  pixels.ymin = fmax(floor(fmin(r.ymin, r.ymax)), 0);
+  pixels.xmax = fmin(ceil (fmax(r.xmin, r.xmax)), w);
+  pixels.ymax = fmin(ceil (fmax(r.ymin, r.ymax)), h);
+  add_dirty(d, pixels);
+  return pixels;
+}
+
+// The bitmap pool.
+
+static size_t bytes_of(draw__Bitmap bitmap) {
+  return CGBitmapContextGetBytesPerRow(bitmap) *
+         CGBitmapContextGetHeight(bitmap);
+}
+
+static int size_class(size_t bytes) {
+  int c = 0;
+  for (; bytes; bytes >>= 1) ++c;
+  return c;
+}
+
+static void free_bitmap(BitmapInfo *info) {
+  void   *pixels = CGBitmapContextGetData(info->bitmap);
+  size_t  bytes  = bytes_of(info->bitmap);
+  CGContextRelease(info->bitmap);
+  if (info->is_vm) {
+    vm_deallocate(mach_task_self(), (vm_address_t)pixels, round_page(bytes));
+  }
+  free(info);
+}
+
+// Frees pooled bitmaps, largest first, until the pool holds at most
+// max_bytes. Within a size class, the least recently deleted go first.
+static void trim_pool(size_t max_bytes) {
+  for (int c = num_size_classes - 1; c >= 0; --c) {
+    while (pool[c] && pool_stats.resident_bytes > max_bytes) {
+      BitmapInfo **link = &pool[c];
+      while ((*link)->next) link = &(*link)->next;
+      BitmapInfo *info = *link;
+      *link = NULL;
+      pool_stats.num_bitmaps--;
+      pool_stats.resident_bytes -= bytes_of(info->bitmap);
+      pool_stats.evictions++;
+      free_bitmap(info);
+    }
+  }
+}
+
+// Keeps the bitmap for reuse if it fits in the pool's budget, and frees it
+// otherwise.
+static void pool_bitmap(BitmapInfo *info) {
+  size_t bytes = bytes_of(info->bitmap);
+  if (info->is_borrowed || bytes > pool_stats.budget) {
+    free_bitmap(info);
+    return;
+  }
+  trim_pool(pool_stats.budget - bytes);
+  int c = size_class(bytes);
+  info->next = pool[c];
+  pool[c]    = info;
+  pool_stats.num_bitmaps++;
+  pool_stats.resident_bytes += bytes;
+}
+
+// Takes a w x h bitmap out of the pool, or returns NULL if there isn't one.
+static BitmapInfo *pooled_bitmap(int w, int h) {
+  size_t bytes = (size_t)w * 4 * h;
+  BitmapInfo **link = &pool[size_class(bytes)];
+  for (; *link; link = &(*link)->next) {
+    BitmapInfo *info = *link;
+    if ((int)CGBitmapContextGetWidth (info->bitmap) != w ||
+        (int)CGBitmapContextGetHeight(info->bitmap) != h) continue;
+    *link = info->next;
+    pool_stats.num_bitmaps--;
+    pool_stats.resident_bytes -= bytes;
+    return info;
+  }
+  return NULL;
+}
+
+// Makes a bitmap context over pixels, which core graphics allocates when
+// pixels is NULL, and adds its info to bitmap_infos.
+static BitmapInfo *new_bitmap_info(int w, int h, int stride, void *pixels) {
+  CGBitmapInfo bitmap_info = (CGBitmapInfo)kCGImageAlphaPremultipliedLast;
+  draw__Bitmap bitmap = CGBitmapContextCreate(pixels,
+                                              w,
+                                              h,
+                                              8,      // bits per component
+                                              stride,
+                                              generic_rgb_colorspace,
+                                              bitmap_info);  // premult. alpha
+  if (bitmap == NULL) {
+    fprintf(stderr, "Error in %s: CGBitmapContextCreate failed for a %dx%d "
+                    "bitmap.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+
+  // Make (0, 0) correspond to the lower-left corner.
+  CGContextTranslateCTM(bitmap, 0, h);
+  CGContextScaleCTM(bitmap, 1.0, -1.0);
+  // Pooled bitmaps go back to this state when they're reused.
+  CGContextSaveGState(bitmap);
+
+  BitmapInfo *info = calloc(1, sizeof(BitmapInfo));
+  info->bitmap = bitmap;
+  info->next   = bitmap_infos;
+  bitmap_infos = info;
+  memcpy(info->fill_rgba,   opaque_black, sizeof(info->fill_rgba));
+  memcpy(info->stroke_rgba, opaque_black, sizeof(info->stroke_rgba));
+  return info;
+}
+
+static BitmapInfo *info_of(draw__Bitmap bitmap) {
+  BitmapInfo *info = bitmap_infos;
+  while (info && info->bitmap != bitmap) info = info->next;
+  return info;
+}
+
+static Dirty *dirty_of(draw__Bitmap bitmap) {
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *info = info_of(bitmap);
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return info ? &info->dirty : NULL;
+}
+
+// Adds r to the dirty rects of the context's bitmap, and of its parent
+// when it's a view.
+static void mark(draw__Context *c, xy__Rect r) {
+  BitmapInfo *info = c->info;
+  if (info == NULL) return;
+  xy__Rect pixels = mark_dirty(&info->dirty,
+                               (int)CGBitmapContextGetWidth(c->bitmap),
+                               (int)CGBitmapContextGetHeight(c->bitmap), r);
+  if (info->parent) {
+    add_dirty(&info->parent->dirty,
+              xy__rect_pts(pixels.xmin + info->x0, pixels.ymin + info->y0,
+                           pixels.xmax + info->x0, pixels.ymax + info->y0));
+  }
+}
+
+// Sets the context's colors in its bitmap when the bitmap has different
+// ones, which saves core graphics calls when the colors are set repeatedly.
+// Bitmaps without an info always have their colors set.
+
+static void use_fill_color(draw__Context *c) {
+  BitmapInfo *info = c->info;
+  if (info && same_rgba(info->fill_rgba, c->fill_rgba)) return;
+  float *f = c->fill_rgba;
+  CGContextSetRGBFillColor(c->bitmap, f[0], f[1], f[2], f[3]);
+  if (info) memcpy(info->fill_rgba, f, sizeof(info->fill_rgba));
+}
+
+static void use_stroke_color(draw__Context *c) {
+  BitmapInfo *info = c->info;
+  if (info && same_rgba(info->stroke_rgba, c->stroke_rgba)) return;
+  float *s = c->stroke_rgba;
+  CGContextSetRGBStrokeColor(c->bitmap, s[0], s[1], s[2], s[3]);
+  if (info) memcpy(info->stroke_rgba, s, sizeof(info->stroke_rgba));
+}
+
+static void reserve_scratch(draw__Context *c, int n) {
+  if (n <= c->scratch_cap) return;
+  c->scratch_cap   = n;
+  c->scratch_rects = realloc(c->scratch_rects, n * sizeof(CGRect));
+  c->scratch_pts   = realloc(c->scratch_pts, 2 * n * sizeof(CGPoint));
+}
+
+// Draws n commands that all have the same op and color with a single
+// core graphics call, leaving out those outside the clip. Filled rects are
+// cut to the clip, and core graphics is clipped if any other command
+// crosses its edge.
+static void draw_run(draw__Context *c, Cmd *cmds, int n) {
+  draw__Bitmap ctx        = c->bitmap;
+  bit          is_fill    = (cmds[0].op == cmd_fill_rect);
+  bit          needs_clip = false;
+  int          num_drawn  = 0;
+  reserve_scratch(c, n);
+  for (int i = 0; i < n; ++i) {
+    xy__Rect r       = cmds[i].rect;
+    xy__Rect bounds  = is_fill ? r : padded(r);
+    xy__Rect visible = clipped(c, bounds);
+    if (is_empty(visible)) continue;
+    if (is_fill) r = visible;
+    else if (crosses_clip(c, bounds)) needs_clip = true;
+    mark(c, visible);
+    int j = num_drawn++;
+    c->scratch_rects[j]       = cg_rect_from_xy(r);
+    c->scratch_pts[2 * j]     = CGPointMake(r.xmin, r.ymin);
+    c->scratch_pts[2 * j + 1] = CGPointMake(r.xmax, r.ymax);
+  }
+  if (num_drawn == 0) return;
+  n = num_drawn;
+
+  if (needs_clip) begin_clip(c);
+  switch (cmds[0].op) {
+    case cmd_fill_rect:
+      CGContextFillRects(ctx, c->scratch_rects, n);
+      break;
+    case cmd_stroke_rect:
+      CGContextBeginPath (ctx);
+      CGContextAddRects  (ctx, c->scratch_rects, n);
+      CGContextStrokePath(ctx);
+      break;
+    case cmd_line:
+      CGContextStrokeLineSegments(ctx, c->scratch_pts, 2 * n);
+      break;
+  }
+  if (needs_clip) CGContextRestoreGState(ctx);
+}
+
+// Mipmaps.
+
+typedef struct {
+  draw__Bitmap src;
+  draw__Bitmap dst;
+  bit          is_linear;  // Colors are averaged in linear light when set.
+} MipJob;
+
+// Averages the 2x2 blocks of the rows src0 and src1 into the n pixels of
+// dst. Colors are averaged as squares, and are clamped to their alpha so
+// that they stay premultiplied.
+static void downsample(uint8_t *dst, const uint8_t *src0,
+                       const uint8_t *src1, int n) {
+  for (int i = 0; i < n; ++i, dst += 4, src0 += 8, src1 += 8) {
+    const uint8_t *p[4] = { src0, src0 + 4, src1, src1 + 4 };
+    int      a     = 3;  // The alpha byte.
+    uint32_t alpha = (p[0][a] + p[1][a] + p[2][a] + p[3][a] + 2) >> 2;
+    for (int j = 0; j < 3; ++j) {
+      uint32_t sum = p[0][j] * p[0][j] + p[1][j] * p[1][j] +
+                     p[2][j] * p[2][j] + p[3][j] * p[3][j];
+      uint32_t c   = (uint32_t)(sqrtf(sum * 0.25f) + 0.5f);
+      dst[j] = c > alpha ? alpha : c;
+    }
+    dst[a] = alpha;
+  }
+}
+
+// Linear mipmaps average colors in linear light, weighted by alpha, using
+// tables for the exact sRGB curve. The rounding matches the linux
+// rasterizer's, so each platform makes the same levels.
+
+static uint16_t lin_of_srgb[256];
+static uint8_t  srgb_of_lin[65536];
+
+static double linear_of(double x) {
+  return (x <= 0.04045) ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+// Each linear value maps to the byte whose sRGB value is nearest its own,
+// so that every byte maps back to itself.
+static void make_srgb_tables() {
+  for (int i = 0; i < 256; ++i) {
+    lin_of_srgb[i] = (uint16_t)lround(linear_of(i / 255.0) * 65535);
+  }
+  int    s    = 0;
+  double next = linear_of(0.5 / 255) * 65535;  // Where s + 1 starts.
+  for (int l = 0; l < 65536; ++l) {
+    while (s < 255 && l >= next) next = linear_of((++s + 0.5) / 255) * 65535;
+    srgb_of_lin[l] = s;
+  }
+}
+
+static uint8_t straight(uint32_t c, uint32_t a) {
+  uint32_t v = (c * 255 + a / 2) / a;
+  return v > 255 ? 255 : v;
+}
+
+static void downsample_linear(uint8_t *dst, const uint8_t *src0,
+                              const uint8_t *src1, int n) {
+  for (int i = 0; i < n; ++i, dst += 4, src0 += 8, src1 += 8) {
+    const uint8_t *p[4] = { src0, src0 + 4, src1, src1 + 4 };
+    uint32_t       sum  = p[0][3] + p[1][3] + p[2][3] + p[3][3];
+    uint32_t       a    = (sum + 2) >> 2;
+    for (int j = 0; j < 3; ++j) {
+      uint32_t total = 0;
+      for (int q = 0; q < 4; ++q) {
+        uint32_t alpha = p[q][3];
+        if (alpha) total += lin_of_srgb[straight(p[q][j], alpha)] * alpha;
+      }
+      uint32_t t = srgb_of_lin[sum ? total / sum : 0] * a + 128;
+      dst[j] = (t + (t >> 8)) >> 8;
+    }
+    dst[3] = a;
+  }
+}
+
+// Fills row y of the mip level dst from its parent src. Sizes that are odd
+// drop the parent's last row or column, and a parent 1 pixel wide or tall
+// has its pixels used twice.
+static void downsample_row(void *data, size_t y) {
+  MipJob  *job        = data;
+  uint8_t *src        = CGBitmapContextGetData(job->src);
+  uint8_t *dst        = CGBitmapContextGetData(job->dst);
+  size_t   src_stride = CGBitmapContextGetBytesPerRow(job->src);
+  size_t   dst_stride = CGBitmapContextGetBytesPerRow(job->dst);
+  bit      is_tall    = CGBitmapContextGetHeight(job->src) > 1;
+  uint8_t *src0       = src + 2 * y * src_stride;
+  uint8_t *src1       = is_tall ? src0 + src_stride : src0;
+  int      w          = (int)CGBitmapContextGetWidth(job->dst);
+  void   (*average)(uint8_t *, const uint8_t *, const uint8_t *, int) =
+      job->is_linear ? downsample_linear : downsample;
+  if (CGBitmapContextGetWidth(job->src) > 1) {
+    average(dst + y * dst_stride, src0, src1, w);
+  } else {
+    uint8_t pair0[8], pair1[8];
+    memcpy(pair0, src0, 4); memcpy(pair0 + 4, src0, 4);
+    memcpy(pair1, src1, 4); memcpy(pair1 + 4, src1, 4);
+    average(dst + y * dst_stride, pair0, pair1, 1);
+  }
+}
+
+// Blurs.
+
+// Finds the radii of three box blurs that together are close to a Gaussian
+// blur with standard deviation sigma. A box of odd width w adds
+// (w^2 - 1) / 12 to the variance, so the widths are a mix of the odd w
+// below the ideal width and w + 2, in the numbers that sum closest to
+// sigma^2.
+static void find_blur_radii(double sigma, int *radii) {
+  double var = sigma * sigma;
+  int    w   = (int)sqrt(4 * var + 1);  // The ideal width for three boxes.
+  if (w % 2 == 0) --w;
+  int num_narrow = (int)round((12 * var - 3.0 * w * w - 12.0 * w - 9) /
+                              (-4.0 * w - 4));
+  for (int i = 0; i < 3; ++i) radii[i] = ((i < num_narrow) ? w : w + 2) / 2;
+}
+
+// Returns the first pixel whose center is at or after v, clamped to
+// [lo, hi].
+static int pixel_edge(xy__Float v, int lo, int hi) {
+  v = ceil(v - 0.5);
+  if (!(v >= lo)) return lo;  // This also catches NaN.
+  if (v > hi)     return hi;
+  return (int)v;
+}
+
+// Atlases.
+
+// Returns the width a w-wide region at x takes up, which includes a
+// pixel's gap on its right unless it's at the atlas's right edge.
+static int padded_width(draw__Atlas a, int x, int w) {
+  return (x + w < a->w) ? w + 1 : w;
+}
+
+// Returns the lowest y at which a w x h region and its gap fit with the
+// region's left edge at the start of segment i, or -1 if they don't fit.
+static int atlas_fit(draw__Atlas a, int i, int w, int h) {
+  Segment *s = a->segments;
+  if (s[i].x + w > a->w) return -1;
+  int x_end = s[i].x + padded_width(a, s[i].x, w);
+  int y     = 0;
+  for (int j = i; j < a->num_segments && s[j].x < x_end; ++j) {
+    if (s[j].y > y) y = s[j].y;
+  }
+  return (y + h <= a->h) ? y : -1;
+}
+
+static void remove_segment(draw__Atlas a, int i) {
+  memmove(a->segments + i, a->segments + i + 1,
+          (a->num_segments - i - 1) * sizeof(Segment));
+  a->num_segments--;
+}
+
+// Raises the skyline to y for w pixels from the start of segment i.
+static void atlas_raise(draw__Atlas a, int i, int w, int y) {
+  Segment *s     = a->segments;
+  int      x     = s[i].x;
+  int      x_end = x + w;
+
+  // The new segment replaces segments i to j - 1, which it covers, and
+  // trims segment j if it covers part of it.
+  int j = i;
+  while (j < a->num_segments && s[j].x + s[j].w <= x_end) ++j;
+  if (j < a->num_segments && s[j].x < x_end) {
+    s[j].w -= x_end - s[j].x;
+    s[j].x  = x_end;
+  }
+  memmove(s + i + 1, s + j, (a->num_segments - j) * sizeof(Segment));
+  a->num_segments += 1 - (j - i);
+  s[i] = (Segment) { x, y, w };
+
+  // Join the new segment to neighbors of the same height.
+  if (i + 1 < a->num_segments && s[i + 1].y == y) {
+    s[i].w += s[i + 1].w;
+    remove_segment(a, i + 1);
+  }
+  if (i > 0 && s[i - 1].y == y) {
+    s[i - 1].w += s[i].w;
+    remove_segment(a, i);
+  }
+}
+
+// Deletes the atlas's views and makes its whole bitmap free.
+static void reset_atlas(draw__Atlas a) {
+  for (int i = 0; i < a->num_views; ++i) draw__delete_bitmap(a->views[i]);
+  a->num_views    = 0;
+  a->num_segments = 1;
+  a->segments[0]  = (Segment) { 0, 0, a->w };
+}
+
+// Tiled bitmaps.
+
+static xy__Rect offset_rect(xy__Rect r, double dx, double dy) {
+  return xy__rect_pts(r.xmin + dx, r.ymin + dy, r.xmax + dx, r.ymax + dy);
+}
+
+// Orders hits by tile and, within a tile, by command, which keeps each
+// tile's commands in list order.
+static int compare_hits(const void *a, const void *b) {
+  const TileHit *p = a, *q = b;
+  if (p->ty != q->ty) return (p->ty < q->ty) ? -1 : 1;
+  if (p->tx != q->tx) return (p->tx < q->tx) ? -1 : 1;
+  return p->cmd - q->cmd;
+}
+
+// Returns true when the segment from (line.xmin, line.ymin) to
+// (line.xmax, line.ymax) meets r. The segment is cut by each of r's edges
+// in turn, as in the Liang-Barsky algorithm.
+static bit line_meets_rect(xy__Rect line, xy__Rect r) {
+  double x  = line.xmin,      y  = line.ymin;
+  double dx = line.xmax - x,  dy = line.ymax - y;
+  double p[4] = { -dx, dx, -dy, dy };
+  double q[4] = { x - r.xmin, r.xmax - x, y - r.ymin, r.ymax - y };
+  double t0 = 0, t1 = 1;
+  for (int i = 0; i < 4; ++i) {
+    if (p[i] == 0) {
+      if (q[i] < 0) return false;  // It's parallel to this edge and outside.
+      continue;
+    }
+    double t = q[i] / p[i];
+    if (p[i] < 0) {
+      if (t > t1) return false;
+      if (t > t0) t0 = t;
+    } else {
+      if (t < t0) return false;
+      if (t < t1) t1 = t;
+    }
+  }
+  return true;
+}
+
+// Returns true when cmd may touch r, given that its bounds overlap r.
+// Lines and outlines only touch the tiles along them, so a long line or a
+// big outline doesn't make every tile it spans.
+static bit cmd_meets_rect(Cmd *cmd, xy__Rect r) {
+  xy__Rect c = cmd->rect;
+  if (cmd->op == cmd_fill_rect) return true;
+  if (cmd->op != cmd_stroke_rect) return line_meets_rect(c, r);
+  return line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmax, c.ymin), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymax, c.xmax, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmin, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmax, c.ymin, c.xmax, c.ymax), r);
+}
+
+// Appends a hit for each tile that command i, cmd, may touch within area,
+// which is the part of the canvas inside the clip.
+static void add_tile_hits(xy__Rect area, Cmd *cmd, int i,
+                          TileHit **hits, int *num_hits, int *hits_cap) {
+  xy__Rect b = intersection_of(cmd_bounds(cmd), area);
+  if (b.xmin == b.xmax || b.ymin == b.ymax) return;
+  int tx0 = (int)floor(b.xmin / draw__tile_size);
+  int ty0 = (int)floor(b.ymin / draw__tile_size);
+  int tx1 = (int)ceil (b.xmax / draw__tile_size) - 1;
+  int ty1 = (int)ceil (b.ymax / draw__tile_size) - 1;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      // Pad the tile by a pixel to allow for the pen width and antialiasing.
+      xy__Rect r = xy__rect_size((double)tx * draw__tile_size - 1,
+                                 (double)ty * draw__tile_size - 1,
+                                 draw__tile_size + 2, draw__tile_size + 2);
+      if (!cmd_meets_rect(cmd, r)) continue;
+      if (*num_hits == *hits_cap) {
+        *hits_cap = *hits_cap ? 2 * *hits_cap : 64;
+        *hits     = realloc(*hits, *hits_cap * sizeof(TileHit));
+      }
+      (*hits)[(*num_hits)++] = (TileHit) { tx, ty, i };
+    }
+  }
+}
+
+// Text boxes.
+
+// This is the 64-bit FNV-1a hash taken 8 bytes at a time, which keeps
+// looking up a long string, such as a log, cheap enough to do every frame.
+static uint64_t hash_text(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ULL, v;
+  size_t   i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, 8);
+    h = (h ^ v) * 1099511628211ULL;
+  }
+  for (; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ULL;
+  return h ^ (h >> 32);
+}
+
+// Returns the number of bytes at the start of a and b that match,
+// comparing 8 bytes at a time.
+static size_t common_prefix(const char *a, size_t a_len,
+                            const char *b, size_t b_len) {
+  size_t n = (a_len < b_len) ? a_len : b_len, i = 0;
+  for (uint64_t u, v; i + 8 <= n; i += 8) {
+    memcpy(&u, a + i, 8);
+    memcpy(&v, b + i, 8);
+    if (u != v) break;
+  }
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
+}
+
+static void unlink_layout(TextLayout *l) {
+  if (l->newer) l->newer->older = l->older;
+  else          newest_layout   = l->older;
+  if (l->older) l->older->newer = l->newer;
+  else          oldest_layout   = l->newer;
+}
+
+static void push_newest_layout(TextLayout *l) {
+  l->newer = NULL;
+  l->older = newest_layout;
+  if (newest_layout) newest_layout->newer = l;
+  newest_layout = l;
+  if (oldest_layout == NULL) oldest_layout = l;
+}
+
+static void remove_layout(TextLayout *l) {
+  unlink_layout(l);
+  num_layouts--;
+  free(l->text);
+  free(l->words);
+  free(l->lines);
+  free(l);
+}
+
+// Starts the new layout l with the first num_words words and num_lines line
+// starts of from.
+static void copy_layout_start(TextLayout *l, TextLayout *from,
+                              int num_words, int num_lines) {
+  l->words     = malloc(num_words * sizeof(Word));
+  l->words_cap = l->num_words = num_words;
+  memcpy(l->words, from->words, num_words * sizeof(Word));
+  if (num_lines == 0) return;
+  l->lines     = malloc(num_lines * sizeof(int));
+  l->lines_cap = l->num_lines = num_lines;
+  memcpy(l->lines, from->lines, num_lines * sizeof(int));
+}
+
+// Drops the layouts in the given font, since it may be deleted and its
+// address reused.
+static void remove_layouts_using(draw__Font old_font) {
+  pthread_mutex_lock(&layouts_mutex);
+  for (TextLayout *l = oldest_layout, *newer; l; l = newer) {
+    newer = l->newer;
+    if (l->font == old_font) remove_layout(l);
+  }
+  pthread_mutex_unlock(&layouts_mutex);
+}
+
+static size_t word_start(TextLayout *l, int i) {
+  return i ? l->words[i - 1].end : 0;
+}
+
+static bit is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Appends the words of text[from..len) to the layout without measuring
+// them.
+static void split_words(TextLayout *l, size_t from) {
+  const char *text = l->text;
+  size_t      i    = from;
+  while (i < l->len) {
+    if (l->num_words == l->words_cap) {
+      l->words_cap = l->words_cap ? 2 * l->words_cap : 64;
+      l->words     = realloc(l->words, l->words_cap * sizeof(Word));
+    }
+    Word *w = &l->words[l->num_words++];
+    while (i < l->len && !is_space(text[i]) && text[i] != '\n') ++i;
+    w->chars_end = i;
+    while (i < l->len && is_space(text[i])) ++i;
+    w->ends_line = (i < l->len && text[i] == '\n');
+    if (w->ends_line) ++i;
+    w->end = i;
+  }
+}
+
+// Measures the words from words[first] on. Each line of text between
+// newlines is shaped as one CTLine, and each word's width is the distance
+// between the offsets of its ends, so kerning between two words counts
+// toward the later one. A line starts being shaped at its first word even
+// when that word is kept, so that every word is shaped the same way it
+// would be in a new layout.
+static void measure_words(draw__Context *c, TextLayout *l, int first) {
+  int i = first;
+  while (i > 0 && !l->words[i - 1].ends_line) --i;
+  while (i < l->num_words) {
+    // Words [i, j) are one line of text.
+    int j = i;
+    while (j < l->num_words && !l->words[j].ends_line) ++j;
+    if (j < l->num_words) ++j;
+
+    size_t start = word_start(l, i);
+    size_t end   = l->words[j - 1].end - l->words[j - 1].ends_line;
+    char  *text  = malloc(end - start + 1);
+    memcpy(text, l->text + start, end - start);
+    text[end - start] = '\0';
+    CTLineRef line = new_line(c->font, NULL, text);
+    free(text);
+
+    // CTLine offsets are in UTF-16 units, which are counted from the bytes:
+    // one for each byte that starts a character, and another for each
+    // character of 4 bytes.
+    const uint8_t *p     = (const uint8_t *)l->text + start;
+    CFIndex        units = 0;
+    CGFloat        x     = 0;
+    for (; i < j; ++i) {
+      Word   *w = &l->words[i];
+      CGFloat x_of[2];
+      size_t  ends[2] = { w->chars_end, w->end - w->ends_line };
+      for (int k = 0; k < 2; ++k) {
+        for (; p < (const uint8_t *)l->text + ends[k]; ++p) {
+          if ((*p & 0xc0) != 0x80) ++units;
+          if (*p >= 0xf0)          ++units;
+        }
+        x_of[k] = line ? CTLineGetOffsetForStringIndex(line, units, NULL) : 0;
+      }
+      if (i >= first) {
+        w->width       = x_of[0] - x;
+        w->space_width = x_of[1] - x_of[0];
+      }
+      x = x_of[1];
+    }
+    if (line) CFRelease(line);
+  }
+}
+
+// Breaks the words into lines from line first_line on, which starts with
+// the same word as before. Each line takes words while they fit in the
+// width; a word too wide for any line gets one to itself.
+static void wrap_lines(TextLayout *l, int first_line) {
+  int i = first_line ? l->lines[first_line] : 0;
+  l->num_lines = first_line;
+  while (i < l->num_words) {
+    if (l->num_lines == l->lines_cap) {
+      l->lines_cap = l->lines_cap ? 2 * l->lines_cap : 64;
+      l->lines     = realloc(l->lines, l->lines_cap * sizeof(int));
+    }
+    l->lines[l->num_lines++] = i;
+    xy__Float x = l->words[i].width;
+    while (!l->words[i].ends_line && i + 1 < l->num_words) {
+      xy__Float next = x + l->words[i].space_width + l->words[i + 1].width;
+      if (l->is_wrapped && next > l->width) break;
+      x = next;
+      ++i;
+    }
+    ++i;
+  }
+}
+
+// Returns the index of the first word that doesn't end before byte at,
+// which is the first word that may change when the text changes there.
+static int word_at(TextLayout *l, size_t at) {
+  int lo = 0, hi = l->num_words;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (l->words[mid].end < at) lo = mid + 1;
+    else                        hi = mid;
+  }
+  return lo;
+}
+
+// Returns the index of the line holding word i.
+static int line_of_word(TextLayout *l, int i) {
+  int lo = 0, hi = l->num_lines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (l->lines[mid] <= i) lo = mid;
+    else                    hi = mid - 1;
+  }
+  return lo;
+}
+
+// Returns the layout of s in the context's font, with its lines wrapped to
+// width when is_wrapped, making or updating one as needed. A string that
+// starts the same as a cached one in the font reuses its words: only the
+// words from the first changed byte on are measured, and only the lines
+// from the one before them are wrapped again. A new width wraps the
+// cached words without measuring them. The caller holds layouts_mutex.
+static TextLayout *layout_of(draw__Context *c, const char *s,
+                             bit is_wrapped, xy__Float width) {
+  size_t   len  = strlen(s);
+  uint64_t hash = hash_text(s, len);
+
+  // Find the layout of s, or else the one sharing the most leading bytes
+  // with it.
+  TextLayout *l    = NULL;
+  size_t      same = 0;
+  for (TextLayout *m = newest_layout; m; m = m->older) {
+    if (m->font != c->font) continue;
+    if (m->hash == hash && m->len == len && memcmp(m->text, s, len) == 0) {
+      l    = m;
+      same = len;
+      break;
+    }
+    size_t n = common_prefix(m->text, m->len, s, len);
+    if (n > same) {
+      l    = m;
+      same = n;
+    }
+  }
+
+  // A layout that would keep no words is left to its own string.
+  bit is_same = (l && same == len && l->len == len);
+  if (l && !is_same && word_at(l, same) == 0) l = NULL;
+
+  // Lines before the one holding the last unchanged word are kept, since
+  // each of their breaks only depends on unchanged words.
+  int first_word     = 0;
+  int first_line     = 0;
+  bit are_lines_kept = false;
+  if (l) {
+    first_word     = is_same ? l->num_words : word_at(l, same);
+    are_lines_kept = (l->num_lines > 0 && l->is_wrapped == is_wrapped &&
+                      (!is_wrapped || l->width == width));
+  }
+  if (are_lines_kept && first_word > 0) {
+    first_line = line_of_word(l, first_word - 1);
+  }
+
+  // A string that extends a cached one, such as a log that's been added to,
+  // takes over its layout. Any other string starts a new layout from a copy
+  // of the kept words and lines, so that boxes with a common start, such as
+  // timestamped entries, don't evict each other.
+  if (l && same == l->len) {
+    unlink_layout(l);
+  } else {
+    TextLayout *from = l;
+    l       = calloc(1, sizeof(TextLayout));
+    l->font = c->font;
+    if (from) {
+      copy_layout_start(l, from, first_word, first_line ? first_line + 1 : 0);
+    }
+    same = 0;  // The text is all copied below.
+    if (num_layouts == max_text_layouts) remove_layout(oldest_layout);
+    num_layouts++;
+  }
+
+  if (!is_same) {
+    size_t from = word_start(l, first_word);
+    l->text      = realloc(l->text, len + 1);
+    memcpy(l->text + same, s + same, len - same + 1);
+    l->len       = len;
+    l->hash      = hash;
+    l->num_words = first_word;
+    split_words(l, from);
+    measure_words(c, l, first_word);
+  }
+  if (!is_same || !are_lines_kept) {
+    l->is_wrapped = is_wrapped;
+    l->width      = width;
+    wrap_lines(l, are_lines_kept ? first_line : 0);
+  }
+  push_newest_layout(l);
+  return l;
+}
+
+// Finds the bytes [*start, *end) of line i, leaving out its trailing spaces
+// and newline.
+static void line_span(TextLayout *l, int i, size_t *start, size_t *end) {
+  int last = ((i + 1 < l->num_lines) ? l->lines[i + 1] : l->num_words) - 1;
+  *start = word_start(l, l->lines[i]);
+  *end   = l->words[last].chars_end;
+}
+
+
+// Bitmaps.
+
+draw__Bitmap draw__new_bitmap(int w, int h) {
+  init_if_needed();
+
+  if (w <= 0 || h <= 0 || w > max_bitmap_width) {
+    fprintf(stderr, "Error in %s: bitmap size must be positive, with a width "
+                    "of at most %d; got %dx%d.\n", __FUNCTION__,
+                    max_bitmap_width, w, h);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *info = pooled_bitmap(w, h);
+  if (info) {
+    pool_stats.hits++;
+    info->next   = bitmap_infos;
+    bitmap_infos = info;
+    pthread_mutex_unlock(&bitmaps_mutex);
+
+    draw__Bitmap bitmap = info->bitmap;
+    // Go back to the state saved when the bitmap was made.
+    CGContextRestoreGState(bitmap);
+    CGContextSaveGState(bitmap);
+    memset(CGBitmapContextGetData(bitmap), 0, bytes_of(bitmap));
+    info->dirty.num_rects = 0;
+    memcpy(info->fill_rgba,   opaque_black, sizeof(info->fill_rgba));
+    memcpy(info->stroke_rgba, opaque_black, sizeof(info->stroke_rgba));
+    return bitmap;
+  }
+  pool_stats.misses++;
+
+  info = new_bitmap_info(w, h, w * 4, NULL);
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return info ? info->bitmap : NULL;
+}
+
+draw__Bitmap draw__new_bitmap_with_data(int w, int h, int stride,
+                                        void *pixels) {
+  init_if_needed();
+
+  if (pixels == NULL || stride < (int64_t)w * 4 || stride % 4) {
+    fprintf(stderr, "Error in %s: need pixels and a stride that's a multiple "
+                    "of 4 and at least 4 * w.\n", __FUNCTION__);
+    return NULL;
+  }
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *info = new_bitmap_info(w, h, stride, pixels);
+  if (info) info->is_borrowed = true;
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return info ? info->bitmap : NULL;
+}
+
+// The view is a bitmap context over the same memory, so core graphics
+// clips its drawing to the view.
+draw__Bitmap draw__new_bitmap_view(draw__Bitmap bitmap, int x, int y,
+                                   int w, int h) {
+  if (bitmap == NULL || w <= 0 || h <= 0 || x < 0 || y < 0 ||
+      x + w > (int)CGBitmapContextGetWidth (bitmap) ||
+      y + h > (int)CGBitmapContextGetHeight(bitmap)) {
+    fprintf(stderr, "Error in %s: need a bitmap containing the %dx%d rect "
+                    "at (%d, %d).\n", __FUNCTION__, w, h, x, y);
+    return NULL;
+  }
+  size_t   stride = CGBitmapContextGetBytesPerRow(bitmap);
+  uint8_t *pixels = (uint8_t *)CGBitmapContextGetData(bitmap) +
+                    y * stride + x * 4;
+
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *parent = info_of(bitmap);
+  BitmapInfo *info   = new_bitmap_info(w, h, (int)stride, pixels);
+  if (info) {
+    info->is_borrowed = true;
+    if (parent && parent->parent) {
+      x     += parent->x0;
+      y     += parent->y0;
+      parent = parent->parent;
+    }
+    info->parent = parent;
+    info->x0     = x;
+    info->y0     = y;
+  }
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return info ? info->bitmap : NULL;
+}
+
+// vm_copy maps the source's pages into the clone copy-on-write, so only
+// pages that one of the two bitmaps writes to are ever copied. It needs
+// page-aligned memory, which large bitmaps from core graphics have; views
+// and small bitmaps are copied row by row.
+draw__Bitmap draw__clone_bitmap(draw__Bitmap bitmap) {
+  if (bitmap == NULL) {
+    fprintf(stderr, "Error in %s: bitmap is NULL.\n", __FUNCTION__);
+    return NULL;
+  }
+  int      w      = (int)CGBitmapContextGetWidth (bitmap);
+  int      h      = (int)CGBitmapContextGetHeight(bitmap);
+  size_t   stride = CGBitmapContextGetBytesPerRow(bitmap);
+  size_t   bytes  = stride * h;
+  uint8_t *src    = CGBitmapContextGetData(bitmap);
+
+  size_t whole      = trunc_page(bytes);
+  bit    is_aligned = (vm_address_t)src % vm_page_size == 0;
+  if (stride == (size_t)w * 4 && whole && is_aligned) {
+    vm_address_t pixels = 0;
+    if (vm_allocate(mach_task_self(), &pixels, round_page(bytes),
+                    VM_FLAGS_ANYWHERE) == KERN_SUCCESS) {
+      if (vm_copy(mach_task_self(), (vm_address_t)src, whole,
+                  pixels) == KERN_SUCCESS) {
+        memcpy((uint8_t *)pixels + whole, src + whole, bytes - whole);
+        pthread_mutex_lock(&bitmaps_mutex);
+        BitmapInfo *info = new_bitmap_info(w, h, (int)stride, (void *)pixels);
+        if (info) info->is_vm = true;
+        pthread_mutex_unlock(&bitmaps_mutex);
+        if (info) return info->bitmap;
+      }
+      vm_deallocate(mach_task_self(), pixels, round_page(bytes));
+    }
+  }
+
+  draw__Bitmap clone = draw__new_bitmap(w, h);
+  if (clone == NULL) return NULL;
+  uint8_t *dst = CGBitmapContextGetData(clone);
+  for (int y = 0; y < h; ++y) {
+    memcpy(dst + (size_t)y * w * 4, src + y * stride, (size_t)w * 4);
+  }
+  return clone;
+}
+
+void draw__delete_bitmap(draw__Bitmap bitmap) {
+  if (default_context.bitmap == bitmap) {
+    default_context.bitmap = NULL;
+    default_context.info   = NULL;
+  }
+  pthread_mutex_lock(&bitmaps_mutex);
+  for (BitmapInfo **link = &bitmap_infos; *link; link = &(*link)->next) {
+    if ((*link)->bitmap != bitmap) continue;
+    BitmapInfo *info = *link;
+    *link = info->next;
+    pool_bitmap(info);
+    pthread_mutex_unlock(&bitmaps_mutex);
+    return;
+  }
+  pthread_mutex_unlock(&bitmaps_mutex);
+  CGContextRelease(bitmap);
+}
+
+void draw__ctx_set_bitmap(draw__Context *c, draw__Bitmap bitmap) {
+  pthread_mutex_lock(&bitmaps_mutex);
+  c->bitmap = bitmap;
+  c->info   = info_of(bitmap);
+  pthread_mutex_unlock(&bitmaps_mutex);
+}
+
+void *draw__get_bitmap_data(draw__Bitmap bitmap) {
+  return CGBitmapContextGetData(bitmap);
+}
+
+int draw__get_bitmap_stride(draw__Bitmap bitmap) {
+  return (int)CGBitmapContextGetBytesPerRow(bitmap);
+}
+
+// vImage does the conversion with the cpu's vector instructions. Its
+// permute maps list, for each output channel, the input channel to use;
+// the bitmap's channels are R, G, B, A.
+void draw__copy_bitmap_data(draw__Bitmap bitmap, void *dst, int dst_stride,
+                            draw__Format format, int flags) {
+  static const uint8_t permute_maps[][4] = {
+    [draw__rgba] = { 0, 1, 2, 3 },
+    [draw__bgra] = { 2, 1, 0, 3 },
+    [draw__argb] = { 3, 0, 1, 2 }
+  };
+  if (bitmap == NULL || format < draw__rgba || format > draw__argb) {
+    fprintf(stderr, "Error in %s: need a bitmap and a valid format.\n",
+            __FUNCTION__);
+    return;
+  }
+
+  size_t w = CGBitmapContextGetWidth (bitmap);
+  size_t h = CGBitmapContextGetHeight(bitmap);
+  vImage_Buffer src = { CGBitmapContextGetData(bitmap), h, w,
+                        CGBitmapContextGetBytesPerRow(bitmap) };
+  vImage_Buffer out = { dst, h, w, dst_stride };
+
+  // Flipped copies are made a row at a time.
+  bit do_flip = (flags & draw__flip_rows) != 0;
+  if (do_flip) src.height = out.height = 1;
+
+  for (size_t y = 0; y < h; y += src.height) {
+    vImage_Buffer src_rows = src, out_rows = out;
+    src_rows.data = (uint8_t *)src.data + y * src.rowBytes;
+    out_rows.data = (uint8_t *)dst + (do_flip ? h - 1 - y : y) * dst_stride;
+
+    vImage_Error err = vImagePermuteChannels_ARGB8888(
+        &src_rows, &out_rows, permute_maps[format], kvImageNoFlags);
+    if (err == kvImageNoError && (flags & draw__straight_alpha)) {
+      if (format == draw__argb) {
+        err = vImageUnpremultiplyData_ARGB8888(&out_rows, &out_rows,
+                                               kvImageNoFlags);
+      } else {
+        err = vImageUnpremultiplyData_RGBA8888(&out_rows, &out_rows,
+                                               kvImageNoFlags);
+      }
+    }
+    if (err != kvImageNoError) {
+      fprintf(stderr, "Error in %s: vImage error %ld.\n", __FUNCTION__,
+              (long)err);
+      return;
+    }
+  }
+}
+
+// Compressed bitmaps.
+
+void draw__compress_bitmap(draw__Bitmap bitmap) {}
+
+size_t draw__get_bitmap_bytes(draw__Bitmap bitmap) {
+  if (bitmap == NULL) return 0;
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *info = info_of(bitmap);
+  bit is_owned = info && !info->is_borrowed;
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return is_owned ? bytes_of(bitmap) : 0;
+}
+
+// Dirty rects.
+
+void draw__set_bitmap_pool_budget(size_t bytes) {
+  pthread_mutex_lock(&bitmaps_mutex);
+  pool_stats.budget = bytes;
+  trim_pool(bytes);
+  pthread_mutex_unlock(&bitmaps_mutex);
+}
+
+void draw__trim_bitmap_pool(size_t bytes) {
+  pthread_mutex_lock(&bitmaps_mutex);
+  trim_pool(bytes);
+  pthread_mutex_unlock(&bitmaps_mutex);
+}
+
+draw__PoolStats draw__get_bitmap_pool_stats() {
+  pthread_mutex_lock(&bitmaps_mutex);
+  draw__PoolStats stats = pool_stats;
+  pthread_mutex_unlock(&bitmaps_mutex);
+  return stats;
+}
+
+int draw__get_dirty_rects(draw__Bitmap bitmap, xy__Rect *out, int max) {
+  Dirty *d = dirty_of(bitmap);
+  if (d == NULL || max <= 0) return 0;
+  int n = (d->num_rects < max) ? d->num_rects : max;
+  for (int i = 0; i < n; ++i) out[i] = d->rects[i];
+  for (int i = n; i < d->num_rects; ++i) {
+    out[n - 1] = union_of(out[n - 1], d->rects[i]);
+  }
+  return n;
+}
+
+void draw__clear_dirty(draw__Bitmap bitmap) {
+  Dirty *d = dirty_of(bitmap);
+  if (d) d->num_rects = 0;
+}
 
-// Internal functions.
+// Mipmaps.
 
-static void init_if_needed() {
-  static int is_initialized = false;
-  if (is_initialized) return;
+// Large levels are made a row per task on a global dispatch queue.
+static int build_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                         int max_levels, bit is_linear) {
+  if (bitmap == NULL) return 0;
+  if (is_linear) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, make_srgb_tables);
+  }
+  int          n   = 0;
+  draw__Bitmap src = bitmap;
+  while (n < max_levels) {
+    int src_w = (int)CGBitmapContextGetWidth (src);
+    int src_h = (int)CGBitmapContextGetHeight(src);
+    if (src_w == 1 && src_h == 1) break;
+    int          w   = (src_w > 1) ? src_w / 2 : 1;
+    int          h   = (src_h > 1) ? src_h / 2 : 1;
+    draw__Bitmap dst = draw__new_bitmap(w, h);
+    if (dst == NULL) break;
 
-  generic_rgb_colorspace = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGB);
-  if (generic_rgb_colorspace == NULL) {
-    fprintf(stderr, "Error allocating generic rgb color space.\n");
+    MipJob job = { src, dst, is_linear };
+    if ((int64_t)w * h >= min_threaded_mip) {
+      dispatch_queue_t queue =
+          dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+      dispatch_apply_f(h, queue, &job, downsample_row);
+    } else {
+      for (int y = 0; y < h; ++y) downsample_row(&job, y);
+    }
+    Dirty *d = dirty_of(dst);
+    if (d) add_dirty(d, xy__rect_pts(0, 0, w, h));
+
+    levels[n++] = dst;
+    src         = dst;
   }
+  return n;
+}
 
-  is_initialized = true;
+int draw__build_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                        int max_levels) {
+  return build_mipmaps(bitmap, levels, max_levels, false);
 }
 
-#define cg_rect_from_xy(rect) \
-  ((CGRect) { { rect.xmin, rect.ymin }, { xy__width(rect), xy__height(rect) } })
+int draw__build_linear_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                               int max_levels) {
+  return build_mipmaps(bitmap, levels, max_levels, true);
+}
 
+// Blurs.
 
-// Bitmaps.
+// Each pass is one vImage box convolution over both axes, which vImage
+// vectorizes and spreads across cores. The passes go from the rect to two
+// scratch buffers in turn and back, as a convolution can't work in place.
+void draw__blur(draw__Bitmap bitmap, xy__Rect rect, xy__Float radius) {
+  if (bitmap == NULL || !(radius > 0)) return;
+  int bw = (int)CGBitmapContextGetWidth (bitmap);
+  int bh = (int)CGBitmapContextGetHeight(bitmap);
+  int x0 = pixel_edge(fmin(rect.xmin, rect.xmax), 0, bw);
+  int x1 = pixel_edge(fmax(rect.xmin, rect.xmax), 0, bw);
+  int y0 = pixel_edge(fmin(rect.ymin, rect.ymax), 0, bh);
+  int y1 = pixel_edge(fmax(rect.ymin, rect.ymax), 0, bh);
+  if (x0 >= x1 || y0 >= y1) return;
 
-draw__Bitmap draw__new_bitmap(int w, int h) {
-  init_if_needed();
+  int      w      = x1 - x0, h = y1 - y0;
+  size_t   stride = CGBitmapContextGetBytesPerRow(bitmap);
+  uint8_t *pixels = CGBitmapContextGetData(bitmap);
+  uint8_t *temp   = malloc(2 * (size_t)w * h * 4);
+  vImage_Buffer buffers[4] = {
+    { pixels + y0 * stride + x0 * 4, h, w, stride },
+    { temp,                          h, w, (size_t)w * 4 },
+    { temp + (size_t)w * h * 4,      h, w, (size_t)w * 4 },
+    { pixels + y0 * stride + x0 * 4, h, w, stride }
+  };
+  int radii[3];
+  find_blur_radii(fmin(radius, max_blur_radius), radii);
+  for (int i = 0; i < 3; ++i) {
+    uint32_t     size = 2 * radii[i] + 1;
+    vImage_Error err  = vImageBoxConvolve_ARGB8888(
+        &buffers[i], &buffers[i + 1], NULL, 0, 0, size, size, NULL,
+        kvImageEdgeExtend);
+    if (err != kvImageNoError) {
+      fprintf(stderr, "Error in %s: vImage error %ld.\n", __FUNCTION__,
+              (long)err);
+      break;
+    }
+  }
+  free(temp);
 
-  int bytes_per_row = w * 4;
-  CGBitmapInfo bitmap_info = (CGBitmapInfo)kCGImageAlphaPremultipliedLast;
-  draw__Bitmap bitmap = CGBitmapContextCreate(NULL,   // data
-                                              w,
-                                              h,
-                                              8,      // bits per component
-                                              bytes_per_row,
-                                              generic_rgb_colorspace,
-                                              bitmap_info);  // premult. alpha
+  pthread_mutex_lock(&bitmaps_mutex);
+  BitmapInfo *info = info_of(bitmap);
+  if (info) {
+    add_dirty(&info->dirty, xy__rect_pts(x0, y0, x1, y1));
+    if (info->parent) {
+      add_dirty(&info->parent->dirty,
+                xy__rect_pts(x0 + info->x0, y0 + info->y0,
+                             x1 + info->x0, y1 + info->y0));
+    }
+  }
+  pthread_mutex_unlock(&bitmaps_mutex);
+}
 
-  // Make (0, 0) correspond to the lower-left corner.
-  CGContextTranslateCTM(bitmap, 0, h);
-  CGContextScaleCTM(bitmap, 1.0, -1.0);
+// Atlases.
 
-  return bitmap;
+draw__Atlas draw__new_atlas(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: atlas size must be positive; got %dx%d.\n",
+            __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__Bitmap bitmap = draw__new_bitmap(w, h);
+  if (bitmap == NULL) return NULL;
+  draw__Atlas atlas = calloc(1, sizeof(*atlas));
+  atlas->bitmap   = bitmap;
+  atlas->w        = w;
+  atlas->h        = h;
+  atlas->segments = malloc(w * sizeof(Segment));
+  reset_atlas(atlas);
+  return atlas;
 }
 
-void draw__delete_bitmap(draw__Bitmap bitmap) {
-  CGContextRelease(bitmap);
+void draw__delete_atlas(draw__Atlas atlas) {
+  if (atlas == NULL) return;
+  reset_atlas(atlas);
+  draw__delete_bitmap(atlas->bitmap);
+  free(atlas->segments);
+  free(atlas->views);
+  free(atlas);
 }
 
-void draw__set_bitmap(draw__Bitmap bitmap) {
-  ctx = bitmap;
+draw__Bitmap draw__get_atlas_bitmap(draw__Atlas atlas) {
+  return atlas->bitmap;
 }
 
-void *draw__get_bitmap_data(draw__Bitmap bitmap) {
-  return CGBitmapContextGetData(bitmap);
+// Each region goes where its top is lowest, and where it's leftmost among
+// those. It takes up an extra row above it for its gap.
+draw__Bitmap draw__atlas_add(draw__Atlas atlas, int w, int h, xy__Rect *uv) {
+  if (atlas == NULL || w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: need an atlas and a positive size; "
+                    "got %dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  int best_i = -1, best_y = 0;
+  for (int i = 0; i < atlas->num_segments; ++i) {
+    int y = atlas_fit(atlas, i, w, h);
+    if (y >= 0 && (best_i < 0 || y < best_y)) {
+      best_i = i;
+      best_y = y;
+    }
+  }
+  if (best_i < 0) return NULL;
+
+  int          x    = atlas->segments[best_i].x;
+  draw__Bitmap view = draw__new_bitmap_view(atlas->bitmap, x, best_y, w, h);
+  if (view == NULL) return NULL;
+  atlas_raise(atlas, best_i, padded_width(atlas, x, w), best_y + h + 1);
+
+  if (atlas->num_views == atlas->views_cap) {
+    atlas->views_cap = atlas->views_cap ? 2 * atlas->views_cap : 64;
+    atlas->views     = realloc(atlas->views,
+                               atlas->views_cap * sizeof(draw__Bitmap));
+  }
+  atlas->views[atlas->num_views++] = view;
+
+  if (uv) {
+    double sx = 1.0 / atlas->w, sy = 1.0 / atlas->h;
+    *uv = xy__rect_pts(x * sx, best_y * sy, (x + w) * sx, (best_y + h) * sy);
+  }
+  return view;
+}
+
+void draw__clear_atlas(draw__Atlas atlas) {
+  if (atlas) reset_atlas(atlas);
+}
+
+// Tiled bitmaps.
+
+draw__TiledBitmap draw__new_tiled_bitmap(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    fprintf(stderr, "Error in %s: tiled bitmap size must be positive; got "
+                    "%dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__TiledBitmap tiled = malloc(sizeof(*tiled));
+  tiled->w       = w;
+  tiled->h       = h;
+  tiled->tiles_x = (int)(((int64_t)w + draw__tile_size - 1) / draw__tile_size);
+  tiled->tiles_y = (int)(((int64_t)h + draw__tile_size - 1) / draw__tile_size);
+  tiled->rows    = calloc(tiled->tiles_y, sizeof(draw__Bitmap *));
+  return tiled;
+}
+
+void draw__delete_tiled_bitmap(draw__TiledBitmap tiled) {
+  if (tiled == NULL) return;
+  for (int ty = 0; ty < tiled->tiles_y; ++ty) {
+    if (tiled->rows[ty] == NULL) continue;
+    for (int tx = 0; tx < tiled->tiles_x; ++tx) {
+      if (tiled->rows[ty][tx]) draw__delete_bitmap(tiled->rows[ty][tx]);
+    }
+    free(tiled->rows[ty]);
+  }
+  free(tiled->rows);
+  free(tiled);
+}
+
+void draw__get_tile_counts(draw__TiledBitmap tiled, int *tiles_x,
+                           int *tiles_y) {
+  *tiles_x = tiled->tiles_x;
+  *tiles_y = tiled->tiles_y;
+}
+
+// Tiles on the right and top edges are cut to the canvas.
+draw__Bitmap draw__get_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y) {
+    return NULL;
+  }
+  draw__Bitmap **row = &tiled->rows[ty];
+  if (*row == NULL) *row = calloc(tiled->tiles_x, sizeof(draw__Bitmap));
+  draw__Bitmap *tile = &(*row)[tx];
+  if (*tile == NULL) {
+    int x = tx * draw__tile_size, y = ty * draw__tile_size;
+    int w = tiled->w - x,         h = tiled->h - y;
+    *tile = draw__new_bitmap((w < draw__tile_size) ? w : draw__tile_size,
+                             (h < draw__tile_size) ? h : draw__tile_size);
+  }
+  return *tile;
+}
+
+draw__Bitmap draw__find_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y ||
+      tiled->rows[ty] == NULL) {
+    return NULL;
+  }
+  return tiled->rows[ty][tx];
 }
 
 // Fonts and text.
@@ -81,59 +1928,168 @@ draw__Font draw__new_font(const char *name, int size) {
   return      font;
 }
 
-void draw__delete_font(draw__Font font) {
-  CFRelease(font);
+void draw__delete_font(draw__Font old_font) {
+  if (default_context.font == old_font) default_context.font = NULL;
+  pthread_mutex_lock(&cache_mutex);
+  remove_lines_using(old_font, NULL);
+  pthread_mutex_unlock(&cache_mutex);
+  remove_layouts_using(old_font);
+  CFRelease(old_font);
 }
 
-void draw__set_font(draw__Font new_font) {
-  font = new_font;
+void draw__ctx_set_font(draw__Context *c, draw__Font new_font) {
+  c->font = new_font;
 }
 
-void draw__set_font_color(draw__Color color) {
-  font_color = color;
+void draw__ctx_set_font_color(draw__Context *c, draw__Color color) {
+  c->font_color = color;
 }
 
-xy__Float draw__string(const char *s, int x, int y, int w, float pos) {
-  CFStringRef string = CFStringCreateWithCString(kCFAllocatorDefault, s,
-                                                 kCFStringEncodingUTF8);
-
-  if (font == NULL || font_color == NULL) {
+xy__Float draw__ctx_string(draw__Context *c, const char *s, int x, int y,
+                           int w, float pos) {
+  if (c->font == NULL || c->font_color == NULL) {
     fprintf(stderr,
             "Error in %s: need both font & font_color to be non-NULL.\n",
             __FUNCTION__);
     return x;
   }
 
-  CFStringRef keys[] = { kCTFontAttributeName,
-                         kCTForegroundColorAttributeName };
-  CFTypeRef values[] = { font, font_color };
-
-  CFDictionaryRef attributes =
-  CFDictionaryCreate(kCFAllocatorDefault, (const void**)&keys,
-                     (const void**)&values, sizeof(keys) / sizeof(keys[0]),
-                     &kCFTypeDictionaryKeyCallBacks,
-                     &kCFTypeDictionaryValueCallBacks);
-
-  CFAttributedStringRef attrString =
-      CFAttributedStringCreate(kCFAllocatorDefault, string, attributes);
-  CFRelease(string);
-  CFRelease(attributes);
-
-  CTLineRef line = CTLineCreateWithAttributedString(attrString);
+  draw__Bitmap ctx = c->bitmap;
+  pthread_mutex_lock(&cache_mutex);
+  LineEntry *entry = shaped_line(c->font, c->font_color, s);
+  CTLineRef  line  = entry->line;
 
   // This position set is needed to get a useful x_pos value on the next line.
   CGContextSetTextPosition(ctx, x, y);
   double x_pos = CTLineGetPenOffsetForFlush(line, pos, w);
 
-  CGFloat descent;
-  double line_width = CTLineGetTypographicBounds(line, NULL, &descent, NULL);
+  CGContextSetTextPosition(ctx, x + x_pos, y + entry->descent);
+
+  if (!entry->has_image_bounds) {
+    entry->image_bounds     = CTLineGetImageBounds(line, ctx);
+    entry->has_image_bounds = true;
+  }
+  CGRect   r       = entry->image_bounds;
+  CGFloat  text_x  = x + x_pos, text_y = y + entry->descent;
+  xy__Rect visible = clipped(c, padded(xy__rect_pts(
+      text_x + r.origin.x, text_y + r.origin.y,
+      text_x + r.origin.x + r.size.width,
+      text_y + r.origin.y + r.size.height)));
+
+  // Text outside the clip isn't drawn, though it's still shaped so that the
+  // end x is known. Core text may leave other colors set in the bitmap, so
+  // the bitmap's colors are saved and restored around the text.
+  if (!is_empty(visible)) {
+    CGContextSaveGState(ctx);
+    if (c->num_clips) {
+      CGContextClipToRect(ctx, cg_rect_from_xy(c->clips[c->num_clips - 1]));
+    }
+    CTLineDraw(line, ctx);
+    CGContextRestoreGState(ctx);
+    mark(c, visible);
+  }
+
+  xy__Float end_x = x + x_pos + entry->width;
+  trim_cache();
+  pthread_mutex_unlock(&cache_mutex);
+  return end_x;
+}
+
+void draw__set_string_cache_budget(size_t bytes) {
+  pthread_mutex_lock(&cache_mutex);
+  cache_stats.budget = bytes;
+  trim_cache();
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+draw__CacheStats draw__get_string_cache_stats() {
+  pthread_mutex_lock(&cache_mutex);
+  draw__CacheStats stats = cache_stats;
+  pthread_mutex_unlock(&cache_mutex);
+  return stats;
+}
+
+// Text measurement.
+
+draw__TextMetrics draw__ctx_measure_string(draw__Context *c, const char *s) {
+  draw__TextMetrics metrics = { 0, 0, 0 };
+  draw__ctx_measure_strings(c, &s, 1, &metrics);
+  return metrics;
+}
+
+// Measured lines go through the same cache as drawn ones, so measuring a
+// string and then drawing it in the same color shapes it only once.
+void draw__ctx_measure_strings(draw__Context *c, const char **strs, int n,
+                               draw__TextMetrics *out) {
+  if (c->font == NULL) {
+    fprintf(stderr, "Error in %s: need a non-NULL font.\n", __FUNCTION__);
+    for (int i = 0; i < n; ++i) out[i] = (draw__TextMetrics) { 0, 0, 0 };
+    return;
+  }
+  pthread_mutex_lock(&cache_mutex);
+  for (int i = 0; i < n; ++i) {
+    LineEntry *entry = shaped_line(c->font, c->font_color, strs[i]);
+    out[i] = (draw__TextMetrics) { entry->width, entry->ascent,
+                                   entry->descent };
+    trim_cache();
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+// Text boxes.
+
+// Each drawn line goes through draw__ctx_string, so its shaped CTLine is
+// kept in the string cache between frames.
+xy__Float draw__ctx_text_box(draw__Context *c, const char *s, xy__Rect rect,
+                             float align, int wrap) {
+  if (c->font == NULL || c->font_color == NULL) {
+    fprintf(stderr,
+            "Error in %s: need both font & font_color to be non-NULL.\n",
+            __FUNCTION__);
+    return 0;
+  }
+  xy__Float line_h = CTFontGetAscent (c->font) + CTFontGetDescent(c->font) +
+                     CTFontGetLeading(c->font);
+  xy__Float x0     = fmin(rect.xmin, rect.xmax);
+  xy__Float width  = fmax(rect.xmin, rect.xmax) - x0;
+  xy__Float top    = fmax(rect.ymin, rect.ymax);
 
-  CGContextSetTextPosition(ctx, x + x_pos, y + descent);
+  // Only the lines that meet both the rect and the clip are drawn, so the
+  // cost of drawing doesn't grow with lines scrolled out of view.
+  xy__Rect visible = c->bitmap ? clipped(c, rect) : xy__rect_pts(0, 0, 0, 0);
 
-  CTLineDraw(line, ctx);
-  CFRelease(line);
+  pthread_mutex_lock(&layouts_mutex);
+  TextLayout *l         = layout_of(c, s, wrap == draw__wrap_words, width);
+  int         num_lines = l->num_lines;
+  int         i0 = 0, i1 = 0;
+  if (line_h > 0 && visible.ymin < visible.ymax) {
+    i0 = (int)fmax(floor((top - visible.ymax) / line_h), 0);
+    i1 = (int)fmin(ceil ((top - visible.ymin) / line_h), num_lines);
+  }
+  size_t *spans = malloc(2 * (size_t)(i1 > i0 ? i1 - i0 : 0) *
+                         sizeof(size_t));
+  size_t  max_n = 0;
+  for (int i = i0; i < i1; ++i) {
+    size_t *span = &spans[2 * (i - i0)];
+    line_span(l, i, &span[0], &span[1]);
+    if (span[1] - span[0] > max_n) max_n = span[1] - span[0];
+  }
+  pthread_mutex_unlock(&layouts_mutex);
 
-  return x + x_pos + line_width;
+  // The lines are drawn after the layouts are released, as the spans are
+  // offsets into s.
+  char *line = malloc(max_n + 1);
+  for (int i = i0; i < i1; ++i) {
+    size_t start = spans[2 * (i - i0)], n = spans[2 * (i - i0) + 1] - start;
+    memcpy(line, s + start, n);
+    line[n] = '\0';
+    draw__ctx_string(c, line, (int)floor(x0 + 0.5),
+                     (int)floor(top - (i + 1) * line_h + 0.5),
+                     (int)floor(width + 0.5), align);
+  }
+  free(line);
+  free(spans);
+  return num_lines * line_h;
 }
 
 // Colors.
@@ -143,31 +2099,544 @@ draw__Color draw__new_color(double r, double g, double b) {
 }
 
 void draw__delete_color(draw__Color color) {
+  if (default_context.font_color == color) default_context.font_color = NULL;
+  pthread_mutex_lock(&cache_mutex);
+  remove_lines_using(NULL, color);
+  pthread_mutex_unlock(&cache_mutex);
   CGColorRelease(color);
 }
 
+void draw__ctx_rgb_fill_color(draw__Context *c, double r, double g, double b) {
+  set_rgba(c->fill_rgba, r, g, b, 1.0);
+}
+
+void draw__ctx_rgb_stroke_color(draw__Context *c,
+                                double r, double g, double b) {
+  set_rgba(c->stroke_rgba, r, g, b, 1.0);
+}
+
+void draw__ctx_rgba_fill_color(draw__Context *c,
+                               double r, double g, double b, double a) {
+  set_rgba(c->fill_rgba, r, g, b, a);
+}
+
+void draw__ctx_rgba_stroke_color(draw__Context *c,
+                                 double r, double g, double b, double a) {
+  set_rgba(c->stroke_rgba, r, g, b, a);
+}
+
+void draw__ctx_fill_color32(draw__Context *c, draw__Rgba32 color) {
+  set_rgba32(c->fill_rgba, color);
+}
+
+void draw__ctx_stroke_color32(draw__Context *c, draw__Rgba32 color) {
+  set_rgba32(c->stroke_rgba, color);
+}
+
+void draw__ctx_set_gamma_blending(draw__Context *c, int is_on) {
+  // The system blends colors, so there's no blending mode to set.
+}
+
+
+// Clipping.
+
+void draw__ctx_push_clip(draw__Context *c, xy__Rect rect) {
+  if (c->num_clips == c->clips_cap) {
+    c->clips_cap = c->clips_cap ? 2 * c->clips_cap : 8;
+    c->clips     = realloc(c->clips, c->clips_cap * sizeof(xy__Rect));
+  }
+  // Moving each edge to the nearest pixel edge keeps the pixels whose
+  // centers are in rect.
+  rect = xy__rect_pts(ceil(fmin(rect.xmin, rect.xmax) - 0.5),
+                      ceil(fmin(rect.ymin, rect.ymax) - 0.5),
+                      ceil(fmax(rect.xmin, rect.xmax) - 0.5),
+                      ceil(fmax(rect.ymin, rect.ymax) - 0.5));
+  if (c->num_clips) rect = intersection_of(rect, c->clips[c->num_clips - 1]);
+  c->clips[c->num_clips++] = rect;
+}
+
+void draw__ctx_pop_clip(draw__Context *c) {
+  if (c->num_clips == 0) {
+    fprintf(stderr, "Error in %s: no clip to pop.\n", __FUNCTION__);
+    return;
+  }
+  c->num_clips--;
+}
+
+// Shapes and lines.
+
+void draw__ctx_fill_rect(draw__Context *c, xy__Rect rect) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_fill_rect, c->fill_rgba, rect);
+    return;
+  }
+  // Filling the part inside the clip matches clipping the fill, as the clip
+  // has whole-pixel edges.
+  rect = clipped(c, rect);
+  if (is_empty(rect)) return;
+  use_fill_color(c);
+  mark(c, rect);
+  CGContextFillRect(c->bitmap, cg_rect_from_xy(rect));
+}
+
+void draw__ctx_stroke_rect(draw__Context *c, xy__Rect rect) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_stroke_rect, c->stroke_rgba, rect);
+    return;
+  }
+  xy__Rect bounds  = padded(rect);
+  xy__Rect visible = clipped(c, bounds);
+  if (is_empty(visible)) return;
+  use_stroke_color(c);
+  mark(c, visible);
+  bit needs_clip = crosses_clip(c, bounds);
+  if (needs_clip) begin_clip(c);
+  CGContextStrokeRect(c->bitmap, cg_rect_from_xy(rect));
+  if (needs_clip) CGContextRestoreGState(c->bitmap);
+}
+
+void draw__ctx_line(draw__Context *c, xy__Float x1, xy__Float y1,
+                                      xy__Float x2, xy__Float y2) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_line, c->stroke_rgba, xy__rect_pts(x1, y1, x2, y2));
+    return;
+  }
+  xy__Rect bounds  = padded(xy__rect_pts(x1, y1, x2, y2));
+  xy__Rect visible = clipped(c, bounds);
+  if (is_empty(visible)) return;
+  draw__Bitmap ctx = c->bitmap;
+  use_stroke_color(c);
+  mark(c, visible);
+  bit needs_clip = crosses_clip(c, bounds);
+  if (needs_clip) begin_clip(c);
+  CGContextMoveToPoint   (ctx, x1, y1);
+  CGContextAddLineToPoint(ctx, x2, y2);
+  CGContextStrokePath    (ctx);
+  if (needs_clip) CGContextRestoreGState(ctx);
+}
+
+// All of the lines go to core graphics in one call. Core graphics always
+// antialiases them, so draw__antialias makes no difference here.
+void draw__ctx_lines(draw__Context *c, const xy__Pt *pts, int n, int mode) {
+  bit is_polyline = !(mode & draw__segments);
+  int num_lines   = is_polyline ? n - 1 : n / 2;
+  int num_pts     = is_polyline ? n : 2 * num_lines;
+  if (num_lines <= 0) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < num_lines; ++i) {
+      const xy__Pt *p = pts + (is_polyline ? i : 2 * i);
+      add_cmd(c, cmd_line, c->stroke_rgba,
+              xy__rect_pts(p[0].x, p[0].y, p[1].x, p[1].y));
+    }
+    return;
+  }
+
+  reserve_scratch(c, (num_pts + 1) / 2);  // There are two points per slot.
+  CGPoint *cg_pts = c->scratch_pts;
+  xy__Rect bounds = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 0; i < num_pts; ++i) {
+    cg_pts[i] = CGPointMake(pts[i].x, pts[i].y);
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  bounds = padded(bounds);
+  xy__Rect visible = clipped(c, bounds);
+  if (is_empty(visible)) return;
+  mark(c, visible);
+  use_stroke_color(c);
+
+  draw__Bitmap ctx        = c->bitmap;
+  bit          needs_clip = crosses_clip(c, bounds);
+  if (needs_clip) begin_clip(c);
+  if (is_polyline) {
+    CGContextBeginPath (ctx);
+    CGContextAddLines  (ctx, cg_pts, num_pts);
+    CGContextStrokePath(ctx);
+  } else {
+    CGContextStrokeLineSegments(ctx, cg_pts, num_pts);
+  }
+  if (needs_clip) CGContextRestoreGState(ctx);
+}
+
+void draw__ctx_fill_polygon(draw__Context *c, const xy__Pt *pts, int n,
+                            int rule) {
+  if (rule != draw__nonzero && rule != draw__even_odd) {
+    fprintf(stderr, "Error in %s: unknown fill rule %d.\n", __FUNCTION__,
+            rule);
+    return;
+  }
+  if (n < 3) return;
+
+  reserve_scratch(c, (n + 1) / 2);  // There are two points per slot.
+  CGPoint *cg_pts = c->scratch_pts;
+  xy__Rect bounds = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 0; i < n; ++i) {
+    cg_pts[i] = CGPointMake(pts[i].x, pts[i].y);
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  bounds = padded(bounds);
+  xy__Rect visible = clipped(c, bounds);
+  if (is_empty(visible)) return;
+  mark(c, visible);
+  use_fill_color(c);
+
+  draw__Bitmap ctx        = c->bitmap;
+  bit          needs_clip = crosses_clip(c, bounds);
+  if (needs_clip) begin_clip(c);
+  CGContextBeginPath(ctx);
+  CGContextAddLines (ctx, cg_pts, n);
+  CGContextClosePath(ctx);
+  if (rule == draw__even_odd) CGContextEOFillPath(ctx);
+  else                        CGContextFillPath  (ctx);
+  if (needs_clip) CGContextRestoreGState(ctx);
+}
+
+// Blitting.
+
+void draw__ctx_blit(draw__Context *c, draw__Bitmap src, xy__Rect src_rect,
+                    int dst_x, int dst_y, int mode) {
+  draw__Sprite sprite = { src, src_rect, dst_x, dst_y };
+  draw__ctx_blit_many(c, &sprite, 1, mode);
+}
+
+// Core graphics composites the images, and an image is made from each
+// source bitmap once per run of sprites using it. Images are drawn upright
+// in device space, where row 0 is at the top, so the flip made in
+// new_bitmap_info is undone while drawing them.
+void draw__ctx_blit_many(draw__Context *c, const draw__Sprite *sprites, int n,
+                         int mode) {
+  static const CGBlendMode blend_modes[] = {
+    [draw__blit_copy] = kCGBlendModeCopy,
+    [draw__blit_over] = kCGBlendModeNormal,
+    [draw__blit_add]  = kCGBlendModePlusLighter
+  };
+  if (mode < draw__blit_copy || mode > draw__blit_add) {
+    fprintf(stderr, "Error in %s: unknown blit mode %d.\n", __FUNCTION__,
+            mode);
+    return;
+  }
+  draw__Bitmap ctx = c->bitmap;
+  if (ctx == NULL) return;
+
+  size_t h = CGBitmapContextGetHeight(ctx);
+  CGContextSaveGState(ctx);
+  if (c->num_clips) {
+    CGContextClipToRect(ctx, cg_rect_from_xy(c->clips[c->num_clips - 1]));
+  }
+  CGContextTranslateCTM(ctx, 0, h);
+  CGContextScaleCTM(ctx, 1.0, -1.0);
+  CGContextSetBlendMode(ctx, blend_modes[mode]);
+  CGContextSetInterpolationQuality(ctx, kCGInterpolationNone);
+
+  draw__Bitmap image_src = NULL;
+  CGImageRef   image     = NULL;
+  for (int i = 0; i < n; ++i) {
+    const draw__Sprite *sprite = &sprites[i];
+    if (sprite->src == NULL) continue;
+
+    // Take the pixels whose centers are in the rect, clipped to the source;
+    // (dx, dy) takes them to where they're drawn.
+    xy__Rect r  = sprite->src_rect;
+    double   x0 = ceil(fmin(r.xmin, r.xmax) - 0.5);
+    double   y0 = ceil(fmin(r.ymin, r.ymax) - 0.5);
+    double   x1 = ceil(fmax(r.xmin, r.xmax) - 0.5);
+    double   y1 = ceil(fmax(r.ymin, r.ymax) - 0.5);
+    double   dx = sprite->dst_x - x0, dy = sprite->dst_y - y0;
+    x0 = fmax(x0, 0);
+    y0 = fmax(y0, 0);
+    x1 = fmin(x1, CGBitmapContextGetWidth (sprite->src));
+    y1 = fmin(y1, CGBitmapContextGetHeight(sprite->src));
+    if (!(x0 < x1 && y0 < y1)) continue;
+
+    // Sprites outside the clip are skipped before any image is made.
+    xy__Rect visible = clipped(c, xy__rect_pts(x0 + dx, y0 + dy,
+                                               x1 + dx, y1 + dy));
+    if (is_empty(visible)) continue;
+    if (sprite->src != image_src) {
+      if (image) CGImageRelease(image);
+      image     = CGBitmapContextCreateImage(sprite->src);
+      image_src = sprite->src;
+    }
+
+    CGImageRef part = CGImageCreateWithImageInRect(
+        image, CGRectMake(x0, y0, x1 - x0, y1 - y0));
+    if (part == NULL) continue;
+    CGContextDrawImage(ctx, CGRectMake(x0 + dx, h - (y1 + dy), x1 - x0,
+                                       y1 - y0), part);
+    CGImageRelease(part);
+    mark(c, visible);
+  }
+  if (image) CGImageRelease(image);
+  CGContextRestoreGState(ctx);
+}
+
+// Command lists.
+
+void draw__ctx_begin_list(draw__Context *c) {
+  if (c->recording_list) {
+    fprintf(stderr, "Error in %s: a list is already being recorded.\n",
+            __FUNCTION__);
+    return;
+  }
+  c->recording_list = calloc(1, sizeof(*c->recording_list));
+}
+
+draw__List draw__ctx_end_list(draw__Context *c) {
+  draw__List list = c->recording_list;
+  if (list == NULL) {
+    fprintf(stderr, "Error in %s: no list is being recorded.\n", __FUNCTION__);
+    return NULL;
+  }
+  c->recording_list = NULL;
+
+  sort_cmds(list);
+  memcpy(list->fill_rgba,   c->fill_rgba,   sizeof(c->fill_rgba));
+  memcpy(list->stroke_rgba, c->stroke_rgba, sizeof(c->stroke_rgba));
+  return list;
+}
+
+void draw__ctx_execute_list(draw__Context *c, draw__List list) {
+  if (list == NULL) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < list->num_cmds; ++i) {
+      Cmd *cmd = &list->cmds[i];
+      add_cmd(c, cmd->op, cmd->rgba, cmd->rect);
+    }
+  } else {
+    // Draw each run of commands that share an op and a color in one call.
+    Cmd *cmds = list->cmds;
+    for (int i = 0, end; i < list->num_cmds; i = end) {
+      for (end = i + 1; end < list->num_cmds; ++end) {
+        if (cmds[end].op != cmds[i].op) break;
+        if (!same_rgba(cmds[end].rgba, cmds[i].rgba)) break;
+      }
+      if (cmds[i].op == cmd_fill_rect) {
+        memcpy(c->fill_rgba, cmds[i].rgba, sizeof(c->fill_rgba));
+        use_fill_color(c);
+      } else {
+        memcpy(c->stroke_rgba, cmds[i].rgba, sizeof(c->stroke_rgba));
+        use_stroke_color(c);
+      }
+      draw_run(c, cmds + i, end - i);
+    }
+  }
+
+  memcpy(c->fill_rgba,   list->fill_rgba,   sizeof(c->fill_rgba));
+  memcpy(c->stroke_rgba, list->stroke_rgba, sizeof(c->stroke_rgba));
+}
+
+// Each touched tile runs the commands that touch it, moved to the tile's
+// coordinates, with the clip moved the same way. Setting the tile in the
+// context applies the moved clip, and restoring the bitmap afterward
+// applies the original one.
+void draw__ctx_execute_list_on_tiles(draw__Context *c,
+                                     draw__TiledBitmap tiled,
+                                     draw__List list) {
+  if (tiled == NULL || list == NULL) return;
+  if (c->recording_list) {
+    fprintf(stderr, "Error in %s: tiles can't be drawn into while a list is "
+                    "being recorded.\n", __FUNCTION__);
+    return;
+  }
+
+  // Tiles outside the clip aren't made.
+  xy__Rect area = xy__rect_pts(0, 0, tiled->w, tiled->h);
+  if (c->num_clips) area = intersection_of(area, c->clips[c->num_clips - 1]);
+
+  TileHit *hits     = NULL;
+  int      num_hits = 0, hits_cap = 0;
+  for (int i = 0; i < list->num_cmds; ++i) {
+    add_tile_hits(area, &list->cmds[i], i, &hits, &num_hits, &hits_cap);
+  }
+  if (num_hits) qsort(hits, num_hits, sizeof(TileHit), compare_hits);
+
+  draw__Bitmap bitmap    = c->bitmap;
+  xy__Rect    *clips     = c->clips;
+  int          num_clips = c->num_clips;
+  xy__Rect     clip;
+  struct draw__ListStruct part = *list;
+  part.cmds = malloc((list->num_cmds + 1) * sizeof(Cmd));
+  for (int i = 0, end; i < num_hits; i = end) {
+    int tx = hits[i].tx, ty = hits[i].ty;
+    for (end = i + 1; end < num_hits; ++end) {
+      if (hits[end].tx != tx || hits[end].ty != ty) break;
+    }
+    double dx = -(double)tx * draw__tile_size;
+    double dy = -(double)ty * draw__tile_size;
+    part.num_cmds = end - i;
+    for (int k = 0; k < part.num_cmds; ++k) {
+      part.cmds[k]      = list->cmds[hits[i + k].cmd];
+      part.cmds[k].rect = offset_rect(part.cmds[k].rect, dx, dy);
+    }
+    if (num_clips) {
+      clip = offset_rect(clips[num_clips - 1], dx, dy);
+      c->clips     = &clip;
+      c->num_clips = 1;
+    }
+    draw__ctx_set_bitmap(c, draw__get_tile(tiled, tx, ty));
+    draw__ctx_execute_list(c, &part);
+  }
+  c->clips     = clips;
+  c->num_clips = num_clips;
+  draw__ctx_set_bitmap(c, bitmap);
+
+  // Executing no commands leaves the colors as the list does.
+  part.num_cmds = 0;
+  draw__ctx_execute_list(c, &part);
+  free(part.cmds);
+  free(hits);
+}
+
+void draw__delete_list(draw__List list) {
+  if (list == NULL) return;
+  if (default_context.recording_list == list) {
+    default_context.recording_list = NULL;
+  }
+  free(list->cmds);
+  free(list);
+}
+
+void draw__ctx_set_num_threads(draw__Context *c, int n) {
+  // Core graphics draws each list on the calling thread, so there's no
+  // thread count to set.
+}
+
+// Contexts.
+
+draw__Context *draw__new_context() {
+  draw__Context *c = calloc(1, sizeof(draw__Context));
+  memcpy(c->fill_rgba,   opaque_black, sizeof(c->fill_rgba));
+  memcpy(c->stroke_rgba, opaque_black, sizeof(c->stroke_rgba));
+  return c;
+}
+
+void draw__delete_context(draw__Context *c) {
+  if (c == NULL || c == &default_context) return;
+  draw__delete_list(c->recording_list);
+  free(c->scratch_rects);
+  free(c->scratch_pts);
+  free(c->clips);
+  free(c);
+}
+
+draw__Context *draw__get_default_context() {
+  return &default_context;
+}
+
+// These use the default context.
+
+void draw__set_bitmap(draw__Bitmap bitmap) {
+  draw__ctx_set_bitmap(&default_context, bitmap);
+}
+
+void draw__set_font(draw__Font new_font) {
+  draw__ctx_set_font(&default_context, new_font);
+}
+
+void draw__set_font_color(draw__Color color) {
+  draw__ctx_set_font_color(&default_context, color);
+}
+
+xy__Float draw__string(const char *s, int x, int y, int w, float pos) {
+  return draw__ctx_string(&default_context, s, x, y, w, pos);
+}
+
+draw__TextMetrics draw__measure_string(const char *s) {
+  return draw__ctx_measure_string(&default_context, s);
+}
+
+void draw__measure_strings(const char **strs, int n, draw__TextMetrics *out) {
+  draw__ctx_measure_strings(&default_context, strs, n, out);
+}
+
+xy__Float draw__text_box(const char *s, xy__Rect rect, float align, int wrap) {
+  return draw__ctx_text_box(&default_context, s, rect, align, wrap);
+}
+
 void draw__rgb_fill_color(double r, double g, double b) {
-  CGContextSetRGBFillColor(ctx, r, g, b, 1.0);
+  draw__ctx_rgb_fill_color(&default_context, r, g, b);
 }
 
 void draw__rgb_stroke_color(double r, double g, double b) {
-  CGContextSetRGBStrokeColor(ctx, r, g, b, 1.0);
+  draw__ctx_rgb_stroke_color(&default_context, r, g, b);
+}
+
+void draw__rgba_fill_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_fill_color(&default_context, r, g, b, a);
 }
 
+void draw__rgba_stroke_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_stroke_color(&default_context, r, g, b, a);
+}
 
-// Shapes and lines.
+void draw__fill_color32(draw__Rgba32 color) {
+  draw__ctx_fill_color32(&default_context, color);
+}
+
+void draw__stroke_color32(draw__Rgba32 color) {
+  draw__ctx_stroke_color32(&default_context, color);
+}
+
+void draw__set_gamma_blending(int is_on) {
+  draw__ctx_set_gamma_blending(&default_context, is_on);
+}
+
+void draw__push_clip(xy__Rect rect) {
+  draw__ctx_push_clip(&default_context, rect);
+}
+
+void draw__pop_clip() {
+  draw__ctx_pop_clip(&default_context);
+}
 
 void draw__fill_rect(xy__Rect rect) {
-  CGContextFillRect(ctx, cg_rect_from_xy(rect));
+  draw__ctx_fill_rect(&default_context, rect);
 }
 
 void draw__stroke_rect(xy__Rect rect) {
-  CGContextStrokeRect(ctx, cg_rect_from_xy(rect));
+  draw__ctx_stroke_rect(&default_context, rect);
 }
 
 void draw__line(xy__Float x1, xy__Float y1, xy__Float x2, xy__Float y2) {
-  CGContextMoveToPoint   (ctx, x1, y1);
-  CGContextAddLineToPoint(ctx, x2, y2);
-  CGContextStrokePath    (ctx);
+  draw__ctx_line(&default_context, x1, y1, x2, y2);
+}
+
+void draw__lines(const xy__Pt *pts, int n, int mode) {
+  draw__ctx_lines(&default_context, pts, n, mode);
+}
+
+void draw__fill_polygon(const xy__Pt *pts, int n, int rule) {
+  draw__ctx_fill_polygon(&default_context, pts, n, rule);
+}
+
+void draw__blit(draw__Bitmap src, xy__Rect src_rect, int dst_x, int dst_y,
+                int mode) {
+  draw__ctx_blit(&default_context, src, src_rect, dst_x, dst_y, mode);
+}
+
+void draw__blit_many(const draw__Sprite *sprites, int n, int mode) {
+  draw__ctx_blit_many(&default_context, sprites, n, mode);
+}
+
+void draw__begin_list() {
+  draw__ctx_begin_list(&default_context);
+}
+
+draw__List draw__end_list() {
+  return draw__ctx_end_list(&default_context);
+}
+
+void draw__execute_list(draw__List list) {
+  draw__ctx_execute_list(&default_context, list);
+}
+
+void draw__execute_list_on_tiles(draw__TiledBitmap tiled, draw__List list) {
+  draw__ctx_execute_list_on_tiles(&default_context, tiled, list);
 }
 
+void draw__set_num_threads(int n) {
+  draw__ctx_set_num_threads(&default_context, n);
+}
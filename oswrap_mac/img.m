@@ -14,8 +14,8 @@
 static CGContextRef CreateARGBBitmapContext (CGImageRef inImage) {
   CGContextRef    context = NULL;
   CGColorSpaceRef colorSpace;
-  int             bitmapByteCount;
-  int             bitmapBytesPerRow;
+  size_t          bitmapByteCount;
+  size_t          bitmapBytesPerRow;
 
   // Get image width, height. We'll use the entire image.
   size_t pixelsWide = CGImageGetWidth(inImage);
@@ -24,8 +24,8 @@ static CGContextRef CreateARGBBitmapContext (CGImageRef inImage) {
   // Declare the number of bytes per row. Each pixel in the bitmap in this
   // example is represented by 4 bytes; 8 bits each of red, green, blue, and
   // alpha.
-  bitmapBytesPerRow   = (int)(pixelsWide * 4);
-  bitmapByteCount     = (int)(bitmapBytesPerRow * pixelsHigh);
+  bitmapBytesPerRow   = pixelsWide * 4;
+  bitmapByteCount     = bitmapBytesPerRow * pixelsHigh;
 
   // Use the generic RGB color space.
   colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGB);
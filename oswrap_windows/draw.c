@@ -8,126 +8,2158 @@
 #include "cbit.h"
 #include "winutil.h"
 
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define has_sse2 true
+#include <emmintrin.h>
+#else
+#define has_sse2 false
+#endif
+
+#define max_look_back       16
+#define max_dirty_rects     8
+#define default_pool_budget (32 << 20)
+#define num_size_classes    65  // One for each bit length of a size_t.
+#define max_bitmap_width    (INT_MAX / 4)  // So the stride fits in an int.
+#define max_blur_radius     8192
+#define max_text_layouts    32
+
 
 // Internal types and globals.
 
+// The parts of a bitmap changed by draw calls since it was last cleared,
+// as whole-pixel rects; see draw__get_dirty_rects.
+typedef struct {
+  xy__Rect rects[max_dirty_rects + 1];  // There's room to add one more.
+  int      num_rects;
+} Dirty;
+
 // This struct is designed to allow for casting between
 // the Bitmap * and HBITMAP * types.
-typedef struct {
+typedef struct Bitmap {
   HBITMAP bitmap;
   char *  bytes;
   int     x_size;
   int     y_size;
-} Bitmap;
+  Dirty   dirty;
+  bit     is_shared;  // True when the pixels are in the caller's section.
+
+  // Views share the pixels and HBITMAP of their parent from (x0, y0) on;
+  // see draw__new_bitmap_view. A parent is never itself a view, and other
+  // bitmaps have no parent and (x0, y0) = (0, 0).
+  struct Bitmap *parent;
+  int            x0;
+  int            y0;
 
-// Drawing happens with these objects.
-static HDC     active_hdc    = NULL;
-static Bitmap *active_bitmap = NULL;
+  // GDI can't draw into memory it didn't allocate, so a bitmap made by
+  // draw__new_bitmap_with_data draws into its own pixels and copies the
+  // unsynced ones out to user_bytes after each draw call; see copy_out.
+  char *user_bytes;
+  int   user_stride;
+  Dirty unsynced;
+
+  struct Bitmap *next;  // The next bitmap in its pool list.
+} Bitmap;
 
 // Handles that are useful for deselecting user-made objects.
 static HBITMAP system_bitmap  = NULL;
 static HFONT   system_font    = NULL;
 
+// A recorded drawing command. Each command keeps the color that was set
+// when it was recorded, so replaying a list only changes colors between
+// runs of differently-colored commands.
+
+enum {
+  cmd_fill_rect,
+  cmd_stroke_rect,
+  cmd_line  // The rect holds the line's endpoints as (xmin, ymin, xmax, ymax).
+};
+
+typedef struct {
+  int      op;
+  COLORREF color;
+  xy__Rect rect;
+} Cmd;
+
+struct draw__ListStruct {
+  Cmd     *cmds;
+  int      num_cmds;
+  int      cmds_cap;
+
+  // The colors that were set when recording ended.
+  COLORREF fill_color;
+  COLORREF stroke_color;
+};
+
+// Each context draws with its own hdc, since GDI objects selected into an
+// hdc are only safe to use from one thread at a time.
+struct draw__ContextStruct {
+  HDC        hdc;
+  Bitmap    *bitmap;
+
+  // The colors of the selected brush and pen; GDI starts with a white brush
+  // and a black pen.
+  COLORREF   fill_color;
+  COLORREF   stroke_color;
+
+  // When this is non-NULL, shapes and lines are added to it instead of drawn.
+  draw__List recording_list;
+
+  // Reusable space for passing many lines to GDI at once.
+  POINT     *scratch_pts;
+  DWORD     *scratch_counts;
+  int        scratch_cap;
+
+  // The text metrics of the most recently measured font.
+  HFONT      metrics_font;
+  TEXTMETRIC metrics;
+
+  // Each clip rect has whole-pixel edges and is within the clip below it,
+  // so the top one is where drawing may happen; it's kept selected into
+  // the hdc as a clip region.
+  xy__Rect  *clips;
+  int        num_clips;
+  int        clips_cap;
+};
+
+#define new_context_values { NULL, NULL, RGB(255, 255, 255), RGB(0, 0, 0) }
+
+static draw__Context default_context = new_context_values;
+
+// Deleted bitmaps kept for reuse. The list pool[i] holds the bitmaps whose
+// byte counts are i bits long, most recently deleted first.
+static Bitmap         *pool[num_size_classes];
+static draw__PoolStats pool_stats = { 0, 0, 0, 0, 0, default_pool_budget };
+
+// These guard the pool, which all contexts share, and the setup done by
+// init_if_needed.
+static SRWLOCK pool_lock = SRWLOCK_INIT;
+static SRWLOCK init_lock = SRWLOCK_INIT;
+
+// An atlas packs regions into its bitmap using a skyline, which is the top
+// edge of the packed regions as segments from left to right. The segments
+// span the bitmap's width, and each region is placed where its top is
+// lowest.
+
+typedef struct {
+  int x;
+  int y;  // The lowest row that's free above the segment.
+  int w;
+} Segment;
+
+struct draw__AtlasStruct {
+  draw__Bitmap  bitmap;
+  int           w;
+  int           h;
+
+  Segment      *segments;  // There's room for w, as each is at least 1 wide.
+  int           num_segments;
+
+  draw__Bitmap *views;
+  int           num_views;
+  int           views_cap;
+};
+
+
+// A tiled bitmap keeps its tiles in rows, and a row's array of tiles is
+// only made once one of its tiles is. Missing tiles are NULL.
+struct draw__TiledBitmapStruct {
+  int            w;
+  int            h;
+  int            tiles_x;
+  int            tiles_y;
+  draw__Bitmap **rows;
+};
+
+// A command of a list that touches tile (tx, ty).
+typedef struct {
+  int tx;
+  int ty;
+  int cmd;
+} TileHit;
+
+// A text box's string is split into words, each a run of non-space bytes
+// and the spaces after it. A newline ends the word before it and breaks the
+// line there. Words keep their widths, so wrapping them to a new width
+// doesn't measure any text.
+typedef struct {
+  size_t    chars_end;    // The byte after the word's last non-space byte.
+  size_t    end;          // The byte after its spaces and newline.
+  xy__Float width;        // The width of its non-space bytes.
+  xy__Float space_width;  // The width of its spaces.
+  bit       ends_line;    // True when it ends with a newline.
+} Word;
+
+// The words and lines of a string drawn by draw__text_box in one font.
+// Line i is the words from lines[i] up to lines[i + 1], or up to the end
+// for the last line. Layouts are kept in a list from most to least
+// recently used.
+typedef struct TextLayout {
+  struct TextLayout *newer;
+  struct TextLayout *older;
+
+  draw__Font font;
+  uint64_t   hash;
+  char      *text;
+  size_t     len;
+
+  Word      *words;
+  int        num_words;
+  int        words_cap;
+
+  int       *lines;
+  int        num_lines;
+  int        lines_cap;
+  bit        is_wrapped;  // True when the lines are wrapped to width.
+  xy__Float  width;
+} TextLayout;
+
+// Text box layouts are shared by every thread, so they're only used while
+// holding layouts_lock.
+static TextLayout *newest_layout = NULL;
+static TextLayout *oldest_layout = NULL;
+static int         num_layouts   = 0;
+static SRWLOCK     layouts_lock  = SRWLOCK_INIT;
+
+
+// Internal functions.
+
+static intptr_t err_msg(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  char *str;
+  vasprintf(&str, fmt, args);
+  va_end(args);
+
+  OutputDebugString(str);
+
+  return 0;
+}
+
+static HDC new_hdc() {
+  HDC hdc = CreateCompatibleDC(NULL);
+
+  if (hdc == NULL) err_msg("Error: CreateCompatibleDC failed.\n");
+
+  SetGraphicsMode(hdc, GM_ADVANCED);
+  SetBkMode(hdc, TRANSPARENT);
+
+  return hdc;
+}
+
+static void init_if_needed() {
+  static bit is_initialized = false;
+  AcquireSRWLockExclusive(&init_lock);
+  if (!is_initialized) {
+    default_context.hdc = new_hdc();
+
+    // Keep handles to the objects a new hdc starts with so we may later
+    // deselect a bitmap or font from an hdc.
+    system_bitmap = (HBITMAP)GetCurrentObject(default_context.hdc, OBJ_BITMAP);
+    system_font   = (HFONT)  GetCurrentObject(default_context.hdc, OBJ_FONT);
+
+    is_initialized = true;
+  }
+  ReleaseSRWLockExclusive(&init_lock);
+}
+
+static void UseObject(HDC hdc, HGDIOBJ obj) {
+  HGDIOBJ old_obj = SelectObject(hdc, obj);
+  if (old_obj != obj) DeleteObject(old_obj);
+}
+
+static xy__Float area_of(xy__Rect r) {
+  return (r.xmax - r.xmin) * (r.ymax - r.ymin);
+}
+
+// Returns the overlap of two rects with min <= max on each axis. An empty
+// overlap keeps min <= max so that it isn't read as a flipped rect.
+static xy__Rect intersection_of(xy__Rect a, xy__Rect b) {
+  xy__Rect r = xy__rect_pts(fmax(a.xmin, b.xmin), fmax(a.ymin, b.ymin),
+                            fmin(a.xmax, b.xmax), fmin(a.ymax, b.ymax));
+  if (r.xmax < r.xmin) r.xmax = r.xmin;
+  if (r.ymax < r.ymin) r.ymax = r.ymin;
+  return r;
+}
+
+static bit is_empty(xy__Rect r) {
+  return !(r.xmin < r.xmax && r.ymin < r.ymax);
+}
+
+static xy__Rect union_of(xy__Rect a, xy__Rect b) {
+  return xy__rect_pts(fmin(a.xmin, b.xmin), fmin(a.ymin, b.ymin),
+                      fmax(a.xmax, b.xmax), fmax(a.ymax, b.ymax));
+}
+
+// Adds r to the dirty rects. To keep the list short, any two rects whose
+// union is no bigger than their areas together are merged, which joins
+// rects that overlap or line up. Past max_dirty_rects, the pair whose
+// union adds the least area is merged.
+static void add_dirty(Dirty *d, xy__Rect r) {
+  if (!(r.xmin < r.xmax && r.ymin < r.ymax)) return;
+  for (int i = 0; i < d->num_rects; ++i) {
+    if (area_of(union_of(d->rects[i], r)) == area_of(d->rects[i])) return;
+  }
+  d->rects[d->num_rects++] = r;
+
+  while (d->num_rects > 1) {
+    int       best_i = 0, best_j = 1;
+    xy__Float best_cost = INFINITY;
+    for (int i = 0; i < d->num_rects; ++i) {
+      for (int j = i + 1; j < d->num_rects; ++j) {
+        xy__Rect *a = &d->rects[i], *b = &d->rects[j];
+        xy__Float cost = area_of(union_of(*a, *b)) - area_of(*a) -
+                         area_of(*b);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_i    = i;
+          best_j    = j;
+        }
+      }
+    }
+    if (best_cost > 0 && d->num_rects <= max_dirty_rects) break;
+    d->rects[best_i] = union_of(d->rects[best_i], d->rects[best_j]);
+    d->rects[best_j] = d->rects[--d->num_rects];
+  }
+}
+
+// Adds the whole pixels that r touches, clipped to a w x h bitmap, and
+// returns them.
+static xy__Rect mark_dirty(Dirty *d, int w, int h, xy__Rect r) {
+  xy__Rect pixels;
+  pixels.xmin = fmax(floor(fmin(r.xmin, r.xmax)), 0);
+  pixels.ymin = fmax(floor(fmin(r.ymin, r.ymax)), 0);
+  pixels.xmax = fmin(ceil (fmax(r.xmin, r.xmax)), w);
+  pixels.ymax = fmin(ceil (fmax(r.ymin, r.ymax)), h);
+  add_dirty(d, pixels);
+  return pixels;
+}
+
+// Adds r to the dirty rects of b, and of its parent when it's a view.
+static void mark_bitmap(Bitmap *b, xy__Rect r) {
+  xy__Rect pixels = mark_dirty(&b->dirty, b->x_size, b->y_size, r);
+  if (b->parent) {
+    add_dirty(&b->parent->dirty,
+              xy__rect_pts(pixels.xmin + b->x0, pixels.ymin + b->y0,
+                           pixels.xmax + b->x0, pixels.ymax + b->y0));
+  }
+  Bitmap *root = b->parent ? b->parent : b;
+  if (root->user_bytes) {
+    add_dirty(&root->unsynced,
+              xy__rect_pts(pixels.xmin + b->x0, pixels.ymin + b->y0,
+                           pixels.xmax + b->x0, pixels.ymax + b->y0));
+  }
+}
+
+// Adds r to the dirty rects of the context's bitmap.
+static void mark(draw__Context *c, xy__Rect r) {
+  if (c->bitmap) mark_bitmap(c->bitmap, r);
+}
+
+// Returns the bitmap whose pixels b uses, which is b unless it's a view.
+static Bitmap *root_of(Bitmap *b) {
+  return b->parent ? b->parent : b;
+}
+
+// Sets the hdc's transform so that (0, 0) is the lower-left corner of the
+// context's bitmap with y going up, or its upper-left corner with y going
+// down when is_top_down; GDI draws text upside-down otherwise. Views are
+// offset to their place in their parent.
+static void set_transform(draw__Context *c, bit is_top_down) {
+  Bitmap *b      = c->bitmap;
+  FLOAT   x      = (FLOAT)b->x0;
+  FLOAT   top    = (FLOAT)(root_of(b)->y_size - b->y0 - b->y_size);
+  FLOAT   bottom = top + b->y_size - 1;
+  XFORM   down   = { 1.0f, 0.0f, 0.0f,  1.0f, x, top };
+  XFORM   up     = { 1.0f, 0.0f, 0.0f, -1.0f, x, bottom };
+  SetWorldTransform(c->hdc, is_top_down ? &down : &up);
+}
+
+// Returns the part of r inside the context's bitmap and clip, with
+// min <= max. It's empty when r misses them, and such commands are skipped
+// before reaching GDI.
+static xy__Rect visible_part(draw__Context *c, xy__Rect r) {
+  Bitmap *b = c->bitmap;
+  if (b == NULL) return xy__rect_pts(0, 0, 0, 0);
+  r = xy__rect_pts(fmin(r.xmin, r.xmax), fmin(r.ymin, r.ymax),
+                   fmax(r.xmin, r.xmax), fmax(r.ymin, r.ymax));
+  r = intersection_of(r, xy__rect_pts(0, 0, b->x_size, b->y_size));
+  if (c->num_clips) r = intersection_of(r, c->clips[c->num_clips - 1]);
+  return r;
+}
+
+// Clips the hdc to the context's clip and, for a view, to its part of the
+// HBITMAP. Regions are in device coordinates, which go down from the
+// HBITMAP's top row.
+static void select_clip(draw__Context *c) {
+  Bitmap *b = c->bitmap;
+  if (b->parent == NULL && c->num_clips == 0) {
+    SelectClipRgn(c->hdc, NULL);
+    return;
+  }
+  xy__Rect r    = visible_part(c, xy__rect_pts(0, 0, b->x_size, b->y_size));
+  int      top  = root_of(b)->y_size - b->y0 - (int)r.ymax;
+  HRGN     clip = CreateRectRgn(b->x0 + (int)r.xmin, top, b->x0 + (int)r.xmax,
+                                top + (int)(r.ymax - r.ymin));
+  SelectClipRgn(c->hdc, clip);
+  DeleteObject(clip);
+}
+
+// Returns the metrics of the font selected into the context's hdc.
+static TEXTMETRIC *font_metrics(draw__Context *c) {
+  HFONT font = (HFONT)GetCurrentObject(c->hdc, OBJ_FONT);
+  if (font != c->metrics_font) {
+    if (!GetTextMetrics(c->hdc, &c->metrics)) {
+      err_msg("Error: GetTextMetrics failed in %s.\n", __FUNCTION__);
+      memset(&c->metrics, 0, sizeof(c->metrics));
+      font = NULL;
+    }
+    c->metrics_font = font;
+  }
+  return &c->metrics;
+}
+
+// The bitmap pool.
+
+static size_t bytes_of(Bitmap *b) {
+  return (size_t)4 * b->x_size * b->y_size;
+}
+
+static int size_class(size_t bytes) {
+  int c = 0;
+  for (; bytes; bytes >>= 1) ++c;
+  return c;
+}
+
+// Ensures the bitmap is not selected into the context's hdc.
+// A view's HBITMAP is its parent's, so it's only deselected for a view when
+// that view is the context's bitmap.
+static void deselect(draw__Context *c, Bitmap *b) {
+  HBITMAP current_bitmap = (HBITMAP)GetCurrentObject(c->hdc, OBJ_BITMAP);
+  if (current_bitmap == b->bitmap && (b->parent == NULL || c->bitmap == b)) {
+    SelectObject(c->hdc, system_bitmap);
+    SelectClipRgn(c->hdc, NULL);
+  }
+  if (c->bitmap == b) c->bitmap = NULL;
+}
+
+static void free_bitmap(Bitmap *b) {
+  if (b->parent == NULL) DeleteObject(b->bitmap);
+  free(b);
+}
+
+// Frees pooled bitmaps, largest first, until the pool holds at most
+// max_bytes. Within a size class, the least recently deleted go first.
+static void trim_pool(size_t max_bytes) {
+  for (int c = num_size_classes - 1; c >= 0; --c) {
+    while (pool[c] && pool_stats.resident_bytes > max_bytes) {
+      Bitmap **link = &pool[c];
+      while ((*link)->next) link = &(*link)->next;
+      Bitmap *b = *link;
+      *link = NULL;
+      pool_stats.num_bitmaps--;
+      pool_stats.resident_bytes -= bytes_of(b);
+      pool_stats.evictions++;
+      free_bitmap(b);
+    }
+  }
+}
+
+// Keeps b for reuse if it fits in the pool's budget, and frees it otherwise.
+static void pool_bitmap(Bitmap *b) {
+  size_t bytes = bytes_of(b);
+  if (b->is_shared || b->parent || b->user_bytes ||
+      bytes > pool_stats.budget) {
+    free_bitmap(b);
+    return;
+  }
+  trim_pool(pool_stats.budget - bytes);
+  int c = size_class(bytes);
+  b->next = pool[c];
+  pool[c] = b;
+  pool_stats.num_bitmaps++;
+  pool_stats.resident_bytes += bytes;
+}
+
+// Takes a w x h bitmap out of the pool, or returns NULL if there isn't one.
+static Bitmap *pooled_bitmap(int w, int h) {
+  size_t bytes = (size_t)4 * w * h;
+  for (Bitmap **link = &pool[size_class(bytes)]; *link; link = &(*link)->next) {
+    Bitmap *b = *link;
+    if (b->x_size != w || b->y_size != h) continue;
+    *link = b->next;
+    pool_stats.num_bitmaps--;
+    pool_stats.resident_bytes -= bytes;
+    return b;
+  }
+  return NULL;
+}
+
+// Pixel conversion.
+//
+// Bitmap pixels have the bytes B, G, R, A, which is the little-endian
+// value B | G << 8 | R << 16 | A << 24.
+
+static uint8_t straight(uint32_t c, uint32_t a) {
+  uint32_t v = (c * 255 + a / 2) / a;
+  return v > 255 ? 255 : v;
+}
+
+static void convert_pixels_slowly(uint8_t *dst, const uint8_t *src, int n,
+                                  draw__Format format, bit to_straight) {
+  static const int byte_of_channel[][4] = {  // Indexed by format, then BGRA.
+    [draw__rgba] = { 2, 1, 0, 3 },
+    [draw__bgra] = { 0, 1, 2, 3 },
+    [draw__argb] = { 3, 2, 1, 0 }
+  };
+  const int *to = byte_of_channel[format];
+  for (int i = 0; i < n; ++i, src += 4, dst += 4) {
+    uint8_t bgra[4] = { src[0], src[1], src[2], src[3] };
+    if (to_straight) {
+      for (int j = 0; j < 3; ++j) {
+        bgra[j] = bgra[3] ? straight(bgra[j], bgra[3]) : 0;
+      }
+    }
+    for (int j = 0; j < 4; ++j) dst[to[j]] = bgra[j];
+  }
+}
+
+#if has_sse2
+
+// Converts the channel c, in the low byte of each 32-bit lane, to straight
+// alpha. Truncating the float division matches the integer division in
+// straight(); lanes with zero alpha become 0.
+static __m128i straight4(__m128i c, __m128i a, __m128i zero_alpha) {
+  __m128i num = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 8), c),
+                              _mm_srli_epi32(a, 1));
+  __m128i v   = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(num),
+                                            _mm_cvtepi32_ps(a)));
+  __m128i max = _mm_set1_epi32(255);
+  __m128i big = _mm_cmpgt_epi32(v, max);
+  v = _mm_or_si128(_mm_andnot_si128(big, v), _mm_and_si128(big, max));
+  return _mm_andnot_si128(zero_alpha, v);
+}
+
+// Converts four pixels at a time by splitting their channels into lanes,
+// then shifting each channel to its place in the output.
+static void convert_pixels(uint8_t *dst, const uint8_t *src, int n,
+                           draw__Format format, bit to_straight) {
+  __m128i byte = _mm_set1_epi32(0xff);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((__m128i *)(src + 4 * i));
+    __m128i b = _mm_and_si128(p, byte);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), byte);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), byte);
+    __m128i a = _mm_srli_epi32(p, 24);
+    if (to_straight) {
+      __m128i zero_alpha = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+      r = straight4(r, a, zero_alpha);
+      g = straight4(g, a, zero_alpha);
+      b = straight4(b, a, zero_alpha);
+    }
+    __m128i hi_a = _mm_slli_epi32(a, 24);
+    if (format == draw__rgba) {
+      p = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                       _mm_or_si128(_mm_slli_epi32(b, 16), hi_a));
+    } else if (format == draw__bgra) {
+      p = _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                       _mm_or_si128(_mm_slli_epi32(r, 16), hi_a));
+    } else {
+      p = _mm_or_si128(_mm_or_si128(a, _mm_slli_epi32(r, 8)),
+                       _mm_or_si128(_mm_slli_epi32(g, 16),
+                                    _mm_slli_epi32(b, 24)));
+    }
+    _mm_storeu_si128((__m128i *)(dst + 4 * i), p);
+  }
+  convert_pixels_slowly(dst + 4 * i, src + 4 * i, n - i, format, to_straight);
+}
+
+#else
+
+#define convert_pixels convert_pixels_slowly
+
+#endif
+
+// Blending.
+//
+// Channels are scaled by alpha the same way in every version, so the
+// results don't depend on whether SSE2 is available.
+
+static uint8_t scale(uint32_t c, uint32_t a) {
+  uint32_t v = c * a + 128;
+  return (v + (v >> 8)) >> 8;
+}
+
+static void composite_pixels_slowly(uint32_t *dst, const uint32_t *src,
+                                    int n) {
+  for (int i = 0; i < n; ++i) {
+    if (src[i] == 0) continue;
+    uint8_t       *d   = (uint8_t *)&dst[i];
+    const uint8_t *s   = (const uint8_t *)&src[i];
+    uint32_t       inv = 255 - s[3];
+    for (int j = 0; j < 4; ++j) d[j] = s[j] + scale(d[j], inv);
+  }
+}
+
+static void add_pixels_slowly(uint32_t *dst, const uint32_t *src, int n) {
+  uint8_t       *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+  for (int i = 0; i < 4 * n; ++i) {
+    uint32_t sum = d[i] + s[i];
+    d[i] = sum > 255 ? 255 : sum;
+  }
+}
+
+#if has_sse2
+
+// Scales the 16-bit channels in v by the matching channels in a / 255.
+static __m128i scale16(__m128i v, __m128i a) {
+  v = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+// Returns 255 minus each pixel's alpha, in all four of its 16-bit channels.
+static __m128i inv_alpha16(__m128i v) {
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+  return _mm_sub_epi16(_mm_set1_epi16(255), v);
+}
+
+// Runs of four zero or four opaque source pixels are skipped or copied
+// without blending, since sprites are mostly one or the other.
+static void composite_pixels(uint32_t *dst, const uint32_t *src, int n) {
+  __m128i zero  = _mm_setzero_si128();
+  __m128i alpha = _mm_set1_epi32((int)0xff000000);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff) continue;
+    __m128i a = _mm_and_si128(s, alpha);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) != 0xffff) {
+      __m128i d  = _mm_loadu_si128((__m128i *)(dst + i));
+      __m128i lo = scale16(_mm_unpacklo_epi8(d, zero),
+                           inv_alpha16(_mm_unpacklo_epi8(s, zero)));
+      __m128i hi = scale16(_mm_unpackhi_epi8(d, zero),
+                           inv_alpha16(_mm_unpackhi_epi8(s, zero)));
+      s = _mm_add_epi8(_mm_packus_epi16(lo, hi), s);
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), s);
+  }
+  composite_pixels_slowly(dst + i, src + i, n - i);
+}
+
+static void add_pixels(uint32_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(d, s));
+  }
+  add_pixels_slowly(dst + i, src + i, n - i);
+}
+
+#else
+
+#define composite_pixels composite_pixels_slowly
+#define add_pixels       add_pixels_slowly
+
+#endif
+
+// DIB rows are 4-byte aligned, so there's no gap between rows of pixels.
+static int stride_of(Bitmap *b) {
+  return 4 * root_of(b)->x_size;
+}
+
+static uint32_t *row(Bitmap *b, int y) {
+  return (uint32_t *)(b->bytes + (size_t)y * stride_of(b));
+}
+
+// Copies the pixels drawn since the last call out to the caller's memory
+// when b's pixels are in draw__new_bitmap_with_data's pixels.
+static void copy_out(Bitmap *b) {
+  if (b == NULL) return;
+  Bitmap *root = root_of(b);
+  if (root->user_bytes == NULL || root->unsynced.num_rects == 0) return;
+  GdiFlush();  // Finish GDI's drawing before reading its pixels.
+  for (int i = 0; i < root->unsynced.num_rects; ++i) {
+    xy__Rect r = root->unsynced.rects[i];
+    int      x = (int)r.xmin;
+    int      n = (int)r.xmax - x;
+    for (int y = (int)r.ymin; y < (int)r.ymax; ++y) {
+      memcpy(root->user_bytes + (size_t)y * root->user_stride + 4 * x,
+             row(root, y) + x, n * sizeof(uint32_t));
+    }
+  }
+  root->unsynced.num_rects = 0;
+}
+
+// Copies the sprite's pixels into the area of b, which has whole-pixel
+// edges within b, clipped to the source bitmap, and marks the pixels
+// changed as dirty. The rect covers the pixels whose centers it contains;
+// (dx, dy) takes them from src to b.
+static void blit(Bitmap *b, xy__Rect area, const draw__Sprite *sprite,
+                 int mode) {
+  Bitmap  *src = (Bitmap *)sprite->src;
+  xy__Rect r   = sprite->src_rect;
+  if (src == NULL) return;
+
+  double x0 = ceil(fmin(r.xmin, r.xmax) - 0.5);
+  double y0 = ceil(fmin(r.ymin, r.ymax) - 0.5);
+  double x1 = ceil(fmax(r.xmin, r.xmax) - 0.5);
+  double y1 = ceil(fmax(r.ymin, r.ymax) - 0.5);
+  double dx = sprite->dst_x - x0, dy = sprite->dst_y - y0;
+  x0 = fmax(fmax(x0, 0), area.xmin - dx);
+  y0 = fmax(fmax(y0, 0), area.ymin - dy);
+  x1 = fmin(fmin(x1, src->x_size), area.xmax - dx);
+  y1 = fmin(fmin(y1, src->y_size), area.ymax - dy);
+  if (!(x0 < x1 && y0 < y1)) return;
+
+  int sx = (int)x0, sy = (int)y0, tx = (int)(x0 + dx), ty = (int)(y0 + dy);
+  int n  = (int)(x1 - x0), h = (int)(y1 - y0);
+
+  // A bitmap blitted into itself may have its source pixels drawn over
+  // before they're read, so they're read from a copy.
+  uint32_t *copy = NULL;
+  if (root_of(src) == root_of(b)) {
+    copy = malloc((size_t)n * h * sizeof(uint32_t));
+    for (int i = 0; i < h; ++i) {
+      memcpy(copy + (size_t)i * n, row(src, sy + i) + sx,
+             n * sizeof(uint32_t));
+    }
+  }
+
+  for (int i = 0; i < h; ++i) {
+    const uint32_t *from = copy ? copy + (size_t)i * n : row(src, sy + i) + sx;
+    uint32_t       *to   = row(b, ty + i) + tx;
+    switch (mode) {
+      case draw__blit_copy: memcpy(to, from, n * sizeof(uint32_t)); break;
+      case draw__blit_over: composite_pixels(to, from, n);           break;
+      case draw__blit_add:  add_pixels(to, from, n);                 break;
+    }
+  }
+  free(copy);
+  mark_bitmap(b, xy__rect_pts(tx, ty, tx + n, ty + h));
+}
+
+// Mipmaps.
+//
+// Colors are averaged as squares and clamped to their alpha so that they
+// stay premultiplied. The filter treats the color channels alike, so their
+// order doesn't matter.
+
+static void downsample_slowly(uint32_t *dst, const uint32_t *src0,
+                              const uint32_t *src1, int n) {
+  for (int i = 0; i < n; ++i) {
+    const uint8_t *p[4] = {
+      (const uint8_t *)&src0[2 * i], (const uint8_t *)&src0[2 * i + 1],
+      (const uint8_t *)&src1[2 * i], (const uint8_t *)&src1[2 * i + 1]
+    };
+    uint8_t *out   = (uint8_t *)&dst[i];
+    uint32_t alpha = (p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) >> 2;
+    for (int j = 0; j < 3; ++j) {
+      uint32_t sum = p[0][j] * p[0][j] + p[1][j] * p[1][j] +
+                     p[2][j] * p[2][j] + p[3][j] * p[3][j];
+      uint32_t c   = (uint32_t)(sqrtf(sum * 0.25f) + 0.5f);
+      out[j] = c > alpha ? alpha : c;
+    }
+    out[3] = alpha;
+  }
+}
+
+#if has_sse2
+
+// Adds the two pixels in v, which have 16 bits per channel, giving one
+// pixel with 32 bits per channel.
+static __m128i pair_sum(__m128i v) {
+  __m128i zero = _mm_setzero_si128();
+  return _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                       _mm_unpackhi_epi16(v, zero));
+}
+
+// Returns one output pixel from the sums of its squares and of its values,
+// with 16-bit colors in the low half and 16-bit alphas in the high half.
+static __m128i mip_pixel(__m128i sq, __m128i v) {
+  __m128  mean  = _mm_mul_ps(_mm_cvtepi32_ps(sq), _mm_set1_ps(0.25f));
+  __m128i c     = _mm_cvttps_epi32(_mm_add_ps(_mm_sqrt_ps(mean),
+                                              _mm_set1_ps(0.5f)));
+  __m128i alpha = _mm_srli_epi32(_mm_add_epi32(v, _mm_set1_epi32(2)), 2);
+  return _mm_packs_epi32(c, alpha);
+}
+
+// Each pass turns four pixels from each row into two output pixels.
+static void downsample(uint32_t *dst, const uint32_t *src0,
+                       const uint32_t *src1, int n) {
+  __m128i zero     = _mm_setzero_si128();
+  __m128i is_alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i r0  = _mm_loadu_si128((__m128i *)(src0 + 2 * i));
+    __m128i r1  = _mm_loadu_si128((__m128i *)(src1 + 2 * i));
+    __m128i lo0 = _mm_unpacklo_epi8(r0, zero);
+    __m128i lo1 = _mm_unpacklo_epi8(r1, zero);
+    __m128i hi0 = _mm_unpackhi_epi8(r0, zero);
+    __m128i hi1 = _mm_unpackhi_epi8(r1, zero);
+
+    // The squares fit in 16 bits, but their sums don't.
+    __m128i sq0 = _mm_add_epi32(pair_sum(_mm_mullo_epi16(lo0, lo0)),
+                                pair_sum(_mm_mullo_epi16(lo1, lo1)));
+    __m128i sq1 = _mm_add_epi32(pair_sum(_mm_mullo_epi16(hi0, hi0)),
+                                pair_sum(_mm_mullo_epi16(hi1, hi1)));
+    __m128i p0  = mip_pixel(sq0, pair_sum(_mm_add_epi16(lo0, lo1)));
+    __m128i p1  = mip_pixel(sq1, pair_sum(_mm_add_epi16(hi0, hi1)));
+
+    __m128i c = _mm_unpacklo_epi64(p0, p1);
+    __m128i a = _mm_unpackhi_epi64(p0, p1);
+    a = _mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    c = _mm_min_epi16(c, a);
+    c = _mm_or_si128(_mm_andnot_si128(is_alpha, c), _mm_and_si128(is_alpha, a));
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(c, c));
+  }
+  downsample_slowly(dst + i, src0 + 2 * i, src1 + 2 * i, n - i);
+}
+
+#else
+
+#define downsample downsample_slowly
+
+#endif
+
+// Linear mipmaps average colors in linear light, weighted by alpha, using
+// tables for the exact sRGB curve. The rounding matches the linux
+// rasterizer's, so each platform makes the same levels.
+
+static uint16_t lin_of_srgb[256];
+static uint8_t  srgb_of_lin[65536];
+static bit      are_tables_made = false;  // This is guarded by init_lock.
+
+static double linear_of(double x) {
+  return (x <= 0.04045) ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+// Each linear value maps to the byte whose sRGB value is nearest its own,
+// so that every byte maps back to itself.
+static void make_srgb_tables() {
+  AcquireSRWLockExclusive(&init_lock);
+  if (!are_tables_made) {
+    for (int i = 0; i < 256; ++i) {
+      lin_of_srgb[i] = (uint16_t)lround(linear_of(i / 255.0) * 65535);
+    }
+    int    s    = 0;
+    double next = linear_of(0.5 / 255) * 65535;  // Where s + 1 starts.
+    for (int l = 0; l < 65536; ++l) {
+      while (s < 255 && l >= next) next = linear_of((++s + 0.5) / 255) * 65535;
+      srgb_of_lin[l] = s;
+    }
+    are_tables_made = true;
+  }
+  ReleaseSRWLockExclusive(&init_lock);
+}
+
+static void downsample_linear(uint32_t *dst, const uint32_t *src0,
+                              const uint32_t *src1, int n) {
+  for (int i = 0; i < n; ++i) {
+    const uint8_t *p[4] = {
+      (const uint8_t *)&src0[2 * i], (const uint8_t *)&src0[2 * i + 1],
+      (const uint8_t *)&src1[2 * i], (const uint8_t *)&src1[2 * i + 1]
+    };
+    uint8_t *out = (uint8_t *)&dst[i];
+    uint32_t sum = p[0][3] + p[1][3] + p[2][3] + p[3][3];
+    uint32_t a   = (sum + 2) >> 2;
+    for (int j = 0; j < 3; ++j) {
+      uint32_t total = 0;
+      for (int q = 0; q < 4; ++q) {
+        uint32_t alpha = p[q][3];
+        if (alpha) total += lin_of_srgb[straight(p[q][j], alpha)] * alpha;
+      }
+      uint32_t t = srgb_of_lin[sum ? total / sum : 0] * a + 128;
+      out[j] = (t + (t >> 8)) >> 8;
+    }
+    out[3] = a;
+  }
+}
+
+// Fills the mip level dst from its parent src. Sizes that are odd drop the
+// parent's last row or column, and a parent 1 pixel wide or tall has its
+// pixels used twice.
+static void downsample_bitmap(Bitmap *src, Bitmap *dst, bit is_linear) {
+  void (*average)(uint32_t *, const uint32_t *, const uint32_t *, int) =
+      is_linear ? downsample_linear : downsample;
+  for (int y = 0; y < dst->y_size; ++y) {
+    uint32_t *src0 = row(src, 2 * y);
+    uint32_t *src1 = row(src, (src->y_size > 1) ? 2 * y + 1 : 2 * y);
+    if (src->x_size > 1) {
+      average(row(dst, y), src0, src1, dst->x_size);
+    } else {
+      uint32_t pair0[2] = { src0[0], src0[0] };
+      uint32_t pair1[2] = { src1[0], src1[0] };
+      average(row(dst, y), pair0, pair1, 1);
+    }
+  }
+}
+
+static int build_mipmaps(Bitmap *bitmap, draw__Bitmap *levels,
+                         int max_levels, bit is_linear) {
+  if (bitmap == NULL) return 0;
+  // GdiFlush ensures that GDI has finished drawing into the bitmap.
+  GdiFlush();
+  if (is_linear) make_srgb_tables();
+
+  int     n   = 0;
+  Bitmap *src = bitmap;
+  while (n < max_levels && (src->x_size > 1 || src->y_size > 1)) {
+    int     w   = (src->x_size > 1) ? src->x_size / 2 : 1;
+    int     h   = (src->y_size > 1) ? src->y_size / 2 : 1;
+    Bitmap *dst = (Bitmap *)draw__new_bitmap(w, h);
+    if (dst == NULL) break;
+
+    downsample_bitmap(src, dst, is_linear);
+    add_dirty(&dst->dirty, xy__rect_pts(0, 0, w, h));
+
+    levels[n++] = (draw__Bitmap)dst;
+    src         = dst;
+  }
+  return n;
+}
+
+// Blurs.
+//
+// A box's channel sums are below 2^24, so they're exact as floats. Each
+// average is the sum times the float 1 / (2r + 1), rounded to the nearest
+// integer, which matches the linux kernels.
+
+// Finds the radii of three box blurs that together are close to a Gaussian
+// blur with standard deviation sigma. A box of odd width w adds
+// (w^2 - 1) / 12 to the variance, so the widths are a mix of the odd w
+// below the ideal width and w + 2, in the numbers that sum closest to
+// sigma^2.
+static void find_blur_radii(double sigma, int *radii) {
+  double var = sigma * sigma;
+  int    w   = (int)sqrt(4 * var + 1);  // The ideal width for three boxes.
+  if (w % 2 == 0) --w;
+  int num_narrow = (int)round((12 * var - 3.0 * w * w - 12.0 * w - 9) /
+                              (-4.0 * w - 4));
+  for (int i = 0; i < 3; ++i) radii[i] = ((i < num_narrow) ? w : w + 2) / 2;
+}
+
+// Sets sum[0..3] to the channel sums of the box of radius r centered on
+// src[0], repeating the run's end pixels past its ends.
+static void start_box(uint32_t *sum, const uint32_t *src, int n, int r) {
+  const uint8_t *in   = (const uint8_t *)src;
+  int            last = (r < n - 1) ? r : n - 1;  // The last pixel inside.
+  for (int j = 0; j < 4; ++j) {
+    sum[j] = (uint32_t)(r + 1) * in[j] +
+             (uint32_t)(r - last) * in[4 * (n - 1) + j];
+    for (int i = 1; i <= last; ++i) sum[j] += in[4 * i + j];
+  }
+}
+
+// Writes the averages of the 4 * n box sums to dst, then moves each box a
+// row down by adding the pixels in add and subtracting those in sub.
+static void box_blur_step_slowly(uint32_t *dst, uint32_t *sums,
+                                 const uint32_t *add, const uint32_t *sub,
+                                 int n, int r) {
+  const uint8_t *a     = (const uint8_t *)add;
+  const uint8_t *b     = (const uint8_t *)sub;
+  uint8_t       *out   = (uint8_t *)dst;
+  float          scale = 1.0f / (2 * r + 1);
+  for (int i = 0; i < 4 * n; ++i) {
+    out[i]   = (uint8_t)lrintf(sums[i] * scale);
+    sums[i] += a[i] - b[i];
+  }
+}
+
+#if has_sse2
+
+// Returns the channels of pixel p with 32 bits each.
+static __m128i channels32(uint32_t p) {
+  __m128i zero = _mm_setzero_si128();
+  return _mm_unpacklo_epi16(
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), zero), zero);
+}
+
+// Returns the 32-bit channel sums in v times scale, rounded.
+static __m128i box_average(__m128i v, __m128 scale) {
+  return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+}
+
+// Returns the 16-bit channel differences in d, which are from -255 to 255,
+// with 32 bits each; lo picks the low four and hi the high four.
+static __m128i widen_lo(__m128i d) {
+  return _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+}
+
+static __m128i widen_hi(__m128i d) {
+  return _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16);
+}
+
+// One pixel's four channel sums stay in a register as the box moves along
+// the run.
+static void box_blur(uint32_t *dst, const uint32_t *src, int n, int r) {
+  __m128   scale = _mm_set1_ps(1.0f / (2 * r + 1));
+  uint32_t start[4];
+  start_box(start, src, n, r);
+  __m128i sum = _mm_loadu_si128((__m128i *)start);
+  for (int x = 0; x < n; ++x) {
+    __m128i avg = box_average(sum, scale);
+    avg    = _mm_packs_epi32(avg, avg);
+    dst[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(avg, avg));
+
+    int add = (x + r + 1 < n) ? x + r + 1 : n - 1;
+    int sub = (x - r > 0)     ? x - r     : 0;
+    sum = _mm_add_epi32(sum, channels32(src[add]));
+    sum = _mm_sub_epi32(sum, channels32(src[sub]));
+  }
+}
+
+// Each pass moves the sums of four pixels.
+static void box_blur_step(uint32_t *dst, uint32_t *sums, const uint32_t *add,
+                          const uint32_t *sub, int n, int r) {
+  __m128  scale = _mm_set1_ps(1.0f / (2 * r + 1));
+  __m128i zero  = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i *s  = (__m128i *)(sums + 4 * i);
+    __m128i  v0 = _mm_loadu_si128(s),     v1 = _mm_loadu_si128(s + 1);
+    __m128i  v2 = _mm_loadu_si128(s + 2), v3 = _mm_loadu_si128(s + 3);
+    __m128i out = _mm_packus_epi16(
+        _mm_packs_epi32(box_average(v0, scale), box_average(v1, scale)),
+        _mm_packs_epi32(box_average(v2, scale), box_average(v3, scale)));
+    _mm_storeu_si128((__m128i *)(dst + i), out);
+
+    __m128i a  = _mm_loadu_si128((__m128i *)(add + i));
+    __m128i b  = _mm_loadu_si128((__m128i *)(sub + i));
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero),
+                               _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(b, zero));
+    _mm_storeu_si128(s,     _mm_add_epi32(v0, widen_lo(lo)));
+    _mm_storeu_si128(s + 1, _mm_add_epi32(v1, widen_hi(lo)));
+    _mm_storeu_si128(s + 2, _mm_add_epi32(v2, widen_lo(hi)));
+    _mm_storeu_si128(s + 3, _mm_add_epi32(v3, widen_hi(hi)));
+  }
+  box_blur_step_slowly(dst + i, sums + 4 * i, add + i, sub + i, n - i, r);
+}
+
+#else
+
+// Box blurs the run of n pixels at src into dst.
+static void box_blur(uint32_t *dst, const uint32_t *src, int n, int r) {
+  const uint8_t *in    = (const uint8_t *)src;
+  uint8_t       *out   = (uint8_t *)dst;
+  float          scale = 1.0f / (2 * r + 1);
+  uint32_t       sum[4];
+  start_box(sum, src, n, r);
+  for (int x = 0; x < n; ++x) {
+    const uint8_t *add = in + 4 * ((x + r + 1 < n) ? x + r + 1 : n - 1);
+    const uint8_t *sub = in + 4 * ((x - r > 0) ? x - r : 0);
+    for (int j = 0; j < 4; ++j) {
+      out[4 * x + j] = (uint8_t)lrintf(sum[j] * scale);
+      sum[j] += add[j] - sub[j];
+    }
+  }
+}
+
+#define box_blur_step box_blur_step_slowly
+
+#endif
+
+// Box blurs the columns of a run n pixels wide and h rows tall from src to
+// dst, whose rows are src_stride and dst_stride pixels apart. The sums
+// array holds 4 * n values.
+static void box_blur_columns(uint32_t *dst, size_t dst_stride,
+                             const uint32_t *src, size_t src_stride,
+                             int n, int h, int r, uint32_t *sums) {
+  // Start with the boxes centered on row 0, which repeat the top and bottom
+  // rows past their edges.
+  int            last   = (r < h - 1) ? r : h - 1;
+  const uint8_t *top    = (const uint8_t *)src;
+  const uint8_t *bottom = (const uint8_t *)(src + (h - 1) * src_stride);
+  for (int i = 0; i < 4 * n; ++i) {
+    sums[i] = (uint32_t)(r + 1) * top[i] + (uint32_t)(r - last) * bottom[i];
+  }
+  for (int y = 1; y <= last; ++y) {
+    const uint8_t *p = (const uint8_t *)(src + y * src_stride);
+    for (int i = 0; i < 4 * n; ++i) sums[i] += p[i];
+  }
+
+  for (int y = 0; y < h; ++y) {
+    int add = (y + r + 1 < h) ? y + r + 1 : h - 1;
+    int sub = (y - r > 0)     ? y - r     : 0;
+    box_blur_step(dst + y * dst_stride, sums, src + add * src_stride,
+                  src + sub * src_stride, n, r);
+  }
+}
+
+// The alpha byte is ignored, as GDI colors are opaque.
+static COLORREF colorref_of_rgba32(draw__Rgba32 color) {
+  return RGB(color >> 24, (color >> 16) & 0xff, (color >> 8) & 0xff);
+}
+
+// A new brush or pen is only made when the color changes.
+
+static void set_fill_color(draw__Context *c, COLORREF color) {
+  if (color == c->fill_color) return;
+  c->fill_color = color;
+  UseObject(c->hdc, CreateSolidBrush(color));
+}
+
+static void set_stroke_color(draw__Context *c, COLORREF color) {
+  if (color == c->stroke_color) return;
+  c->stroke_color = color;
+  UseObject(c->hdc, CreatePen(PS_SOLID, 1 /* width */, color));
+}
+
+static void add_cmd(draw__Context *c, int op, COLORREF color, xy__Rect rect) {
+  draw__List list = c->recording_list;
+  if (list->num_cmds == list->cmds_cap) {
+    list->cmds_cap = list->cmds_cap ? 2 * list->cmds_cap : 64;
+    list->cmds     = realloc(list->cmds, list->cmds_cap * sizeof(Cmd));
+  }
+  Cmd *cmd   = &list->cmds[list->num_cmds++];
+  cmd->op    = op;
+  cmd->color = color;
+  cmd->rect  = rect;
+}
+
+// Fills use the brush and everything else uses the pen, so two commands
+// can share a selected brush or pen when this returns true.
+static bit same_color_state(Cmd *a, Cmd *b) {
+  return (a->op == cmd_fill_rect) == (b->op == cmd_fill_rect) &&
+         a->color == b->color;
+}
+
+// Returns a rect containing every pixel the command may touch.
+static xy__Rect cmd_bounds(Cmd *cmd) {
+  xy__Rect r = cmd->rect;
+  // Pad by a pixel to allow for the pen width.
+  return xy__rect_pts(fmin(r.xmin, r.xmax) - 1, fmin(r.ymin, r.ymax) - 1,
+                      fmax(r.xmin, r.xmax) + 1, fmax(r.ymin, r.ymax) + 1);
+}
+
+static bit rects_overlap(xy__Rect a, xy__Rect b) {
+  return (a.xmin < b.xmax && b.xmin < a.xmax &&
+          a.ymin < b.ymax && b.ymin < a.ymax);
+}
+
+// Reorders the commands of a finished list so that commands sharing a brush
+// or pen run together. A command is only moved ahead of commands it doesn't
+// overlap, so the drawn result is unchanged.
+static void sort_cmds(draw__List list) {
+  typedef struct {
+    Cmd     *first;
+    xy__Rect bounds;
+    int      head;
+    int      tail;
+  } Batch;
+
+  int    n           = list->num_cmds;
+  Batch *batches     = malloc(n * sizeof(Batch));
+  int   *next        = malloc(n * sizeof(int));
+  int    num_batches = 0;
+
+  for (int i = 0; i < n; ++i) {
+    Cmd     *cmd    = &list->cmds[i];
+    xy__Rect bounds = cmd_bounds(cmd);
+    Batch   *batch  = NULL;
+
+    // Look for a recent batch with the same color that cmd can join without
+    // passing over anything it overlaps.
+    for (int j = num_batches - 1; j >= 0 && j >= num_batches - max_look_back;
+         --j) {
+      if (same_color_state(batches[j].first, cmd)) {
+        batch = &batches[j];
+        break;
+      }
+      if (rects_overlap(batches[j].bounds, bounds)) break;
+    }
+
+    next[i] = -1;
+    if (batch == NULL) {
+      batch         = &batches[num_batches++];
+      batch->first  = cmd;
+      batch->bounds = bounds;
+      batch->head   = i;
+    } else {
+      next[batch->tail] = i;
+      xy__Rect *b = &batch->bounds;
+      *b = xy__rect_pts(fmin(b->xmin, bounds.xmin), fmin(b->ymin, bounds.ymin),
+                        fmax(b->xmax, bounds.xmax), fmax(b->ymax, bounds.ymax));
+    }
+    batch->tail = i;
+  }
+
+  Cmd *sorted = malloc(list->cmds_cap * sizeof(Cmd));
+  int  k      = 0;
+  for (int j = 0; j < num_batches; ++j) {
+    for (int i = batches[j].head; i != -1; i = next[i]) {
+      sorted[k++] = list->cmds[i];
+    }
+  }
+
+  free(list->cmds);
+  free(batches);
+  free(next);
+  list->cmds = sorted;
+}
+
+static void reserve_scratch(draw__Context *c, int n) {
+  if (n <= c->scratch_cap) return;
+  c->scratch_cap    = n;
+  c->scratch_pts    = realloc(c->scratch_pts,    n * sizeof(POINT));
+  c->scratch_counts = realloc(c->scratch_counts, n * sizeof(DWORD));
+}
+
+// Draws n commands that all have the same op and color, selecting the
+// stock pen or brush they need just once. Commands outside the clip are
+// skipped.
+static void draw_run(draw__Context *c, Cmd *cmds, int n) {
+  HDC hdc     = c->hdc;
+  bit is_line = (cmds[0].op == cmd_line);
+
+  if (!is_line) {
+    SaveDC(hdc);
+    if (cmds[0].op == cmd_fill_rect) {
+      SelectObject(hdc, GetStockObject(NULL_PEN));
+    } else {
+      SelectObject(hdc, GetStockObject(NULL_BRUSH));
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    xy__Rect visible = visible_part(c, cmd_bounds(&cmds[i]));
+    if (is_empty(visible)) continue;
+    mark(c, visible);
+    xy__Rect r = cmds[i].rect;
+    if (is_line) {
+      MoveToEx(hdc, (int)r.xmin, (int)r.ymin, NULL);
+      LineTo  (hdc, (int)r.xmax, (int)r.ymax);
+    } else {
+      Rectangle(hdc, (int)r.xmin, (int)r.ymin, (int)r.xmax, (int)r.ymax);
+    }
+  }
+  if (!is_line) RestoreDC(hdc, -1 /* restore last saved state */);
+}
+
+
+// Makes a bitmap backed by a DIB section; its pixels are in the given file
+// mapping, or in memory GDI allocates when section is NULL.
+static Bitmap *new_dib_bitmap(int w, int h, HANDLE section, DWORD offset) {
+  Bitmap *b = malloc(sizeof(Bitmap));
+
+  b->x_size = w;
+  b->y_size = h;
+  b->is_shared = (section != NULL);
+  b->dirty.num_rects = 0;
+  b->parent = NULL;
+  b->x0     = 0;
+  b->y0     = 0;
+  b->user_bytes         = NULL;
+  b->user_stride        = 0;
+  b->unsynced.num_rects = 0;
+
+  BITMAPINFOHEADER bitmap_header;
+  memset(&bitmap_header, 0, sizeof(bitmap_header));
+  bitmap_header.biSize        = sizeof(bitmap_header);
+  bitmap_header.biWidth       = w;
+  bitmap_header.biHeight      = h;
+  bitmap_header.biPlanes      = 1;
+  bitmap_header.biBitCount    = 32;
+  bitmap_header.biCompression = BI_RGB;
+
+  b->bitmap = CreateDIBSection(
+    NULL,
+    (BITMAPINFO *)&bitmap_header,
+    DIB_RGB_COLORS,
+    &b->bytes,
+    section,  // file-mapping object
+    offset);  // offset to bits in file-mapping object
+
+  if (b->bitmap == NULL) {
+    err_msg("Error: CreateDIBSection failed in %s.\n", __FUNCTION__);
+    free(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+// Atlases.
+
+// Returns the width a w-wide region at x takes up, which includes a
+// pixel's gap on its right unless it's at the atlas's right edge.
+static int padded_width(draw__Atlas a, int x, int w) {
+  return (x + w < a->w) ? w + 1 : w;
+}
+
+// Returns the lowest y at which a w x h region and its gap fit with the
+// region's left edge at the start of segment i, or -1 if they don't fit.
+static int atlas_fit(draw__Atlas a, int i, int w, int h) {
+  Segment *s = a->segments;
+  if (s[i].x + w > a->w) return -1;
+  int x_end = s[i].x + padded_width(a, s[i].x, w);
+  int y     = 0;
+  for (int j = i; j < a->num_segments && s[j].x < x_end; ++j) {
+    if (s[j].y > y) y = s[j].y;
+  }
+  return (y + h <= a->h) ? y : -1;
+}
+
+static void remove_segment(draw__Atlas a, int i) {
+  memmove(a->segments + i, a->segments + i + 1,
+          (a->num_segments - i - 1) * sizeof(Segment));
+  a->num_segments--;
+}
+
+// Raises the skyline to y for w pixels from the start of segment i.
+static void atlas_raise(draw__Atlas a, int i, int w, int y) {
+  Segment *s     = a->segments;
+  int      x     = s[i].x;
+  int      x_end = x + w;
+
+  // The new segment replaces segments i to j - 1, which it covers, and
+  // trims segment j if it covers part of it.
+  int j = i;
+  while (j < a->num_segments && s[j].x + s[j].w <= x_end) ++j;
+  if (j < a->num_segments && s[j].x < x_end) {
+    s[j].w -= x_end - s[j].x;
+    s[j].x  = x_end;
+  }
+  memmove(s + i + 1, s + j, (a->num_segments - j) * sizeof(Segment));
+  a->num_segments += 1 - (j - i);
+  s[i] = (Segment) { x, y, w };
+
+  // Join the new segment to neighbors of the same height.
+  if (i + 1 < a->num_segments && s[i + 1].y == y) {
+    s[i].w += s[i + 1].w;
+    remove_segment(a, i + 1);
+  }
+  if (i > 0 && s[i - 1].y == y) {
+    s[i - 1].w += s[i].w;
+    remove_segment(a, i);
+  }
+}
+
+// Deletes the atlas's views and makes its whole bitmap free.
+static void reset_atlas(draw__Atlas a) {
+  for (int i = 0; i < a->num_views; ++i) draw__delete_bitmap(a->views[i]);
+  a->num_views    = 0;
+  a->num_segments = 1;
+  a->segments[0]  = (Segment) { 0, 0, a->w };
+}
+
+// Tiled bitmaps.
+
+static xy__Rect offset_rect(xy__Rect r, double dx, double dy) {
+  return xy__rect_pts(r.xmin + dx, r.ymin + dy, r.xmax + dx, r.ymax + dy);
+}
+
+// Orders hits by tile and, within a tile, by command, which keeps each
+// tile's commands in list order.
+static int compare_hits(const void *a, const void *b) {
+  const TileHit *p = a, *q = b;
+  if (p->ty != q->ty) return (p->ty < q->ty) ? -1 : 1;
+  if (p->tx != q->tx) return (p->tx < q->tx) ? -1 : 1;
+  return p->cmd - q->cmd;
+}
+
+// Returns true when the segment from (line.xmin, line.ymin) to
+// (line.xmax, line.ymax) meets r. The segment is cut by each of r's edges
+// in turn, as in the Liang-Barsky algorithm.
+static bit line_meets_rect(xy__Rect line, xy__Rect r) {
+  double x  = line.xmin,      y  = line.ymin;
+  double dx = line.xmax - x,  dy = line.ymax - y;
+  double p[4] = { -dx, dx, -dy, dy };
+  double q[4] = { x - r.xmin, r.xmax - x, y - r.ymin, r.ymax - y };
+  double t0 = 0, t1 = 1;
+  for (int i = 0; i < 4; ++i) {
+    if (p[i] == 0) {
+      if (q[i] < 0) return false;  // It's parallel to this edge and outside.
+      continue;
+    }
+    double t = q[i] / p[i];
+    if (p[i] < 0) {
+      if (t > t1) return false;
+      if (t > t0) t0 = t;
+    } else {
+      if (t < t0) return false;
+      if (t < t1) t1 = t;
+    }
+  }
+  return true;
+}
+
+// Returns true when cmd may touch r, given that its bounds overlap r.
+// Lines and outlines only touch the tiles along them, so a long line or a
+// big outline doesn't make every tile it spans.
+static bit cmd_meets_rect(Cmd *cmd, xy__Rect r) {
+  xy__Rect c = cmd->rect;
+  if (cmd->op == cmd_fill_rect) return true;
+  if (cmd->op != cmd_stroke_rect) return line_meets_rect(c, r);
+  return line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmax, c.ymin), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymax, c.xmax, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmin, c.ymin, c.xmin, c.ymax), r) ||
+         line_meets_rect(xy__rect_pts(c.xmax, c.ymin, c.xmax, c.ymax), r);
+}
+
+// Appends a hit for each tile that command i, cmd, may touch within area,
+// which is the part of the canvas inside the clip.
+static void add_tile_hits(xy__Rect area, Cmd *cmd, int i,
+                          TileHit **hits, int *num_hits, int *hits_cap) {
+  xy__Rect b = intersection_of(cmd_bounds(cmd), area);
+  if (b.xmin == b.xmax || b.ymin == b.ymax) return;
+  int tx0 = (int)floor(b.xmin / draw__tile_size);
+  int ty0 = (int)floor(b.ymin / draw__tile_size);
+  int tx1 = (int)ceil (b.xmax / draw__tile_size) - 1;
+  int ty1 = (int)ceil (b.ymax / draw__tile_size) - 1;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      // Pad the tile by a pixel to allow for the pen width and antialiasing.
+      xy__Rect r = xy__rect_size((double)tx * draw__tile_size - 1,
+                                 (double)ty * draw__tile_size - 1,
+                                 draw__tile_size + 2, draw__tile_size + 2);
+      if (!cmd_meets_rect(cmd, r)) continue;
+      if (*num_hits == *hits_cap) {
+        *hits_cap = *hits_cap ? 2 * *hits_cap : 64;
+        *hits     = realloc(*hits, *hits_cap * sizeof(TileHit));
+      }
+      (*hits)[(*num_hits)++] = (TileHit) { tx, ty, i };
+    }
+  }
+}
+
+// Text boxes.
+
+// This is the 64-bit FNV-1a hash taken 8 bytes at a time, which keeps
+// looking up a long string, such as a log, cheap enough to do every frame.
+static uint64_t hash_text(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ULL, v;
+  size_t   i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, 8);
+    h = (h ^ v) * 1099511628211ULL;
+  }
+  for (; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ULL;
+  return h ^ (h >> 32);
+}
+
+// Returns the number of bytes at the start of a and b that match,
+// comparing 8 bytes at a time.
+static size_t common_prefix(const char *a, size_t a_len,
+                            const char *b, size_t b_len) {
+  size_t n = (a_len < b_len) ? a_len : b_len, i = 0;
+  for (uint64_t u, v; i + 8 <= n; i += 8) {
+    memcpy(&u, a + i, 8);
+    memcpy(&v, b + i, 8);
+    if (u != v) break;
+  }
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
+}
+
+static void unlink_layout(TextLayout *l) {
+  if (l->newer) l->newer->older = l->older;
+  else          newest_layout   = l->older;
+  if (l->older) l->older->newer = l->newer;
+  else          oldest_layout   = l->newer;
+}
+
+static void push_newest_layout(TextLayout *l) {
+  l->newer = NULL;
+  l->older = newest_layout;
+  if (newest_layout) newest_layout->newer = l;
+  newest_layout = l;
+  if (oldest_layout == NULL) oldest_layout = l;
+}
+
+static void remove_layout(TextLayout *l) {
+  unlink_layout(l);
+  num_layouts--;
+  free(l->text);
+  free(l->words);
+  free(l->lines);
+  free(l);
+}
+
+// Starts the new layout l with the first num_words words and num_lines line
+// starts of from.
+static void copy_layout_start(TextLayout *l, TextLayout *from,
+                              int num_words, int num_lines) {
+  l->words     = malloc(num_words * sizeof(Word));
+  l->words_cap = l->num_words = num_words;
+  memcpy(l->words, from->words, num_words * sizeof(Word));
+  if (num_lines == 0) return;
+  l->lines     = malloc(num_lines * sizeof(int));
+  l->lines_cap = l->num_lines = num_lines;
+  memcpy(l->lines, from->lines, num_lines * sizeof(int));
+}
+
+// Drops the layouts in the given font, since it may be deleted and its
+// address reused.
+static void remove_layouts_using(draw__Font old_font) {
+  AcquireSRWLockExclusive(&layouts_lock);
+  for (TextLayout *l = oldest_layout, *newer; l; l = newer) {
+    newer = l->newer;
+    if (l->font == old_font) remove_layout(l);
+  }
+  ReleaseSRWLockExclusive(&layouts_lock);
+}
+
+static size_t word_start(TextLayout *l, int i) {
+  return i ? l->words[i - 1].end : 0;
+}
+
+static bit is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Appends the words of text[from..len) to the layout without measuring
+// them.
+static void split_words(TextLayout *l, size_t from) {
+  const char *text = l->text;
+  size_t      i    = from;
+  while (i < l->len) {
+    if (l->num_words == l->words_cap) {
+      l->words_cap = l->words_cap ? 2 * l->words_cap : 64;
+      l->words     = realloc(l->words, l->words_cap * sizeof(Word));
+    }
+    Word *w = &l->words[l->num_words++];
+    while (i < l->len && !is_space(text[i]) && text[i] != '\n') ++i;
+    w->chars_end = i;
+    while (i < l->len && is_space(text[i])) ++i;
+    w->ends_line = (i < l->len && text[i] == '\n');
+    if (w->ends_line) ++i;
+    w->end = i;
+  }
+}
+
+// Measures the words from words[first] on. Each line of text between
+// newlines is measured in one call, which gives the width of each of its
+// leading runs of characters; a word's width is the distance between its
+// ends, so kerning between two words counts toward the later one. A line
+// is measured from its first word even when that word is kept, so that
+// every word is measured the same way it would be in a new layout.
+static void measure_words(draw__Context *c, TextLayout *l, int first) {
+  int i = first;
+  while (i > 0 && !l->words[i - 1].ends_line) --i;
+  while (i < l->num_words) {
+    // Words [i, j) are one line of text.
+    int j = i;
+    while (j < l->num_words && !l->words[j].ends_line) ++j;
+    if (j < l->num_words) ++j;
+
+    // GDI strings are ANSI, so each byte is a character; x_at[k] is the
+    // width of the first k + 1 of them.
+    size_t start = word_start(l, i);
+    int    n     = (int)(l->words[j - 1].end - l->words[j - 1].ends_line -
+                         start);
+    int   *x_at  = malloc((n + 1) * sizeof(int));
+    SIZE   size;
+    if (n > 0 && !GetTextExtentExPoint(c->hdc, l->text + start, n, 0, NULL,
+                                       x_at, &size)) {
+      err_msg("Error: GetTextExtentExPoint failed in %s.\n", __FUNCTION__);
+      memset(x_at, 0, n * sizeof(int));
+    }
+    int x = 0;
+    for (; i < j; ++i) {
+      Word *w         = &l->words[i];
+      int   chars_end = (int)(w->chars_end - start);
+      int   end       = (int)(w->end - w->ends_line - start);
+      int   x_chars   = chars_end ? x_at[chars_end - 1] : 0;
+      int   x_end     = end       ? x_at[end - 1]       : 0;
+      if (i >= first) {
+        w->width       = x_chars - x;
+        w->space_width = x_end - x_chars;
+      }
+      x = x_end;
+    }
+    free(x_at);
+  }
+}
+
+// Breaks the words into lines from line first_line on, which starts with
+// the same word as before. Each line takes words while they fit in the
+// width; a word too wide for any line gets one to itself.
+static void wrap_lines(TextLayout *l, int first_line) {
+  int i = first_line ? l->lines[first_line] : 0;
+  l->num_lines = first_line;
+  while (i < l->num_words) {
+    if (l->num_lines == l->lines_cap) {
+      l->lines_cap = l->lines_cap ? 2 * l->lines_cap : 64;
+      l->lines     = realloc(l->lines, l->lines_cap * sizeof(int));
+    }
+    l->lines[l->num_lines++] = i;
+    xy__Float x = l->words[i].width;
+    while (!l->words[i].ends_line && i + 1 < l->num_words) {
+      xy__Float next = x + l->words[i].space_width + l->words[i + 1].width;
+      if (l->is_wrapped && next > l->width) break;
+      x = next;
+      ++i;
+    }
+    ++i;
+  }
+}
+
+// Returns the index of the first word that doesn't end before byte at,
+// which is the first word that may change when the text changes there.
+static int word_at(TextLayout *l, size_t at) {
+  int lo = 0, hi = l->num_words;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (l->words[mid].end < at) lo = mid + 1;
+    else                        hi = mid;
+  }
+  return lo;
+}
+
+// Returns the index of the line holding word i.
+static int line_of_word(TextLayout *l, int i) {
+  int lo = 0, hi = l->num_lines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (l->lines[mid] <= i) lo = mid;
+    else                    hi = mid - 1;
+  }
+  return lo;
+}
+
+// Returns the layout of s in the font selected into the context's hdc,
+// with its lines wrapped to width when is_wrapped, making or updating one
+// as needed. A string that starts the same as a cached one in the font
+// reuses its words: only the words from the first changed byte on are
+// measured, and only the lines from the one before them are wrapped
+// again. A new width wraps the cached words without measuring them. The
+// caller holds layouts_lock.
+static TextLayout *layout_of(draw__Context *c, const char *s,
+                             bit is_wrapped, xy__Float width) {
+  HFONT    font = (HFONT)GetCurrentObject(c->hdc, OBJ_FONT);
+  size_t   len  = strlen(s);
+  uint64_t hash = hash_text(s, len);
+
+  // Find the layout of s, or else the one sharing the most leading bytes
+  // with it.
+  TextLayout *l    = NULL;
+  size_t      same = 0;
+  for (TextLayout *m = newest_layout; m; m = m->older) {
+    if (m->font != font) continue;
+    if (m->hash == hash && m->len == len && memcmp(m->text, s, len) == 0) {
+      l    = m;
+      same = len;
+      break;
+    }
+    size_t n = common_prefix(m->text, m->len, s, len);
+    if (n > same) {
+      l    = m;
+      same = n;
+    }
+  }
+
+  // A layout that would keep no words is left to its own string.
+  bit is_same = (l && same == len && l->len == len);
+  if (l && !is_same && word_at(l, same) == 0) l = NULL;
+
+  // Lines before the one holding the last unchanged word are kept, since
+  // each of their breaks only depends on unchanged words.
+  int first_word     = 0;
+  int first_line     = 0;
+  bit are_lines_kept = false;
+  if (l) {
+    first_word     = is_same ? l->num_words : word_at(l, same);
+    are_lines_kept = (l->num_lines > 0 && l->is_wrapped == is_wrapped &&
+                      (!is_wrapped || l->width == width));
+  }
+  if (are_lines_kept && first_word > 0) {
+    first_line = line_of_word(l, first_word - 1);
+  }
+
+  // A string that extends a cached one, such as a log that's been added to,
+  // takes over its layout. Any other string starts a new layout from a copy
+  // of the kept words and lines, so that boxes with a common start, such as
+  // timestamped entries, don't evict each other.
+  if (l && same == l->len) {
+    unlink_layout(l);
+  } else {
+    TextLayout *from = l;
+    l       = calloc(1, sizeof(TextLayout));
+    l->font = font;
+    if (from) {
+      copy_layout_start(l, from, first_word, first_line ? first_line + 1 : 0);
+    }
+    same = 0;  // The text is all copied below.
+    if (num_layouts == max_text_layouts) remove_layout(oldest_layout);
+    num_layouts++;
+  }
+
+  if (!is_same) {
+    size_t from = word_start(l, first_word);
+    l->text      = realloc(l->text, len + 1);
+    memcpy(l->text + same, s + same, len - same + 1);
+    l->len       = len;
+    l->hash      = hash;
+    l->num_words = first_word;
+    split_words(l, from);
+    measure_words(c, l, first_word);
+  }
+  if (!is_same || !are_lines_kept) {
+    l->is_wrapped = is_wrapped;
+    l->width      = width;
+    wrap_lines(l, are_lines_kept ? first_line : 0);
+  }
+  push_newest_layout(l);
+  return l;
+}
+
+// Finds the bytes [*start, *end) of line i, leaving out its trailing spaces
+// and newline.
+static void line_span(TextLayout *l, int i, size_t *start, size_t *end) {
+  int last = ((i + 1 < l->num_lines) ? l->lines[i + 1] : l->num_words) - 1;
+  *start = word_start(l, l->lines[i]);
+  *end   = l->words[last].chars_end;
+}
+
+// Draws the len bytes at s in the box with min corner (x, y) and width w,
+// returning the x value at the end of the text.
+static xy__Float draw_text(draw__Context *c, const char *s, size_t len,
+                           int x, int y, int w, float pos) {
+  HDC hdc = c->hdc;
+
+  // Temporarily unflip the coordinate system; otherwise text appears upside-down.
+  set_transform(c, true);
+  int ymax = c->bitmap->y_size - 1;
+  y = ymax - y;
+
+  SIZE str_size;
+  BOOL is_ok = GetTextExtentPoint32(hdc, s, (int)len, &str_size);
+
+  if (!is_ok) {
+    err_msg("Error: GetTextExtentPoint32 failed in %s.\n", __FUNCTION__);
+    str_size.cx = 0;
+  }
+
+  if (pos != 0 && pos != 0.5 && pos != 1) {
+    err_msg("Error: in %s, pos should be 0, 0.5, or 1.\n", __FUNCTION__);
+    pos = 0;
+  }
+
+  UINT align_modes[] = { TA_LEFT, TA_CENTER, TA_RIGHT };
+  SetTextAlign(hdc, TA_BOTTOM | align_modes[(int)(pos * 2)]);
+
+  int start_x = x;
+  if (pos == 1.0) x += w;
+  if (pos == 0.5) x += (int)(w / 2.0);
+
+  // Find the text's box, padded for any overhang, in bottom-up coordinates.
+  TEXTMETRIC *font_info = font_metrics(c);
+  int text_x = x - (int)(pos * str_size.cx);
+  int pad    = 1 + font_info->tmOverhang;
+  xy__Rect visible = visible_part(c, xy__rect_pts(
+      text_x - pad, ymax - y - pad, text_x + str_size.cx + pad,
+      ymax - y + font_info->tmHeight + pad));
+
+  // Text outside the clip is measured but not drawn.
+  if (!is_empty(visible)) {
+    mark(c, visible);
+    is_ok = TextOut(hdc, x, y, s, (int)len);
+    if (!is_ok) { err_msg("Error: TextOut failed in %s.\n", __FUNCTION__); }
+  }
+
+  // Re-flip the coordinate system to a bottom-up orientation.
+  set_transform(c, false);
+
+  return start_x + str_size.cx;
+}
+
+
+// Public functions.
+
+draw__Bitmap draw__new_bitmap(int w, int h) {
+  if (w <= 0 || h <= 0 || w > max_bitmap_width) {
+    err_msg("Error in %s: bitmap size must be positive, with a width of at "
+            "most %d; got %dx%d.\n", __FUNCTION__, max_bitmap_width, w, h);
+    return NULL;
+  }
+
+  AcquireSRWLockExclusive(&pool_lock);
+  Bitmap *b = pooled_bitmap(w, h);
+  if (b) pool_stats.hits++;
+  else   pool_stats.misses++;
+  ReleaseSRWLockExclusive(&pool_lock);
+
+  if (b) {
+    // GdiFlush ensures that GDI has finished drawing into the bitmap.
+    GdiFlush();
+    memset(b->bytes, 0, bytes_of(b));  // Transparent black, as if new.
+    b->dirty.num_rects = 0;
+    return (draw__Bitmap)b;
+  }
+
+  return (draw__Bitmap)new_dib_bitmap(w, h, NULL, 0);
+}
+
+// GDI can't draw into the caller's pixels, so the bitmap starts as a copy
+// of them, and copy_out writes what each draw call changes back out.
+draw__Bitmap draw__new_bitmap_with_data(int w, int h, int stride,
+                                        void *pixels) {
+  if (w <= 0 || h <= 0 || w > max_bitmap_width || pixels == NULL) {
+    err_msg("Error in %s: need pixels and a positive size with a width of "
+            "at most %d; got %dx%d.\n", __FUNCTION__, max_bitmap_width, w, h);
+    return NULL;
+  }
+  // Rows are copied as 32-bit pixels, so they must stay aligned.
+  if (stride < (int64_t)w * 4 || stride % 4 || (uintptr_t)pixels % 4) {
+    err_msg("Error in %s: stride %d can't hold 4-byte-aligned rows of %d "
+            "pixels.\n", __FUNCTION__, stride, w);
+    return NULL;
+  }
+
+  Bitmap *b = new_dib_bitmap(w, h, NULL, 0);
+  if (b == NULL) return NULL;
+  for (int y = 0; y < h; ++y) {
+    memcpy(row(b, y), (char *)pixels + (size_t)y * stride, 4 * w);
+  }
+  b->user_bytes  = pixels;
+  b->user_stride = stride;
+  return (draw__Bitmap)b;
+}
+
+draw__Bitmap draw__new_bitmap_with_section(int w, int h, HANDLE section,
+                                           DWORD offset) {
+  if (section == NULL || offset % 4) {
+    err_msg("Error in %s: need a section and an offset that's a multiple "
+            "of 4.\n", __FUNCTION__);
+    return NULL;
+  }
+  return (draw__Bitmap)new_dib_bitmap(w, h, section, offset);
+}
+
+// The view draws into its parent's HBITMAP, offset and clipped to its rect
+// when it's set in a context.
+draw__Bitmap draw__new_bitmap_view(draw__Bitmap bitmap, int x, int y,
+                                   int w, int h) {
+  Bitmap *p = (Bitmap *)bitmap;
+  if (p == NULL || w <= 0 || h <= 0 || x < 0 || y < 0 ||
+      x + w > p->x_size || y + h > p->y_size) {
+    err_msg("Error in %s: need a bitmap containing the %dx%d rect "
+            "at (%d, %d).\n", __FUNCTION__, w, h, x, y);
+    return NULL;
+  }
+  Bitmap *b = malloc(sizeof(Bitmap));
+  b->bitmap    = p->bitmap;
+  b->bytes     = (char *)(row(p, y) + x);
+  b->x_size    = w;
+  b->y_size    = h;
+  b->is_shared = false;
+  b->dirty.num_rects = 0;
+  b->parent    = root_of(p);
+  b->user_bytes         = NULL;
+  b->user_stride        = 0;
+  b->unsynced.num_rects = 0;
+  b->x0        = p->x0 + x;
+  b->y0        = p->y0 + y;
+  return (draw__Bitmap)b;
+}
+
+draw__Bitmap draw__clone_bitmap(draw__Bitmap bitmap) {
+  Bitmap *src = (Bitmap *)bitmap;
+  if (src == NULL) {
+    err_msg("Error in %s: bitmap is NULL.\n", __FUNCTION__);
+    return NULL;
+  }
+  Bitmap *b = (Bitmap *)draw__new_bitmap(src->x_size, src->y_size);
+  if (b == NULL) return NULL;
+  // GdiFlush ensures that GDI has finished drawing into the source.
+  GdiFlush();
+  for (int y = 0; y < b->y_size; ++y) {
+    memcpy(row(b, y), row(src, y), (size_t)b->x_size * 4);
+  }
+  return (draw__Bitmap)b;
+}
+
+void draw__delete_bitmap(draw__Bitmap bitmap) {
+  Bitmap *b = (Bitmap *)bitmap;
+  if (default_context.hdc) deselect(&default_context, b);
+  AcquireSRWLockExclusive(&pool_lock);
+  pool_bitmap(b);
+  ReleaseSRWLockExclusive(&pool_lock);
+}
+
+// A NULL bitmap deselects the context's bitmap, after which it may be set
+// in another context.
+void draw__ctx_set_bitmap(draw__Context *c, draw__Bitmap bitmap) {
+  init_if_needed();
+
+  Bitmap *b = (Bitmap *)bitmap;
+  c->bitmap = b;
+  if (b == NULL) {
+    SelectClipRgn(c->hdc, NULL);
+    SelectObject(c->hdc, system_bitmap);
+    return;
+  }
+  SelectObject(c->hdc, b->bitmap);
+
+  // Use a bottom-up coordinate system; (0, 0) is the lower-left corner.
+  set_transform(c, false);
+  select_clip(c);
+}
+
+void *draw__get_bitmap_data(draw__Bitmap bitmap) {
+  Bitmap *b = (Bitmap *)bitmap;
+  return b->bytes;
+}
+
+int draw__get_bitmap_stride(draw__Bitmap bitmap) {
+  return stride_of((Bitmap *)bitmap);
+}
+
+void draw__copy_bitmap_data(draw__Bitmap bitmap, void *dst, int dst_stride,
+                            draw__Format format, int flags) {
+  if (bitmap == NULL || format < draw__rgba || format > draw__argb) {
+    err_msg("Error in %s: need a bitmap and a valid format.\n", __FUNCTION__);
+    return;
+  }
+  // GdiFlush ensures that GDI has finished drawing into the bitmap.
+  GdiFlush();
+
+  Bitmap *b = (Bitmap *)bitmap;
+  for (int y = 0; y < b->y_size; ++y) {
+    int dst_y = (flags & draw__flip_rows) ? b->y_size - 1 - y : y;
+    convert_pixels((uint8_t *)dst + (size_t)dst_y * dst_stride,
+                   (uint8_t *)row(b, y), b->x_size, format,
+                   flags & draw__straight_alpha);
+  }
+}
 
-// Internal functions.
+void draw__compress_bitmap(draw__Bitmap bitmap) {}
 
-static intptr_t err_msg(const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  char *str;
-  vasprintf(&str, fmt, args);
-  va_end(args);
+size_t draw__get_bitmap_bytes(draw__Bitmap bitmap) {
+  Bitmap *b = (Bitmap *)bitmap;
+  if (b == NULL || b->is_shared || b->parent) return 0;
+  return bytes_of(b);
+}
 
-  OutputDebugString(str);
+void draw__set_bitmap_pool_budget(size_t bytes) {
+  AcquireSRWLockExclusive(&pool_lock);
+  pool_stats.budget = bytes;
+  trim_pool(bytes);
+  ReleaseSRWLockExclusive(&pool_lock);
+}
 
-  return 0;
+void draw__trim_bitmap_pool(size_t bytes) {
+  AcquireSRWLockExclusive(&pool_lock);
+  trim_pool(bytes);
+  ReleaseSRWLockExclusive(&pool_lock);
 }
 
-static void init_if_needed() {
-  static bit is_initialized = false;
-  if (is_initialized) return;
+draw__PoolStats draw__get_bitmap_pool_stats() {
+  AcquireSRWLockExclusive(&pool_lock);
+  draw__PoolStats stats = pool_stats;
+  ReleaseSRWLockExclusive(&pool_lock);
+  return stats;
+}
 
-  active_hdc = CreateCompatibleDC(NULL);
+int draw__get_dirty_rects(draw__Bitmap bitmap, xy__Rect *out, int max) {
+  Dirty *d = bitmap ? &((Bitmap *)bitmap)->dirty : NULL;
+  if (d == NULL || max <= 0) return 0;
+  int n = (d->num_rects < max) ? d->num_rects : max;
+  for (int i = 0; i < n; ++i) out[i] = d->rects[i];
+  for (int i = n; i < d->num_rects; ++i) {
+    out[n - 1] = union_of(out[n - 1], d->rects[i]);
+  }
+  return n;
+}
 
-  if (active_hdc == NULL) err_msg("Error: CreateCompatibleDC failed.\n");
+void draw__clear_dirty(draw__Bitmap bitmap) {
+  Dirty *d = bitmap ? &((Bitmap *)bitmap)->dirty : NULL;
+  if (d) d->num_rects = 0;
+}
 
-  SetGraphicsMode(active_hdc, GM_ADVANCED);
-  SetBkMode(active_hdc, TRANSPARENT);
+// Mipmaps.
 
-  is_initialized = true;
+int draw__build_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                        int max_levels) {
+  return build_mipmaps((Bitmap *)bitmap, levels, max_levels, false);
 }
 
-static void UseObject(HGDIOBJ obj) {
-  HGDIOBJ old_obj = SelectObject(active_hdc, obj);
-  if (old_obj != obj) DeleteObject(old_obj);
+int draw__build_linear_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                               int max_levels) {
+  return build_mipmaps((Bitmap *)bitmap, levels, max_levels, true);
 }
 
+// Blurs.
 
-// Public functions.
+// The rows are blurred into a w x h buffer, and the columns from there back
+// into the bitmap, each box moving down a row of sums at a time.
+void draw__blur(draw__Bitmap bitmap, xy__Rect rect, xy__Float radius) {
+  Bitmap *b = (Bitmap *)bitmap;
+  if (b == NULL || !(radius > 0)) return;
+  int x0 = (int)fmax(ceil(fmin(rect.xmin, rect.xmax) - 0.5), 0);
+  int y0 = (int)fmax(ceil(fmin(rect.ymin, rect.ymax) - 0.5), 0);
+  int x1 = (int)fmin(ceil(fmax(rect.xmin, rect.xmax) - 0.5), b->x_size);
+  int y1 = (int)fmin(ceil(fmax(rect.ymin, rect.ymax) - 0.5), b->y_size);
+  if (!(x0 < x1 && y0 < y1)) return;
 
-draw__Bitmap draw__new_bitmap(int w, int h) {
-  Bitmap *b = malloc(sizeof(Bitmap));
+  // GdiFlush ensures that GDI has finished drawing into the bitmap.
+  GdiFlush();
+  int radii[3];
+  find_blur_radii(fmin(radius, max_blur_radius), radii);
+  int       w      = x1 - x0, h = y1 - y0;
+  // The rows take 2 * w pixels of tmp, which is more than w * h when h = 1.
+  uint32_t *pixels = malloc((2 * (size_t)h + 1) * w * sizeof(uint32_t));
+  uint32_t *tmp    = pixels + (size_t)w * h;
+  uint32_t *sums   = malloc(4 * (size_t)w * sizeof(uint32_t));
+  for (int y = 0; y < h; ++y) {
+    uint32_t *out = pixels + (size_t)y * w;
+    box_blur(tmp,     row(b, y0 + y) + x0, w, radii[0]);
+    box_blur(tmp + w, tmp,                 w, radii[1]);
+    box_blur(out,     tmp + w,             w, radii[2]);
+  }
+  box_blur_columns(tmp, w, pixels, w, w, h, radii[0], sums);
+  box_blur_columns(pixels, w, tmp, w, w, h, radii[1], sums);
+  box_blur_columns(row(b, y0) + x0, stride_of(b) / 4, pixels, w, w, h,
+                   radii[2], sums);
+  free(sums);
+  free(pixels);
+  mark_bitmap(b, xy__rect_pts(x0, y0, x1, y1));
+  copy_out(b);
+}
 
-  b->x_size = w;
-  b->y_size = h;
+// Atlases.
 
-  BITMAPINFOHEADER bitmap_header;
-  memset(&bitmap_header, 0, sizeof(bitmap_header));
-  bitmap_header.biSize        = sizeof(bitmap_header);
-  bitmap_header.biWidth       = w;
-  bitmap_header.biHeight      = h;
-  bitmap_header.biPlanes      = 1;
-  bitmap_header.biBitCount    = 32;
-  bitmap_header.biCompression = BI_RGB;
+draw__Atlas draw__new_atlas(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    err_msg("Error in %s: atlas size must be positive; got %dx%d.\n",
+            __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__Bitmap bitmap = draw__new_bitmap(w, h);
+  if (bitmap == NULL) return NULL;
+  draw__Atlas atlas = calloc(1, sizeof(*atlas));
+  atlas->bitmap   = bitmap;
+  atlas->w        = w;
+  atlas->h        = h;
+  atlas->segments = malloc(w * sizeof(Segment));
+  reset_atlas(atlas);
+  return atlas;
+}
 
-  b->bitmap = CreateDIBSection(
-    NULL,
-    (BITMAPINFO *)&bitmap_header,
-    DIB_RGB_COLORS,
-    &b->bytes,
-    NULL,  // file-mapping object
-    0);    // offset to bits in file-mapping object
+void draw__delete_atlas(draw__Atlas atlas) {
+  if (atlas == NULL) return;
+  reset_atlas(atlas);
+  draw__delete_bitmap(atlas->bitmap);
+  free(atlas->segments);
+  free(atlas->views);
+  free(atlas);
+}
 
-  if (b->bitmap == NULL) {
-    err_msg("Error: CreateDIBSection failed in %s.\n", __FUNCTION__);
+draw__Bitmap draw__get_atlas_bitmap(draw__Atlas atlas) {
+  return atlas->bitmap;
+}
+
+// Each region goes where its top is lowest, and where it's leftmost among
+// those. It takes up an extra row above it for its gap.
+draw__Bitmap draw__atlas_add(draw__Atlas atlas, int w, int h, xy__Rect *uv) {
+  if (atlas == NULL || w <= 0 || h <= 0) {
+    err_msg("Error in %s: need an atlas and a positive size; got %dx%d.\n",
+            __FUNCTION__, w, h);
     return NULL;
   }
+  int best_i = -1, best_y = 0;
+  for (int i = 0; i < atlas->num_segments; ++i) {
+    int y = atlas_fit(atlas, i, w, h);
+    if (y >= 0 && (best_i < 0 || y < best_y)) {
+      best_i = i;
+      best_y = y;
+    }
+  }
+  if (best_i < 0) return NULL;
+
+  int          x    = atlas->segments[best_i].x;
+  draw__Bitmap view = draw__new_bitmap_view(atlas->bitmap, x, best_y, w, h);
+  if (view == NULL) return NULL;
+  atlas_raise(atlas, best_i, padded_width(atlas, x, w), best_y + h + 1);
 
-  if (system_bitmap == NULL) {
-    init_if_needed();  // Ensure active_hdc != NULL.
-    // Keep a handle to the constant 1x1 bitmap object
-    // so we may later deselect a bitmap from an hdc.
-    system_bitmap = SelectObject(active_hdc, b->bitmap);
+  if (atlas->num_views == atlas->views_cap) {
+    atlas->views_cap = atlas->views_cap ? 2 * atlas->views_cap : 64;
+    atlas->views     = realloc(atlas->views,
+                               atlas->views_cap * sizeof(draw__Bitmap));
   }
+  atlas->views[atlas->num_views++] = view;
 
-  return (draw__Bitmap)b;
+  if (uv) {
+    double sx = 1.0 / atlas->w, sy = 1.0 / atlas->h;
+    *uv = xy__rect_pts(x * sx, best_y * sy, (x + w) * sx, (best_y + h) * sy);
+  }
+  return view;
 }
 
-void draw__delete_bitmap(draw__Bitmap bitmap) {
-  Bitmap *b = (Bitmap *)bitmap;
-
-  // Ensure the bitmap is not currently selected.
-  HBITMAP current_bitmap = (HBITMAP)GetCurrentObject(active_hdc, OBJ_BITMAP);
-  if (current_bitmap == b->bitmap) SelectObject(active_hdc, system_bitmap);
-  DeleteObject(b->bitmap);
+void draw__clear_atlas(draw__Atlas atlas) {
+  if (atlas) reset_atlas(atlas);
 }
 
-void draw__set_bitmap(draw__Bitmap bitmap) {
-  init_if_needed();
+// Tiled bitmaps.
 
-  Bitmap *b = (Bitmap *)bitmap;
-  SelectObject(active_hdc, b->bitmap);
+draw__TiledBitmap draw__new_tiled_bitmap(int w, int h) {
+  if (w <= 0 || h <= 0) {
+    err_msg("Error in %s: tiled bitmap size must be positive; got "
+            "%dx%d.\n", __FUNCTION__, w, h);
+    return NULL;
+  }
+  draw__TiledBitmap tiled = malloc(sizeof(*tiled));
+  tiled->w       = w;
+  tiled->h       = h;
+  tiled->tiles_x = (int)(((int64_t)w + draw__tile_size - 1) / draw__tile_size);
+  tiled->tiles_y = (int)(((int64_t)h + draw__tile_size - 1) / draw__tile_size);
+  tiled->rows    = calloc(tiled->tiles_y, sizeof(draw__Bitmap *));
+  return tiled;
+}
 
-  // Use a bottom-up coordinate system; (0, 0) is the lower-left corner.
-  XFORM yflip = { 1.0f, 0.0f, 0.0f, -1.0f, 0.0f, (FLOAT)(b->y_size - 1) };
-  SetWorldTransform(active_hdc, &yflip);
+void draw__delete_tiled_bitmap(draw__TiledBitmap tiled) {
+  if (tiled == NULL) return;
+  for (int ty = 0; ty < tiled->tiles_y; ++ty) {
+    if (tiled->rows[ty] == NULL) continue;
+    for (int tx = 0; tx < tiled->tiles_x; ++tx) {
+      if (tiled->rows[ty][tx]) draw__delete_bitmap(tiled->rows[ty][tx]);
+    }
+    free(tiled->rows[ty]);
+  }
+  free(tiled->rows);
+  free(tiled);
+}
 
-  active_bitmap = b;
+void draw__get_tile_counts(draw__TiledBitmap tiled, int *tiles_x,
+                           int *tiles_y) {
+  *tiles_x = tiled->tiles_x;
+  *tiles_y = tiled->tiles_y;
 }
 
-void *draw__get_bitmap_data(draw__Bitmap bitmap) {
-  Bitmap *b = (Bitmap *)bitmap;
-  return b->bytes;
+// Tiles on the right and top edges are cut to the canvas.
+draw__Bitmap draw__get_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y) {
+    return NULL;
+  }
+  draw__Bitmap **row = &tiled->rows[ty];
+  if (*row == NULL) *row = calloc(tiled->tiles_x, sizeof(draw__Bitmap));
+  draw__Bitmap *tile = &(*row)[tx];
+  if (*tile == NULL) {
+    int x = tx * draw__tile_size, y = ty * draw__tile_size;
+    int w = tiled->w - x,         h = tiled->h - y;
+    *tile = draw__new_bitmap((w < draw__tile_size) ? w : draw__tile_size,
+                             (h < draw__tile_size) ? h : draw__tile_size);
+  }
+  return *tile;
+}
+
+draw__Bitmap draw__find_tile(draw__TiledBitmap tiled, int tx, int ty) {
+  if (tiled == NULL || tx < 0 || ty < 0 ||
+      tx >= tiled->tiles_x || ty >= tiled->tiles_y ||
+      tiled->rows[ty] == NULL) {
+    return NULL;
+  }
+  return tiled->rows[ty][tx];
 }
 
 // Fonts and text.
@@ -142,78 +2174,120 @@ draw__Font draw__new_font(const char *name, int size) {
   font_info.lfHeight = -1 * size;
   HFONT font = CreateFontIndirect(&font_info);
 
+
   if (font == NULL) {
     err_msg("Error: CreateFontIndirect failed in %s.\n", __FUNCTION__);
     return NULL;
   }
 
-  if (system_font == NULL) {
-    init_if_needed();  // Ensure active_hdc != NULL.
-    // Keep a handle to the system font so we may
-    // later deselect a font from an hdc.
-    system_font = SelectObject(active_hdc, font);
-  }
-
   return font;
 }
 
 void draw__delete_font(draw__Font font) {
-  // Ensure the bitmap is not currently selected.
-  HFONT current_font = (HFONT)GetCurrentObject(active_hdc, OBJ_FONT);
-  if (current_font == font) SelectObject(active_hdc, system_font);
+  draw__Context *c = &default_context;
+  // Ensure the font is not currently selected.
+  HFONT current_font = (HFONT)GetCurrentObject(c->hdc, OBJ_FONT);
+  if (current_font == font) SelectObject(c->hdc, system_font);
+  if (c->metrics_font == font) c->metrics_font = NULL;
+  remove_layouts_using(font);
   DeleteObject(font);
 }
 
-void draw__set_font(draw__Font font) {
-  SelectObject(active_hdc, font);
+void draw__ctx_set_font(draw__Context *c, draw__Font font) {
+  SelectObject(c->hdc, font);
 }
 
-void draw__set_font_color(draw__Color color) {
-  SetTextColor(active_hdc, color);
+void draw__ctx_set_font_color(draw__Context *c, draw__Color color) {
+  SetTextColor(c->hdc, color);
 }
 
 // Returns the x value at the end of the drawn text.
-xy__Float draw__string(
+xy__Float draw__ctx_string(
+  draw__Context *c,
   const char *s,  // The string to draw.
   int x,          // The min x of the drawing box.
   int y,          // The min y of the drawing box.
   int w,          // The width of the drawing box; ignored when left-justified.
   float pos) {    // 0, 0.5, 1 = left, center, or right justified in the box.
+  xy__Float end = draw_text(c, s, strlen(s), x, y, w, pos);
+  copy_out(c->bitmap);
+  return end;
+}
 
-  // Temporarily unflip the coordinate system; otherwise text appears upside-down.
-  ModifyWorldTransform(active_hdc, NULL, MWT_IDENTITY);  // World transform = identity.
-  int ymax = active_bitmap->y_size - 1;
-  y = ymax - y;
+void draw__set_string_cache_budget(size_t bytes) {
+  // There's no line cache to budget; see draw.h.
+}
 
-  SIZE str_size;
-  size_t s_len = strlen(s);
-  BOOL is_ok = GetTextExtentPoint32(active_hdc, s, s_len, &str_size);
+draw__CacheStats draw__get_string_cache_stats() {
+  draw__CacheStats stats = { 0, 0, 0, 0, 0, 0 };
+  return stats;
+}
 
-  if (!is_ok) {
-    err_msg("Error: GetTextExtentPoint32 failed in %s.\n", __FUNCTION__);
-    str_size.cx = 0;
-  }
+// Text measurement.
 
-  if (pos != 0 && pos != 0.5 && pos != 1) {
-    err_msg("Error: in %s, pos should be 0, 0.5, or 1.\n", __FUNCTION__);
-    pos = 0;
+draw__TextMetrics draw__ctx_measure_string(draw__Context *c, const char *s) {
+  draw__TextMetrics text_metrics = { 0, 0, 0 };
+  draw__ctx_measure_strings(c, &s, 1, &text_metrics);
+  return text_metrics;
+}
+
+// This only asks the hdc for sizes, so no pixels are touched.
+void draw__ctx_measure_strings(draw__Context *c, const char **strs, int n,
+                               draw__TextMetrics *out) {
+  init_if_needed();
+  TEXTMETRIC *font_info = font_metrics(c);
+
+  for (int i = 0; i < n; ++i) {
+    SIZE str_size = { 0, 0 };
+    if (!GetTextExtentPoint32(c->hdc, strs[i], strlen(strs[i]),
+                              &str_size)) {
+      err_msg("Error: GetTextExtentPoint32 failed in %s.\n", __FUNCTION__);
+    }
+    out[i] = (draw__TextMetrics) { str_size.cx, font_info->tmAscent,
+                                   font_info->tmDescent };
   }
+}
 
-  UINT align_modes[] = { TA_LEFT, TA_CENTER, TA_RIGHT };
-  SetTextAlign(active_hdc, TA_BOTTOM | align_modes[(int)(pos * 2)]);
+// Text boxes.
 
-  int start_x = x;
-  if (pos == 1.0) x += w;
-  if (pos == 0.5) x += (int)(w / 2.0);
+xy__Float draw__ctx_text_box(draw__Context *c, const char *s, xy__Rect rect,
+                             float align, int wrap) {
+  TEXTMETRIC *font_info = font_metrics(c);
+  xy__Float   line_h    = font_info->tmHeight + font_info->tmExternalLeading;
+  xy__Float   x0        = fmin(rect.xmin, rect.xmax);
+  xy__Float   width     = fmax(rect.xmin, rect.xmax) - x0;
+  xy__Float   top       = fmax(rect.ymin, rect.ymax);
 
-  is_ok = TextOut(active_hdc, x, y, s, s_len);
-  if (!is_ok) { err_msg("Error: TextOut failed in %s.\n", __FUNCTION__); }
+  // Only the lines that meet both the rect and the clip are drawn, so the
+  // cost of drawing doesn't grow with lines scrolled out of view.
+  xy__Rect visible = visible_part(c, rect);
 
-  // Re-flip the coordinate system to a bottom-up orientation.
-  XFORM yflip = { 1.0f, 0.0f, 0.0f, -1.0f, 0.0f, (FLOAT)(ymax) };
-  SetWorldTransform(active_hdc, &yflip);
+  AcquireSRWLockExclusive(&layouts_lock);
+  TextLayout *l         = layout_of(c, s, wrap == draw__wrap_words, width);
+  int         num_lines = l->num_lines;
+  int         i0 = 0, i1 = 0;
+  if (line_h > 0 && !is_empty(visible)) {
+    i0 = (int)fmax(floor((top - visible.ymax) / line_h), 0);
+    i1 = (int)fmin(ceil ((top - visible.ymin) / line_h), num_lines);
+  }
+  size_t *spans = malloc(2 * (size_t)(i1 > i0 ? i1 - i0 : 0) *
+                         sizeof(size_t));
+  for (int i = i0; i < i1; ++i) {
+    line_span(l, i, &spans[2 * (i - i0)], &spans[2 * (i - i0) + 1]);
+  }
+  ReleaseSRWLockExclusive(&layouts_lock);
 
-  return start_x + str_size.cx;
+  // The lines are drawn after the layouts are released, as the spans are
+  // offsets into s.
+  for (int i = i0; i < i1; ++i) {
+    size_t start = spans[2 * (i - i0)], end = spans[2 * (i - i0) + 1];
+    draw_text(c, s + start, end - start, (int)floor(x0 + 0.5),
+              (int)floor(top - (i + 1) * line_h + 0.5),
+              (int)floor(width + 0.5), align);
+  }
+  copy_out(c->bitmap);
+  free(spans);
+  return num_lines * line_h;
 }
 
 // Colors.
@@ -226,35 +2300,496 @@ void draw__delete_color(draw__Color color) {
   // Colors on windows are not dynamically allocated, so don't need to be deleted.
 }
 
+void draw__ctx_rgb_fill_color(draw__Context *c, double r, double g, double b) {
+  set_fill_color(c, draw__new_color(r, g, b));
+}
+
+void draw__ctx_rgb_stroke_color(draw__Context *c,
+                                double r, double g, double b) {
+  set_stroke_color(c, draw__new_color(r, g, b));
+}
+
+// GDI brushes and pens are opaque, so the alpha is dropped.
+
+void draw__ctx_rgba_fill_color(draw__Context *c,
+                               double r, double g, double b, double a) {
+  set_fill_color(c, draw__new_color(r, g, b));
+}
+
+void draw__ctx_rgba_stroke_color(draw__Context *c,
+                                 double r, double g, double b, double a) {
+  set_stroke_color(c, draw__new_color(r, g, b));
+}
+
+void draw__ctx_fill_color32(draw__Context *c, draw__Rgba32 color) {
+  set_fill_color(c, colorref_of_rgba32(color));
+}
+
+void draw__ctx_stroke_color32(draw__Context *c, draw__Rgba32 color) {
+  set_stroke_color(c, colorref_of_rgba32(color));
+}
+
+void draw__ctx_set_gamma_blending(draw__Context *c, int is_on) {
+  // The system blends colors, so there's no blending mode to set.
+}
+
+// Clipping.
+
+void draw__ctx_push_clip(draw__Context *c, xy__Rect rect) {
+  if (c->num_clips == c->clips_cap) {
+    c->clips_cap = c->clips_cap ? 2 * c->clips_cap : 8;
+    c->clips     = realloc(c->clips, c->clips_cap * sizeof(xy__Rect));
+  }
+  // Moving each edge to the nearest pixel edge keeps the pixels whose
+  // centers are in rect.
+  rect = xy__rect_pts(ceil(fmin(rect.xmin, rect.xmax) - 0.5),
+                      ceil(fmin(rect.ymin, rect.ymax) - 0.5),
+                      ceil(fmax(rect.xmin, rect.xmax) - 0.5),
+                      ceil(fmax(rect.ymin, rect.ymax) - 0.5));
+  if (c->num_clips) rect = intersection_of(rect, c->clips[c->num_clips - 1]);
+  c->clips[c->num_clips++] = rect;
+  if (c->bitmap) select_clip(c);
+}
+
+void draw__ctx_pop_clip(draw__Context *c) {
+  if (c->num_clips == 0) {
+    err_msg("Error in %s: no clip to pop.\n", __FUNCTION__);
+    return;
+  }
+  c->num_clips--;
+  if (c->bitmap) select_clip(c);
+}
+
+// Shapes and lines.
+
+void draw__ctx_fill_rect(draw__Context *c, xy__Rect rect) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_fill_rect, c->fill_color, rect);
+    return;
+  }
+  xy__Rect visible = visible_part(c, cmd_bounds(&(Cmd) { cmd_fill_rect,
+                                                        c->fill_color, rect }));
+  if (is_empty(visible)) return;
+  mark(c, visible);
+  HDC hdc = c->hdc;
+  SaveDC(hdc);
+  HPEN pen = (HPEN)GetStockObject(NULL_PEN);
+  SelectObject(hdc, pen);
+  Rectangle(hdc, (int)rect.xmin, (int)rect.ymin, (int)rect.xmax, (int)rect.ymax);
+  RestoreDC(hdc, -1 /* restore last saved state */);
+  copy_out(c->bitmap);
+}
+
+void draw__ctx_stroke_rect(draw__Context *c, xy__Rect rect) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_stroke_rect, c->stroke_color, rect);
+    return;
+  }
+  xy__Rect visible = visible_part(c, cmd_bounds(&(Cmd) { cmd_stroke_rect,
+                                                        c->stroke_color,
+                                                        rect }));
+  if (is_empty(visible)) return;
+  mark(c, visible);
+  HDC hdc = c->hdc;
+  SaveDC(hdc);
+  HBRUSH brush = (HBRUSH)GetStockObject(NULL_BRUSH);
+  SelectObject(hdc, brush);
+  Rectangle(hdc, (int)rect.xmin, (int)rect.ymin, (int)rect.xmax, (int)rect.ymax);
+  RestoreDC(hdc, -1 /* restore last saved state */);
+  copy_out(c->bitmap);
+}
+
+void draw__ctx_line(draw__Context *c, xy__Float x1, xy__Float y1,
+                                      xy__Float x2, xy__Float y2) {
+  if (c->recording_list) {
+    add_cmd(c, cmd_line, c->stroke_color, xy__rect_pts(x1, y1, x2, y2));
+    return;
+  }
+  xy__Rect visible = visible_part(c, cmd_bounds(&(Cmd) {
+      cmd_line, c->stroke_color, xy__rect_pts(x1, y1, x2, y2) }));
+  if (is_empty(visible)) return;
+  mark(c, visible);
+  MoveToEx(c->hdc, (int)x1, (int)y1, NULL);
+  LineTo(c->hdc, (int)x2, (int)y2);
+  copy_out(c->bitmap);
+}
+
+// All of the lines go to GDI in one call. GDI lines aren't antialiased, so
+// draw__antialias makes no difference here.
+void draw__ctx_lines(draw__Context *c, const xy__Pt *pts, int n, int mode) {
+  bit is_polyline = !(mode & draw__segments);
+  int num_lines   = is_polyline ? n - 1 : n / 2;
+  int num_pts     = is_polyline ? n : 2 * num_lines;
+  if (num_lines <= 0) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < num_lines; ++i) {
+      const xy__Pt *p = pts + (is_polyline ? i : 2 * i);
+      add_cmd(c, cmd_line, c->stroke_color,
+              xy__rect_pts(p[0].x, p[0].y, p[1].x, p[1].y));
+    }
+    return;
+  }
+
+  reserve_scratch(c, num_pts);
+  POINT   *gdi_pts = c->scratch_pts;
+  xy__Rect bounds  = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 0; i < num_pts; ++i) {
+    gdi_pts[i].x = (int)pts[i].x;
+    gdi_pts[i].y = (int)pts[i].y;
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  xy__Rect visible = visible_part(c, cmd_bounds(&(Cmd) { cmd_line,
+                                                        c->stroke_color,
+                                                        bounds }));
+  if (is_empty(visible)) return;
+  mark(c, visible);
+
+  if (is_polyline) {
+    Polyline(c->hdc, gdi_pts, num_pts);
+  } else {
+    for (int i = 0; i < num_lines; ++i) c->scratch_counts[i] = 2;
+    PolyPolyline(c->hdc, gdi_pts, c->scratch_counts, num_lines);
+  }
+  copy_out(c->bitmap);
+}
+
+// GDI's ALTERNATE and WINDING fill modes are the even-odd and nonzero rules.
+void draw__ctx_fill_polygon(draw__Context *c, const xy__Pt *pts, int n,
+                            int rule) {
+  if (rule != draw__nonzero && rule != draw__even_odd) {
+    err_msg("Error in %s: unknown fill rule %d.\n", __FUNCTION__, rule);
+    return;
+  }
+  if (n < 3) return;
+
+  reserve_scratch(c, n);
+  POINT   *gdi_pts = c->scratch_pts;
+  xy__Rect bounds  = xy__rect_pts(pts[0].x, pts[0].y, pts[0].x, pts[0].y);
+  for (int i = 0; i < n; ++i) {
+    gdi_pts[i].x = (int)pts[i].x;
+    gdi_pts[i].y = (int)pts[i].y;
+    bounds = union_of(bounds, xy__rect_pts(pts[i].x, pts[i].y,
+                                           pts[i].x, pts[i].y));
+  }
+  xy__Rect visible = visible_part(c, cmd_bounds(&(Cmd) { cmd_fill_rect,
+                                                        c->fill_color,
+                                                        bounds }));
+  if (is_empty(visible)) return;
+  mark(c, visible);
+
+  HDC hdc = c->hdc;
+  SaveDC(hdc);
+  SelectObject(hdc, GetStockObject(NULL_PEN));
+  SetPolyFillMode(hdc, (rule == draw__even_odd) ? ALTERNATE : WINDING);
+  Polygon(hdc, gdi_pts, n);
+  RestoreDC(hdc, -1 /* restore last saved state */);
+  copy_out(c->bitmap);
+}
+
+// Blitting.
+
+void draw__ctx_blit(draw__Context *c, draw__Bitmap src, xy__Rect src_rect,
+                    int dst_x, int dst_y, int mode) {
+  draw__Sprite sprite = { src, src_rect, dst_x, dst_y };
+  draw__ctx_blit_many(c, &sprite, 1, mode);
+}
+
+// GDI has no additive blending, so blits work on the bitmap's pixels
+// directly.
+void draw__ctx_blit_many(draw__Context *c, const draw__Sprite *sprites, int n,
+                         int mode) {
+  if (mode < draw__blit_copy || mode > draw__blit_add) {
+    err_msg("Error in %s: unknown blit mode %d.\n", __FUNCTION__, mode);
+    return;
+  }
+  Bitmap  *b    = c->bitmap;
+  if (b == NULL) return;
+  xy__Rect area = visible_part(c, xy__rect_pts(0, 0, b->x_size, b->y_size));
+  if (is_empty(area)) return;
+
+  // GdiFlush ensures that GDI has finished drawing into the bitmaps.
+  GdiFlush();
+  for (int i = 0; i < n; ++i) blit(b, area, &sprites[i], mode);
+  copy_out(b);
+}
+
+// Command lists.
+
+void draw__ctx_begin_list(draw__Context *c) {
+  if (c->recording_list) {
+    err_msg("Error in %s: a list is already being recorded.\n", __FUNCTION__);
+    return;
+  }
+  c->recording_list = calloc(1, sizeof(*c->recording_list));
+}
+
+draw__List draw__ctx_end_list(draw__Context *c) {
+  draw__List list = c->recording_list;
+  if (list == NULL) {
+    err_msg("Error in %s: no list is being recorded.\n", __FUNCTION__);
+    return NULL;
+  }
+  c->recording_list = NULL;
+
+  sort_cmds(list);
+  list->fill_color   = c->fill_color;
+  list->stroke_color = c->stroke_color;
+  return list;
+}
+
+void draw__ctx_execute_list(draw__Context *c, draw__List list) {
+  if (list == NULL) return;
+
+  if (c->recording_list) {
+    for (int i = 0; i < list->num_cmds; ++i) {
+      Cmd *cmd = &list->cmds[i];
+      add_cmd(c, cmd->op, cmd->color, cmd->rect);
+    }
+  } else {
+    // Draw each run of commands that share an op and a color together,
+    // only replacing the brush or pen when the color changes.
+    Cmd *cmds = list->cmds;
+    for (int i = 0, end; i < list->num_cmds; i = end) {
+      for (end = i + 1; end < list->num_cmds; ++end) {
+        if (cmds[end].op != cmds[i].op || cmds[end].color != cmds[i].color) {
+          break;
+        }
+      }
+      if (cmds[i].op == cmd_fill_rect) {
+        set_fill_color(c, cmds[i].color);
+      } else {
+        set_stroke_color(c, cmds[i].color);
+      }
+      draw_run(c, cmds + i, end - i);
+    }
+    copy_out(c->bitmap);
+  }
+
+  set_fill_color  (c, list->fill_color);
+  set_stroke_color(c, list->stroke_color);
+}
+
+// Each touched tile runs the commands that touch it, moved to the tile's
+// coordinates, with the clip moved the same way. Setting the tile in the
+// context applies the moved clip, and restoring the bitmap afterward
+// applies the original one.
+void draw__ctx_execute_list_on_tiles(draw__Context *c,
+                                     draw__TiledBitmap tiled,
+                                     draw__List list) {
+  if (tiled == NULL || list == NULL) return;
+  if (c->recording_list) {
+    err_msg("Error in %s: tiles can't be drawn into while a list is "
+            "being recorded.\n", __FUNCTION__);
+    return;
+  }
+
+  // Tiles outside the clip aren't made.
+  xy__Rect area = xy__rect_pts(0, 0, tiled->w, tiled->h);
+  if (c->num_clips) area = intersection_of(area, c->clips[c->num_clips - 1]);
+
+  TileHit *hits     = NULL;
+  int      num_hits = 0, hits_cap = 0;
+  for (int i = 0; i < list->num_cmds; ++i) {
+    add_tile_hits(area, &list->cmds[i], i, &hits, &num_hits, &hits_cap);
+  }
+  if (num_hits) qsort(hits, num_hits, sizeof(TileHit), compare_hits);
+
+  draw__Bitmap bitmap    = (draw__Bitmap)c->bitmap;
+  xy__Rect    *clips     = c->clips;
+  int          num_clips = c->num_clips;
+  xy__Rect     clip;
+  struct draw__ListStruct part = *list;
+  part.cmds = malloc((list->num_cmds + 1) * sizeof(Cmd));
+  for (int i = 0, end; i < num_hits; i = end) {
+    int tx = hits[i].tx, ty = hits[i].ty;
+    for (end = i + 1; end < num_hits; ++end) {
+      if (hits[end].tx != tx || hits[end].ty != ty) break;
+    }
+    double dx = -(double)tx * draw__tile_size;
+    double dy = -(double)ty * draw__tile_size;
+    part.num_cmds = end - i;
+    for (int k = 0; k < part.num_cmds; ++k) {
+      part.cmds[k]      = list->cmds[hits[i + k].cmd];
+      part.cmds[k].rect = offset_rect(part.cmds[k].rect, dx, dy);
+    }
+    if (num_clips) {
+      clip = offset_rect(clips[num_clips - 1], dx, dy);
+      c->clips     = &clip;
+      c->num_clips = 1;
+    }
+    draw__ctx_set_bitmap(c, draw__get_tile(tiled, tx, ty));
+    draw__ctx_execute_list(c, &part);
+  }
+  c->clips     = clips;
+  c->num_clips = num_clips;
+  draw__ctx_set_bitmap(c, bitmap);
+
+  // Executing no commands leaves the colors as the list does.
+  part.num_cmds = 0;
+  draw__ctx_execute_list(c, &part);
+  free(part.cmds);
+  free(hits);
+}
+
+void draw__delete_list(draw__List list) {
+  if (list == NULL) return;
+  if (default_context.recording_list == list) {
+    default_context.recording_list = NULL;
+  }
+  free(list->cmds);
+  free(list);
+}
+
+void draw__ctx_set_num_threads(draw__Context *c, int n) {
+  // GDI draws each list on the calling thread, so there's no thread count
+  // to set.
+}
+
+// Contexts.
+
+draw__Context *draw__new_context() {
+  init_if_needed();
+
+  draw__Context *c = malloc(sizeof(draw__Context));
+  *c = (draw__Context) new_context_values;
+  c->hdc = new_hdc();
+  return c;
+}
+
+// The brush and pen made by set_fill_color and set_stroke_color are still
+// selected, so they're swapped for stock objects and freed with the hdc.
+void draw__delete_context(draw__Context *c) {
+  if (c == NULL || c == &default_context) return;
+  SelectObject(c->hdc, system_bitmap);
+  SelectObject(c->hdc, system_font);
+  UseObject(c->hdc, GetStockObject(WHITE_BRUSH));
+  UseObject(c->hdc, GetStockObject(BLACK_PEN));
+  DeleteDC(c->hdc);
+  draw__delete_list(c->recording_list);
+  free(c->scratch_pts);
+  free(c->scratch_counts);
+  free(c->clips);
+  free(c);
+}
+
+draw__Context *draw__get_default_context() {
+  init_if_needed();
+  return &default_context;
+}
+
+// These use the default context.
+
+void draw__set_bitmap(draw__Bitmap bitmap) {
+  draw__ctx_set_bitmap(&default_context, bitmap);
+}
+
+void draw__set_font(draw__Font font) {
+  draw__ctx_set_font(&default_context, font);
+}
+
+void draw__set_font_color(draw__Color color) {
+  draw__ctx_set_font_color(&default_context, color);
+}
+
+xy__Float draw__string(const char *s, int x, int y, int w, float pos) {
+  return draw__ctx_string(&default_context, s, x, y, w, pos);
+}
+
+draw__TextMetrics draw__measure_string(const char *s) {
+  return draw__ctx_measure_string(&default_context, s);
+}
+
+void draw__measure_strings(const char **strs, int n, draw__TextMetrics *out) {
+  draw__ctx_measure_strings(&default_context, strs, n, out);
+}
+
+xy__Float draw__text_box(const char *s, xy__Rect rect, float align, int wrap) {
+  return draw__ctx_text_box(&default_context, s, rect, align, wrap);
+}
+
 void draw__rgb_fill_color(double r, double g, double b) {
-  HBRUSH brush = CreateSolidBrush(draw__new_color(r, g, b));
-  UseObject(brush);
+  draw__ctx_rgb_fill_color(&default_context, r, g, b);
 }
 
 void draw__rgb_stroke_color(double r, double g, double b) {
-  HPEN pen = CreatePen(PS_SOLID, 1 /* width */, draw__new_color(r, g, b));
-  UseObject(pen);
+  draw__ctx_rgb_stroke_color(&default_context, r, g, b);
 }
 
-// Shapes and lines.
+void draw__rgba_fill_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_fill_color(&default_context, r, g, b, a);
+}
+
+void draw__rgba_stroke_color(double r, double g, double b, double a) {
+  draw__ctx_rgba_stroke_color(&default_context, r, g, b, a);
+}
+
+void draw__fill_color32(draw__Rgba32 color) {
+  draw__ctx_fill_color32(&default_context, color);
+}
+
+void draw__stroke_color32(draw__Rgba32 color) {
+  draw__ctx_stroke_color32(&default_context, color);
+}
+
+void draw__set_gamma_blending(int is_on) {
+  draw__ctx_set_gamma_blending(&default_context, is_on);
+}
+
+void draw__push_clip(xy__Rect rect) {
+  draw__ctx_push_clip(&default_context, rect);
+}
+
+void draw__pop_clip() {
+  draw__ctx_pop_clip(&default_context);
+}
 
 void draw__fill_rect(xy__Rect rect) {
-  SaveDC(active_hdc);
-  HPEN pen = (HPEN)GetStockObject(NULL_PEN);
-  SelectObject(active_hdc, pen);
-  Rectangle(active_hdc, (int)rect.xmin, (int)rect.ymin, (int)rect.xmax, (int)rect.ymax);
-  RestoreDC(active_hdc, -1 /* restore last saved state */);
+  draw__ctx_fill_rect(&default_context, rect);
 }
 
 void draw__stroke_rect(xy__Rect rect) {
-  SaveDC(active_hdc);
-  HBRUSH brush = (HBRUSH)GetStockObject(NULL_BRUSH);
-  SelectObject(active_hdc, brush);
-  Rectangle(active_hdc, (int)rect.xmin, (int)rect.ymin, (int)rect.xmax, (int)rect.ymax);
-  RestoreDC(active_hdc, -1 /* restore last saved state */);
+  draw__ctx_stroke_rect(&default_context, rect);
 }
 
 void draw__line(xy__Float x1, xy__Float y1, xy__Float x2, xy__Float y2) {
-  MoveToEx(active_hdc, (int)x1, (int)y1, NULL);
-  LineTo(active_hdc, (int)x2, (int)y2);
+  draw__ctx_line(&default_context, x1, y1, x2, y2);
+}
+
+void draw__lines(const xy__Pt *pts, int n, int mode) {
+  draw__ctx_lines(&default_context, pts, n, mode);
+}
+
+void draw__fill_polygon(const xy__Pt *pts, int n, int rule) {
+  draw__ctx_fill_polygon(&default_context, pts, n, rule);
+}
+
+void draw__blit(draw__Bitmap src, xy__Rect src_rect, int dst_x, int dst_y,
+                int mode) {
+  draw__ctx_blit(&default_context, src, src_rect, dst_x, dst_y, mode);
+}
+
+void draw__blit_many(const draw__Sprite *sprites, int n, int mode) {
+  draw__ctx_blit_many(&default_context, sprites, n, mode);
+}
+
+void draw__begin_list() {
+  draw__ctx_begin_list(&default_context);
+}
+
+draw__List draw__end_list() {
+  return draw__ctx_end_list(&default_context);
+}
+
+void draw__execute_list(draw__List list) {
+  draw__ctx_execute_list(&default_context, list);
+}
+
+void draw__execute_list_on_tiles(draw__TiledBitmap tiled, draw__List list) {
+  draw__ctx_execute_list_on_tiles(&default_context, tiled, list);
+}
+
+void draw__set_num_threads(int n) {
+  draw__ctx_set_num_threads(&default_context, n);
 }
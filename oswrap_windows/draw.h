@@ -10,6 +10,8 @@
 
 #include "xy.h"
 
+#include <stdint.h>
+
 #ifdef __APPLE__
 #include <CoreGraphics/CoreGraphics.h>
 #include <CoreText/CoreText.h>
@@ -43,10 +45,57 @@ typedef COLORREF     draw__Color;
 
 #endif
 
+// A color packed as 0xRRGGBBAA, so that 0xff8000ff is opaque orange.
+// Unlike a draw__Color, it holds no resources and is the same on every
+// platform.
+typedef uint32_t draw__Rgba32;
+
 // Bitmaps.
+//
+// A bitmap is at most INT_MAX / 4 pixels wide, so that its stride fits in
+// an int. Sizes in bytes are found with 64-bit math, so bitmaps may hold
+// more than 2 GB when memory allows; for canvases larger than that, see
+// the tiled bitmaps below.
 
 draw__Bitmap draw__new_bitmap     (int w, int h);
 void         draw__delete_bitmap  (draw__Bitmap bitmap);
+
+// Makes a bitmap that draws directly into pixels owned by the caller, such
+// as shared or mapped memory. The pixels are in the format returned by
+// draw__get_bitmap_data, with row y starting y * stride bytes in, and
+// stride a multiple of 4. They're drawn over as they are rather than
+// cleared, and must outlive the bitmap; deleting the bitmap leaves them be.
+//
+// GDI can only draw into memory it allocates or into a file mapping, so on
+// windows the bitmap draws into its own copy of the pixels, made when it's
+// created, and each draw call copies the pixels it changes out to them.
+// Changes made to the pixels directly after that aren't seen by later
+// drawing. draw__new_bitmap_with_section draws straight into a file mapping.
+draw__Bitmap draw__new_bitmap_with_data(int w, int h, int stride,
+                                        void *pixels);
+
+#ifdef _WIN32
+// Makes a bitmap whose pixels are in the file mapping section, starting at
+// offset bytes in, which must be a multiple of 4. Rows are 4 * w bytes apart.
+draw__Bitmap draw__new_bitmap_with_section(int w, int h, HANDLE section,
+                                           DWORD offset);
+#endif
+
+// Makes a view of the w x h rect of bitmap with its lower-left corner at
+// (x, y). A view shares the bitmap's pixels, so drawing into it changes
+// the bitmap, and its drawing is clipped to the rect. Changes to a view are
+// also dirty in the bitmap. A view is deleted like any other bitmap, and
+// must be deleted before the bitmap it views. Views of one bitmap count as
+// that bitmap when contexts draw from several threads.
+draw__Bitmap draw__new_bitmap_view(draw__Bitmap bitmap, int x, int y,
+                                   int w, int h);
+
+// Returns a new bitmap with the same size and pixels as bitmap, and no
+// dirty rects. The clone is independent of bitmap, and is deleted like any
+// other bitmap.
+// GDI owns the memory of its bitmaps, so the pixels are copied.
+draw__Bitmap draw__clone_bitmap   (draw__Bitmap bitmap);
+
 void         draw__set_bitmap     (draw__Bitmap bitmap);
 // TODO draw__get_bitmap_data would make sense returning char * on
 //      windows. Would that also make sense on mac?
@@ -54,6 +103,167 @@ void         draw__set_bitmap     (draw__Bitmap bitmap);
 // object.
 void *       draw__get_bitmap_data(draw__Bitmap bitmap);
 
+// Returns the number of bytes from the start of one row of pixels to the
+// start of the next.
+int          draw__get_bitmap_stride(draw__Bitmap bitmap);
+
+// Copies the bitmap's pixels to dst with each pixel's bytes in the given
+// order. Row y of the copy starts y * dst_stride bytes into dst, so that rows
+// go up from y = 0 as in draw__get_bitmap_data; draw__flip_rows puts the
+// top row first instead. Colors stay premultiplied by alpha unless flags
+// includes draw__straight_alpha.
+
+typedef enum {
+  draw__rgba,
+  draw__bgra,
+  draw__argb
+} draw__Format;
+
+enum {
+  draw__straight_alpha = 1,
+  draw__flip_rows      = 2
+};
+
+void         draw__copy_bitmap_data(draw__Bitmap bitmap, void *dst,
+                                    int dst_stride, draw__Format format,
+                                    int flags);
+
+// Compressed bitmaps.
+//
+// GDI owns the memory of its bitmaps and draws into it without notice, so
+// bitmaps can't be unpacked on demand, and draw__compress_bitmap does
+// nothing. It's here so that the same code builds on every platform.
+
+void         draw__compress_bitmap (draw__Bitmap bitmap);
+
+// Returns the bytes of memory held by the bitmap's pixels: 4 * w * h, and
+// 0 for views and bitmaps in the caller's sections.
+size_t       draw__get_bitmap_bytes(draw__Bitmap bitmap);
+
+// Dirty rects.
+//
+// Each bitmap keeps a short list of rects that together cover every pixel
+// changed by draw calls since the bitmap was made or last cleared. The
+// rects have whole-pixel corners in the same coordinates used to draw, so
+// rows ymin to ymax - 1 of draw__get_bitmap_data hold every change, ready
+// for glTexSubImage2D. Changes made directly to the bitmap's data are not
+// tracked.
+
+// Copies up to max dirty rects to out and returns the number copied. When
+// there are more than max, the rest are merged into out[max - 1].
+int          draw__get_dirty_rects(draw__Bitmap bitmap, xy__Rect *out,
+                                   int max);
+void         draw__clear_dirty    (draw__Bitmap bitmap);
+
+// The bitmap pool.
+//
+// Deleted bitmaps are kept for reuse instead of being freed, and
+// draw__new_bitmap takes a bitmap of the same size from the pool when it
+// can, cleared to transparent black as a new one would be. The pool groups
+// bitmaps into size classes by their number of bytes. It frees its largest
+// bitmaps first to stay within a budget, which starts at 32 MB; a budget of
+// 0 turns pooling off.
+
+typedef struct {
+  size_t hits;            // New bitmaps taken from the pool.
+  size_t misses;          // New bitmaps that had to be made.
+  size_t evictions;       // Pooled bitmaps freed by the budget or a trim.
+  size_t num_bitmaps;     // Bitmaps in the pool now.
+  size_t resident_bytes;  // The pixel bytes held by those bitmaps.
+  size_t budget;
+} draw__PoolStats;
+
+void            draw__set_bitmap_pool_budget(size_t bytes);
+// Frees pooled bitmaps, largest first, until at most bytes remain pooled.
+void            draw__trim_bitmap_pool      (size_t bytes);
+draw__PoolStats draw__get_bitmap_pool_stats ();
+
+// Mipmaps.
+//
+// Each mip level is half the width and height of the one before, rounded
+// down but at least 1, down to 1x1. A level's pixels average 2x2 blocks of
+// the level before, which is gamma-aware: colors are averaged with a gamma
+// of 2, close to sRGB, so that fine detail doesn't darken. The levels are
+// new bitmaps, each fully dirty.
+
+// Stores up to max_levels mip levels of bitmap, after the bitmap itself, in
+// levels[0], levels[1], and so on, and returns how many were stored. The
+// caller deletes them with draw__delete_bitmap.
+int          draw__build_mipmaps(draw__Bitmap bitmap, draw__Bitmap *levels,
+                                 int max_levels);
+
+// This is the same, but averages in linear light using the exact sRGB
+// curve, so that levels match what a gamma-correct renderer expects. It's
+// slower than the gamma-2 average.
+int          draw__build_linear_mipmaps(draw__Bitmap bitmap,
+                                        draw__Bitmap *levels, int max_levels);
+
+// Blurs.
+//
+// A blur spreads each pixel over its neighbors using three box blurs of
+// each row and then of each column, which together are close to a Gaussian
+// blur. Its cost per pixel is the same for any radius.
+
+// Blurs the pixels whose centers are in rect, clipped to the bitmap. Only
+// those pixels are read, and the ones on the rect's edges are repeated
+// past it. The radius is the Gaussian's standard deviation in pixels, as in
+// CSS's blur(), up to 8192; the rect is left as it is when it's 0.
+void         draw__blur(draw__Bitmap bitmap, xy__Rect rect, xy__Float radius);
+
+// Atlases.
+//
+// An atlas packs many small bitmaps, such as icons, into one large bitmap,
+// so that they can be uploaded and bound as a single texture. Each region
+// added is returned as a view into the atlas's bitmap. Regions are kept a
+// pixel apart so that filtering one doesn't pick up its neighbors.
+
+typedef struct draw__AtlasStruct *draw__Atlas;
+
+// Deleting an atlas deletes its bitmap and views.
+draw__Atlas  draw__new_atlas       (int w, int h);
+void         draw__delete_atlas    (draw__Atlas atlas);
+draw__Bitmap draw__get_atlas_bitmap(draw__Atlas atlas);
+
+// Packs a w x h region into the atlas and returns a view of it, or NULL if
+// there's no room. When uv is non-NULL, it's set to the region's texture
+// coordinates, which are its rect in the atlas divided by the atlas's size.
+// The view belongs to the atlas; don't delete it.
+draw__Bitmap draw__atlas_add       (draw__Atlas atlas, int w, int h,
+                                    xy__Rect *uv);
+
+// Deletes the atlas's views and makes all of it free. The pixels are left
+// as they are.
+void         draw__clear_atlas     (draw__Atlas atlas);
+
+// Tiled bitmaps.
+//
+// A tiled bitmap is a canvas too big to keep as one bitmap, such as a
+// 30k x 30k map. It's split into draw__tile_size x draw__tile_size tiles,
+// each an ordinary bitmap made, transparent black, the first time it's
+// asked for. So making a tiled bitmap is cheap, and memory is only used for
+// the tiles that are drawn into. Tile (tx, ty) holds the canvas's pixels
+// from (tx * draw__tile_size, ty * draw__tile_size) on; tiles on the right
+// and top edges are cut to the canvas's size. Each tile keeps its own dirty
+// rects.
+
+#define draw__tile_size 256
+
+typedef struct draw__TiledBitmapStruct *draw__TiledBitmap;
+
+// Deleting a tiled bitmap deletes its tiles.
+draw__TiledBitmap draw__new_tiled_bitmap   (int w, int h);
+void              draw__delete_tiled_bitmap(draw__TiledBitmap tiled);
+void              draw__get_tile_counts    (draw__TiledBitmap tiled,
+                                            int *tiles_x, int *tiles_y);
+
+// Returns tile (tx, ty), making it if needed, or NULL if it's outside the
+// canvas. Tiles belong to the tiled bitmap; don't delete them.
+draw__Bitmap      draw__get_tile (draw__TiledBitmap tiled, int tx, int ty);
+
+// Returns tile (tx, ty) if it's been made, and NULL otherwise, which skips
+// the tiles that were never drawn into.
+draw__Bitmap      draw__find_tile(draw__TiledBitmap tiled, int tx, int ty);
+
 // Fonts and text.
 
 draw__Font   draw__new_font      (const char *name, int size);
@@ -70,6 +280,66 @@ xy__Float    draw__string(const char *s,       // The string to draw.
                                 float pos);    // 0, 0.5, 1 = left, center, or
                                                //   right justified in the box.
 
+// Mac caches shaped lines of text by font, color, and string so that
+// redrawing the same text skips shaping, within a memory budget. GDI draws
+// text here without a line cache, so the budget is ignored and the stats
+// are all zero.
+
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t num_entries;
+  size_t bytes_used;
+  size_t budget;
+} draw__CacheStats;
+
+void             draw__set_string_cache_budget(size_t bytes);
+draw__CacheStats draw__get_string_cache_stats ();
+
+// Text measurement.
+//
+// These find the size of a string in the active font without drawing it.
+// The width is the amount that draw__string advances x by; the ascent and
+// descent are the font's extents above and below the baseline, and are
+// both at least 0.
+
+typedef struct {
+  xy__Float width;
+  xy__Float ascent;
+  xy__Float descent;
+} draw__TextMetrics;
+
+draw__TextMetrics draw__measure_string (const char *s);
+
+// Measures strs[0] through strs[n - 1] into out[0] through out[n - 1].
+void              draw__measure_strings(const char **strs, int n,
+                                        draw__TextMetrics *out);
+
+// Text boxes.
+//
+// A text box draws a string as lines from the top of rect down, each one
+// placed across the rect's width by align as draw__string places text by
+// pos. With draw__wrap_words, lines break between words to fit the width,
+// and a word wider than that gets a line to itself; lines always break at
+// newlines. Only the lines that meet both the rect and the clip are drawn,
+// and those are drawn whole, so clip to the rect to cut off a partial line.
+//
+// Line breaks are cached by font, string, and width, for the 32 most
+// recently drawn strings. A new width wraps the cached words again without
+// measuring any text, and a string that only differs from a cached one
+// after some point, such as a log that's been added to, measures and wraps
+// just the lines from there on. As with draw__string, align is 0, 0.5, or 1.
+
+enum {
+  draw__wrap_none,  // Lines only break at newlines.
+  draw__wrap_words  // Lines also break between words to fit the width.
+};
+
+// Returns the height of all the lines, including those not drawn.
+xy__Float    draw__text_box(const char *s, xy__Rect rect, float align,
+                            int wrap);
+
 // Colors.
 
 draw__Color  draw__new_color       (double r, double g, double b);
@@ -77,9 +347,197 @@ void         draw__delete_color    (draw__Color color);
 void         draw__rgb_fill_color  (double r, double g, double b);
 void         draw__rgb_stroke_color(double r, double g, double b);
 
+// Packed colors are set without converting from doubles. Their alpha
+// bytes are ignored, as these colors are always opaque here. Colors only
+// reach the system's drawing state when they change, so setting the
+// current color again is cheap.
+void         draw__fill_color32    (draw__Rgba32 color);
+void         draw__stroke_color32  (draw__Rgba32 color);
+
+// These take alpha values in the range 0 to 1 to match the other
+// platforms, but GDI brushes and pens can't blend, so the alpha is ignored
+// here and the colors are drawn opaque.
+void         draw__rgba_fill_color  (double r, double g, double b, double a);
+void         draw__rgba_stroke_color(double r, double g, double b, double a);
+
+// The system does the blending here, so gamma blending can't be turned on;
+// this does nothing. It's here to match the linux rasterizer.
+void         draw__set_gamma_blending(int is_on);
+
+// Clipping.
+//
+// Drawing only changes pixels inside the clip, which is the overlap of the
+// rects pushed and not yet popped; with none pushed, it's the whole bitmap.
+// Clip rects are in the active bitmap's coordinates and cover the pixels
+// whose centers they contain, as draw__fill_rect does. Rects, lines, text,
+// and blits entirely outside the clip are skipped before any drawing work,
+// so content scrolled out of view costs little. The clip belongs to the
+// context and stays as it is when the active bitmap changes. Lists are
+// clipped when they're executed rather than when they're recorded.
+
+void         draw__push_clip(xy__Rect rect);
+void         draw__pop_clip ();
+
 // Shapes and lines.
 
 void         draw__fill_rect  (xy__Rect rect);
 void         draw__stroke_rect(xy__Rect rect);
 void         draw__line       (xy__Float x1, xy__Float y1,
                                xy__Float x2, xy__Float y2);
+
+// Draws many lines in the stroke color with one call. By default, the
+// lines connect each point to the next, as n - 1 lines; with draw__segments
+// they connect pts[0] to pts[1], pts[2] to pts[3], and so on, as n / 2
+// lines. Adding draw__antialias blends the pixels along each line by how
+// much of them it covers. Lines are always antialiased on mac and never on
+// windows, where GDI doesn't support it; the flag only matters on linux.
+// Within a list, the lines are recorded as separate line commands.
+
+enum {
+  draw__polyline  = 0,
+  draw__segments  = 1,
+  draw__antialias = 2
+};
+
+void         draw__lines      (const xy__Pt *pts, int n, int mode);
+
+// Fills the polygon with corners pts[0] through pts[n - 1] in the fill
+// color, closing it from the last point back to the first. The rule decides
+// which parts of a self-crossing polygon are inside: with draw__nonzero,
+// every point the outline winds around, and with draw__even_odd, only the
+// points it winds around an odd number of times. Edges are antialiased by
+// the exact area of each pixel covered on linux and by core graphics on
+// mac; GDI fills them without antialiasing. Polygons are drawn right away
+// rather than recorded into a list.
+
+enum {
+  draw__nonzero,
+  draw__even_odd
+};
+
+void         draw__fill_polygon(const xy__Pt *pts, int n, int rule);
+
+// Blitting.
+//
+// These copy the pixels of src_rect in src to the active bitmap, with the
+// rect's lower-left corner at (dst_x, dst_y). The rect covers the pixels
+// whose centers it contains, as draw__fill_rect does, and the copy is
+// clipped to both bitmaps and the clip. Blits are drawn right away rather
+// than recorded into a list.
+
+enum {
+  draw__blit_copy,  // Replaces the pixels, alpha included.
+  draw__blit_over,  // Blends src over them using its premultiplied alpha.
+  draw__blit_add    // Adds each channel, stopping at its largest value.
+};
+
+typedef struct {
+  draw__Bitmap src;
+  xy__Rect     src_rect;
+  int          dst_x;
+  int          dst_y;
+} draw__Sprite;
+
+void         draw__blit     (draw__Bitmap src, xy__Rect src_rect,
+                             int dst_x, int dst_y, int mode);
+
+// Blits sprites[0] through sprites[n - 1], in that order, with one mode.
+void         draw__blit_many(const draw__Sprite *sprites, int n, int mode);
+
+// Command lists.
+//
+// Between draw__begin_list and draw__end_list, rect and line calls are
+// recorded into a list instead of being drawn; each command keeps the
+// color that was set when it was recorded. Executing the list draws its
+// commands into the active bitmap and leaves the fill and stroke colors
+// as they were when recording ended. A list may be executed any number
+// of times, including while another list is being recorded. Text is not
+// recorded; draw__string draws immediately.
+
+typedef struct draw__ListStruct *draw__List;
+
+void         draw__begin_list  ();
+draw__List   draw__end_list    ();
+void         draw__execute_list(draw__List list);
+void         draw__delete_list (draw__List list);
+
+// Draws the list into a tiled bitmap using the canvas's coordinates, making
+// the tiles that its commands touch as needed. The clip is in the canvas's
+// coordinates as well, and the active bitmap is left as it was.
+void         draw__execute_list_on_tiles(draw__TiledBitmap tiled,
+                                         draw__List list);
+
+// Linux uses this to rasterize lists on n threads. GDI draws them on the
+// calling thread, so this does nothing here.
+void         draw__set_num_threads(int n);
+
+// Contexts.
+//
+// A context holds the state that drawing uses: the active bitmap, font,
+// colors, and clip, and the list being recorded. Each function above that uses
+// this state has a draw__ctx_ version taking a context as its first
+// argument, and the versions without it use the default context. Threads
+// can draw at the same time when each uses its own context and no bitmap
+// is drawn into by two threads at once. Fonts, colors, and lists may be
+// shared between contexts, but GDI lets a bitmap be set in only one context
+// at a time; setting a NULL bitmap frees it for use in another context.
+//
+// Deleting a bitmap, font, or list only unsets it in the default context,
+// so unset it in other contexts that use it before deleting it.
+
+typedef struct draw__ContextStruct draw__Context;
+
+draw__Context *draw__new_context        ();
+void           draw__delete_context     (draw__Context *c);
+draw__Context *draw__get_default_context();
+
+void      draw__ctx_set_bitmap    (draw__Context *c, draw__Bitmap bitmap);
+void      draw__ctx_set_font      (draw__Context *c, draw__Font font);
+void      draw__ctx_set_font_color(draw__Context *c, draw__Color color);
+xy__Float draw__ctx_string        (draw__Context *c, const char *s,
+                                   int x, int y, int w, float pos);
+
+draw__TextMetrics draw__ctx_measure_string (draw__Context *c, const char *s);
+void              draw__ctx_measure_strings(draw__Context *c,
+                                            const char **strs, int n,
+                                            draw__TextMetrics *out);
+xy__Float         draw__ctx_text_box       (draw__Context *c, const char *s,
+                                            xy__Rect rect, float align,
+                                            int wrap);
+
+void draw__ctx_rgb_fill_color   (draw__Context *c,
+                                 double r, double g, double b);
+void draw__ctx_rgb_stroke_color (draw__Context *c,
+                                 double r, double g, double b);
+void draw__ctx_rgba_fill_color  (draw__Context *c,
+                                 double r, double g, double b, double a);
+void draw__ctx_rgba_stroke_color(draw__Context *c,
+                                 double r, double g, double b, double a);
+void draw__ctx_fill_color32     (draw__Context *c, draw__Rgba32 color);
+void draw__ctx_stroke_color32   (draw__Context *c, draw__Rgba32 color);
+
+void draw__ctx_set_gamma_blending(draw__Context *c, int is_on);
+
+void draw__ctx_push_clip(draw__Context *c, xy__Rect rect);
+void draw__ctx_pop_clip (draw__Context *c);
+
+void draw__ctx_fill_rect   (draw__Context *c, xy__Rect rect);
+void draw__ctx_stroke_rect (draw__Context *c, xy__Rect rect);
+void draw__ctx_line        (draw__Context *c, xy__Float x1, xy__Float y1,
+                                              xy__Float x2, xy__Float y2);
+void draw__ctx_lines       (draw__Context *c, const xy__Pt *pts, int n,
+                            int mode);
+void draw__ctx_fill_polygon(draw__Context *c, const xy__Pt *pts, int n,
+                            int rule);
+void draw__ctx_blit     (draw__Context *c, draw__Bitmap src,
+                           xy__Rect src_rect, int dst_x, int dst_y, int mode);
+void draw__ctx_blit_many(draw__Context *c, const draw__Sprite *sprites, int n,
+                         int mode);
+
+void       draw__ctx_begin_list  (draw__Context *c);
+draw__List draw__ctx_end_list    (draw__Context *c);
+void       draw__ctx_execute_list(draw__Context *c, draw__List list);
+void       draw__ctx_execute_list_on_tiles(draw__Context *c,
+                                           draw__TiledBitmap tiled,
+                                           draw__List list);
+void       draw__ctx_set_num_threads(draw__Context *c, int n);
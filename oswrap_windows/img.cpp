@@ -71,7 +71,7 @@ extern "C" draw__Bitmap img__new_bitmap(const char *path, int *w, int *h) {
   // A negative stride effectively reverses the image's y-direction.
   bitmap_data.Stride = *w * -4;
   // Since Stride < 0, we want Scan0 to point to the last row in data.
-  bitmap_data.Scan0 = draw_bitmap->bytes + (*h - 1) * (*w * 4);
+  bitmap_data.Scan0 = draw_bitmap->bytes + (size_t)(*h - 1) * (*w * 4);
   bitmap_data.PixelFormat = PixelFormat32bppPARGB;
 
   Status status = gdi_bitmap->LockBits(